@@ -1,9 +1,122 @@
 // Interface functions for libac.so
 //
+#include <string.h>     // for strlen
 #include "ac_slow.hpp"
 #include "ac_fast.hpp"
+#include "ac_lazy.hpp"
+#include "ac_cache.hpp"
+#include "ac_warm.hpp"
+#include "ac_telemetry.hpp"
 #include "ac.h"
 
+static inline bool
+Same_Result(const ac_result_t& r, const Match_Result& r2) {
+    if (r.match_begin != r2.begin)
+        return false;
+
+    return r.match_begin < 0 ||
+           (r.match_end == r2.end && r.pattern_idx == r2.pattern_idx);
+}
+
+// Sampled shadow verification. Unlike the all-or-nothing -DVERIFY build, it
+// re-runs only one in "sample rate" calls to the instance (per thread)
+// against the slow implementation, and counts rather than asserts the
+// discrepancies, so that it can be turned on in production to check new
+// engines or layouts against the real traffic.
+class AC_Shadow {
+public:
+    AC_Shadow(ACS_Constructor* slow_impl, uint32 sample_rate) :
+        _slow_impl(slow_impl), _sample_rate(sample_rate), _gen(1),
+        _sampled(0), _mismatch(0) {
+        memset(_countdown, 0, sizeof(_countdown));
+    }
+
+    // The counting starts over at the new rate.
+    void Set_Sample_Rate(uint32 rate) {
+        _sample_rate = rate;
+        __atomic_add_fetch(&_gen, 1, __ATOMIC_RELEASE);
+    }
+    ACS_Constructor* Get_Slow_Impl() const { return _slow_impl; }
+
+    void Get_Stat(ac_verify_stat_t* stat) const {
+        stat->sampled = _sampled;
+        stat->mismatch = _mismatch;
+    }
+
+    // This is called after each match; the overhead is a decrement of the
+    // calling thread's countdown unless this call is sampled.
+    void Sample(const char* str, uint32 len, const ac_result_t& r) {
+        if (unlikely(Count_Call()))
+            Verify(str, len, r);
+    }
+
+    // Likewise, for the NUL-terminated "str", whose length is only taken if
+    // this call is sampled.
+    void Sample(const char* str, const ac_result_t& r) {
+        if (unlikely(Count_Call()))
+            Verify(str, strlen(str), r);
+    }
+
+private:
+    // The calls left till the next sampled one, armed for the generation
+    // "gen" of the rate. Each is padded to a cache line.
+    typedef struct {
+        uint32 left;
+        uint32 gen;
+        char pad[TELEMETRY_LINE_SZ - 2 * sizeof(uint32)];
+    } Countdown;
+
+    // Return true if this call is sampled. The calls are counted down per
+    // instance and per thread slot (the same one as the telemetry's), such
+    // that each instance is sampled at its own rate however the threads
+    // interleave the instances, and the calls not sampled only write the
+    // slot's own cache line. The threads sharing a slot may lose a count to
+    // each other, which merely shifts the next sample.
+    bool Count_Call() {
+        Countdown* c = &_countdown[AC_Telemetry::Get_Thread_Slot()];
+        uint32 gen = __atomic_load_n(&_gen, __ATOMIC_ACQUIRE);
+        uint32 left = __atomic_load_n(&c->left, __ATOMIC_RELAXED);
+        if (likely(left > 1 &&
+                   __atomic_load_n(&c->gen, __ATOMIC_RELAXED) == gen)) {
+            __atomic_store_n(&c->left, left - 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        return Rearm(c, gen, left);
+    }
+
+    // The slow path of Count_Call(): the countdown is at the sampled call,
+    // paused (i.e. zero), or armed for the previous rate.
+    bool Rearm(Countdown* c, uint32 gen, uint32 left) {
+        uint32 rate = _sample_rate;
+        if (__atomic_load_n(&c->gen, __ATOMIC_RELAXED) != gen) {
+            __atomic_store_n(&c->gen, gen, __ATOMIC_RELAXED);
+            left = rate;
+        }
+
+        bool sampled = left == 1;
+        if (left > 1)
+            left--;
+        else if (sampled)
+            left = rate;
+        __atomic_store_n(&c->left, left, __ATOMIC_RELAXED);
+        return sampled;
+    }
+
+    void Verify(const char* str, uint32 len, const ac_result_t& r) {
+        Match_Result r2 = _slow_impl->Match(str, len);
+        __sync_fetch_and_add(&_sampled, 1);
+        if (!Same_Result(r, r2))
+            __sync_fetch_and_add(&_mismatch, 1);
+    }
+
+    ACS_Constructor* _slow_impl;
+    volatile uint32 _sample_rate;
+    uint32 _gen;
+    unsigned long long _sampled;
+    unsigned long long _mismatch;
+    Countdown _countdown[TELEMETRY_STRIPE_NUM];
+};
+
 static inline ac_result_t
 _match(buf_header_t* ac, const char* str, unsigned int len) {
     AC_Buffer* buf = (AC_Buffer*)(void*)ac;
@@ -12,17 +125,17 @@ _match(buf_header_t* ac, const char* str, unsigned int len) {
     ac_result_t r = Match(buf, str, len);
 
     #ifdef VERIFY
-    {
+    // Instances from ac_load() don't have the slow implementation.
+    if (buf->slow_impl) {
         Match_Result r2 = buf->slow_impl->Match(str, len);
-        if (r.match_begin != r2.begin) {
-            ASSERT(0);
-        } else {
-            ASSERT((r.match_begin < 0) ||
-                   (r.match_end == r2.end &&
-                    r.pattern_idx == r2.pattern_idx));
-        }
+        ASSERT(Same_Result(r, r2));
     }
     #endif
+
+    if (unlikely(buf->shadow != 0))
+        buf->shadow->Sample(str, len, r);
+
+    Count_Hits(buf, r);
     return r;
 }
 
@@ -43,9 +156,72 @@ ac_match_longest_l(ac_t* ac, const char* str, unsigned int len) {
     ASSERT(((buf_header_t*)ac)->magic_num == AC_MAGIC_NUM);
 
     ac_result_t r = Match_Longest_L(buf, str, len);
+    Count_Hits(buf, r);
     return r;
 }
 
+extern "C" ac_result_t
+ac_match_cstr(ac_t* ac, const char* str) {
+    AC_Buffer* buf = (AC_Buffer*)(void*)ac;
+    ASSERT(((buf_header_t*)ac)->magic_num == AC_MAGIC_NUM);
+
+    ac_result_t r = Match_Cstr(buf, str);
+
+    #ifdef VERIFY
+    if (buf->slow_impl) {
+        Match_Result r2 = buf->slow_impl->Match(str, strlen(str));
+        ASSERT(Same_Result(r, r2));
+    }
+    #endif
+
+    if (unlikely(buf->shadow != 0))
+        buf->shadow->Sample(str, r);
+
+    Count_Hits(buf, r);
+    return r;
+}
+
+extern "C" ac_result_t
+ac_match_longest_cstr(ac_t* ac, const char* str) {
+    AC_Buffer* buf = (AC_Buffer*)(void*)ac;
+    ASSERT(((buf_header_t*)ac)->magic_num == AC_MAGIC_NUM);
+
+    ac_result_t r = Match_Longest_Cstr(buf, str);
+    Count_Hits(buf, r);
+    return r;
+}
+
+extern "C" int
+ac_match_all(ac_t* ac, const char* str, unsigned int len,
+             ac_result_t* result_v, unsigned int result_cap,
+             const ac_limit_t* limit, ac_scan_t* scan) {
+    AC_Buffer* buf = (AC_Buffer*)(void*)ac;
+    ASSERT(((buf_header_t*)ac)->magic_num == AC_MAGIC_NUM);
+
+    ac_scan_t tmp;
+    if (!scan) {
+        memset(&tmp, 0, sizeof(tmp));
+        scan = &tmp;
+    }
+    int num = Match_All(buf, str, len, result_v, result_cap, limit, scan);
+    Count_Hits(buf, result_v, num);
+    return num;
+}
+
+extern "C" int
+ac_match_count(ac_t* ac, const char* str, unsigned int len,
+               const ac_limit_t* limit, ac_scan_t* scan) {
+    AC_Buffer* buf = (AC_Buffer*)(void*)ac;
+    ASSERT(((buf_header_t*)ac)->magic_num == AC_MAGIC_NUM);
+
+    ac_scan_t tmp;
+    if (!scan) {
+        memset(&tmp, 0, sizeof(tmp));
+        scan = &tmp;
+    }
+    return Match_Count(buf, str, len, limit, scan);
+}
+
 class BufAlloc : public Buf_Allocator {
 public:
     virtual AC_Buffer* alloc(int sz) {
@@ -63,39 +239,171 @@ public:
 };
 
 extern "C" ac_t*
-ac_create(const char** strv, unsigned int* strlenv, unsigned int v_len) {
-    if (v_len >= 65535) {
+ac_create_opt(const char** strv, unsigned int* strlenv, unsigned int v_len,
+              const ac_opt_t* opt) {
+    if (v_len > MAX_PATTERN_NUM) {
         // TODO: Currently we use 16-bit to encode pattern-index (see the
         //  comment to AC_State::is_term), therefore we are not able to
         //  handle pattern set with more than 65535 entries.
         return 0;
     }
 
-    ACS_Constructor *acc;
+    // The slow implementation is kept around only if it is going to serve
+    // as the reference of the verification.
+    uint32 verify_sample = opt ? opt->verify_sample : 0;
+    bool keep_slow_impl = verify_sample != 0;
 #ifdef VERIFY
-    acc = new ACS_Constructor;
-#else
-    ACS_Constructor tmp;
-    acc = &tmp;
+    keep_slow_impl = true;
+#endif
+
+    // The cache is bypassed if the instance is to be sampled against the
+    // slow implementation, or if the graph is not to be built entirely. The
+    // -DVERIFY build does use it, and builds the reference on a hit.
+    bool lazy = opt && (opt->flags & AC_OPT_LAZY);
+    AC_Cache* cache = 0;
+    if (opt && opt->cache_dir && !verify_sample && !lazy) {
+        cache = new AC_Cache(opt->cache_dir, strv, strlenv, v_len, opt);
+        if (AC_Buffer* buf = cache->Load()) {
+            delete cache;
+#ifdef VERIFY
+            ACS_Constructor* acc = new ACS_Constructor;
+            acc->Construct(strv, strlenv, v_len, true);
+            buf->slow_impl = acc;
 #endif
-    acc->Construct(strv, strlenv, v_len);
+            return (ac_t*)(void*)buf;
+        }
+    }
+
+    ACS_Constructor tmp;
+    ACS_Constructor *acc = keep_slow_impl ? new ACS_Constructor : &tmp;
+    AC_Buffer* buf;
+    if (lazy) {
+        // The slow implementation serves as the reference only.
+        if (keep_slow_impl)
+            acc->Construct(strv, strlenv, v_len, true);
+        buf = (new AC_Lazy(strv, strlenv, v_len, opt->flags))->Get_Buffer();
+    } else {
+        acc->Construct(strv, strlenv, v_len, keep_slow_impl);
+
+        BufAlloc ba;
+        AC_Converter cvt(*acc, ba, opt);
+        buf = cvt.Convert();
+    }
 
-    BufAlloc ba;
-    AC_Converter cvt(*acc, ba);
-    AC_Buffer* buf = cvt.Convert();
+    if (cache) {
+        cache->Save(buf);
+        delete cache;
+    }
 
 #ifdef VERIFY
     buf->slow_impl = acc;
 #endif
+    if (verify_sample)
+        buf->shadow = new AC_Shadow(acc, verify_sample);
+
+    return (ac_t*)(void*)buf;
+}
+
+extern "C" ac_t*
+ac_create(const char** strv, unsigned int* strlenv, unsigned int v_len) {
+    return ac_create_opt(strv, strlenv, v_len, 0);
+}
+
+extern "C" int
+ac_set_verify_sample(ac_t* ac, unsigned int sample) {
+    AC_Buffer* buf = (AC_Buffer*)(void*)ac;
+    if (!buf->shadow)
+        return -1;
+
+    buf->shadow->Set_Sample_Rate(sample);
+    return 0;
+}
+
+extern "C" int
+ac_get_verify_stat(ac_t* ac, ac_verify_stat_t* stat) {
+    AC_Buffer* buf = (AC_Buffer*)(void*)ac;
+    if (!buf->shadow)
+        return -1;
+
+    buf->shadow->Get_Stat(stat);
+    return 0;
+}
+
+extern "C" unsigned int
+ac_serialize(ac_t* ac, void* blob, unsigned int cap) {
+    AC_Buffer* buf = (AC_Buffer*)(void*)ac;
+    ASSERT(buf->hdr.magic_num == AC_MAGIC_NUM);
+
+    if (buf->flags & BUF_LAZY)
+        return AC_Lazy::Get(buf)->Serialize(blob, cap);
+
+    uint32 len = buf->buf_len;
+    if (cap >= len) {
+        memcpy(blob, buf, len);
+        Clear_Runtime_Fields((AC_Buffer*)blob);
+        ((AC_Buffer*)blob)->flags &= ~BUF_POOLED;
+    }
+    return len;
+}
+
+extern "C" const char*
+ac_get_pattern(ac_t* ac, unsigned int idx, unsigned int* len) {
+    AC_Buffer* buf = (AC_Buffer*)(void*)ac;
+    if (buf->flags & BUF_LAZY)
+        return AC_Lazy::Get(buf)->Get_Pattern(idx, len);
+
+    if (!(buf->flags & BUF_PATTERNS) || idx >= buf->pattern_num)
+        return 0;
+
+    const unsigned char* tbl = (const unsigned char*)buf + buf->pattern_ofst;
+    const unsigned char* loc = tbl + PATTERN_TABLE_HDR_SZ +
+                               idx * PATTERN_LOC_SZ;
+    *len = Load_Uint32(loc + 4);
+    return (const char*)tbl + Load_Uint32(loc);
+}
+
+extern "C" ac_t*
+ac_load(const void* blob, unsigned int len, unsigned int flags) {
+    if (len < sizeof(AC_Buffer))
+        return 0;
+
+    AC_Buffer* buf = (AC_Buffer*)(new unsigned char[len]);
+    memcpy(buf, blob, len);
+    Clear_Runtime_Fields(buf);
+
+    // A tenant is never loaded on its own, see ac_serialize().
+    if ((buf->flags & BUF_POOLED) ||
+        !Validate_Buffer(buf, len, flags & AC_LOAD_TRUSTED)) {
+        delete[] (unsigned char*)buf;
+        return 0;
+    }
     return (ac_t*)(void*)buf;
 }
 
 extern "C" void
 ac_free(void* ac) {
     AC_Buffer* buf = (AC_Buffer*)ac;
+    // The tenant is part of the arena, and is freed along with the pool.
+    if (buf->flags & BUF_POOLED)
+        return;
+
+    ACS_Constructor* slow_impl = 0;
 #ifdef VERIFY
-    delete buf->slow_impl;
+    slow_impl = buf->slow_impl;
 #endif
+    if (AC_Shadow* shadow = buf->shadow) {
+        slow_impl = shadow->Get_Slow_Impl();
+        delete shadow;
+    }
+    delete slow_impl;
+    Free_Telemetry(buf);
 
-    BufAlloc::myfree(buf);
+    if (buf->flags & BUF_LOCKED)
+        Unlock_Pages(buf, buf->buf_len);
+    if (buf->flags & BUF_LAZY)
+        delete AC_Lazy::Get(buf);
+    else if (buf->flags & BUF_MAPPED)
+        AC_Cache::Unmap(buf);
+    else
+        BufAlloc::myfree(buf);
 }
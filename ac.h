@@ -21,6 +21,134 @@ typedef struct {
 
 struct ac_t;
 
+/* Knobs for ac_create_opt(). Zero-initialize it and set only the fields you
+ * care about; an all-zero ac_opt_t gives you exactly what ac_create() does.
+ */
+typedef struct {
+    unsigned int flags;         /* bitwise-or of AC_OPT_XXX */
+
+    /* If non-zero, keep the slow implementation around as the reference,
+     * and re-run one in "verify_sample" calls to ac_match()/ac_match2() of
+     * the instance (per thread) against it, counting the discrepancies. See
+     * ac_set_verify_sample() and ac_get_verify_stat().
+     */
+    unsigned int verify_sample;
+
+    /* If non-NULL, the directory of the on-disk cache of compiled instances.
+     * The cache is keyed by the patterns, the options and the version of
+     * the library's internal layout. ac_create_opt() maps the cached
+     * instance if there is one, and otherwise builds the instance and saves
+     * it to the cache. Failing to access the cache is not an error; it
+     * merely falls back to building the instance. The cache is bypassed if
+     * "verify_sample" is non-zero, as the verification needs the state
+     * thrown away when building the instance.
+     */
+    const char* cache_dir;
+} ac_opt_t;
+
+/* Match with the direct-threaded interpreter, which dispatches on the kind of
+ * each state via computed goto rather than running one generic loop body.
+ * It overrides the automatic pick of the DFA-based engines below.
+ */
+#define AC_OPT_THREADED     (1 << 0)
+
+/* Don't match tiny dictionaries (no more than 15 distinct prefixes) with the
+ * SIMD shuffle-based DFA, which is otherwise picked automatically. It's mostly
+ * for testing and benchmarking the other engines.
+ */
+#define AC_OPT_NO_SHENG     (1 << 1)
+
+/* Don't match dictionaries over small alphabet (no more than 16 distinct
+ * chars, e.g. hex digits) with the DFA consuming two bytes per transition,
+ * which is otherwise picked automatically if its tables fit in 1MB. See
+ * also AC_OPT_STRIDE2.
+ */
+#define AC_OPT_NO_STRIDE2   (1 << 2)
+
+/* Lay out the transitions as a double-array trie, such that each transition
+ * is one indexed load plus a check, rather than a search among the valid
+ * inputs of the state. It takes more memory, and it overrides the automatic
+ * pick of the DFA-based engines above.
+ */
+#define AC_OPT_DOUBLE_ARRAY (1 << 3)
+
+/* Memory-first: store the graph as a succinct LOUDS-encoded trie, taking
+ * several times less memory than otherwise, at the cost of slower matching.
+ * It overrides all the options above.
+ */
+#define AC_OPT_SUCCINCT     (1 << 4)
+
+/* Don't store tiny dictionaries (no more than 255 distinct prefixes) in the
+ * compact format, which is otherwise picked automatically unless any of
+ * AC_OPT_THREADED, AC_OPT_DOUBLE_ARRAY and AC_OPT_SUCCINCT is specified, or
+ * the SIMD shuffle-based DFA applies. The compact format takes a fraction of
+ * the memory of the others, as it has no fixed-size tables; it's in place of
+ * the stride-2 DFA, which is faster on such dictionaries, but takes
+ * kilobytes of tables.
+ */
+#define AC_OPT_NO_COMPACT   (1 << 5)
+
+/* Build the top levels of the graph up front, and the rest of it on demand,
+ * the first time the matcher goes through a state whose kids are yet to be
+ * built. It's for huge dictionaries only a small share of which is hit by the
+ * traffic, such that creating the instance doesn't take the time of
+ * building the entire graph. Matching is thread-safe as usual; the first
+ * call reaching a state yet to be built builds it under a lock.
+ *
+ * It overrides all the options above, and bypasses ac_opt_t::cache_dir, as
+ * the instance lives on the heap only. ac_serialize() builds the entire graph
+ * with the other options, and so the serialized instance is not lazy. Only
+ * ac_create_opt() honors it; the builder and the pool ignore it.
+ */
+#define AC_OPT_LAZY         (1 << 6)
+
+/* Split the patterns by length for mixed dictionaries, where a handful of
+ * 1-3 byte tokens would otherwise make nearly every char a valid input of
+ * root, and defeat the skipping over the chars no pattern begins with. The
+ * short patterns are matched with a DFA taking one lookup per char, and the
+ * long ones with the automaton, which leaves root only on the first two
+ * bytes of some long pattern; both run in one pass over the subject string,
+ * and yield exactly the matches the automaton of all the patterns does.
+ *
+ * It's ignored unless there are patterns of both classes and the short ones
+ * have no more than 1023 distinct prefixes. It overrides the options above
+ * but AC_OPT_SUCCINCT and AC_OPT_LAZY; the instance built lazily is only
+ * composite once serialized.
+ */
+#define AC_OPT_COMPOSITE    (1 << 7)
+
+/* Keep a copy of the patterns in the instance, such that the pattern index of
+ * a match can be turned back into the pattern with ac_get_pattern(), e.g.
+ * to report it or to check the match against it, without the caller keeping
+ * the patterns around. It's saved by ac_serialize() along with the rest of
+ * the instance, and costs eight bytes per pattern plus the patterns
+ * themselves; the matching is not affected.
+ */
+#define AC_OPT_PATTERN_TABLE (1 << 8)
+
+/* Skip over the benign traffic with a prefilter, for dictionaries of long
+ * patterns (8 bytes or longer) whose first bytes are so diverse that nearly
+ * every char begins some pattern. The prefilter is a bitset of the hashes
+ * of the 4-grams of the first few bytes of the patterns; the matcher looks
+ * up every few 4-grams of the subject string, and skips the stretches no
+ * pattern can begin in without running the automaton. It takes no more than
+ * 128KB, and the matches are the same as without it.
+ *
+ * It's ignored if any non-empty pattern is shorter than 8 bytes, or
+ * AC_OPT_DOUBLE_ARRAY or AC_OPT_SUCCINCT is specified. Otherwise, it
+ * overrides the automatic pick of the DFA-based engines and the compact
+ * format. Only the matchers of a given length use it; ac_match_cstr() and
+ * ac_match_longest_cstr() don't, as they don't look ahead of the NUL.
+ */
+#define AC_OPT_QGRAM_FILTER (1 << 9)
+
+/* Match with the DFA consuming two bytes per transition (see
+ * AC_OPT_NO_STRIDE2) even if the alphabet is not small, as long as its
+ * tables fit in 1MB. The tables grow with the square of the alphabet, and
+ * may take hundreds of times the memory of the graph.
+ */
+#define AC_OPT_STRIDE2      (1 << 10)
+
 /* Create an AC instance. "pattern_v" is a vector of patterns, the length of
  * i-th pattern is specified by "pattern_len_v[i]"; the number of patterns
  * is specified by "vect_len".
@@ -30,18 +158,471 @@ struct ac_t;
 ac_t* ac_create(const char** pattern_v, unsigned int* pattern_len_v,
                 unsigned int vect_len) AC_EXPORT;
 
+/* Same as ac_create() except that the instance is tuned by "opt", which can
+ * be NULL.
+ */
+ac_t* ac_create_opt(const char** pattern_v, unsigned int* pattern_len_v,
+                    unsigned int vect_len, const ac_opt_t* opt) AC_EXPORT;
+
 ac_result_t ac_match(ac_t*, const char *str, unsigned int len) AC_EXPORT;
 
 ac_result_t ac_match_longest_l(ac_t*, const char *str, unsigned int len) AC_EXPORT;
 
+/* Same as ac_match() and ac_match_longest_l() respectively, except that the
+ * subject string ends at the first NUL, so there is no need to strlen() it
+ * beforehand. The plain automaton (threaded or not) finds the NUL as it
+ * scans, and reads the string only once; the other engines take the length
+ * first.
+ */
+ac_result_t ac_match_cstr(ac_t*, const char *str) AC_EXPORT;
+
+ac_result_t ac_match_longest_cstr(ac_t*, const char *str) AC_EXPORT;
+
 /* Similar to ac_match() except that it only returns match-begin. The rationale
  * for this interface is that luajit has hard time in dealing with strcture-
  * return-value.
  */
 int ac_match2(ac_t*, const char *str, unsigned int len) AC_EXPORT;
 
+/* Per-call limits of ac_match_all() and ac_match_count(); zero means no
+ * limit. They bound the worst-case cost of scanning pathological input,
+ * which may be huge and may have a hit at every byte.
+ */
+typedef struct {
+    unsigned int max_matches;   /* stop after this many matches */
+    unsigned int max_bytes;     /* stop after scanning this many bytes */
+    unsigned int max_usec;      /* stop after this many microseconds, which
+                                 * is checked every few KB */
+} ac_limit_t;
+
+#define AC_SCAN_DONE        0   /* the whole subject string is scanned */
+#define AC_SCAN_TRUNCATED   1   /* stopped early due to the limits */
+
+/* The progress of a scan. Zero-initialize it to scan a subject string from
+ * the beginning. If a call stops early, the status is AC_SCAN_TRUNCATED,
+ * and "resume_ofst" tells where it stopped. Calling again with the same
+ * string and the same ac_scan_t resumes the scan right where it was left,
+ * without missing or repeating any match.
+ */
+typedef struct {
+    int status;                 /* AC_SCAN_XXX */
+    unsigned int resume_ofst;
+    unsigned int priv[2];       /* private to the library */
+} ac_scan_t;
+
+/* Find all occurrences of all patterns in the subject string, in the
+ * ascending order of their ending offsets, and the longer one first if they
+ * end at the same offset. (If the dictionary has duplicated patterns, only
+ * one of them is reported.)
+ *
+ * At most "result_cap" matches are saved to "result_v"; a full vector stops
+ * the scan just like the "max_matches" limit does. "limit" and "scan" can be
+ * NULL. Return the number of matches saved by this call.
+ */
+int ac_match_all(ac_t*, const char* str, unsigned int len,
+                 ac_result_t* result_v, unsigned int result_cap,
+                 const ac_limit_t* limit, ac_scan_t* scan) AC_EXPORT;
+
+/* Similar to ac_match_all() except that it only counts the matches. */
+int ac_match_count(ac_t*, const char* str, unsigned int len,
+                   const ac_limit_t* limit, ac_scan_t* scan) AC_EXPORT;
+
+/* A match found by ac_line_match_all(), along with the line it's in. */
+typedef struct {
+    ac_result_t match;
+    unsigned int line_num;      /* 1-based, as "grep -n" counts */
+    unsigned int line_begin;    /* the offset of the first byte of the line */
+} ac_line_result_t;
+
+/* The progress of a line-oriented scan, which is the same as ac_scan_t
+ * otherwise.
+ */
+typedef struct {
+    ac_scan_t scan;
+    unsigned int priv[3];       /* private to the library */
+} ac_line_scan_t;
+
+/* Report only the first match of each line, i.e. the one ending first, and
+ * move on to the next line right away, where the scan starts afresh, as
+ * "grep -n" stops at the first match of a line.
+ */
+#define AC_LINE_FIRST_ONLY  (1 << 0)
+
+/* Same as ac_match_all() except that each match is reported along with the
+ * line it's in, which is that of its last byte. The lines end with '\n',
+ * which belongs to the line it ends. The lines are counted in the same pass
+ * as the matching, by a vectorized newline counter running in between the
+ * matches. "flags" is the bitwise-or of AC_LINE_XXX.
+ */
+int ac_line_match_all(ac_t*, const char* str, unsigned int len,
+                      unsigned int flags, ac_line_result_t* result_v,
+                      unsigned int result_cap, const ac_limit_t* limit,
+                      ac_line_scan_t* scan) AC_EXPORT;
+
+/* The scratch space of the advanced match APIs, which keeps what they need
+ * between calls, such that they never allocate memory. It's created for an
+ * instance, and is good for any instance it fits; ac_scratch_fit() grows it
+ * to fit one more. It's used by one thread at a time, and is not tied to
+ * any instance otherwise.
+ */
+typedef struct ac_scratch ac_scratch_t;
+
+ac_scratch_t* ac_scratch_create(ac_t*) AC_EXPORT;
+void ac_scratch_fit(ac_scratch_t*, ac_t*) AC_EXPORT;
+void ac_scratch_fit_norm(ac_scratch_t*) AC_EXPORT;
+void ac_scratch_free(ac_scratch_t*) AC_EXPORT;
+
+/* Scan the subject string fed in segments, as if they were one string, with
+ * the state in between kept in the scratch space; start a new string with
+ * ac_stream_reset(). Matches across the segments are found, and the offsets
+ * are of the whole string, so it should be less than 2GB.
+ *
+ * Otherwise they are the same as ac_match_all() and ac_match_count() for one
+ * segment: if a call is truncated, call again with the same segment and
+ * "scan" to resume it; a "scan" not truncated starts the segment over.
+ * Return -1 if the scratch space does not fit the instance.
+ */
+void ac_stream_reset(ac_scratch_t*) AC_EXPORT;
+
+int ac_stream_match_all(ac_t*, ac_scratch_t*, const char* seg,
+                        unsigned int len, ac_result_t* result_v,
+                        unsigned int result_cap, const ac_limit_t* limit,
+                        ac_scan_t* scan) AC_EXPORT;
+
+int ac_stream_match_count(ac_t*, ac_scratch_t*, const char* seg,
+                          unsigned int len, const ac_limit_t* limit,
+                          ac_scan_t* scan) AC_EXPORT;
+
+/* The transforms normalizing the subject string before matching, which apply
+ * in this order, each to the output of the previous ones.
+ */
+#define AC_NORM_URL_DECODE  (1 << 0)  /* "%XX" to the byte, and '+' to ' ' */
+#define AC_NORM_HTML_DECODE (1 << 1)  /* "&lt;", "&gt;", "&amp;", "&quot;",
+                                       * "&apos;", "&nbsp;", and "&#NN;" and
+                                       * "&#xHH;" below 256, to the byte */
+#define AC_NORM_CASE_FOLD   (1 << 2)  /* 'A'-'Z' to 'a'-'z' */
+#define AC_NORM_WS_COLLAPSE (1 << 3)  /* a run of whitespaces to one ' ' */
+
+/* Same as ac_match_all() and ac_match_count() except that the patterns are
+ * matched against the subject string normalized by the transforms "norm",
+ * the bitwise-or of AC_NORM_XXX. The normalization is fused into the scan:
+ * the string is normalized in one pass, a few KB at a time, each of which
+ * is matched right away, and nothing is copied otherwise.
+ *
+ * The offsets reported, including "resume_ofst", are of the raw string: a
+ * match begins at the first raw byte of its first normalized byte, and ends
+ * at the last raw byte of its last one. "max_bytes" counts the normalized
+ * bytes. The progress of a truncated scan is kept in the scratch space, so
+ * the scratch space must not be used for anything else until it's done; it
+ * starts a new string as ac_stream_reset() does. The scratch space must be
+ * made fit for the normalization by ac_scratch_fit_norm() beforehand, which
+ * allocates 260KB for it once and for all. Return -1 if the scratch space
+ * does not fit the instance, or the normalization.
+ */
+int ac_norm_match_all(ac_t*, ac_scratch_t*, unsigned int norm,
+                      const char* str, unsigned int len,
+                      ac_result_t* result_v, unsigned int result_cap,
+                      const ac_limit_t* limit, ac_scan_t* scan) AC_EXPORT;
+
+int ac_norm_match_count(ac_t*, ac_scratch_t*, unsigned int norm,
+                        const char* str, unsigned int len,
+                        const ac_limit_t* limit, ac_scan_t* scan) AC_EXPORT;
+
+/* Return the "idx"-th pattern the instance was created with, and its length
+ * via "len", or NULL if "idx" is out of range or the instance was created
+ * without AC_OPT_PATTERN_TABLE. The pattern is not NUL-terminated, and it's
+ * valid as long as the instance is.
+ */
+const char* ac_get_pattern(ac_t*, unsigned int idx,
+                           unsigned int* len) AC_EXPORT;
+
+/* Turn on the per-pattern hit telemetry of the instance, which counts how
+ * often each pattern fires, e.g. to retire the dead patterns and to find the
+ * hot ones. Once it's on, each match reported by ac_match(), ac_match2(),
+ * ac_match_longest_l(), ac_match_cstr(), ac_match_longest_cstr(),
+ * ac_match_all(), ac_stream_match_all(), ac_norm_match_all() and
+ * ac_line_match_all() counts as a hit of its pattern; ac_match_count(),
+ * ac_stream_match_count() and ac_norm_match_count() don't report the
+ * patterns, and count nothing. The counters are split into 16 stripes, which
+ * the threads are handed in round robin as they first count, and bumping one
+ * is an atomic add rather than a lock; the threads contend for the counters
+ * only if more than 16 of them ever count, in which case some share a
+ * stripe. With the telemetry off, it costs a check per call.
+ *
+ * It's safe to call while other threads are matching against the instance,
+ * and it's a no-op if the telemetry is on already. The telemetry is on until
+ * the instance is freed, and it's not part of the serialized instance.
+ */
+void ac_telemetry_enable(ac_t*) AC_EXPORT;
+
+/* Copy the number of hits of each pattern, since the telemetry was turned on
+ * or last reset, to "hits_v", which is "cap" entries long, and reset the
+ * counters to zero if "reset" is non-zero. The matchers keep running; a hit
+ * counted meanwhile is in either this snapshot or the next one.
+ *
+ * Return the number of patterns, or -1 if the telemetry is off. Nothing is
+ * copied or reset if "cap" is smaller than the number of patterns.
+ */
+int ac_telemetry_snapshot(ac_t*, unsigned long long* hits_v, unsigned int cap,
+                          int reset) AC_EXPORT;
+
+/* Statistic of the sampled shadow verification */
+typedef struct {
+    unsigned long long sampled;  /* number of calls being verified */
+    unsigned long long mismatch; /* number of calls getting wrong result */
+} ac_verify_stat_t;
+
+/* Change the sampling rate of the shadow verification to one in "sample"
+ * calls, and zero pauses the verification. Return 0 on success, or -1 if the
+ * instance was not created with a non-zero ac_opt_t::verify_sample.
+ */
+int ac_set_verify_sample(ac_t*, unsigned int sample) AC_EXPORT;
+
+/* Return 0 and populate "stat" on success, or -1 if the instance was not
+ * created with a non-zero ac_opt_t::verify_sample.
+ */
+int ac_get_verify_stat(ac_t*, ac_verify_stat_t* stat) AC_EXPORT;
+
+/* Copy the instance into "blob", which is "cap" bytes long, so that it can be
+ * saved to a file or shared memory and then turned back into an instance
+ * with ac_load(). The instance is position-independent, so the copy is
+ * just a memcpy. Return the size of the serialized instance; nothing is
+ * copied if "cap" is smaller than that.
+ */
+unsigned int ac_serialize(ac_t*, void* blob, unsigned int cap) AC_EXPORT;
+
+/* Skip the validation of the blob if it has been validated before (the
+ * verdict is recorded in the blob). Only use it for blobs from a trusted
+ * source, e.g. those written by ac_serialize() of this very process.
+ */
+#define AC_LOAD_TRUSTED     (1 << 0)
+
+/* Create an instance from the "len"-byte blob produced by ac_serialize().
+ * Unless AC_LOAD_TRUSTED is specified, the blob is validated with a linear
+ * pass before it is used, so that a corrupted or truncated blob is rejected
+ * rather than crashing the matcher. "flags" is the bitwise-or of
+ * AC_LOAD_XXX.
+ *
+ * Return the instance on success, or NULL if the blob is malformed.
+ */
+ac_t* ac_load(const void* blob, unsigned int len, unsigned int flags) AC_EXPORT;
+
 void ac_free(void*) AC_EXPORT;
 
+/* Warm-up of a freshly created, loaded or mapped instance, such that the
+ * first calls after it goes live don't pay for the page faults and the cold
+ * cache. "flags" is the bitwise-or of AC_WARM_XXX.
+ */
+#define AC_WARM_PREFAULT    (1 << 0)  /* fault in all pages of the instance,
+                                       * like MAP_POPULATE does at mmap */
+#define AC_WARM_LOCK        (1 << 1)  /* mlock(2) the instance until it, or
+                                       * the pool it's in, is freed; the
+                                       * pages are faulted in by reading
+                                       * them, such that those of a mapped
+                                       * file stay shared with the page
+                                       * cache rather than being copied;
+                                       * only the pages entirely in an
+                                       * instance on the heap are locked, as
+                                       * the others may be shared */
+#define AC_WARM_TOUCH       (1 << 2)  /* load the hot part into the cache */
+
+/* For the instance created with AC_OPT_LAZY, AC_WARM_TOUCH builds the hot
+ * part rather than loading it, and the other two flags are ignored.
+ */
+
+typedef struct {
+    /* The states no deeper than this are hot, 3 if zero. The tables of the
+     * DFA-based engines, the compact and the succinct graphs are all hot.
+     */
+    unsigned int max_depth;
+
+    /* If non-NULL, "sample" is matched against, with the states it hits
+     * loaded into the cache, which is how to warm up the states that are
+     * hot in profiled traffic rather than by depth.
+     */
+    const char* sample;
+    unsigned int sample_len;
+} ac_warm_opt_t;
+
+typedef struct {
+    unsigned long long usec;        /* time spent */
+    unsigned long long fault_bytes; /* bytes prefaulted or locked */
+    unsigned long long touch_bytes; /* bytes of the hot part touched, not
+                                     * counting what the sample touches */
+} ac_warm_stat_t;
+
+/* Warm up the instance with the options "opt", which can be NULL. "stat",
+ * if non-NULL, is populated even on failure. Return 0 on success, or -1 with
+ * errno set if the instance cannot be locked (e.g. due to RLIMIT_MEMLOCK),
+ * in which case the rest of the warm-up is still done.
+ */
+int ac_warm(ac_t*, unsigned int flags, const ac_warm_opt_t* opt,
+            ac_warm_stat_t* stat) AC_EXPORT;
+
+/* Incremental construction.
+ *
+ * Unlike ac_create(), the builder takes the patterns one at a time, copying
+ * them into its own storage, so the caller doesn't need to keep them
+ * around. Before finishing, the builder can tell how big the instance and
+ * the construction are going to be, and it refuses to go beyond the memory
+ * budget, if any, before allocating the memory.
+ */
+typedef struct ac_builder_t ac_builder_t;
+
+/* Error codes of the builder functions */
+#define AC_OK               0
+#define AC_ERR_BUDGET       (-1)    /* exceeds the memory budget */
+#define AC_ERR_TOO_MANY     (-2)    /* too many patterns */
+#define AC_ERR_PATTERN      (-3)    /* the pattern is empty or too long */
+
+typedef struct {
+    unsigned int pattern_num;
+    unsigned int state_num;
+    unsigned long long buf_size;    /* size of the instance in bytes */
+    unsigned long long peak_mem;    /* peak memory of the construction in
+                                     * bytes, including the builder itself */
+} ac_estimate_t;
+
+/* Create a builder. The options "opt", which can be NULL, apply to the
+ * instance to be built. "budget" is the limit of the peak memory (see
+ * ac_estimate_t::peak_mem), and zero means unlimited.
+ */
+ac_builder_t* ac_builder_create(const ac_opt_t* opt,
+                                unsigned long long budget) AC_EXPORT;
+
+/* Add a pattern, its index is the number of patterns added before it.
+ * Return AC_OK on success, or AC_ERR_XXX otherwise, in which case the
+ * pattern is not added, and the builder is still usable.
+ */
+int ac_builder_add(ac_builder_t*, const char* pattern,
+                   unsigned int len) AC_EXPORT;
+
+/* Estimate the instance to be built with the patterns added so far, which
+ * takes time linear to their total length (after sorting them). The
+ * estimation of the size of the instance is exact.
+ */
+void ac_builder_estimate(ac_builder_t*, ac_estimate_t*) AC_EXPORT;
+
+/* Build the instance with the patterns added so far. Return the instance on
+ * success, or NULL with "*err" (if "err" is non-NULL) set to AC_ERR_XXX.
+ * The builder can be used to add more patterns or to build again.
+ */
+ac_t* ac_builder_finish(ac_builder_t*, int* err) AC_EXPORT;
+
+void ac_builder_free(ac_builder_t*) AC_EXPORT;
+
+/* Multi-tenant pool.
+ *
+ * A pool packs many dictionaries (aka tenants) into one contiguous,
+ * position-independent arena, along with the index of the tenants, rather
+ * than having each of them in its own allocation. A tenant is identified by
+ * its index in the vector of dictionaries the pool is created from.
+ */
+typedef struct ac_pool_t ac_pool_t;
+
+typedef struct {
+    const char** pattern_v;
+    unsigned int* pattern_len_v;
+    unsigned int pattern_num;
+} ac_dict_t;
+
+typedef struct {
+    unsigned int tenant_num;
+    unsigned int pattern_num;       /* total of all tenants */
+    unsigned long long size;        /* size of the arena in bytes */
+} ac_pool_stat_t;
+
+/* Create a pool of the "dict_num" dictionaries of "dict_v", each built as
+ * ac_create_opt() does with the flags of "opt" (which can be NULL); the
+ * other fields of "opt" are ignored. Return NULL if any dictionary has too
+ * many patterns, or the arena would be 4GB or larger.
+ */
+ac_pool_t* ac_pool_create(const ac_dict_t* dict_v, unsigned int dict_num,
+                          const ac_opt_t* opt) AC_EXPORT;
+
+/* Return the tenant as an instance living in the arena, which works with
+ * all the ac_match*() functions, ac_serialize() and the telemetry, or NULL
+ * if "tenant" is out of range. It's valid as long as the pool is; it's freed
+ * along with the pool, and ac_free() on it does nothing.
+ */
+ac_t* ac_pool_get(ac_pool_t*, unsigned int tenant) AC_EXPORT;
+
+void ac_pool_get_stat(ac_pool_t*, ac_pool_stat_t*) AC_EXPORT;
+
+/* Same as ac_serialize(), ac_load() and ac_free(), respectively, except that
+ * they apply to the whole pool.
+ */
+unsigned int ac_pool_serialize(ac_pool_t*, void* blob,
+                               unsigned int cap) AC_EXPORT;
+ac_pool_t* ac_pool_load(const void* blob, unsigned int len,
+                        unsigned int flags) AC_EXPORT;
+void ac_pool_free(ac_pool_t*) AC_EXPORT;
+
+/* Save the pool to the file at "path", which is written under a temporary
+ * name and then renamed. Return 0 on success, or -1 otherwise.
+ */
+int ac_pool_save(ac_pool_t*, const char* path) AC_EXPORT;
+
+/* Map the pool saved by ac_pool_save() at "path". "flags" is the same as
+ * that of ac_load(). As the saved pool has the verdict of the validation
+ * recorded, no page of the mapping is written, and so the pages are shared
+ * by all the processes mapping the same file. Return NULL if the file cannot
+ * be mapped or is malformed.
+ */
+ac_pool_t* ac_pool_map(const char* path, unsigned int flags) AC_EXPORT;
+
+/* Hot-reload of dictionary file.
+ *
+ * A reloader watches a dictionary file, which has one pattern per line
+ * (empty lines are ignored). As the file changes, the reloader rebuilds the
+ * instance in a low-priority background thread, and then publishes it
+ * atomically. A reader acquires the current instance, matches against it as
+ * many times as it likes, and then releases it; an instance is freed once it
+ * is neither current nor acquired by anyone. Replace the file via rename(2)
+ * rather than rewriting it in place, so the reloader never sees a partially
+ * written file.
+ */
+typedef struct ac_reloader_t ac_reloader_t;
+
+/* Watch the file by polling its status rather than via inotify(7), which is
+ * the fallback anyway if inotify is not available.
+ */
+#define AC_RELOAD_POLL      (1 << 0)
+
+typedef struct {
+    unsigned int flags;         /* bitwise-or of AC_RELOAD_XXX */
+    unsigned int poll_msec;     /* interval of polling, 1000 by default */
+} ac_reload_opt_t;
+
+typedef struct {
+    unsigned int generation;    /* number of instances built successfully,
+                                 * including the initial one */
+    unsigned int fail_num;      /* number of failed rebuilds */
+    int last_error;             /* errno of the last rebuild, 0 on success */
+    unsigned long long last_build_usec; /* duration of the last rebuild */
+} ac_reload_stat_t;
+
+/* Build the instance from the file at "dict_path" with the options "opt",
+ * and watch the file afterwards. Both "opt" and "reload_opt" can be NULL.
+ * Return NULL if the initial instance cannot be built.
+ */
+ac_reloader_t* ac_reloader_create(const char* dict_path, const ac_opt_t* opt,
+                                  const ac_reload_opt_t* reload_opt) AC_EXPORT;
+
+/* Return the current instance; it stays valid until it is released. Neither
+ * acquiring nor releasing takes a lock, so they are cheap enough to do once
+ * per request.
+ */
+ac_t* ac_reloader_acquire(ac_reloader_t*) AC_EXPORT;
+void ac_reloader_release(ac_reloader_t*, ac_t*) AC_EXPORT;
+
+void ac_reloader_get_stat(ac_reloader_t*, ac_reload_stat_t*) AC_EXPORT;
+
+/* Stop watching and free the reloader. All the acquired instances must be
+ * released before this call.
+ */
+void ac_reloader_free(ac_reloader_t*) AC_EXPORT;
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,466 @@
+// Incremental construction, see ac_builder_create().
+//
+#include <string.h>
+#include <string>
+#include <algorithm>    // for std::sort
+#include "ac_slow.hpp"
+#include "ac_fast.hpp"
+#include "ac_cache.hpp"
+#include "ac_da.hpp"
+#include "ac_louds.hpp"
+#include "ac_compact.hpp"
+#include "ac_composite.hpp"
+#include "ac_qgram.hpp"
+#include "ac.h"
+
+namespace {
+// The storage of the patterns. Patterns are copied into big chunks, and
+// they never move once copied.
+class Pattern_Arena {
+public:
+    Pattern_Arena() : _cur(0), _left(0), _size(0) {}
+    ~Pattern_Arena() {
+        for (vector<char*>::iterator i = _chunks.begin(), e = _chunks.end();
+             i != e; i++) {
+            delete[] *i;
+        }
+    }
+
+    const char* Copy(const char* str, uint32 len) {
+        if (len > _left) {
+            // Huge pattern gets a chunk of its own.
+            uint32 sz = len > CHUNK_SZ / 4 ? len : CHUNK_SZ;
+            char* chunk = new char[sz];
+            _chunks.push_back(chunk);
+            _size += sz;
+            if (sz != CHUNK_SZ)
+                return (const char*)memcpy(chunk, str, len);
+
+            _cur = chunk;
+            _left = sz;
+        }
+
+        char* p = _cur;
+        memcpy(p, str, len);
+        _cur += len;
+        _left -= len;
+        return p;
+    }
+
+    // Return the memory occupied by the arena, after copying a pattern
+    // of "len" bytes.
+    uint64 Get_Size(uint32 len) const {
+        if (len <= _left)
+            return _size;
+        return _size + (len > CHUNK_SZ / 4 ? len : CHUNK_SZ);
+    }
+
+private:
+    enum { CHUNK_SZ = 64 * 1024 };
+
+    vector<char*> _chunks;
+    char* _cur;
+    uint32 _left;   // Bytes left in the current chunk.
+    uint64 _size;
+};
+
+// Order the patterns in lexicographical order.
+class Pattern_Less {
+public:
+    Pattern_Less(const vector<const char*>& pat_v,
+                 const vector<unsigned int>& len_v) :
+        _pat_v(pat_v), _len_v(len_v) {}
+
+    bool operator() (uint32 i, uint32 j) const {
+        uint32 len_i = _len_v[i], len_j = _len_v[j];
+        int r = memcmp(_pat_v[i], _pat_v[j], len_i < len_j ? len_i : len_j);
+        return r < 0 || (r == 0 && len_i < len_j);
+    }
+
+private:
+    const vector<const char*>& _pat_v;
+    const vector<unsigned int>& _len_v;
+};
+
+// The shape of the trie of some of the patterns, see AC_Builder::Scan_Trie().
+struct Trie_Shape {
+    uint64 state_num;       // including root
+    uint64 state_sz;        // the size of the states, except root
+    uint64 compact_sz;      // the size of the compact states, except root
+    uint32 root_fanout;
+    uint32 term_num;        // The terminal states are the distinct patterns.
+    uint32 max_len;
+    bool used[256];         // The inputs of the transitions.
+};
+
+class AC_Builder {
+public:
+    AC_Builder(const ac_opt_t* opt, uint64 budget);
+
+    int Add(const char* str, uint32 len);
+    void Estimate(ac_estimate_t* est) const;
+    ac_t* Finish(int* err);
+
+private:
+    // Memory occupied by the builder after adding a pattern of "len" bytes,
+    // if "len" is non-zero.
+    uint64 Get_Self_Size(uint32 len) const;
+
+    // Return the length of the shortest pattern.
+    uint32 Get_Min_Len() const;
+
+    // Return the number of cells of the double-array, given the patterns
+    // in lexicographical order.
+    uint32 Estimate_DA(const vector<uint32>& order) const;
+
+    // Figure out the shape of the trie of the patterns no shorter than
+    // "min_len" and no longer than "max_len", given the patterns in
+    // lexicographical order.
+    void Scan_Trie(const vector<uint32>& order, uint32 min_len,
+                   uint32 max_len, Trie_Shape* shape) const;
+
+    ac_opt_t _opt;
+    string _cache_dir;
+    uint64 _budget;
+
+    Pattern_Arena _arena;
+    vector<const char*> _pat_v;
+    vector<unsigned int> _len_v;
+};
+} // end of anonymous namespace
+
+AC_Builder::AC_Builder(const ac_opt_t* opt, uint64 budget) :
+    _budget(budget) {
+    // The patterns are added one by one, and the options are used only when
+    // they are all in.
+    Copy_Opt(opt, &_opt, &_cache_dir);
+}
+
+uint64
+AC_Builder::Get_Self_Size(uint32 len) const {
+    uint64 per_pattern = sizeof(_pat_v[0]) + sizeof(_len_v[0]);
+    return sizeof(*this) + _arena.Get_Size(len) +
+           per_pattern * (_pat_v.size() + (len ? 1 : 0));
+}
+
+int
+AC_Builder::Add(const char* str, uint32 len) {
+    if (len == 0 || len > MAX_PATTERN_LEN)
+        return AC_ERR_PATTERN;
+
+    if (_pat_v.size() >= MAX_PATTERN_NUM)
+        return AC_ERR_TOO_MANY;
+
+    // Fail fast if the patterns alone don't fit in the budget.
+    if (_budget && Get_Self_Size(len) > _budget)
+        return AC_ERR_BUDGET;
+
+    _pat_v.push_back(_arena.Copy(str, len));
+    _len_v.push_back(len);
+    return AC_OK;
+}
+
+uint32
+AC_Builder::Get_Min_Len() const {
+    uint32 min_len = MAX_PATTERN_LEN;
+    for (uint32 i = 0; i < _len_v.size(); i++) {
+        if (_len_v[i] < min_len)
+            min_len = _len_v[i];
+    }
+    return min_len;
+}
+
+// The states are numbered in BFS order, i.e. by depth, and then by the
+// string they stand for, in lexicographical order. So we visit the patterns
+// once per depth "d": those sharing the prefix of length "d" are consecutive,
+// and they make up the kids of the state standing for the prefix. A pattern
+// is visited no more than its length times in total.
+//
+uint32
+AC_Builder::Estimate_DA(const vector<uint32>& order) const {
+    // The patterns long enough for the current depth, along with the length
+    // of the common prefix with the previous one of them.
+    vector<pair<uint32, uint32> > act;
+    for (uint32 i = 0; i < order.size(); i++) {
+        uint32 lcp = 0;
+        if (i) {
+            const char* prev = _pat_v[order[i - 1]];
+            const char* pat = _pat_v[order[i]];
+            uint32 len = _len_v[order[i]], prev_len = _len_v[order[i - 1]];
+            uint32 min_len = len < prev_len ? len : prev_len;
+            while (lcp < min_len && pat[lcp] == prev[lcp])
+                lcp++;
+        }
+        act.push_back(make_pair(order[i], lcp));
+    }
+
+    DA_Packer packer;
+    vector<InputTy> inputs;
+    vector<pair<uint32, uint32> > next_act;
+    for (uint32 d = 0; !act.empty(); d++) {
+        inputs.clear();
+        for (uint32 k = 0; k < act.size(); k++) {
+            if (k && act[k].second < d) {
+                packer.Place(&inputs[0], inputs.size());
+                inputs.clear();
+            }
+            InputTy c = _pat_v[act[k].first][d];
+            if (inputs.empty() || inputs.back() != c)
+                inputs.push_back(c);
+        }
+        packer.Place(&inputs[0], inputs.size());
+
+        // Drop the patterns ending at this depth. The common prefix with
+        // the previous pattern kept is the shortest one in between.
+        next_act.clear();
+        uint32 lcp = (uint32)-1;
+        for (uint32 k = 0; k < act.size(); k++) {
+            if (act[k].second < lcp)
+                lcp = act[k].second;
+            if (_len_v[act[k].first] > d + 1) {
+                next_act.push_back(make_pair(act[k].first,
+                                             next_act.empty() ? 0 : lcp));
+                lcp = (uint32)-1;
+            }
+        }
+        act.swap(next_act);
+    }
+    return packer.Get_Cell_Num();
+}
+
+// Return the memory occupied by the slow graph of "state_num" states. Each heap
+// allocation has some overhead, and vectors may have up to twice the capacity
+// of their size.
+static uint64
+Calc_Slow_Sz(uint64 state_num) {
+    uint64 heap_overhead = 2 * sizeof(void*);
+    uint64 map_node_sz = sizeof(ACS_Goto_Map::value_type) +
+                         4 * sizeof(void*) + heap_overhead;
+    return state_num * (sizeof(ACS_State) + heap_overhead) +
+           (state_num - 1) * map_node_sz +
+           2 * state_num * sizeof(ACS_State*) + 256;
+}
+
+// The shape of the AC graph is that of the trie of the patterns, which is
+// figured out by visiting the patterns in lexicographical order: the new
+// states of a pattern are those beyond its longest common prefix with the
+// previous one. Along the way, we keep track of the number of kids of each
+// state on the path of the previous pattern; as a state leaves the path,
+// all of its kids are known, and so is its size.
+//
+void
+AC_Builder::Scan_Trie(const vector<uint32>& order, uint32 min_len,
+                      uint32 max_len, Trie_Shape* shape) const {
+    // kids[d]: the number of kids of the state at depth "d" on the path.
+    vector<uint32> kids(1, 0);
+    memset(shape, 0, sizeof(*shape));
+    shape->state_num = 1;
+
+    const char* prev = 0;
+    uint32 prev_len = 0;
+    for (uint32 i = 0; i < order.size(); i++) {
+        const char* pat = _pat_v[order[i]];
+        uint32 len = _len_v[order[i]];
+        if (len < min_len || len > max_len)
+            continue;
+
+        uint32 lcp = 0;
+        uint32 cmp_len = len < prev_len ? len : prev_len;
+        while (lcp < cmp_len && pat[lcp] == prev[lcp])
+            lcp++;
+
+        // Patterns are sorted, so a pattern is never a proper prefix of the
+        // previous one; lcp == len means it's a duplicate.
+        if (lcp == len)
+            continue;
+
+        for (uint32 d = kids.size() - 1; d > lcp; d--) {
+            shape->state_sz += AC_Converter::Calc_State_Sz(kids[d]);
+            shape->compact_sz += Compact_State_Sz(kids[d]);
+        }
+        kids.resize(lcp + 1);
+
+        kids[lcp]++;
+        for (uint32 d = lcp + 1; d < len; d++)
+            kids.push_back(1);
+        kids.push_back(0);
+
+        shape->state_num += len - lcp;
+        shape->term_num++;
+        if (len > shape->max_len)
+            shape->max_len = len;
+        for (uint32 d = lcp; d < len; d++)
+            shape->used[(InputTy)pat[d]] = true;
+        prev = pat;
+        prev_len = len;
+    }
+
+    for (uint32 d = kids.size() - 1; d > 0; d--) {
+        shape->state_sz += AC_Converter::Calc_State_Sz(kids[d]);
+        shape->compact_sz += Compact_State_Sz(kids[d]);
+    }
+    shape->compact_sz += Compact_State_Sz(kids[0]);
+    shape->root_fanout = kids[0];
+}
+
+void
+AC_Builder::Estimate(ac_estimate_t* est) const {
+    uint32 pat_num = _pat_v.size();
+    vector<uint32> order(pat_num);
+    for (uint32 i = 0; i < pat_num; i++)
+        order[i] = i;
+    sort(order.begin(), order.end(), Pattern_Less(_pat_v, _len_v));
+
+    Trie_Shape shape;
+    Scan_Trie(order, 0, MAX_PATTERN_LEN, &shape);
+    uint64 state_num = shape.state_num;
+    uint32 term_num = shape.term_num;
+    uint32 max_len = shape.max_len;
+    uint64 compact_sz = shape.compact_sz;
+
+    AC_Ofst root_goto_ofst, states_ofst_ofst;
+    uint64 buf_sz = AC_Converter::Calc_Layout(shape.root_fanout, state_num,
+                                              &root_goto_ofst,
+                                              &states_ofst_ofst);
+    buf_sz += shape.state_sz;
+    buf_sz += AC_Converter::Calc_Sheng_Sz(state_num, _opt.flags);
+
+    uint32 input_num = 0;
+    for (uint32 c = 0; c < 256; c++)
+        input_num += shape.used[c] ? 1 : 0;
+    buf_sz += AC_Converter::Calc_Stride2_Sz(state_num, input_num, _opt.flags);
+
+    // The peak is reached at the end of the conversion, when the slow graph,
+    // the converter's bookkeeping, and the buffer are all alive.
+    uint64 slow_sz = Calc_Slow_Sz(state_num);
+    uint64 converter_sz = 2 * (state_num + 1) * sizeof(uint32) +
+                          2 * state_num * sizeof(ACS_State*);
+
+    Trie_Shape short_shape, long_shape;
+    if (_opt.flags & AC_OPT_COMPOSITE) {
+        Scan_Trie(order, 1, COMPOSITE_SHORT_LEN, &short_shape);
+        Scan_Trie(order, COMPOSITE_SHORT_LEN + 1, MAX_PATTERN_LEN,
+                  &long_shape);
+    }
+
+    if (_opt.flags & AC_OPT_SUCCINCT) {
+        // The regular graph is converted first, and it's alive until the
+        // succinct one is derived from it.
+        uint64 louds_sz = sizeof(AC_Buffer) +
+                          Calc_LOUDS_Sz(state_num, term_num, pat_num, max_len);
+        converter_sz += buf_sz;
+        buf_sz = louds_sz;
+    } else if ((_opt.flags & AC_OPT_COMPOSITE) &&
+               AC_Converter::Is_Composite(short_shape.state_num,
+                                          long_shape.state_num, _opt.flags)) {
+        // The graph of the long patterns is converted first, out of the slow
+        // graph of them, and they are alive until the composite one is
+        // derived from them.
+        state_num = long_shape.state_num;
+        uint64 graph_sz = AC_Converter::Calc_Layout(long_shape.root_fanout,
+                                                    state_num,
+                                                    &root_goto_ofst,
+                                                    &states_ofst_ofst);
+        graph_sz += long_shape.state_sz;
+        converter_sz += Calc_Slow_Sz(state_num) + graph_sz;
+        buf_sz = Calc_Composite_Sz(graph_sz, short_shape.state_num);
+    } else if ((_opt.flags & AC_OPT_QGRAM_FILTER) &&
+               !(_opt.flags & AC_OPT_DOUBLE_ARRAY) && pat_num &&
+               Get_Min_Len() >= QGRAM_MIN_LEN) {
+        // The regular graph, with no tables of its own, is converted first,
+        // and it's alive until the table is appended to it. Each distinct
+        // prefix of the window's length makes a window.
+        uint32 window = Get_Min_Len();
+        if (window > QGRAM_WINDOW_MAX)
+            window = QGRAM_WINDOW_MAX;
+        uint64 window_num = 0;
+        for (uint32 i = 0; i < pat_num; i++) {
+            if (!i || memcmp(_pat_v[order[i - 1]], _pat_v[order[i]], window))
+                window_num++;
+        }
+
+        uint64 graph_sz = AC_Converter::Calc_Layout(shape.root_fanout,
+                                                    state_num,
+                                                    &root_goto_ofst,
+                                                    &states_ofst_ofst);
+        graph_sz += shape.state_sz;
+        converter_sz += graph_sz;
+        buf_sz = QGram_Table_Ofst(graph_sz) +
+                 QGram_Table_Sz(QGram_Hash_Bits(window_num, window));
+    } else if (AC_Converter::Is_Compact(state_num, _opt.flags)) {
+        // Likewise.
+        converter_sz += buf_sz;
+        buf_sz = sizeof(AC_Buffer) + sizeof(Compact_Table) + compact_sz;
+    } else if (_opt.flags & AC_OPT_DOUBLE_ARRAY) {
+        buf_sz += DA_Table_Sz(Estimate_DA(order));
+        converter_sz += state_num * (sizeof(uint32) + sizeof(ACS_State*));
+    }
+
+    // The slow graph keeps a copy of the patterns only if it outlives the
+    // conversion, as the reference of the verification. The pattern table,
+    // if any, is appended to the graph converted without it, which is alive
+    // until then.
+    uint64 pat_sz = 0;
+    for (uint32 i = 0; i < pat_num; i++)
+        pat_sz += _len_v[i];
+    bool copy = _opt.verify_sample != 0;
+#ifdef VERIFY
+    copy = true;
+#endif
+    if (copy)
+        slow_sz += pat_sz + pat_num * (1 + sizeof(char*) + sizeof(unsigned));
+    if (_opt.flags & AC_OPT_PATTERN_TABLE) {
+        converter_sz += buf_sz;
+        buf_sz += AC_Converter::Calc_Pattern_Table_Sz(pat_num, pat_sz);
+    }
+
+    est->pattern_num = pat_num;
+    est->state_num = state_num;
+    est->buf_size = buf_sz;
+    est->peak_mem = Get_Self_Size(0) + slow_sz + converter_sz + buf_sz;
+}
+
+ac_t*
+AC_Builder::Finish(int* err) {
+    if (_budget) {
+        ac_estimate_t est;
+        Estimate(&est);
+        if (est.peak_mem > _budget) {
+            if (err)
+                *err = AC_ERR_BUDGET;
+            return 0;
+        }
+    }
+
+    ac_t* ac = ac_create_opt(_pat_v.empty() ? 0 : &_pat_v[0],
+                             _len_v.empty() ? 0 : &_len_v[0],
+                             _pat_v.size(), &_opt);
+    if (err)
+        *err = AC_OK;
+    return ac;
+}
+
+extern "C" ac_builder_t*
+ac_builder_create(const ac_opt_t* opt, unsigned long long budget) {
+    return (ac_builder_t*)(void*)(new AC_Builder(opt, budget));
+}
+
+extern "C" int
+ac_builder_add(ac_builder_t* b, const char* pattern, unsigned int len) {
+    return ((AC_Builder*)(void*)b)->Add(pattern, len);
+}
+
+extern "C" void
+ac_builder_estimate(ac_builder_t* b, ac_estimate_t* est) {
+    ((AC_Builder*)(void*)b)->Estimate(est);
+}
+
+extern "C" ac_t*
+ac_builder_finish(ac_builder_t* b, int* err) {
+    return ((AC_Builder*)(void*)b)->Finish(err);
+}
+
+extern "C" void
+ac_builder_free(ac_builder_t* b) {
+    delete (AC_Builder*)(void*)b;
+}
@@ -0,0 +1,176 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>      // for snprintf
+#include <stdlib.h>     // for mkstemp
+#include <string.h>
+#include "ac_cache.hpp"
+
+namespace {
+// 128-bit FNV-1a. It is not a cryptographic hash, but the cache directory
+// is supposed to be writable only by the trusted users; the key only needs
+// to be practically free of accidental collision.
+class Hash128 {
+public:
+    Hash128() {
+        _h = ((unsigned __int128)0x6c62272e07bb0142ULL << 64) |
+             0x62b821756295c58dULL;
+    }
+
+    void Add(const void* data, uint32 len) {
+        const unsigned char* p = (const unsigned char*)data;
+        const unsigned __int128 prime =
+            ((unsigned __int128)1 << 88) | 0x13b;
+        for (uint32 i = 0; i < len; i++) {
+            _h ^= p[i];
+            _h *= prime;
+        }
+    }
+
+    void Add(uint32 v) {
+        // Always little-endian, so the key doesn't depend on host's endian.
+        unsigned char b[4] = {(unsigned char)v, (unsigned char)(v >> 8),
+                              (unsigned char)(v >> 16),
+                              (unsigned char)(v >> 24)};
+        Add(b, 4);
+    }
+
+    // Return the hash as 32 hex digits.
+    string Hex() const {
+        char buf[33];
+        uint64 hi = (uint64)(_h >> 64), lo = (uint64)_h;
+        snprintf(buf, sizeof(buf), "%016lx%016lx", hi, lo);
+        return buf;
+    }
+
+private:
+    unsigned __int128 _h;
+};
+} // end of anonymous namespace
+
+AC_Cache::AC_Cache(const char* dir, const char** strv, unsigned int* strlenv,
+                   unsigned int strnum, const ac_opt_t* opt) {
+    Hash128 h;
+
+    // The layout. The size of the header tells apart the builds with
+    // different header (e.g. -DVERIFY).
+    h.Add(AC_LAYOUT_VERSION);
+    h.Add(sizeof(AC_Buffer));
+
+    // The options which affect the content of the buffer.
+    h.Add(opt ? opt->flags : 0);
+
+    // The patterns, each prefixed with its length to avoid ambiguity.
+    h.Add(strnum);
+    for (uint32 i = 0; i < strnum; i++) {
+        h.Add(strlenv[i]);
+        h.Add(strv[i], strlenv[i]);
+    }
+
+    _path = dir;
+    _path += "/ac-";
+    _path += h.Hex();
+    _path += ".bin";
+}
+
+void
+Copy_Opt(const ac_opt_t* opt, ac_opt_t* copy, string* cache_dir) {
+    if (opt)
+        *copy = *opt;
+    else
+        memset(copy, 0, sizeof(*copy));
+
+    if (copy->cache_dir) {
+        *cache_dir = copy->cache_dir;
+        copy->cache_dir = cache_dir->c_str();
+    }
+}
+
+void*
+Map_File(const char* path, uint32 min_len, uint32* len) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+
+    struct stat filestat;
+    if (fstat(fd, &filestat) || filestat.st_size < (off_t)min_len ||
+        filestat.st_size > (off_t)(uint32)-1) {
+        close(fd);
+        return 0;
+    }
+
+    // Private writable mapping, as the header is updated in place (e.g. the
+    // flags). Only the page(s) being written are copied.
+    *len = filestat.st_size;
+    void* p = mmap(0, *len, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return p == MAP_FAILED ? 0 : p;
+}
+
+bool
+Write_File(const char* path, const void* data, uint32 len) {
+    string tmp_path = path;
+    tmp_path += ".XXXXXX";
+    int fd = mkstemp(&tmp_path[0]);
+    if (fd == -1)
+        return false;
+
+    const unsigned char* p = (const unsigned char*)data;
+    bool ok = fchmod(fd, 0644) == 0;
+    for (uint32 ofst = 0; ok && ofst < len; ) {
+        ssize_t n = write(fd, p + ofst, len - ofst);
+        if (n <= 0)
+            ok = false;
+        else
+            ofst += n;
+    }
+    ok = ok && fsync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+    ok = ok && rename(tmp_path.c_str(), path) == 0;
+
+    if (!ok)
+        unlink(tmp_path.c_str());
+    return ok;
+}
+
+AC_Buffer*
+AC_Cache::Load() const {
+    uint32 len;
+    void* p = Map_File(_path.c_str(), sizeof(AC_Buffer), &len);
+    if (!p)
+        return 0;
+
+    // The entries are written only by Save(), which renames the file into
+    // place once it's complete, and the directory is trusted (see Hash128);
+    // so the verdict recorded in the entry is taken as is, and only the
+    // header is checked.
+    AC_Buffer* buf = (AC_Buffer*)p;
+    Clear_Runtime_Fields(buf);
+    if ((buf->flags & BUF_POOLED) || !Validate_Buffer(buf, len, true)) {
+        munmap(p, len);
+        return 0;
+    }
+
+    buf->flags |= BUF_MAPPED;
+    return buf;
+}
+
+void
+AC_Cache::Save(const AC_Buffer* buf) const {
+    uint32 len = buf->buf_len;
+    unsigned char* copy = new unsigned char[len];
+    memcpy(copy, buf, len);
+    Clear_Runtime_Fields((AC_Buffer*)copy);
+
+    // Errors are ignored, the cache is just an optimization.
+    Write_File(_path.c_str(), copy, len);
+    delete[] copy;
+}
+
+void
+AC_Cache::Unmap(AC_Buffer* buf) {
+    ASSERT(buf->flags & BUF_MAPPED);
+    munmap(buf, buf->buf_len);
+}
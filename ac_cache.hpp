@@ -0,0 +1,56 @@
+#ifndef AC_CACHE_H
+#define AC_CACHE_H
+
+#include <string>
+#include "ac.h"
+#include "ac_fast.hpp"
+
+using namespace std;
+
+// The on-disk cache of fast AC graphs (i.e. AC_Buffer). Each graph is saved
+// in a file named after the hash of everything determining the content of
+// the graph: the patterns, the options and the buffer layout. Since the
+// graph is position-independent, a cached graph is used in place by mmap-ing
+// the file, and the pages are shared by all processes using the same
+// dictionary.
+class AC_Cache {
+public:
+    AC_Cache(const char* dir, const char** strv, unsigned int* strlenv,
+             unsigned int strnum, const ac_opt_t* opt);
+
+    // Map the cached graph, and validate it. Return NULL if the graph is
+    // not in the cache or is invalid. The graph is flagged BUF_MAPPED, and
+    // it should be released via Unmap().
+    AC_Buffer* Load() const;
+
+    // Save the graph to the cache. The file is written under a temporary
+    // name and then renamed, so the readers see either nothing or the
+    // complete file. Errors are ignored, the cache is just an optimization.
+    void Save(const AC_Buffer* buf) const;
+
+    static void Unmap(AC_Buffer* buf);
+
+    const string& Get_Path() const { return _path; }
+
+private:
+    string _path;
+};
+
+// Copy the options "opt", or zeros if it's NULL, to "copy", such that the
+// copy doesn't refer to the caller's memory: the cache directory is kept in
+// "cache_dir". Used by those keeping the options around to build instances
+// later on.
+void Copy_Opt(const ac_opt_t* opt, ac_opt_t* copy, string* cache_dir);
+
+// Map the file at "path" privately and writably, such that the pages not
+// written are shared by all processes mapping the file. Return the address
+// with "*len" set to the size of the file, or NULL if the file cannot be
+// mapped, is shorter than "min_len" bytes, or is 4GB or larger.
+void* Map_File(const char* path, uint32 min_len, uint32* len);
+
+// Write the "len" bytes of "data" to the file at "path". The file is written
+// under a temporary name and then renamed, so the readers see either the
+// old file or the complete new file. Return true on success.
+bool Write_File(const char* path, const void* data, uint32 len);
+
+#endif // AC_CACHE_H
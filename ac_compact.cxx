@@ -0,0 +1,245 @@
+#include <strings.h>    // for bzero
+#include "ac_compact.hpp"
+
+static inline uint32
+Get_Goto_Num(AC_Buffer* graph, State_ID id) {
+    return id ? Get_State(graph, id)->goto_num : graph->root_goto_num;
+}
+
+// Return the offset of each state of the "graph" wrt the first state, along
+// with the size of all states.
+static uint32
+Calc_State_Ofsts(AC_Buffer* graph, vector<uint32>& ofst_v) {
+    uint32 state_num = graph->state_num;
+    ofst_v.resize(state_num);
+
+    uint32 ofst = 0;
+    for (State_ID id = 0; id < state_num; id++) {
+        ofst_v[id] = ofst;
+        ofst += Compact_State_Sz(Get_Goto_Num(graph, id));
+    }
+    return ofst;
+}
+
+uint64
+Calc_Compact_Sz(AC_Buffer* graph) {
+    vector<uint32> ofst_v;
+    return sizeof(Compact_Table) + Calc_State_Ofsts(graph, ofst_v);
+}
+
+void
+Build_Compact_Table(AC_Buffer* graph, Compact_Table* tbl) {
+    ASSERT(graph->state_num <= COMPACT_STATE_MAX);
+
+    vector<uint32> ofst_v;
+    uint32 sz = Calc_State_Ofsts(graph, ofst_v);
+    bzero(tbl, sizeof(Compact_Table) + sz);
+
+    unsigned char* states = (unsigned char*)(tbl + 1);
+    for (State_ID id = 0; id < graph->state_num; id++) {
+        Compact_State* cs = (Compact_State*)(void*)(states + ofst_v[id]);
+        uint32 goto_num = Get_Goto_Num(graph, id);
+        uint16* kids = (uint16*)(void*)(cs + 1);
+        InputTy* inputs = (InputTy*)(kids + goto_num);
+        cs->goto_num = goto_num;
+
+        if (id == 0) {
+            // Root's kids are numbered in the order of their inputs.
+            uint32 i = 0;
+            for (uint32 c = 0; c < 256; c++) {
+                int kid = Get_Goto(graph, 0, c);
+                if (kid >= 0) {
+                    tbl->root_inputs[c / 64] |= (uint64)1 << (c % 64);
+                    kids[i] = ofst_v[kid];
+                    inputs[i++] = c;
+                }
+            }
+            for (uint32 w = 1; w < 4; w++) {
+                tbl->root_rank[w] = tbl->root_rank[w - 1] +
+                                    LOUDS_Popcount(tbl->root_inputs[w - 1]);
+            }
+            continue;
+        }
+
+        AC_State* s = Get_State(graph, id);
+        for (uint32 i = 0; i < goto_num; i++) {
+            kids[i] = ofst_v[s->first_kid + i];
+            inputs[i] = s->input_vect[i];
+        }
+
+        cs->fail = ofst_v[s->fail_link];
+        cs->depth = s->depth;
+        cs->is_term = s->is_term;
+
+        // As the fail-link target has smaller ID, its tags are settled.
+        if (s->is_term)
+            cs->tags |= STATE_TERM_TAG;
+        const Compact_State* fl =
+            (const Compact_State*)(void*)(states + cs->fail);
+        if (s->fail_link && fl->tags)
+            cs->tags |= STATE_OUT_TAG;
+    }
+}
+
+// Like Validate_Buffer(), it's a single pass over the states after locating
+// them, checking the properties the matchers rely on:
+//  - the states exactly fill the table, and the kids of the states are the
+//    states laid out next in order, so each state but root has exactly one
+//    parent, and the inputs of the kids are sorted,
+//  - the fail-link points to a state laid out earlier,
+//  - the tags agree with the fail-links, and the pattern index and depth of
+//    a state are within range and right, respectively.
+//
+bool
+Validate_Compact_Table(AC_Buffer* buf) {
+    AC_Ofst ofst = buf->compact_ofst;
+    uint32 state_num = buf->state_num;
+    if (state_num == 0 || state_num > COMPACT_STATE_MAX ||
+        ofst < sizeof(AC_Buffer) || ofst % __alignof__(Compact_Table) ||
+        (uint64)ofst + sizeof(Compact_Table) > Get_Graph_Len(buf)) {
+        return false;
+    }
+
+    Compact_Table* tbl = (Compact_Table*)((unsigned char*)buf + ofst);
+    const unsigned char* states = (const unsigned char*)(tbl + 1);
+    uint32 sz = Get_Graph_Len(buf) - ofst - sizeof(Compact_Table);
+
+    // Step 1: Locate the states, which must exactly fill the table. As the
+    // table is small, the state at each offset is kept in a map.
+    const uint32 none = (uint32)-1;
+    vector<uint32> ofst_v(state_num);
+    vector<uint32> id_map(sz, none);
+    uint32 pos = 0;
+    for (State_ID id = 0; id < state_num; id++) {
+        if ((uint64)pos + sizeof(Compact_State) > sz)
+            return false;
+
+        const Compact_State* s = (const Compact_State*)(states + pos);
+        ofst_v[id] = pos;
+        id_map[pos] = id;
+        pos += Compact_State_Sz(s->goto_num);
+        if (pos > sz)
+            return false;
+    }
+    if (pos != sz)
+        return false;
+
+    // Step 2: Check the states in order.
+    vector<uint32> depth_v(state_num, 0);
+    State_ID next_kid = 1;
+    for (State_ID id = 0; id < state_num; id++) {
+        const Compact_State* s = (const Compact_State*)(states + ofst_v[id]);
+        uint32 goto_num = s->goto_num;
+        const uint16* kids = (const uint16*)(const void*)(s + 1);
+        const InputTy* inputs = (const InputTy*)(kids + goto_num);
+
+        if (goto_num) {
+            if (next_kid <= id || (uint64)next_kid + goto_num > state_num)
+                return false;
+
+            for (uint32 i = 0; i < goto_num; i++) {
+                State_ID kid = next_kid + i;
+                if (kids[i] != ofst_v[kid] ||
+                    (i && inputs[i - 1] >= inputs[i])) {
+                    return false;
+                }
+                depth_v[kid] = depth_v[id] + 1;
+            }
+            next_kid += goto_num;
+        }
+
+        if (id == 0) {
+            // The bitmap has exactly the inputs of root's kids, and the
+            // rank of each word is right.
+            uint32 input_num = 0;
+            for (uint32 i = 0; i < 4; i++) {
+                if (tbl->root_rank[i] != input_num || tbl->reserved[i])
+                    return false;
+                input_num += LOUDS_Popcount(tbl->root_inputs[i]);
+            }
+            if (input_num != goto_num || goto_num != buf->root_goto_num ||
+                s->fail || s->depth || s->is_term || s->tags) {
+                return false;
+            }
+
+            for (uint32 i = 0; i < goto_num; i++) {
+                InputTy c = inputs[i];
+                if (!((tbl->root_inputs[c / 64] >> (c % 64)) & 1))
+                    return false;
+            }
+            continue;
+        }
+
+        uint32 fl = s->fail >= sz ? none : id_map[s->fail];
+        if (fl == none || fl >= id || (depth_v[id] == 1 && fl != 0))
+            return false;
+
+        if (s->depth != depth_v[id] || s->is_term > buf->pattern_num)
+            return false;
+
+        uint32 tags = s->is_term ? STATE_TERM_TAG : 0;
+        const Compact_State* f = (const Compact_State*)(states + s->fail);
+        if (fl && f->tags)
+            tags |= STATE_OUT_TAG;
+        if (s->tags != tags)
+            return false;
+    }
+    return next_kid == state_num;
+}
+
+// Same as Match_Tmpl(), except that the graph is the compact one.
+template<MATCH_VARIANT variant> static ac_result_t
+Compact_Match_Tmpl(AC_Buffer* buf, const char* str, uint32 len) {
+    Compact_Graph g(buf);
+
+    ac_result_t r = {-1, -1};
+    uint32 idx = 0;
+    State_ID state = 0;
+    for (;;) {
+        if (state == 0) {
+            state = g.Root_Skip(str, len, idx);
+            if (state == 0)
+                break;
+        } else {
+            if (idx >= len)
+                break;
+
+            State_ID kid;
+            if (g.Goto(state, str[idx], kid)) {
+                state = kid;
+                idx++;
+            } else {
+                // Follow the fail-link without consuming the input.
+                state = g.Get_Fail(state);
+                if (state == 0)
+                    continue;
+            }
+        }
+
+        if (unlikely(g.Get_Tags(state) & STATE_TERM_TAG)) {
+            int match_begin = idx - g.Get_Depth(state);
+            int match_end = idx - 1;
+
+            if (variant == MV_FIRST_MATCH || r.match_begin == -1 ||
+                match_end - match_begin > r.match_end - r.match_begin) {
+                r.match_begin = match_begin;
+                r.match_end = match_end;
+                r.pattern_idx = g.Get_Pattern_Idx(state);
+            }
+            if (variant == MV_FIRST_MATCH)
+                return r;
+        }
+    }
+
+    return r;
+}
+
+ac_result_t
+Compact_Match(AC_Buffer* buf, const char* str, uint32 len) {
+    return Compact_Match_Tmpl<MV_FIRST_MATCH>(buf, str, len);
+}
+
+ac_result_t
+Compact_Match_Longest_L(AC_Buffer* buf, const char* str, uint32 len) {
+    return Compact_Match_Tmpl<MV_LEFT_LONGEST>(buf, str, len);
+}
@@ -0,0 +1,146 @@
+#ifndef AC_COMPACT_H
+#define AC_COMPACT_H
+
+#include <vector>
+#include "ac_fast.hpp"
+#include "ac_louds.hpp"     // for LOUDS_Popcount()
+
+using namespace std;
+
+// The compact layout of the AC graph, for tiny dictionaries (e.g. a handful
+// of patterns), whose footprint would otherwise be dominated by the fixed
+// parts: the 256-byte root goto table, the state offset vector, and the
+// tables of the DFA-based engines. It's not used if the Sheng table applies,
+// which is small and much faster. Like the succinct layout, it replaces the
+// states of the graph; the buffer is the header followed by the table.
+//
+// The states are laid out back to back in BFS order, root first, and each
+// state is referred to by its offset wrt the first state, which takes 16
+// bits; so root is at offset 0, and there is no need to map a state's ID to
+// its offset. A state's record is followed by the offsets of its kids, and
+// then by the inputs on which it goes to them, in ascending order.
+//
+// Root's valid inputs are also kept in a bitmap, such that the matcher skips
+// the chars that are not with a single test, and finds the kid on the char
+// by counting the valid inputs less than it.
+//
+#define COMPACT_STATE_MAX   256     // States no more than this are compact.
+
+typedef struct {
+    uint64 root_inputs[4];  // bitmap of root's valid inputs
+    unsigned char root_rank[4]; // number of root's valid inputs before
+                                // each word of the bitmap
+    unsigned char reserved[4];
+
+    // Followed by the states, root first.
+} Compact_Table;
+
+typedef struct {
+    uint16 fail;            // offset of the fail-link target
+    uint16 depth;           // How far away from root.
+    uint16 is_term;         // 1 + pattern-index, or 0 if not terminal.
+    unsigned char goto_num; // The number of valid transitions.
+    unsigned char tags;     // Bitwise-or of STATE_XXX_TAG
+
+    // Followed by:
+    //  uint16 kids[goto_num];      the offsets of the kids.
+    //  InputTy inputs[goto_num];   the inputs, sorted.
+} Compact_State;
+
+// Return the size in byte of a state with "goto_num" transitions.
+static inline uint32
+Compact_State_Sz(uint32 goto_num) {
+    uint32 sz = sizeof(Compact_State) +
+                goto_num * (sizeof(uint16) + sizeof(InputTy));
+    uint32 align = __alignof__(Compact_State);
+    return (sz + align - 1) & ~(align - 1);
+}
+
+// Return the size in byte of the table of the well-formed "graph".
+uint64 Calc_Compact_Sz(AC_Buffer* graph);
+
+// Populate the table, which is allocated by Calc_Compact_Sz(graph) bytes,
+// out of the well-formed "graph".
+void Build_Compact_Table(AC_Buffer* graph, Compact_Table* tbl);
+
+// Check if the table of the compact "buf" is well-formed, such that the
+// matchers never go out of the buffer or loop forever.
+bool Validate_Compact_Table(AC_Buffer* buf);
+
+// The accessors of the compact graph, with the same interface as that of the
+// regular one used by Match_All_Tmpl(). The state's "ID" is its offset.
+class Compact_Graph {
+public:
+    Compact_Graph(AC_Buffer* buf) {
+        _tbl = (const Compact_Table*)((unsigned char*)buf + buf->compact_ofst);
+        _states = (const unsigned char*)(_tbl + 1);
+        _root_kids = (const uint16*)(const void*)(_states +
+                                                  sizeof(Compact_State));
+    }
+
+    // Skip the chars starting from "idx" that are not valid input of the
+    // root-node. Return the root's kid reached by the first valid char (with
+    // "idx" pointing right after it), or 0 if the subject string is
+    // exhausted.
+    State_ID Root_Skip(const char* str, uint32 len, uint32& idx) const {
+        while (idx < len) {
+            InputTy c = str[idx++];
+            uint64 word = _tbl->root_inputs[c / 64];
+            if ((word >> (c % 64)) & 1) {
+                uint64 below = ((uint64)1 << (c % 64)) - 1;
+                uint32 i = _tbl->root_rank[c / 64] +
+                           LOUDS_Popcount(word & below);
+                return _root_kids[i];
+            }
+        }
+        return 0;
+    }
+
+    // Return true, with "kid" set, if the goto function of the state "id" is
+    // defined for the input "c".
+    bool Goto(State_ID id, InputTy c, State_ID& kid) const {
+        const Compact_State* s = Get_State(id);
+        uint32 num = s->goto_num;
+        const uint16* kids = (const uint16*)(const void*)(s + 1);
+        const InputTy* inputs = (const InputTy*)(kids + num);
+
+        // Binary search for the wide, and then linear search for the rest.
+        uint32 low = 0, high = num;
+        while (high - low > 8) {
+            uint32 mid = (low + high) >> 1;
+            if (c < inputs[mid])
+                high = mid;
+            else
+                low = mid;
+        }
+        for (; low < high; low++) {
+            if (inputs[low] == c) {
+                kid = kids[low];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    State_ID Get_Fail(State_ID id) const { return Get_State(id)->fail; }
+    uint32 Get_Tags(State_ID id) const { return Get_State(id)->tags; }
+    uint32 Get_Depth(State_ID id) const { return Get_State(id)->depth; }
+    uint32 Get_Pattern_Idx(State_ID id) const {
+        return Get_State(id)->is_term - 1;
+    }
+
+private:
+    const Compact_State* Get_State(State_ID id) const {
+        return (const Compact_State*)(const void*)(_states + id);
+    }
+
+    const Compact_Table* _tbl;
+    const unsigned char* _states;
+    const uint16* _root_kids;
+};
+
+ac_result_t Compact_Match(AC_Buffer* buf, const char* str, uint32 len);
+ac_result_t Compact_Match_Longest_L(AC_Buffer* buf, const char* str,
+                                    uint32 len);
+
+#endif  // AC_COMPACT_H
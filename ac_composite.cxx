@@ -0,0 +1,600 @@
+#include <strings.h>    // for bzero
+#include <string.h>
+#include "ac_slow.hpp"
+#include "ac_composite.hpp"
+
+Short_DFA::Short_DFA(const Short_Pattern_Vect& patterns) {
+    // Number the prefixes of the patterns in BFS order, root first.
+    map<string, uint32> ids;
+    ids[""] = 0;
+    _strs.push_back("");
+    _parent.push_back(0);
+    for (uint32 depth = 1; depth <= COMPOSITE_SHORT_LEN; depth++) {
+        for (uint32 i = 0; i < patterns.size(); i++) {
+            const string& p = patterns[i].first;
+            if (p.size() < depth)
+                continue;
+
+            string prefix = p.substr(0, depth);
+            if (ids.insert(make_pair(prefix, (uint32)_strs.size())).second) {
+                _strs.push_back(prefix);
+                _parent.push_back(ids[p.substr(0, depth - 1)]);
+            }
+        }
+    }
+
+    for (uint32 i = 0; i < patterns.size(); i++)
+        _patterns[patterns[i].first] = patterns[i].second + 1;
+}
+
+void
+Short_DFA::Build_Table(AC_Buffer* graph, Composite_Table* tbl) const {
+    uint32 state_num = _strs.size();
+    ASSERT(state_num <= COMPOSITE_SHORT_STATE_MAX);
+    bzero(tbl, Calc_Composite_Sz(0, state_num));
+    Build_Bigram(graph, tbl->bigram);
+    tbl->short_state_num = state_num;
+
+    uint16* delta = (uint16*)(void*)(tbl + 1);
+    Composite_Short* states = (Composite_Short*)(delta + state_num * 256);
+
+    // Step 1: The short patterns being the suffixes of each state.
+    for (uint32 id = 0; id < state_num; id++) {
+        const string& s = _strs[id];
+        uint32 depth = s.size();
+        states[id].depth = depth;
+        for (uint32 d = 1; d <= depth; d++) {
+            map<string, uint32>::const_iterator i =
+                _patterns.find(s.substr(depth - d));
+            if (i != _patterns.end())
+                states[id].term[d - 1] = i->second;
+        }
+    }
+
+    // Step 2: The transitions of the trie. As root is never a kid, 0 stands
+    // for a transition yet to be resolved.
+    for (uint32 id = 1; id < state_num; id++)
+        delta[_parent[id] * 256 + (InputTy)_strs[id][_strs[id].size() - 1]] =
+            id;
+
+    // Step 3: Resolve the fail-links in BFS order. The fail-link target is
+    // shallower, so are the states on the chain of the parent's, whose
+    // transitions are all resolved.
+    vector<uint32> fail(state_num, 0);
+    for (uint32 id = 1; id < state_num; id++) {
+        uint32 parent = _parent[id];
+        if (parent != 0) {
+            InputTy c = _strs[id][_strs[id].size() - 1];
+            fail[id] = delta[fail[parent] * 256 + c];
+        }
+
+        uint16* row = delta + id * 256;
+        const uint16* fail_row = delta + fail[id] * 256;
+        for (uint32 c = 0; c < 256; c++) {
+            if (!row[c])
+                row[c] = fail_row[c];
+        }
+    }
+
+    // Step 4: Tag the transitions.
+    for (uint32 i = 0; i < state_num * 256; i++) {
+        const Composite_Short& s = states[delta[i]];
+        uint32 hit = 0;
+        for (uint32 d = 0; d < COMPOSITE_SHORT_LEN; d++)
+            hit |= s.term[d];
+        delta[i] = (delta[i] << 1) | (hit ? COMPOSITE_HIT : 0);
+    }
+}
+
+void
+Build_Bigram(AC_Buffer* graph, uint64* bigram) {
+    bzero(bigram, sizeof(((Composite_Table*)0)->bigram));
+    for (uint32 c = 0; c < 256; c++) {
+        int kid = Get_Goto(graph, 0, c);
+        if (kid < 0)
+            continue;
+
+        AC_State* s = Get_State(graph, kid);
+        for (uint32 i = 0; i < s->goto_num; i++) {
+            uint32 bg = c * 256 + s->input_vect[i];
+            bigram[bg / 64] |= (uint64)1 << (bg % 64);
+        }
+    }
+}
+
+bool
+AC_Converter::Is_Composite(uint64 short_state_num, uint64 long_state_num,
+                           uint32 opt_flags) {
+    return (opt_flags & (AC_OPT_COMPOSITE | AC_OPT_SUCCINCT)) ==
+               AC_OPT_COMPOSITE &&
+           short_state_num > 1 &&
+           short_state_num <= COMPOSITE_SHORT_STATE_MAX &&
+           long_state_num > 1;
+}
+
+AC_Buffer*
+AC_Converter::Convert_Composite() {
+    if ((_opt_flags & (AC_OPT_COMPOSITE | AC_OPT_SUCCINCT)) !=
+        AC_OPT_COMPOSITE) {
+        return 0;
+    }
+
+    // Step 1: Recover the patterns from the slow graph, which keeps only the
+    // winner of the duplicates, and split them by length. The long ones
+    // keep their indices, with the others being empty, which match nothing.
+    uint32 pattern_num = _acs.Get_Pattern_Num();
+    Short_Pattern_Vect short_v;
+    vector<string> long_v(pattern_num);
+
+    typedef pair<const ACS_State*, InputTy> Stack_Elmt;
+    vector<Stack_Elmt> stack;
+    string path;
+    GotoVect gotos;
+    _acs.Get_Root_State()->Get_Sorted_Gotos(gotos);
+    for (uint32 i = gotos.size(); i > 0; i--)
+        stack.push_back(Stack_Elmt(gotos[i - 1].second, gotos[i - 1].first));
+
+    while (!stack.empty()) {
+        const ACS_State* s = stack.back().first;
+        InputTy c = stack.back().second;
+        stack.pop_back();
+
+        uint32 depth = s->Get_Depth();
+        path.resize(depth - 1);
+        path += (char)c;
+        if (s->is_Terminal()) {
+            uint32 idx = s->get_Pattern_Idx();
+            if (depth <= COMPOSITE_SHORT_LEN)
+                short_v.push_back(make_pair(path, idx));
+            else
+                long_v[idx] = path;
+        }
+
+        s->Get_Sorted_Gotos(gotos);
+        for (uint32 i = gotos.size(); i > 0; i--) {
+            stack.push_back(Stack_Elmt(gotos[i - 1].second,
+                                       gotos[i - 1].first));
+        }
+    }
+
+    Short_DFA dfa(short_v);
+    if (dfa.Get_State_Num() > COMPOSITE_SHORT_STATE_MAX)
+        return 0;
+
+    vector<const char*> strv(pattern_num + 1);
+    vector<unsigned int> strlenv(pattern_num + 1);
+    for (uint32 i = 0; i < pattern_num; i++) {
+        strv[i] = long_v[i].data();
+        strlenv[i] = long_v[i].size();
+    }
+    ACS_Constructor long_acs;
+    long_acs.Construct(&strv[0], &strlenv[0], pattern_num);
+    if (!Is_Composite(dfa.Get_State_Num(), long_acs.Get_State_Num(),
+                      _opt_flags)) {
+        return 0;
+    }
+
+    // Step 2: Convert the graph of the long patterns, with no tables of its
+    // own, and append the composite table to it.
+    ac_opt_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.flags = AC_OPT_NO_SHENG | AC_OPT_NO_STRIDE2 | AC_OPT_NO_COMPACT;
+    Heap_Buf_Alloc tmp;
+    AC_Converter cvt(long_acs, tmp, &opt);
+    AC_Buffer* graph = cvt.Convert();
+
+    uint32 graph_sz = graph->buf_len;
+    AC_Ofst ofst = Composite_Table_Ofst(graph_sz);
+    uint32 sz = Calc_Composite_Sz(graph_sz, dfa.Get_State_Num());
+    AC_Buffer* buf = _buf_alloc.alloc(sz);
+    memcpy(buf, graph, graph_sz);
+    bzero((unsigned char*)buf + graph_sz, ofst - graph_sz);
+
+    buf->buf_len = sz;
+    buf->composite_ofst = ofst;
+    buf->flags = BUF_COMPOSITE;
+    dfa.Build_Table(buf, (Composite_Table*)((unsigned char*)buf + ofst));
+
+    ASSERT(Validate_Buffer(buf, buf->buf_len, false));
+    buf->flags |= BUF_VALIDATED;
+    return buf;
+}
+
+// Besides the layout of the table, it checks the properties the matchers
+// rely on:
+//  - the transitions are within range, and they are tagged right,
+//  - a transition goes no more than one level deeper, so the depth of the
+//    state is no more than the number of chars consumed, and the suffixes
+//    yielding short matches are no longer than the state, and the pattern
+//    indices of them are within range,
+//  - the bigrams are exactly what the graph yields, and no state of the
+//    graph shallower than COMPOSITE_SHORT_LEN + 1 is terminal, so the ID of
+//    any state yielding a match is greater than COMPOSITE_SHORT_LEN (see
+//    Composite_Match_All_Tmpl()).
+//
+bool
+Validate_Composite_Table(AC_Buffer* buf) {
+    AC_Ofst ofst = buf->composite_ofst;
+    if (ofst < sizeof(AC_Buffer) || ofst % __alignof__(Composite_Table) ||
+        (uint64)ofst + sizeof(Composite_Table) > Get_Graph_Len(buf)) {
+        return false;
+    }
+
+    Composite_Table* tbl = (Composite_Table*)((unsigned char*)buf + ofst);
+    uint32 state_num = tbl->short_state_num;
+    if (state_num == 0 || state_num > COMPOSITE_SHORT_STATE_MAX ||
+        tbl->reserved ||
+        Calc_Composite_Sz(ofst, state_num) != Get_Graph_Len(buf)) {
+        return false;
+    }
+
+    const uint16* delta = (const uint16*)(const void*)(tbl + 1);
+    const Composite_Short* states =
+        (const Composite_Short*)(delta + state_num * 256);
+
+    vector<bool> hit(state_num);
+    for (uint32 id = 0; id < state_num; id++) {
+        const Composite_Short& s = states[id];
+        if (s.depth > COMPOSITE_SHORT_LEN || (id == 0 && s.depth != 0))
+            return false;
+
+        for (uint32 d = 0; d < COMPOSITE_SHORT_LEN; d++) {
+            if (s.term[d] > buf->pattern_num || (s.term[d] && d >= s.depth))
+                return false;
+            if (s.term[d])
+                hit[id] = true;
+        }
+    }
+
+    for (uint32 i = 0; i < state_num * 256; i++) {
+        uint32 next = delta[i] >> 1;
+        if (next >= state_num ||
+            (delta[i] & COMPOSITE_HIT) != (hit[next] ? COMPOSITE_HIT : 0) ||
+            states[next].depth > states[i / 256].depth + 1) {
+            return false;
+        }
+    }
+
+    for (State_ID id = 1; id < buf->state_num; id++) {
+        AC_State* s = Get_State(buf, id);
+        if (s->is_term && s->depth <= COMPOSITE_SHORT_LEN)
+            return false;
+    }
+
+    uint64 bigram[sizeof(tbl->bigram) / sizeof(uint64)];
+    Build_Bigram(buf, bigram);
+    return memcmp(bigram, tbl->bigram, sizeof(bigram)) == 0;
+}
+
+// The accessors of the two graphs.
+class Composite_Graph {
+public:
+    Composite_Graph(AC_Buffer* buf) {
+        _buf_base = (const unsigned char*)buf;
+        _root_goto = _buf_base + buf->root_goto_ofst;
+        _states_ofst_vect =
+            (const AC_Ofst*)(const void*)(_buf_base + buf->states_ofst_ofst);
+        _full_root = buf->root_goto_num == 256;
+
+        const Composite_Table* tbl =
+            (const Composite_Table*)(_buf_base + buf->composite_ofst);
+        _bigram = tbl->bigram;
+        _delta = (const uint16*)(const void*)(tbl + 1);
+        _shorts = (const Composite_Short*)
+                  (_delta + tbl->short_state_num * 256);
+    }
+
+    // The DFA's state is the element of its transition table, i.e. the ID
+    // tagged with COMPOSITE_HIT.
+    uint32 Short_Step(uint32 s, InputTy c) const {
+        return _delta[(s >> 1) * 256 + c];
+    }
+
+    // Return the state of the DFA right before "idx", which is that after the
+    // COMPOSITE_SHORT_LEN chars before it.
+    uint32 Short_Resume(const char* str, uint32 idx) const {
+        uint32 s = 0;
+        uint32 i = idx > COMPOSITE_SHORT_LEN ? idx - COMPOSITE_SHORT_LEN : 0;
+        for (; i < idx; i++)
+            s = Short_Step(s, str[i]);
+        return s;
+    }
+
+    const Composite_Short& Short_State(uint32 s) const {
+        return _shorts[s >> 1];
+    }
+
+    // Return the state of the graph of the long patterns reached from the
+    // state "id" on the char at "idx".
+    State_ID Long_Step(State_ID id, const char* str, uint32 idx,
+                       uint32 len) const {
+        InputTy c = str[idx];
+        while (id) {
+            const AC_State* s = Get_State(id);
+            uint32 low = 0, high = s->goto_num;
+            const InputTy* inputs = s->input_vect;
+            while (high - low > 8) {
+                uint32 mid = (low + high) >> 1;
+                if (c < inputs[mid])
+                    high = mid;
+                else
+                    low = mid;
+            }
+            for (; low < high; low++) {
+                if (inputs[low] == c)
+                    return s->first_kid + low;
+            }
+            id = s->fail_link;
+        }
+        return Root_Step(str, idx, len);
+    }
+
+    // Likewise, from root. Root's kid is not worth going to unless the next
+    // char is the valid input of it. The last char has no next one to
+    // check, and the kid is gone to regardless, such that the scan of a
+    // string fed in segments goes on right at the next segment.
+    State_ID Root_Step(const char* str, uint32 idx, uint32 len) const {
+        InputTy c = str[idx];
+        if (likely(idx + 1 < len)) {
+            uint32 bg = c * 256 + (InputTy)str[idx + 1];
+            if (likely(!((_bigram[bg / 64] >> (bg % 64)) & 1)))
+                return 0;
+        }
+        return _full_root ? c + 1 : _root_goto[c];
+    }
+
+    // As the offset of root is 0, its tags are 0.
+    uint32 Get_Tags(State_ID id) const {
+        return _states_ofst_vect[id] & STATE_TAG_MASK;
+    }
+    State_ID Get_Fail(State_ID id) const { return Get_State(id)->fail_link; }
+    uint32 Get_Depth(State_ID id) const {
+        return id ? Get_State(id)->depth : 0;
+    }
+    uint32 Get_Pattern_Idx(State_ID id) const {
+        return Get_State(id)->is_term - 1;
+    }
+
+private:
+    const AC_State* Get_State(State_ID id) const {
+        return (const AC_State*)(_buf_base +
+                                 (_states_ofst_vect[id] & ~STATE_TAG_MASK));
+    }
+
+    const unsigned char* _buf_base;
+    const unsigned char* _root_goto;
+    const AC_Ofst* _states_ofst_vect;
+    bool _full_root;
+    const uint64* _bigram;
+    const uint16* _delta;
+    const Composite_Short* _shorts;
+};
+
+// Pick the match ending right before "idx" that Match_Tmpl() reports, given
+// the states of the two graphs there, and the depth no less than which the
+// terminal states it visits are (see ac_composite.hpp). The long match, if
+// any, is the longest one. Return true if it's picked.
+template<MATCH_VARIANT variant> static inline bool
+Pick_Match(const Composite_Graph& g, uint32 a, State_ID b, uint32 idx,
+           uint32 min_depth, ac_result_t& r) {
+    uint32 depth = 0, pattern_idx = 0;
+
+    uint32 tags = g.Get_Tags(b);
+    while (tags && !(tags & STATE_TERM_TAG)) {
+        b = g.Get_Fail(b);
+        tags = g.Get_Tags(b);
+    }
+    if (tags) {
+        depth = g.Get_Depth(b);
+        pattern_idx = g.Get_Pattern_Idx(b);
+    } else {
+        const Composite_Short& s = g.Short_State(a);
+        for (uint32 d = s.depth; d > 0; d--) {
+            if (s.term[d - 1]) {
+                depth = d;
+                pattern_idx = s.term[d - 1] - 1;
+                break;
+            }
+        }
+    }
+
+    if (depth == 0 || depth < min_depth)
+        return false;
+
+    int match_begin = idx - depth;
+    int match_end = idx - 1;
+    if (variant == MV_FIRST_MATCH || r.match_begin == -1 ||
+        match_end - match_begin > r.match_end - r.match_begin) {
+        r.match_begin = match_begin;
+        r.match_end = match_end;
+        r.pattern_idx = pattern_idx;
+    }
+    return true;
+}
+
+template<MATCH_VARIANT variant> static ac_result_t
+Composite_Match_Tmpl(AC_Buffer* buf, const char* str, uint32 len) {
+    Composite_Graph g(buf);
+
+    ac_result_t r = {-1, -1};
+    uint32 a = 0;
+    State_ID b = 0;
+
+    // The offset right after the last char where some match ends, along
+    // with the states there, which are kept until the states after the
+    // next char are known; "hit_idx" is 0 if none.
+    uint32 hit_idx = 0, hit_a = 0;
+    State_ID hit_b = 0;
+    for (uint32 idx = 0; idx < len; idx++) {
+        a = g.Short_Step(a, str[idx]);
+        b = b ? g.Long_Step(b, str, idx, len) : g.Root_Step(str, idx, len);
+
+        if (unlikely(hit_idx != 0)) {
+            uint32 da = g.Short_State(a).depth, db = g.Get_Depth(b);
+            uint32 depth = da > db ? da : db;
+            if (Pick_Match<variant>(g, hit_a, hit_b, hit_idx,
+                                    depth ? depth - 1 : 0, r) &&
+                variant == MV_FIRST_MATCH) {
+                return r;
+            }
+            hit_idx = 0;
+        }
+
+        if (unlikely((a & COMPOSITE_HIT) || g.Get_Tags(b))) {
+            hit_idx = idx + 1;
+            hit_a = a;
+            hit_b = b;
+        }
+    }
+
+    // At the end of the subject string, only the state itself is visited.
+    if (hit_idx != 0) {
+        uint32 da = g.Short_State(hit_a).depth, db = g.Get_Depth(hit_b);
+        Pick_Match<variant>(g, hit_a, hit_b, hit_idx, da > db ? da : db, r);
+    }
+    return r;
+}
+
+ac_result_t
+Composite_Match(AC_Buffer* buf, const char* str, uint32 len) {
+    return Composite_Match_Tmpl<MV_FIRST_MATCH>(buf, str, len);
+}
+
+ac_result_t
+Composite_Match_Longest_L(AC_Buffer* buf, const char* str, uint32 len) {
+    return Composite_Match_Tmpl<MV_LEFT_LONGEST>(buf, str, len);
+}
+
+/* Same as Match_All_Tmpl(), except that the matches come from the two
+ * graphs. Those ending at the same offset are the long ones on the fail-link
+ * chain of the long graph's state, followed by the short ones being the
+ * suffixes of the DFA's state, which are all shorter.
+ *
+ * The matches yet to be reported when the scan stops early are encoded in
+ * "scan->priv[1]" as follows: 0 if none; the long graph's state, which is
+ * greater than COMPOSITE_SHORT_LEN, if the long ones on its chain are yet to
+ * be reported, and so are the short ones; otherwise the length of the
+ * longest short one yet to be reported.
+ */
+template<bool save> static uint32
+Composite_Match_All_Tmpl(AC_Buffer* buf, const char* str, uint32 len,
+                         ac_result_t* result_v, uint32 result_cap,
+                         const ac_limit_t* limit, ac_scan_t* scan) {
+    Composite_Graph g(buf);
+
+    uint32 idx = scan->resume_ofst;
+    State_ID b = scan->priv[0];
+    uint32 out = scan->priv[1];
+    uint32 a = g.Short_Resume(str, idx);
+
+    uint32 max_match = (uint32)-1;
+    uint32 stop = len;
+    uint32 usec = 0;
+    if (limit) {
+        if (limit->max_matches)
+            max_match = limit->max_matches;
+        if (limit->max_bytes && limit->max_bytes < len - idx)
+            stop = idx + limit->max_bytes;
+        usec = limit->max_usec;
+    }
+    if (save && result_cap < max_match)
+        max_match = result_cap;
+    Scan_Budget budget(usec, idx);
+
+    uint32 match_num = 0;
+    for (;;) {
+        // Report the matches ending at "idx - 1", the long ones first.
+        while (out > COMPOSITE_SHORT_LEN) {
+            uint32 tags = g.Get_Tags(out);
+            if (tags & STATE_TERM_TAG) {
+                if (match_num == max_match)
+                    goto truncated;
+
+                if (save) {
+                    ac_result_t& r = result_v[match_num];
+                    r.match_begin = idx - g.Get_Depth(out);
+                    r.match_end = idx - 1;
+                    r.pattern_idx = g.Get_Pattern_Idx(out);
+                }
+                match_num++;
+            }
+            out = (tags & STATE_OUT_TAG) ? g.Get_Fail(out) :
+                                           COMPOSITE_SHORT_LEN;
+        }
+
+        if (out) {
+            const Composite_Short& s = g.Short_State(a);
+            for (uint32 d = out < s.depth ? out : s.depth; d > 0; d--) {
+                if (!s.term[d - 1])
+                    continue;
+
+                if (match_num == max_match) {
+                    out = d;
+                    goto truncated;
+                }
+                if (save) {
+                    ac_result_t& r = result_v[match_num];
+                    r.match_begin = idx - d;
+                    r.match_end = idx - 1;
+                    r.pattern_idx = s.term[d - 1] - 1;
+                }
+                match_num++;
+            }
+            out = 0;
+        }
+
+        if (idx >= stop)
+            break;
+
+        if (match_num == max_match)
+            goto truncated;
+
+        uint32 chunk_end = stop;
+        if (!budget.Check(idx, chunk_end))
+            goto truncated;
+
+        // Advance until reaching a state yielding matches in either graph.
+        while (idx < chunk_end) {
+            a = g.Short_Step(a, str[idx]);
+            b = b ? g.Long_Step(b, str, idx, len) :
+                    g.Root_Step(str, idx, len);
+            idx++;
+
+            if (unlikely(g.Get_Tags(b))) {
+                out = b;
+                break;
+            }
+            if (unlikely(a & COMPOSITE_HIT)) {
+                out = COMPOSITE_SHORT_LEN;
+                break;
+            }
+        }
+    }
+
+    scan->status = idx < len ? AC_SCAN_TRUNCATED : AC_SCAN_DONE;
+    scan->resume_ofst = idx;
+    scan->priv[0] = b;
+    scan->priv[1] = 0;
+    return match_num;
+
+truncated:
+    scan->status = AC_SCAN_TRUNCATED;
+    scan->resume_ofst = idx;
+    scan->priv[0] = b;
+    scan->priv[1] = out;
+    return match_num;
+}
+
+uint32
+Composite_Match_All(AC_Buffer* buf, const char* str, uint32 len,
+                    ac_result_t* result_v, uint32 result_cap,
+                    const ac_limit_t* limit, ac_scan_t* scan) {
+    return Composite_Match_All_Tmpl<true>(buf, str, len, result_v,
+                                          result_cap, limit, scan);
+}
+
+uint32
+Composite_Match_Count(AC_Buffer* buf, const char* str, uint32 len,
+                      const ac_limit_t* limit, ac_scan_t* scan) {
+    return Composite_Match_All_Tmpl<false>(buf, str, len, 0, 0, limit, scan);
+}
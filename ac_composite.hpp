@@ -0,0 +1,120 @@
+#ifndef AC_COMPOSITE_H
+#define AC_COMPOSITE_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "ac_fast.hpp"
+
+using namespace std;
+
+// The composite graph, for dictionaries mixing a handful of short tokens with
+// long signatures. The short tokens alone would make nearly every char a
+// valid input of root, so the matcher would leave root at almost every char,
+// only to fail back a step later, and the skip loop would never skip.
+//
+// So the patterns are split by length. The short ones (no longer than
+// COMPOSITE_SHORT_LEN) are matched with a DFA: the AC graph of them with the
+// fail-links resolved, which takes exactly one lookup per char. The long ones
+// are matched with the regular graph of them, whose root is left only if the
+// char and the next one are the first two bytes of some long pattern; as no
+// state of depth 1 is terminal, skipping those leading nowhere is invisible.
+// Both are run in one pass over the subject string.
+//
+// As a short pattern has no more than COMPOSITE_SHORT_LEN chars, so is any
+// state of the DFA, and the DFA's state after a string is determined by its
+// last COMPOSITE_SHORT_LEN chars; the state of a resumed scan is thus
+// recomputed rather than saved.
+//
+// Merging the matches of the two is exact. The state of the graph of all the
+// patterns after a string is the longer of the two graphs' states, and the
+// terminal states Match_Tmpl() visits at an offset are those on the chain of
+// that state, no shorter than one less than the depth of the next state
+// (that's where it finds the next input valid, and stops following the
+// fail-links), or just the state itself at the end of the subject string. So
+// the matchers look ahead one char before picking the match at an offset.
+//
+// The buffer is the regular graph of the long patterns (with the pattern
+// indices of all the patterns), followed by the composite table.
+//
+#define COMPOSITE_SHORT_LEN         3
+#define COMPOSITE_SHORT_STATE_MAX   1024
+
+// The element of the DFA's transition table is the ID of the next state
+// shifted left by one, with the least significant bit telling if any short
+// pattern ends at it.
+#define COMPOSITE_HIT       1
+
+typedef struct {
+    // The bitmap of the first two bytes of the long patterns, indiced by
+    // "first_byte * 256 + second_byte".
+    uint64 bigram[65536 / 64];
+    uint32 short_state_num;     // The number of states of the DFA.
+    uint32 reserved;
+
+    // Followed by:
+    //  uint16 delta[short_state_num][256];     the transitions.
+    //  Composite_Short states[short_state_num];
+} Composite_Table;
+
+typedef struct {
+    // 1 + the index of the short pattern being the suffix of the state of
+    // length "i + 1", or 0 if none.
+    uint16 term[COMPOSITE_SHORT_LEN];
+    uint16 depth;               // How far away from root.
+} Composite_Short;
+
+// The short patterns, along with their indices, from which the DFA is built.
+typedef vector<pair<string, uint32> > Short_Pattern_Vect;
+
+// Return the offset of the table following the regular graph of "graph_sz"
+// bytes, and the size of the whole buffer, respectively.
+static inline uint64
+Composite_Table_Ofst(uint64 graph_sz) {
+    uint64 align = __alignof__(Composite_Table);
+    return (graph_sz + align - 1) & ~(align - 1);
+}
+
+static inline uint64
+Calc_Composite_Sz(uint64 graph_sz, uint32 short_state_num) {
+    return Composite_Table_Ofst(graph_sz) + sizeof(Composite_Table) +
+           (uint64)short_state_num * (256 * sizeof(uint16) +
+                                      sizeof(Composite_Short));
+}
+
+// The DFA of the short patterns, which are no longer than COMPOSITE_SHORT_LEN.
+class Short_DFA {
+public:
+    Short_DFA(const Short_Pattern_Vect& patterns);
+
+    uint32 Get_State_Num() const { return _strs.size(); }
+
+    // Populate the table, with the bigrams of the regular "graph" of the
+    // long patterns.
+    void Build_Table(AC_Buffer* graph, Composite_Table* tbl) const;
+
+private:
+    vector<string> _strs;           // The prefixes, root first, in BFS order.
+    vector<uint32> _parent;         // The parent of each of them.
+    map<string, uint32> _patterns;  // pattern -> 1 + pattern-index
+};
+
+// Populate the bigram bitmap of the regular "graph".
+void Build_Bigram(AC_Buffer* graph, uint64* bigram);
+
+// Check if the composite table of "buf" is well-formed, such that the
+// matchers never go out of the buffer, and never report a match beginning
+// before the subject string; the rest of the buffer must be already
+// validated.
+bool Validate_Composite_Table(AC_Buffer* buf);
+
+ac_result_t Composite_Match(AC_Buffer* buf, const char* str, uint32 len);
+ac_result_t Composite_Match_Longest_L(AC_Buffer* buf, const char* str,
+                                      uint32 len);
+uint32 Composite_Match_All(AC_Buffer* buf, const char* str, uint32 len,
+                           ac_result_t* result_v, uint32 result_cap,
+                           const ac_limit_t* limit, ac_scan_t* scan);
+uint32 Composite_Match_Count(AC_Buffer* buf, const char* str, uint32 len,
+                             const ac_limit_t* limit, ac_scan_t* scan);
+
+#endif  // AC_COMPOSITE_H
@@ -0,0 +1,268 @@
+#include "ac_da.hpp"
+
+void
+DA_Packer::Use(uint32 cell) {
+    // Extend the list to cover the cell.
+    while (cell >= _used.size()) {
+        uint32 i = _used.size();
+        _used.push_back(false);
+        _next.push_back(i + 1);
+        _prev.push_back(_tail);
+        _tail = i;
+    }
+
+    ASSERT(!_used[cell]);
+    _used[cell] = true;
+
+    // Unlink the cell. As root's cell is never free, _next[0] is used as
+    // the head.
+    uint32 prev = _prev[cell], next = _next[cell];
+    _next[prev] = next;
+    if (next < _used.size())
+        _prev[next] = prev;
+    if (_tail == cell)
+        _tail = prev;
+}
+
+uint32
+DA_Packer::Place(const InputTy* inputs, uint32 num) {
+    ASSERT(num != 0);
+
+    // Try the free cells for the first input one by one.
+    uint32 base;
+    for (uint32 cell = _next[0]; ; cell = Next_Free(cell)) {
+        if (cell < inputs[0])
+            continue;
+
+        base = cell - inputs[0];
+        uint32 i = 1;
+        while (i < num && !Is_Used(base + inputs[i]))
+            i++;
+        if (i == num)
+            break;
+    }
+
+    for (uint32 i = 0; i < num; i++)
+        Use(base + inputs[i]);
+
+    if (base + 256 > _cell_num)
+        _cell_num = base + 256;
+    return base;
+}
+
+static inline DA_Cell*
+Get_Cells(const DA_Table* tbl) {
+    return (DA_Cell*)(void*)(tbl + 1);
+}
+
+uint32
+Pack_DA(AC_Buffer* buf, vector<uint32>& base_v) {
+    uint32 state_num = buf->state_num;
+    base_v.assign(state_num, 0);
+
+    DA_Packer packer;
+    InputTy root_inputs[256];
+    uint32 root_fanout = 0;
+    for (uint32 c = 0; c < 256; c++) {
+        if (Get_Goto(buf, 0, c) >= 0)
+            root_inputs[root_fanout++] = c;
+    }
+    if (root_fanout)
+        base_v[0] = packer.Place(root_inputs, root_fanout);
+
+    for (State_ID id = 1; id < state_num; id++) {
+        AC_State* s = Get_State(buf, id);
+        if (s->goto_num)
+            base_v[id] = packer.Place(s->input_vect, s->goto_num);
+    }
+    return packer.Get_Cell_Num();
+}
+
+void
+Build_DA_Table(AC_Buffer* buf, DA_Table* tbl, const vector<uint32>& base_v) {
+    uint32 state_num = buf->state_num;
+    uint32 cell_num = 256;
+    for (State_ID id = 0; id < state_num; id++) {
+        if (base_v[id] + 256 > cell_num)
+            cell_num = base_v[id] + 256;
+    }
+
+    tbl->cell_num = cell_num;
+    tbl->reserved = 0;
+    DA_Cell* cells = Get_Cells(tbl);
+    for (uint32 i = 0; i < cell_num; i++) {
+        cells[i].base = 0;
+        cells[i].check = DA_FREE;
+        cells[i].fail = 0;
+        cells[i].state = 0;
+    }
+
+    // The cell of each state. As the kids have greater IDs than the parent,
+    // the cell of a state is known by the time it's visited.
+    vector<uint32> cell_v(state_num, 0);
+    for (State_ID id = 0; id < state_num; id++) {
+        uint32 cell = cell_v[id];
+        uint32 base = base_v[id];
+        cells[cell].base = base;
+
+        if (id == 0) {
+            for (uint32 c = 0; c < 256; c++) {
+                int kid = Get_Goto(buf, 0, c);
+                if (kid >= 0) {
+                    cell_v[kid] = base + c;
+                    cells[base + c].check = cell;
+                }
+            }
+            continue;
+        }
+
+        AC_State* s = Get_State(buf, id);
+        for (uint32 i = 0; i < s->goto_num; i++) {
+            uint32 kid_cell = base + s->input_vect[i];
+            cell_v[s->first_kid + i] = kid_cell;
+            cells[kid_cell].check = cell;
+        }
+
+        cells[cell].fail = cell_v[s->fail_link];
+        cells[cell].state = (id << 1) | (s->is_term ? DA_TERM : 0);
+    }
+}
+
+bool
+Validate_DA_Table(AC_Buffer* buf) {
+    AC_Ofst ofst = buf->da_ofst;
+    if (ofst < buf->first_state_ofst || ofst % __alignof__(DA_Table) ||
+        (uint64)ofst + sizeof(DA_Table) > Get_Graph_Len(buf)) {
+        return false;
+    }
+
+    DA_Table* tbl = (DA_Table*)((unsigned char*)buf + ofst);
+    uint32 cell_num = tbl->cell_num;
+    if (cell_num < 256 ||
+        (uint64)ofst + DA_Table_Sz(cell_num) > Get_Graph_Len(buf)) {
+        return false;
+    }
+
+    // Root's cell is not any state's kid, and is never a match.
+    DA_Cell* cells = Get_Cells(tbl);
+    if (cells[0].check != DA_FREE || cells[0].fail || cells[0].state)
+        return false;
+
+    // Visit the states in the order of their IDs, such that the cells of
+    // the parent and of the fail-link target are known by the time a state
+    // is visited (see Validate_Buffer()). Kids of distinct cells have
+    // distinct checks, so no two states share a cell.
+    uint32 state_num = buf->state_num;
+    vector<uint32> cell_v(state_num, 0);
+    uint32 kid_num = 0;
+    for (State_ID id = 0; id < state_num; id++) {
+        uint32 cell = cell_v[id];
+        uint32 base = cells[cell].base;
+        if ((uint64)base + 256 > cell_num)
+            return false;
+
+        if (id == 0) {
+            for (uint32 c = 0; c < 256; c++) {
+                int kid = Get_Goto(buf, 0, c);
+                if (kid < 0)
+                    continue;
+                if (cells[base + c].check != cell)
+                    return false;
+                cell_v[kid] = base + c;
+                kid_num++;
+            }
+            continue;
+        }
+
+        AC_State* s = Get_State(buf, id);
+        if (cells[cell].fail != cell_v[s->fail_link] ||
+            cells[cell].state != ((id << 1) | (s->is_term ? DA_TERM : 0))) {
+            return false;
+        }
+
+        for (uint32 i = 0; i < s->goto_num; i++) {
+            uint32 kid_cell = base + s->input_vect[i];
+            if (cells[kid_cell].check != cell)
+                return false;
+            cell_v[s->first_kid + i] = kid_cell;
+        }
+        kid_num += s->goto_num;
+    }
+
+    // Any other cell claiming a parent would be a bogus transition.
+    uint32 used_num = 0;
+    for (uint32 i = 0; i < cell_num; i++) {
+        if (cells[i].check != DA_FREE)
+            used_num++;
+    }
+    return used_num == kid_num;
+}
+
+// Same as Match_Tmpl(), except that the transitions are looked up in the
+// double-array.
+template<MATCH_VARIANT variant> static ac_result_t
+DA_Match_Tmpl(AC_Buffer* buf, const char* str, uint32 len) {
+    const DA_Table* tbl =
+        (const DA_Table*)((unsigned char*)buf + buf->da_ofst);
+    const DA_Cell* cells = Get_Cells(tbl);
+    uint32 root_base = cells[0].base;
+
+    ac_result_t r = {-1, -1};
+    uint32 idx = 0;
+    uint32 cur = 0;     // The cell of the current state.
+    for (;;) {
+        if (cur == 0) {
+            // Skip the chars that are not valid input of the root-node.
+            while (idx < len) {
+                uint32 t = root_base + (InputTy)str[idx++];
+                if (cells[t].check == 0) {
+                    cur = t;
+                    break;
+                }
+            }
+            if (cur == 0)
+                break;
+        } else {
+            if (idx >= len)
+                break;
+
+            uint32 t = cells[cur].base + (InputTy)str[idx];
+            if (cells[t].check == cur) {
+                cur = t;
+                idx++;
+            } else {
+                // Follow the fail-link without consuming the input.
+                cur = cells[cur].fail;
+                if (cur == 0)
+                    continue;
+            }
+        }
+
+        if (unlikely(cells[cur].state & DA_TERM)) {
+            AC_State* s = Get_State(buf, cells[cur].state >> 1);
+            int match_begin = idx - s->depth;
+            int match_end = idx - 1;
+
+            if (variant == MV_FIRST_MATCH || r.match_begin == -1 ||
+                match_end - match_begin > r.match_end - r.match_begin) {
+                r.match_begin = match_begin;
+                r.match_end = match_end;
+                r.pattern_idx = s->is_term - 1;
+            }
+            if (variant == MV_FIRST_MATCH)
+                return r;
+        }
+    }
+
+    return r;
+}
+
+ac_result_t
+DA_Match(AC_Buffer* buf, const char* str, uint32 len) {
+    return DA_Match_Tmpl<MV_FIRST_MATCH>(buf, str, len);
+}
+
+ac_result_t
+DA_Match_Longest_L(AC_Buffer* buf, const char* str, uint32 len) {
+    return DA_Match_Tmpl<MV_LEFT_LONGEST>(buf, str, len);
+}
@@ -0,0 +1,95 @@
+#ifndef AC_DA_H
+#define AC_DA_H
+
+#include <vector>
+#include "ac_fast.hpp"
+
+using namespace std;
+
+// The double-array layout of the AC graph, an alternative to looking for the
+// transitions in AC_State::input_vect.
+//
+// Each state occupies a cell of an array, and the kids of a state are placed
+// such that the kid on input "c" is at the cell "base + c", where "base" is
+// chosen per state, and the cell records its parent (aka "check"). So a goto
+// is one indexed load, plus a comparison of the check against the current
+// cell. The fail-link, in terms of cell, is stored alongside.
+//
+// Root is at cell 0. The array has at least 256 cells beyond the greatest
+// base, so "base + c" never goes out of the array.
+//
+#define DA_FREE     0xffffffff  // The check of free cells
+#define DA_TERM     1           // Tag of DA_Cell::state
+
+typedef struct {
+    uint32 base;    // the kid on input "c" is at the cell "base + c".
+    uint32 check;   // the cell of the parent, or DA_FREE.
+    uint32 fail;    // the cell of the fail-link target.
+    uint32 state;   // ID of the state, shifted by 1, tagged with DA_TERM.
+} DA_Cell;
+
+typedef struct {
+    uint32 cell_num;
+    uint32 reserved;
+    // Followed by: DA_Cell cells[cell_num]
+} DA_Table;
+
+static inline uint64
+DA_Table_Sz(uint64 cell_num) {
+    return sizeof(DA_Table) + cell_num * sizeof(DA_Cell);
+}
+
+// Figure out the base of each state by first-fit. The states are to be
+// placed in the order of their IDs, i.e. in BFS order; the outcome depends
+// only on the order and the inputs of the kids.
+//
+// The free cells are chained in a doubly-linked list, such that looking for
+// the base only visits the free cells for the first input. The cells beyond
+// the end of the list are all free.
+class DA_Packer {
+public:
+    DA_Packer() : _tail(0), _cell_num(256) {
+        // Root is at cell 0, and cell 1 is the head of the free list.
+        _next.push_back(1);
+        _prev.push_back(0);
+        _used.push_back(true);
+    }
+
+    // Place the kids on the sorted "inputs", and return their base.
+    uint32 Place(const InputTy* inputs, uint32 num);
+
+    uint32 Get_Cell_Num() const { return _cell_num; }
+
+private:
+    bool Is_Used(uint32 cell) const {
+        return cell < _used.size() && _used[cell];
+    }
+    uint32 Next_Free(uint32 cell) const {
+        return cell < _next.size() ? _next[cell] : cell + 1;
+    }
+    void Use(uint32 cell);
+
+    vector<bool> _used;
+    vector<uint32> _next;   // The next free cell; _next[0] is the head.
+    vector<uint32> _prev;   // The previous free cell, 0 if none.
+    uint32 _tail;           // The last free cell in the list, 0 if none.
+    uint32 _cell_num;
+};
+
+// Figure out the base of each state of the well-formed "buf". Return the
+// number of cells.
+uint32 Pack_DA(AC_Buffer* buf, vector<uint32>& base_v);
+
+// Populate the double-array of "buf" by the bases of the states.
+void Build_DA_Table(AC_Buffer* buf, DA_Table* tbl,
+                    const vector<uint32>& base_v);
+
+// Check if the double-array of "buf" encodes exactly the transitions,
+// fail-links and states of the graph, in a pass over the cells; the rest of
+// the buffer must be already validated.
+bool Validate_DA_Table(AC_Buffer* buf);
+
+ac_result_t DA_Match(AC_Buffer* buf, const char* str, uint32 len);
+ac_result_t DA_Match_Longest_L(AC_Buffer* buf, const char* str, uint32 len);
+
+#endif  // AC_DA_H
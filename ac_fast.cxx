@@ -1,12 +1,26 @@
+#include <string.h>     // for strlen
+#include <strings.h>    // for bzero
+#include <stdint.h>     // for uintptr_t
 #include <algorithm>    // for std::sort
+#ifdef __SSE2__
+    #include <emmintrin.h>  // for _mm_cmpeq_epi8
+#endif
 #include "ac_slow.hpp"
 #include "ac_fast.hpp"
+#include "ac_sheng.hpp"
+#include "ac_stride2.hpp"
+#include "ac_da.hpp"
+#include "ac_louds.hpp"
+#include "ac_compact.hpp"
+#include "ac_lazy.hpp"
+#include "ac_composite.hpp"
+#include "ac_qgram.hpp"
 
 uint32
-AC_Converter::Calc_State_Sz(const ACS_State* s) const {
+AC_Converter::Calc_State_Sz(uint32 goto_num) {
     AC_State dummy;
     uint32 sz = offsetof(AC_State, input_vect);
-    sz += s->Get_GotoNum() * sizeof(dummy.input_vect[0]);
+    sz += goto_num * sizeof(dummy.input_vect[0]);
 
     if (sz < sizeof(AC_State))
         sz = sizeof(AC_State);
@@ -16,56 +30,190 @@ AC_Converter::Calc_State_Sz(const ACS_State* s) const {
     return sz;
 }
 
-AC_Buffer*
-AC_Converter::Alloc_Buffer() {
-    const vector<ACS_State*>& all_states = _acs.Get_All_States();
-    const ACS_State* root_state = _acs.Get_Root_State();
-    uint32 root_fanout = root_state->Get_GotoNum();
-
-    // Step 1: Calculate the buffer size
-    AC_Ofst root_goto_ofst, states_ofst_ofst, first_state_ofst;
-
+uint64
+AC_Converter::Calc_Layout(uint32 root_fanout, uint64 state_num,
+                          AC_Ofst* root_goto_ofst, AC_Ofst* states_ofst_ofst) {
     // part 1 :  buffer header
-    uint32 sz = root_goto_ofst = sizeof(AC_Buffer);
+    uint64 sz = *root_goto_ofst = sizeof(AC_Buffer);
 
     // part 2: Root-node's goto function
-    if (likely(root_fanout != 255))
+    if (likely(root_fanout != 256))
         sz += 256;
     else
-        root_goto_ofst = 0;
+        *root_goto_ofst = 0;
 
     // part 3: mapping of state's relative position.
     unsigned align = __alignof__(AC_Ofst);
     sz = (sz + align - 1) & ~(align - 1);
-    states_ofst_ofst = sz;
+    *states_ofst_ofst = sz;
 
-    sz += sizeof(AC_Ofst) * all_states.size();
+    sz += sizeof(AC_Ofst) * state_num;
 
     // part 4: state's contents
     align = __alignof__(AC_State);
     sz = (sz + align - 1) & ~(align - 1);
-    first_state_ofst = sz;
+    return sz;
+}
+
+bool
+AC_Converter::Is_Compact(uint64 state_num, uint32 opt_flags) {
+    // The other layouts, if asked for explicitly, take precedence, and so
+    // does the Sheng table, which is several times faster for under 1KB.
+    return state_num <= COMPACT_STATE_MAX &&
+           !Calc_Sheng_Sz(state_num, opt_flags) &&
+           !(opt_flags & (AC_OPT_THREADED | AC_OPT_DOUBLE_ARRAY |
+                          AC_OPT_SUCCINCT | AC_OPT_NO_COMPACT));
+}
+
+uint32
+AC_Converter::Calc_Sheng_Sz(uint64 state_num, uint32 opt_flags) {
+    if (state_num > SHENG_STATE_MAX ||
+        (opt_flags & (AC_OPT_THREADED | AC_OPT_NO_SHENG |
+                      AC_OPT_DOUBLE_ARRAY | AC_OPT_SUCCINCT))) {
+        return 0;
+    }
+
+    // The states' contents end at the alignment of AC_State, which is no
+    // less than that of the table.
+    ASSERT(__alignof__(AC_State) % __alignof__(Sheng_Table) == 0);
+    return sizeof(Sheng_Table);
+}
+
+uint32
+AC_Converter::Calc_Stride2_Sz(uint64 state_num, uint32 input_num,
+                              uint32 opt_flags) {
+    // The Sheng table, if applicable, is way more compact.
+    if (Calc_Sheng_Sz(state_num, opt_flags) ||
+        Is_Compact(state_num, opt_flags) ||
+        (opt_flags & (AC_OPT_THREADED | AC_OPT_NO_STRIDE2 |
+                      AC_OPT_DOUBLE_ARRAY | AC_OPT_SUCCINCT))) {
+        return 0;
+    }
+
+    uint32 class_num = Stride2_Class_Num(input_num);
+    if (class_num > STRIDE2_CLASS_MAX && !(opt_flags & AC_OPT_STRIDE2))
+        return 0;
+
+    uint64 sz = Stride2_Table_Sz(state_num, class_num);
+    if (sz > STRIDE2_MAX_SZ)
+        return 0;
+
+    ASSERT(__alignof__(AC_State) % __alignof__(Stride2_Table) == 0);
+    return sz;
+}
+
+// The states are placed in the same order as they are numbered in the fast
+// graph, see Convert().
+uint32
+AC_Converter::Pack_DA() {
+    DA_Packer packer;
+    vector<const ACS_State*> wl;
+    wl.push_back(_acs.Get_Root_State());
+
+    GotoVect gotovect;
+    vector<InputTy> inputs;
+    _da_base_v.clear();
+    for (uint32 idx = 0; idx < wl.size(); idx++) {
+        wl[idx]->Get_Sorted_Gotos(gotovect);
+        inputs.clear();
+        for (GotoVect::iterator i = gotovect.begin(), e = gotovect.end();
+             i != e; i++) {
+            inputs.push_back(i->first);
+            wl.push_back(i->second);
+        }
+
+        uint32 base = 0;
+        if (!inputs.empty())
+            base = packer.Place(&inputs[0], inputs.size());
+        _da_base_v.push_back(base);
+    }
+    return packer.Get_Cell_Num();
+}
+
+AC_Buffer*
+AC_Converter::Alloc_Buffer(Buf_Allocator& ba) {
+    const vector<ACS_State*>& all_states = _acs.Get_All_States();
+    const ACS_State* root_state = _acs.Get_Root_State();
+    uint32 root_fanout = root_state->Get_GotoNum();
+
+    // Step 1: Calculate the buffer size
+    AC_Ofst root_goto_ofst, states_ofst_ofst, first_state_ofst;
+    first_state_ofst = Calc_Layout(root_fanout, all_states.size(),
+                                   &root_goto_ofst, &states_ofst_ofst);
+    uint32 sz = first_state_ofst;
 
     uint32 state_sz = 0;
     for (vector<ACS_State*>::const_iterator i = all_states.begin(),
             e = all_states.end(); i != e; i++) {
-        state_sz += Calc_State_Sz(*i);
+        state_sz += Calc_State_Sz((*i)->Get_GotoNum());
     }
-    state_sz -= Calc_State_Sz(root_state);
+    state_sz -= Calc_State_Sz(root_state->Get_GotoNum());
 
     sz += state_sz;
 
+    uint32 sheng_sz = Calc_Sheng_Sz(all_states.size(), _opt_flags);
+    AC_Ofst sheng_ofst = sheng_sz ? sz : 0;
+    sz += sheng_sz;
+
+    bool used[256];
+    bzero(used, sizeof(used));
+    for (vector<ACS_State*>::const_iterator i = all_states.begin(),
+            e = all_states.end(); i != e; i++) {
+        const ACS_Goto_Map& m = (*i)->Get_Goto_Map();
+        for (ACS_Goto_Map::const_iterator gi = m.begin(), ge = m.end();
+             gi != ge; gi++) {
+            used[gi->first] = true;
+        }
+    }
+    uint32 input_num = 0;
+    for (uint32 c = 0; c < 256; c++)
+        input_num += used[c] ? 1 : 0;
+
+    uint32 stride2_sz = Calc_Stride2_Sz(all_states.size(), input_num,
+                                        _opt_flags);
+    AC_Ofst stride2_ofst = stride2_sz ? sz : 0;
+    sz += stride2_sz;
+
+    AC_Ofst da_ofst = 0;
+    if ((_opt_flags & (AC_OPT_DOUBLE_ARRAY | AC_OPT_SUCCINCT)) ==
+        AC_OPT_DOUBLE_ARRAY) {
+        da_ofst = sz;
+        sz += DA_Table_Sz(Pack_DA());
+    }
+
     // Step 2: Allocate buffer, and populate header.
-    AC_Buffer* buf = _buf_alloc.alloc(sz);
+    AC_Buffer* buf = ba.alloc(sz);
+
+    // Zero the buffer including the paddings, such that identical inputs
+    // yield byte-identical buffers.
+    bzero(buf, sz);
 
     buf->hdr.magic_num = AC_MAGIC_NUM;
     buf->hdr.impl_variant = IMPL_FAST_VARIANT;
+    buf->layout_version = AC_LAYOUT_VERSION;
     buf->buf_len = sz;
     buf->root_goto_ofst = root_goto_ofst;
     buf->states_ofst_ofst = states_ofst_ofst;
     buf->first_state_ofst = first_state_ofst;
+    buf->sheng_ofst = sheng_ofst;
+    buf->stride2_ofst = stride2_ofst;
+    buf->da_ofst = da_ofst;
+    buf->louds_ofst = 0;
+    buf->compact_ofst = 0;
+    buf->composite_ofst = 0;
     buf->root_goto_num = root_fanout;
     buf->state_num = _acs.Get_State_Num();
+    buf->pattern_num = _acs.Get_Pattern_Num();
+    buf->flags = (_opt_flags & AC_OPT_THREADED) ? BUF_THREADED : 0;
+    if (sheng_ofst)
+        buf->flags |= BUF_SHENG;
+    if (stride2_ofst)
+        buf->flags |= BUF_STRIDE2;
+    if (da_ofst)
+        buf->flags |= BUF_DA;
+    buf->shadow = 0;
+    buf->telemetry = 0;
+    buf->reload_ver = 0;
     return buf;
 }
 
@@ -80,7 +228,7 @@ AC_Converter::Populate_Root_Goto_Func(AC_Buffer* buf,
 
     // Renumber the ID of root-node's immediate kids.
     uint32 new_id = 1;
-    bool full_fantout = (goto_vect.size() == 255);
+    bool full_fantout = (goto_vect.size() == 256);
     if (likely(!full_fantout))
         bzero(root_gotos, 256*sizeof(InputTy));
 
@@ -95,8 +243,131 @@ AC_Converter::Populate_Root_Goto_Func(AC_Buffer* buf,
     }
 }
 
+// Return the SK_XXX telling how to look for a transition of a state with
+// "goto_num" transitions.
+static inline unsigned char
+Get_Tran_Kind(uint32 goto_num) {
+    if (goto_num == 0)
+        return SK_LEAF;
+    if (goto_num == 1)
+        return SK_ONE_KID;
+    if (goto_num <= SK_SMALL_MAX)
+        return SK_SMALL;
+    return SK_DENSE;
+}
+
 AC_Buffer*
 AC_Converter::Convert() {
+    if (_opt_flags & AC_OPT_PATTERN_TABLE)
+        return Convert_With_Patterns();
+
+    // The succinct graph and the compact one are derived from the regular
+    // one, which is thrown away afterwards.
+    Heap_Buf_Alloc tmp;
+    if (_opt_flags & AC_OPT_SUCCINCT)
+        return Convert_LOUDS(Convert_Graph(tmp));
+    if (AC_Buffer* buf = Convert_Composite())
+        return buf;
+    if (AC_Buffer* buf = Convert_QGram())
+        return buf;
+    if (Is_Compact(_acs.Get_State_Num(), _opt_flags))
+        return Convert_Compact(Convert_Graph(tmp));
+    return Convert_Graph(_buf_alloc);
+}
+
+AC_Buffer*
+AC_Converter::Convert_With_Patterns() {
+    ac_opt_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.flags = _opt_flags & ~AC_OPT_PATTERN_TABLE;
+    Heap_Buf_Alloc tmp;
+    AC_Converter cvt(_acs, tmp, &opt);
+    AC_Buffer* graph = cvt.Convert();
+
+    uint32 pattern_num = _acs.Get_Pattern_Num();
+    uint64 total_len = 0;
+    for (uint32 i = 0; i < pattern_num; i++)
+        total_len += _acs.get_ith_Pattern_Len(i);
+
+    uint32 graph_len = graph->buf_len;
+    uint32 sz = graph_len + Calc_Pattern_Table_Sz(pattern_num, total_len);
+    AC_Buffer* buf = _buf_alloc.alloc(sz);
+    memcpy(buf, graph, graph_len);
+    buf->buf_len = sz;
+    buf->pattern_ofst = graph_len;
+    buf->flags = (graph->flags & ~BUF_VALIDATED) | BUF_PATTERNS;
+
+    unsigned char* tbl = (unsigned char*)buf + graph_len;
+    memcpy(tbl, &pattern_num, sizeof(pattern_num));
+
+    unsigned char* loc = tbl + PATTERN_TABLE_HDR_SZ;
+    uint32 ofst = PATTERN_TABLE_HDR_SZ + pattern_num * PATTERN_LOC_SZ;
+    for (uint32 i = 0; i < pattern_num; i++, loc += PATTERN_LOC_SZ) {
+        uint32 len = _acs.get_ith_Pattern_Len(i);
+        memcpy(loc, &ofst, sizeof(ofst));
+        memcpy(loc + 4, &len, sizeof(len));
+        memcpy(tbl + ofst, _acs.get_ith_Pattern(i), len);
+        ofst += len;
+    }
+
+    ASSERT(Validate_Buffer(buf, buf->buf_len, false));
+    buf->flags |= BUF_VALIDATED;
+    return buf;
+}
+
+AC_Buffer*
+AC_Converter::Alloc_Derived_Buffer(AC_Buffer* graph, uint32 sz) {
+    AC_Buffer* buf = _buf_alloc.alloc(sz);
+    bzero(buf, sizeof(AC_Buffer));
+
+    buf->hdr.magic_num = AC_MAGIC_NUM;
+    buf->hdr.impl_variant = IMPL_FAST_VARIANT;
+    buf->layout_version = AC_LAYOUT_VERSION;
+    buf->buf_len = sz;
+    buf->root_goto_num = graph->root_goto_num;
+    buf->state_num = graph->state_num;
+    buf->pattern_num = graph->pattern_num;
+    buf->shadow = 0;
+    buf->telemetry = 0;
+    buf->reload_ver = 0;
+    return buf;
+}
+
+AC_Buffer*
+AC_Converter::Convert_LOUDS(AC_Buffer* graph) {
+    AC_Ofst louds_ofst = sizeof(AC_Buffer);
+    ASSERT(louds_ofst % __alignof__(LOUDS_Table) == 0);
+    uint32 sz = louds_ofst + Calc_LOUDS_Sz(graph);
+
+    AC_Buffer* buf = Alloc_Derived_Buffer(graph, sz);
+    buf->louds_ofst = louds_ofst;
+    buf->flags = BUF_LOUDS;
+    Build_LOUDS_Table(graph, (LOUDS_Table*)((unsigned char*)buf + louds_ofst));
+
+    ASSERT(Validate_Buffer(buf, buf->buf_len, false));
+    buf->flags |= BUF_VALIDATED;
+    return buf;
+}
+
+AC_Buffer*
+AC_Converter::Convert_Compact(AC_Buffer* graph) {
+    AC_Ofst compact_ofst = sizeof(AC_Buffer);
+    ASSERT(compact_ofst % __alignof__(Compact_Table) == 0);
+    uint32 sz = compact_ofst + Calc_Compact_Sz(graph);
+
+    AC_Buffer* buf = Alloc_Derived_Buffer(graph, sz);
+    buf->compact_ofst = compact_ofst;
+    buf->flags = BUF_COMPACT;
+    Build_Compact_Table(graph,
+                        (Compact_Table*)((unsigned char*)buf + compact_ofst));
+
+    ASSERT(Validate_Buffer(buf, buf->buf_len, false));
+    buf->flags |= BUF_VALIDATED;
+    return buf;
+}
+
+AC_Buffer*
+AC_Converter::Convert_Graph(Buf_Allocator& ba) {
     // Step 1: Some preparation stuff.
     GotoVect gotovect;
 
@@ -106,7 +377,7 @@ AC_Converter::Convert() {
     _ofst_map.resize(_acs.Get_Next_Node_Id());
 
     // Step 2: allocate buffer to accommodate the entire AC graph.
-    AC_Buffer* buf = Alloc_Buffer();
+    AC_Buffer* buf = Alloc_Buffer(ba);
     unsigned char* buf_base = (unsigned char*)buf;
 
     // Step 3: Root node need special care.
@@ -126,6 +397,7 @@ AC_Converter::Convert() {
     }
 
     AC_Ofst* state_ofst_vect = (AC_Ofst*)(buf_base + buf->states_ofst_ofst);
+    state_ofst_vect[0] = 0;  // root node is not in the buffer.
     AC_Ofst ofst = buf->first_state_ofst;
     for (uint32 idx = 0; idx < wl.size(); idx++) {
         const ACS_State* old_s = wl[idx];
@@ -140,6 +412,8 @@ AC_Converter::Convert() {
         ASSERT(_id_map[old_s->Get_ID()] == state_id);
 
         state_ofst_vect[state_id] = ofst;
+        if (old_s->is_Terminal())
+            state_ofst_vect[state_id] |= STATE_TERM_TAG;
 
         new_s->first_kid = wl.size() + 1;
         new_s->depth = old_s->Get_Depth();
@@ -149,6 +423,11 @@ AC_Converter::Convert() {
         uint32 gotonum = old_s->Get_GotoNum();
         new_s->goto_num = gotonum;
 
+        unsigned char kind = Get_Tran_Kind(gotonum);
+        if (new_s->is_term)
+            kind |= SK_TERM;
+        new_s->kind = kind;
+
         // Populate the "input" field
         old_s->Get_Sorted_Gotos(gotovect);
         uint32 input_idx = 0;
@@ -164,35 +443,421 @@ AC_Converter::Convert() {
         }
 
         _ofst_map[old_s->Get_ID()] = ofst;
-        ofst += Calc_State_Sz(old_s);
+        ofst += Calc_State_Sz(old_s->Get_GotoNum());
     }
 
     // This assertion might be useful to catch buffer overflow
-    ASSERT(ofst == buf->buf_len);
+    ASSERT(ofst == (buf->sheng_ofst ? buf->sheng_ofst :
+                    buf->stride2_ofst ? buf->stride2_ofst :
+                    buf->da_ofst ? buf->da_ofst : buf->buf_len));
 
     // Populate the fail-link field.
     for (vector<const ACS_State*>::iterator i = wl.begin(), e = wl.end();
             i != e; i++) {
         const ACS_State* slow_s = *i;
         State_ID fast_s_id = _id_map[slow_s->Get_ID()];
-        AC_State* fast_s = (AC_State*)(buf_base + state_ofst_vect[fast_s_id]);
+        AC_Ofst fast_s_ofst = state_ofst_vect[fast_s_id] & ~STATE_TAG_MASK;
+        AC_State* fast_s = (AC_State*)(buf_base + fast_s_ofst);
         if (const ACS_State* fl = slow_s->Get_FailLink()) {
             State_ID id = _id_map[fl->Get_ID()];
             fast_s->fail_link = id;
         } else
             fast_s->fail_link = 0;
+
+        if (fast_s->fail_link == 0)
+            fast_s->kind |= SK_ROOT_FAIL;
+        else if (state_ofst_vect[fast_s->fail_link] & STATE_TAG_MASK) {
+            // As states are visited in BFS order, the tags of the shallower
+            // fail-link target are already settled.
+            state_ofst_vect[fast_s_id] |= STATE_OUT_TAG;
+        }
     }
 #ifdef DEBUG
     //dump_buffer(buf, stderr);
 #endif
+
+    if (buf->flags & BUF_SHENG)
+        Build_Sheng_Table(buf, (Sheng_Table*)(buf_base + buf->sheng_ofst));
+    if (buf->flags & BUF_STRIDE2) {
+        Build_Stride2_Table(buf,
+                            (Stride2_Table*)(buf_base + buf->stride2_ofst));
+    }
+    if (buf->flags & BUF_DA) {
+        Build_DA_Table(buf, (DA_Table*)(buf_base + buf->da_ofst), _da_base_v);
+        _da_base_v.clear();
+    }
+
+    // The buffer is well-formed by construction.
+    ASSERT(Validate_Buffer(buf, buf->buf_len, false));
+    buf->flags |= BUF_VALIDATED;
     return buf;
 }
 
-static inline AC_State*
-Get_State_Addr(unsigned char* buf_base, AC_Ofst* StateOfstVect, uint32 state_id) {
+// The validation is a single pass over the states in the order of their IDs,
+// which is also the order they are laid-out. Rather than checking the graph
+// is exactly what the converter would produce, it checks the properties
+// the matchers rely on:
+//   - all offsets and the transitions of each state are within the buffer,
+//   - kids' IDs are within range, and as states are numbered in BFS order,
+//     a state's kids have greater IDs, and the kids of consecutive states
+//     are numbered consecutively, so each state but root has exactly one
+//     parent, and its depth is one more than its parent's,
+//   - the fail-link points to a state with smaller ID, hence following the
+//     fail-links always ends up at root,
+//   - the kind and the tags agree with the state's content, and the pattern
+//     index of a terminal state is within range,
+//   - the Sheng table, stride-2 tables, double-array or q-gram table, if
+//     any, are exactly what the graph yields, and the composite table, if
+//     any, is checked by Validate_Composite_Table().
+//
+// The succinct graph and the compact one are checked by Validate_LOUDS_Table()
+// and Validate_Compact_Table(), respectively, instead.
+//
+static bool
+Validate_Graph(AC_Buffer* buf, uint32 len) {
+    unsigned char* buf_base = (unsigned char*)buf;
+
+    uint32 state_num = buf->state_num;
+    uint32 root_fanout = buf->root_goto_num;
+    if (root_fanout > 256 || root_fanout >= state_num)
+        return false;
+
+    // The succinct graph and the compact one have nothing else.
+    if (buf->flags & (BUF_LOUDS | BUF_COMPACT)) {
+        uint32 flag = buf->flags & (BUF_LOUDS | BUF_COMPACT);
+        if ((buf->flags & ~(flag | BUF_VALIDATED | BUF_PATTERNS |
+                            BUF_POOLED)) ||
+            buf->root_goto_ofst || buf->states_ofst_ofst ||
+            buf->first_state_ofst || buf->sheng_ofst || buf->stride2_ofst ||
+            buf->da_ofst || buf->composite_ofst || buf->qgram_ofst) {
+            return false;
+        }
+
+        if (flag == BUF_LOUDS)
+            return !buf->compact_ofst && Validate_LOUDS_Table(buf);
+        return !buf->louds_ofst && Validate_Compact_Table(buf);
+    }
+
+    // Step 2: Check root's goto function.
+    if (root_fanout != 256) {
+        if (buf->root_goto_ofst < sizeof(AC_Buffer) ||
+            (uint64)buf->root_goto_ofst + 256 > len) {
+            return false;
+        }
+
+        unsigned char* root_goto = buf_base + buf->root_goto_ofst;
+        for (uint32 i = 0; i < 256; i++) {
+            if (root_goto[i] > root_fanout)
+                return false;
+        }
+    }
+
+    // Step 3: Check the state offset vector, and then the states.
+    AC_Ofst vect_ofst = buf->states_ofst_ofst;
+    if (vect_ofst < sizeof(AC_Buffer) || vect_ofst % __alignof__(AC_Ofst) ||
+        (uint64)vect_ofst + (uint64)state_num * sizeof(AC_Ofst) > len ||
+        buf->first_state_ofst < sizeof(AC_Buffer)) {
+        return false;
+    }
+
+    // Root is not in the buffer, and has no tags.
+    AC_Ofst* state_ofst_vect = (AC_Ofst*)(buf_base + vect_ofst);
+    if (state_ofst_vect[0] != 0)
+        return false;
+
+    uint32 state_align = __alignof__(AC_State);
+    uint32 state_hdr_sz = offsetof(AC_State, input_vect);
+
+    // The kids of states with ID less than the current one are [1, next_kid).
+    State_ID next_kid = root_fanout + 1;
+
+    // The parent of the current state, and the end of the parent's kids.
+    State_ID parent = 0;
+    State_ID parent_kid_end = root_fanout + 1;
+    int parent_depth = 0;
+
+    for (State_ID id = 1; id < state_num; id++) {
+        AC_Ofst tagged_ofst = state_ofst_vect[id];
+        AC_Ofst ofst = tagged_ofst & ~STATE_TAG_MASK;
+        if (ofst < buf->first_state_ofst || ofst % state_align ||
+            (uint64)ofst + state_hdr_sz > len) {
+            return false;
+        }
+
+        AC_State* s = (AC_State*)(buf_base + ofst);
+        uint32 goto_num = s->goto_num;
+        if ((uint64)ofst + state_hdr_sz + goto_num > len)
+            return false;
+
+        // Every state but root is some state's kid.
+        if (id >= next_kid)
+            return false;
+
+        while (id >= parent_kid_end) {
+            // The parent's ID is less than its kids', so it has been
+            // checked.
+            parent++;
+            AC_Ofst p_ofst = state_ofst_vect[parent] & ~STATE_TAG_MASK;
+            AC_State* p = (AC_State*)(buf_base + p_ofst);
+            if (p->goto_num) {
+                parent_kid_end = p->first_kid + p->goto_num;
+                parent_depth = p->depth;
+            }
+        }
+        if (s->depth != parent_depth + 1)
+            return false;
+
+        if (goto_num) {
+            if (s->first_kid != next_kid || s->first_kid <= id ||
+                (uint64)s->first_kid + goto_num > state_num) {
+                return false;
+            }
+            next_kid += goto_num;
+
+            for (uint32 i = 1; i < goto_num; i++) {
+                if (s->input_vect[i - 1] >= s->input_vect[i])
+                    return false;
+            }
+        }
+
+        State_ID fl = s->fail_link;
+        if (fl >= id || (id <= root_fanout && fl != 0))
+            return false;
+
+        if (s->is_term > buf->pattern_num)
+            return false;
+
+        unsigned char kind = Get_Tran_Kind(goto_num);
+        if (s->is_term)
+            kind |= SK_TERM;
+        if (fl == 0)
+            kind |= SK_ROOT_FAIL;
+        if (s->kind != kind)
+            return false;
+
+        AC_Ofst tag = s->is_term ? STATE_TERM_TAG : 0;
+        if (fl != 0 && (state_ofst_vect[fl] & STATE_TAG_MASK))
+            tag |= STATE_OUT_TAG;
+        if ((tagged_ofst & STATE_TAG_MASK) != tag)
+            return false;
+    }
+
+    if (next_kid != state_num)
+        return false;
+
+    // Step 4: Check the auxiliary tables.
+    if (buf->flags & BUF_SHENG) {
+        if (!Validate_Sheng_Table(buf))
+            return false;
+    } else if (buf->sheng_ofst) {
+        return false;
+    }
+
+    if (buf->flags & BUF_STRIDE2) {
+        if ((buf->flags & BUF_SHENG) || !Validate_Stride2_Table(buf))
+            return false;
+    } else if (buf->stride2_ofst) {
+        return false;
+    }
+
+    if (buf->flags & BUF_DA) {
+        if ((buf->flags & (BUF_SHENG | BUF_STRIDE2)) || !Validate_DA_Table(buf))
+            return false;
+    } else if (buf->da_ofst) {
+        return false;
+    }
+
+    if (buf->flags & BUF_COMPOSITE) {
+        if ((buf->flags & (BUF_THREADED | BUF_SHENG | BUF_STRIDE2 | BUF_DA)) ||
+            !Validate_Composite_Table(buf)) {
+            return false;
+        }
+    } else if (buf->composite_ofst) {
+        return false;
+    }
+
+    if (buf->flags & BUF_QGRAM) {
+        if ((buf->flags & (BUF_SHENG | BUF_STRIDE2 | BUF_DA | BUF_COMPOSITE)) ||
+            !Validate_QGram_Table(buf)) {
+            return false;
+        }
+    } else if (buf->qgram_ofst) {
+        return false;
+    }
+
+    return !buf->louds_ofst && !buf->compact_ofst;
+}
+
+// Check the pattern table, if any, is at the end of the buffer, and the
+// patterns are all within it.
+static bool
+Validate_Pattern_Table(AC_Buffer* buf) {
+    if (!(buf->flags & BUF_PATTERNS))
+        return buf->pattern_ofst == 0;
+
+    uint32 ofst = buf->pattern_ofst;
+    if (ofst < sizeof(AC_Buffer) ||
+        (uint64)ofst + PATTERN_TABLE_HDR_SZ > buf->buf_len) {
+        return false;
+    }
+
+    const unsigned char* tbl = (const unsigned char*)buf + ofst;
+    uint32 tbl_sz = buf->buf_len - ofst;
+    uint32 pattern_num = Load_Uint32(tbl);
+    uint64 hdr_sz = PATTERN_TABLE_HDR_SZ +
+                    (uint64)pattern_num * PATTERN_LOC_SZ;
+    if (pattern_num != buf->pattern_num || hdr_sz > tbl_sz)
+        return false;
+
+    const unsigned char* loc = tbl + PATTERN_TABLE_HDR_SZ;
+    for (uint32 i = 0; i < pattern_num; i++, loc += PATTERN_LOC_SZ) {
+        uint32 pat_ofst = Load_Uint32(loc);
+        uint32 pat_len = Load_Uint32(loc + 4);
+        if (pat_ofst < hdr_sz || (uint64)pat_ofst + pat_len > tbl_sz)
+            return false;
+    }
+    return true;
+}
+
+bool
+Validate_Buffer(AC_Buffer* buf, uint32 len, bool trust_verdict) {
+    // Step 1: Check the header.
+    if (len < sizeof(AC_Buffer) || buf->buf_len != len ||
+        buf->hdr.magic_num != AC_MAGIC_NUM ||
+        buf->hdr.impl_variant != IMPL_FAST_VARIANT ||
+        buf->layout_version != AC_LAYOUT_VERSION ||
+        (buf->flags & ~BUF_ALL_FLAGS)) {
+        return false;
+    }
+
+    if (trust_verdict && (buf->flags & BUF_VALIDATED))
+        return true;
+
+    // Update the verdict only if it changes, so as not to dirty the page of
+    // a shared mapping needlessly.
+    bool valid = Validate_Pattern_Table(buf) &&
+                 Validate_Graph(buf, Get_Graph_Len(buf));
+    uint16 flags = valid ? (buf->flags | BUF_VALIDATED) :
+                           (buf->flags & ~BUF_VALIDATED);
+    if (buf->flags != flags)
+        buf->flags = flags;
+    return valid;
+}
+
+// Return the offset of the specified state, tagged with STATE_XXX_TAG.
+static inline AC_Ofst
+Get_State_Ofst(unsigned char* buf_base, AC_Ofst* StateOfstVect, uint32 state_id) {
     ASSERT(state_id != 0 && "root node is handled in speical way");
     ASSERT(state_id < ((AC_Buffer*)buf_base)->state_num);
-    return (AC_State*)(buf_base + StateOfstVect[state_id]);
+    return StateOfstVect[state_id];
+}
+
+static inline AC_State*
+Get_State_Addr(unsigned char* buf_base, AC_Ofst tagged_ofst) {
+    return (AC_State*)(buf_base + (tagged_ofst & ~STATE_TAG_MASK));
+}
+
+static inline AC_State*
+Get_State_Addr(unsigned char* buf_base, AC_Ofst* StateOfstVect, uint32 state_id) {
+    AC_Ofst ofst = Get_State_Ofst(buf_base, StateOfstVect, state_id);
+    return Get_State_Addr(buf_base, ofst);
+}
+
+// Root_Skip() of the NUL-terminated subject string, which ends at the first
+// NUL rather than at "len". The string is read a 16-byte aligned block at a
+// time, and the NULs of a block are found all at once; as an aligned block
+// never straddles two pages, reading past the NUL in the block is harmless,
+// which is how strlen() works as well.
+static inline uint32
+#ifdef __SSE2__
+__attribute__((no_sanitize_address))
+#endif
+Root_Skip_Cstr(AC_Buffer* buf, unsigned char* root_goto,
+               const char* str, uint32& idx) {
+    if (unlikely(buf->root_goto_num == 256)) {
+        if (InputTy c = str[idx]) {
+            idx++;
+            return c + 1;
+        }
+        return 0;
+    }
+
+#ifdef __SSE2__
+    // Get to the block boundary one char a time.
+    while ((uintptr_t)(str + idx) % sizeof(__m128i)) {
+        InputTy c = str[idx];
+        if (!c)
+            return 0;
+        idx++;
+        if (unsigned char kid_id = root_goto[c])
+            return kid_id;
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+    for (;;) {
+        __m128i blk = _mm_load_si128((const __m128i*)(str + idx));
+        uint32 nul = _mm_movemask_epi8(_mm_cmpeq_epi8(blk, zero));
+        uint32 blk_len = nul ? __builtin_ctz(nul) : sizeof(__m128i);
+        for (uint32 i = 0; i < blk_len; i++) {
+            if (unsigned char kid_id = root_goto[(InputTy)str[idx + i]]) {
+                idx += i + 1;
+                return kid_id;
+            }
+        }
+        idx += blk_len;
+        if (nul)
+            return 0;
+    }
+#else
+    while (InputTy c = str[idx]) {
+        idx++;
+        if (unsigned char kid_id = root_goto[c])
+            return kid_id;
+    }
+    return 0;
+#endif
+}
+
+// Skip the chars starting from "idx" that are not valid input of the
+// root-node. Return the ID of the root's kid reached by the first valid
+// char (with "idx" pointing right after it), or 0 if the subject string
+// is exhausted.
+template<bool cstr> static inline uint32
+Root_Skip(AC_Buffer* buf, unsigned char* root_goto,
+          const char* str, uint32 len, uint32& idx) {
+    if (cstr)
+        return Root_Skip_Cstr(buf, root_goto, str, idx);
+
+    // Skip the offsets no pattern begins at, see ac_qgram.hpp.
+    if (buf->qgram_ofst) {
+        idx = QGram_Skip((const QGram_Table*)((unsigned char*)buf +
+                                              buf->qgram_ofst),
+                         str, len, idx);
+    }
+
+    if (unlikely(buf->root_goto_num == 256)) {
+        // Full fanout: every char is valid, and the kid's ID is "char + 1".
+        if (idx < len)
+            return (InputTy)str[idx++] + 1;
+        return 0;
+    }
+
+    while (idx < len) {
+        if (unsigned char kid_id = root_goto[(InputTy)str[idx++]])
+            return kid_id;
+    }
+    return 0;
+}
+
+static bool __attribute__((always_inline)) inline
+Linear_Search_Input(InputTy* input_vect, int vect_len, InputTy input, int& idx) {
+    for (int i = 0; i < vect_len; i++) {
+        if (input_vect[i] == input) {
+            idx = i;
+            return true;
+        }
+    }
+    return false;
 }
 
 // The performance of the binary search is critical to this work.
@@ -214,15 +879,8 @@ Get_State_Addr(unsigned char* buf_base, AC_Ofst* StateOfstVect, uint32 state_id)
 #if !defined(BS_MULTI_VER)
 static bool __attribute__((always_inline)) inline
 Binary_Search_Input(InputTy* input_vect, int vect_len, InputTy input, int& idx) {
-    if (vect_len <= 8) {
-        for (int i = 0; i < vect_len; i++) {
-            if (input_vect[i] == input) {
-                idx = i;
-                return true;
-            }
-        }
-        return false;
-    }
+    if (vect_len <= SK_SMALL_MAX)
+        return Linear_Search_Input(input_vect, vect_len, input, idx);
 
     // The "low" and "high" must be signed integers, as they could become -1.
     // Also since they are signed integer, "(low + high)/2" is slightly more
@@ -268,26 +926,6 @@ Binary_Search_Input(InputTy* input_vect, int vect_len, InputTy input, int& idx)
 }
 #endif
 
-typedef enum {
-    // Look for the first match. e.g. pattern set = {"ab", "abc", "def"},
-    // subject string "ababcdef". The first match would be "ab" at the
-    // beginning of the subject string.
-    MV_FIRST_MATCH,
-
-    // Look for the left-most longest match. Follow above example; there are
-    // two longest matches, "abc" and "def", and the left-most longest match
-    // is "abc".
-    MV_LEFT_LONGEST,
-
-    // Similar to the left-most longest match, except that it returns the
-    // *right* most longest match. Follow above example, the match would
-    // be "def". NYI.
-    MV_RIGHT_LONGEST,
-
-    // Return all patterns that match that given subject string. NYI.
-    MV_ALL_MATCHES,
-} MATCH_VARIANT;
-
 /* The Match_Tmpl is the template for vairants MV_FIRST_MATCH, MV_LEFT_LONGEST,
  * MV_RIGHT_LONGEST (If we really really need MV_RIGHT_LONGEST variant, we are
  * better off implementing it in a separate function).
@@ -299,8 +937,11 @@ typedef enum {
  *
  * The drawback of using template is increased code size. Unfortunately, there
  * is no silver bullet.
+ *
+ * If "cstr" is true, the subject string ends at the first NUL instead, and
+ * "len" is ignored.
  */
-template<MATCH_VARIANT variant> static ac_result_t
+template<MATCH_VARIANT variant, bool cstr> static ac_result_t
 Match_Tmpl(AC_Buffer* buf, const char* str, uint32 len) {
     unsigned char* buf_base = (unsigned char*)(buf);
     unsigned char* root_goto = buf_base + buf->root_goto_ofst;
@@ -310,18 +951,8 @@ Match_Tmpl(AC_Buffer* buf, const char* str, uint32 len) {
     uint32 idx = 0;
 
     // Skip leading chars that are not valid input of root-nodes.
-    if (likely(buf->root_goto_num != 255)) {
-        while(idx < len) {
-            unsigned char c = str[idx++];
-            if (unsigned char kid_id = root_goto[c]) {
-                state = Get_State_Addr(buf_base, states_ofst_vect, kid_id);
-                break;
-            }
-        }
-    } else {
-        idx = 1;
-        state = Get_State_Addr(buf_base, states_ofst_vect, *str);
-    }
+    if (uint32 kid_id = Root_Skip<cstr>(buf, root_goto, str, len, idx))
+        state = Get_State_Addr(buf_base, states_ofst_vect, kid_id);
 
     ac_result_t r = {-1, -1};
     if (likely(state != 0)) {
@@ -337,40 +968,44 @@ Match_Tmpl(AC_Buffer* buf, const char* str, uint32 len) {
         }
     }
 
-    while (idx < len) {
+    while (cstr || idx < len) {
         unsigned char c = str[idx];
+        if (cstr && c == 0)
+            break;
+
         int res;
         bool found;
+        // The offset of the new state, tagged with STATE_TERM_TAG if the
+        // state is terminal.
+        AC_Ofst ofst;
         found = Binary_Search_Input(state->input_vect, state->goto_num, c, res);
         if (found) {
             // The "t = goto(c, current_state)" is valid, advance to state "t".
             uint32 kid = state->first_kid + res;
-            state = Get_State_Addr(buf_base, states_ofst_vect, kid);
+            ofst = Get_State_Ofst(buf_base, states_ofst_vect, kid);
             idx++;
         } else {
             // Follow the fail-link.
             State_ID fl = state->fail_link;
             if (fl == 0) {
-                // fail-link is root-node, which implies the root-node doesn't
-                // have 255 valid transitions (otherwise, the fail-link should
-                // points to "goto(root, c)"), so we don't need speical handling
-                // as we did before this while-loop is entered.
-                //
-                while(idx < len) {
-                    InputTy c = str[idx++];
-                    if (unsigned char kid_id = root_goto[c]) {
-                        state =
-                            Get_State_Addr(buf_base, states_ofst_vect, kid_id);
-                        break;
-                    }
-                }
+                // fail-link is root-node. Skip the chars that are not valid
+                // input of the root-node, starting from the current one.
+                uint32 kid_id = Root_Skip<cstr>(buf, root_goto, str, len, idx);
+
+                // Reach the end of the subject string.
+                if (!kid_id)
+                    break;
+                ofst = Get_State_Ofst(buf_base, states_ofst_vect, kid_id);
             } else {
-                state = Get_State_Addr(buf_base, states_ofst_vect, fl);
+                ofst = Get_State_Ofst(buf_base, states_ofst_vect, fl);
             }
         }
+        state = Get_State_Addr(buf_base, ofst);
 
-        // Check to see if the state is terminal state?
-        if (state->is_term) {
+        // Check to see if the state is terminal state? Rather than loading
+        // state->is_term, check the tag of the offset which is already in
+        // the register.
+        if (unlikely(ofst & STATE_TERM_TAG)) {
             if (variant == MV_FIRST_MATCH) {
                 ac_result_t r;
                 r.match_begin = idx - state->depth;
@@ -399,14 +1034,393 @@ Match_Tmpl(AC_Buffer* buf, const char* str, uint32 len) {
     return r;
 }
 
+/* Match_Threaded_Tmpl is the direct-threaded counterpart of Match_Tmpl, and
+ * its semantic is exactly the same as Match_Tmpl's.
+ *
+ * The loop of Match_Tmpl copes with every sort of state in one body, so the
+ * couple of branches in it (how to search the input, whether to follow the
+ * fail-link or to skip via root, whether the state is terminal) are shared
+ * by all states and are hard to predict. Here each state carries its kind
+ * (see State_Kind), and after each step we jump, via computed goto, right to
+ * the code specialized for the kind of the new state. This way, each kind
+ * has its own indirect branch and hence its own branch-prediction slot.
+ */
+template<MATCH_VARIANT variant, bool cstr> static ac_result_t
+Match_Threaded_Tmpl(AC_Buffer* buf, const char* str, uint32 len) {
+    unsigned char* buf_base = (unsigned char*)(buf);
+    unsigned char* root_goto = buf_base + buf->root_goto_ofst;
+    AC_Ofst* states_ofst_vect = (AC_Ofst* )(buf_base + buf->states_ofst_ofst);
+
+    // Indiced by AC_State::kind
+    static void* const dispatch_tbl[] = {
+        &&leaf, &&one_kid, &&small, &&dense,
+        &&leaf_rf, &&one_kid_rf, &&small_rf, &&dense_rf,
+        &&term, &&term, &&term, &&term,
+        &&term, &&term, &&term, &&term,
+    };
+
+    AC_State* state = 0;
+    uint32 idx = 0;
+    ac_result_t r = {-1, -1};
+
+    #define DISPATCH(kind) goto *dispatch_tbl[(kind)]
+
+    // Handler of non-terminal state. The "lookup" is to search the transition
+    // for the input "c"; it sets "res" to the index of the transition if
+    // found. The "on_miss" is to follow the fail-link.
+    #define STATE_HANDLER(label, lookup, on_miss)                          \
+    label: {                                                                \
+        if (!cstr && unlikely(idx >= len))                                  \
+            goto done;                                                      \
+        InputTy c = str[idx];                                               \
+        if (cstr && unlikely(c == 0))                                       \
+            goto done;                                                      \
+        int res = 0;                                                        \
+        if (lookup) {                                                       \
+            uint32 kid = state->first_kid + res;                            \
+            state = Get_State_Addr(buf_base, states_ofst_vect, kid);        \
+            idx++;                                                          \
+            DISPATCH(state->kind);                                          \
+        }                                                                   \
+        on_miss;                                                            \
+    }
+
+    #define FOLLOW_FAIL_LINK                                                \
+        state = Get_State_Addr(buf_base, states_ofst_vect, state->fail_link);\
+        DISPATCH(state->kind)
+
+    #define SKIP_VIA_ROOT goto root_skip
+
+    #define LOOKUP_NONE ((void)c, false)
+    #define LOOKUP_ONE_KID (state->input_vect[0] == c)
+    #define LOOKUP_SMALL \
+        Linear_Search_Input(state->input_vect, state->goto_num, c, res)
+    #define LOOKUP_DENSE \
+        Binary_Search_Input(state->input_vect, state->goto_num, c, res)
+
+    goto root_skip;
+
+    STATE_HANDLER(leaf, LOOKUP_NONE, FOLLOW_FAIL_LINK)
+    STATE_HANDLER(one_kid, LOOKUP_ONE_KID, FOLLOW_FAIL_LINK)
+    STATE_HANDLER(small, LOOKUP_SMALL, FOLLOW_FAIL_LINK)
+    STATE_HANDLER(dense, LOOKUP_DENSE, FOLLOW_FAIL_LINK)
+    STATE_HANDLER(leaf_rf, LOOKUP_NONE, SKIP_VIA_ROOT)
+    STATE_HANDLER(one_kid_rf, LOOKUP_ONE_KID, SKIP_VIA_ROOT)
+    STATE_HANDLER(small_rf, LOOKUP_SMALL, SKIP_VIA_ROOT)
+    STATE_HANDLER(dense_rf, LOOKUP_DENSE, SKIP_VIA_ROOT)
+
+term:
+    if (variant == MV_FIRST_MATCH) {
+        r.match_begin = idx - state->depth;
+        r.match_end = idx - 1;
+        r.pattern_idx = state->is_term - 1;
+        return r;
+    }
+
+    if (variant == MV_LEFT_LONGEST) {
+        int match_begin = idx - state->depth;
+        int match_end = idx - 1;
+
+        if (r.match_begin == -1 ||
+            match_end - match_begin > r.match_end - r.match_begin) {
+            r.match_begin = match_begin;
+            r.match_end = match_end;
+            r.pattern_idx = state->is_term - 1;
+        }
+    }
+    DISPATCH(state->kind & ~SK_TERM);
+
+    // Skip the chars that are not valid input of the root-node.
+root_skip:
+    if (uint32 kid_id = Root_Skip<cstr>(buf, root_goto, str, len, idx)) {
+        state = Get_State_Addr(buf_base, states_ofst_vect, kid_id);
+        DISPATCH(state->kind);
+    }
+
+done:
+    return r;
+
+    #undef DISPATCH
+    #undef STATE_HANDLER
+    #undef FOLLOW_FAIL_LINK
+    #undef SKIP_VIA_ROOT
+    #undef LOOKUP_NONE
+    #undef LOOKUP_ONE_KID
+    #undef LOOKUP_SMALL
+    #undef LOOKUP_DENSE
+}
+
 ac_result_t
 Match(AC_Buffer* buf, const char* str, uint32 len) {
-    return Match_Tmpl<MV_FIRST_MATCH>(buf, str, len);
+    if (buf->flags & BUF_LAZY)
+        return Lazy_Match(buf, str, len);
+    if (buf->flags & BUF_LOUDS)
+        return LOUDS_Match(buf, str, len);
+    if (buf->flags & BUF_COMPACT)
+        return Compact_Match(buf, str, len);
+    if (buf->flags & BUF_COMPOSITE)
+        return Composite_Match(buf, str, len);
+    if (buf->flags & BUF_SHENG)
+        return Sheng_Match(buf, str, len);
+    if (buf->flags & BUF_STRIDE2)
+        return Stride2_Match(buf, str, len);
+    if (buf->flags & BUF_DA)
+        return DA_Match(buf, str, len);
+    if (buf->flags & BUF_THREADED)
+        return Match_Threaded_Tmpl<MV_FIRST_MATCH, false>(buf, str, len);
+    return Match_Tmpl<MV_FIRST_MATCH, false>(buf, str, len);
 }
 
 ac_result_t
 Match_Longest_L(AC_Buffer* buf, const char* str, uint32 len) {
-    return Match_Tmpl<MV_LEFT_LONGEST>(buf, str, len);
+    if (buf->flags & BUF_LAZY)
+        return Lazy_Match_Longest_L(buf, str, len);
+    if (buf->flags & BUF_LOUDS)
+        return LOUDS_Match_Longest_L(buf, str, len);
+    if (buf->flags & BUF_COMPACT)
+        return Compact_Match_Longest_L(buf, str, len);
+    if (buf->flags & BUF_COMPOSITE)
+        return Composite_Match_Longest_L(buf, str, len);
+    if (buf->flags & BUF_SHENG)
+        return Sheng_Match_Longest_L(buf, str, len);
+    if (buf->flags & BUF_STRIDE2)
+        return Stride2_Match_Longest_L(buf, str, len);
+    if (buf->flags & BUF_DA)
+        return DA_Match_Longest_L(buf, str, len);
+    if (buf->flags & BUF_THREADED)
+        return Match_Threaded_Tmpl<MV_LEFT_LONGEST, false>(buf, str, len);
+    return Match_Tmpl<MV_LEFT_LONGEST, false>(buf, str, len);
+}
+
+// Only the plain graph, threaded or not, scans the NUL-terminated string in
+// place; the other engines need the length upfront.
+static inline bool
+Scan_Cstr_In_Place(AC_Buffer* buf) {
+    return !(buf->flags & (BUF_SHENG | BUF_STRIDE2 | BUF_DA | BUF_LOUDS |
+                           BUF_COMPACT | BUF_COMPOSITE | BUF_LAZY));
+}
+
+ac_result_t
+Match_Cstr(AC_Buffer* buf, const char* str) {
+    if (!Scan_Cstr_In_Place(buf))
+        return Match(buf, str, strlen(str));
+    if (buf->flags & BUF_THREADED)
+        return Match_Threaded_Tmpl<MV_FIRST_MATCH, true>(buf, str, 0);
+    return Match_Tmpl<MV_FIRST_MATCH, true>(buf, str, 0);
+}
+
+ac_result_t
+Match_Longest_Cstr(AC_Buffer* buf, const char* str) {
+    if (!Scan_Cstr_In_Place(buf))
+        return Match_Longest_L(buf, str, strlen(str));
+    if (buf->flags & BUF_THREADED)
+        return Match_Threaded_Tmpl<MV_LEFT_LONGEST, true>(buf, str, 0);
+    return Match_Tmpl<MV_LEFT_LONGEST, true>(buf, str, 0);
+}
+
+// The accessors of the graph used by Match_All_Tmpl(), see LOUDS_Graph,
+// Compact_Graph and Lazy_Graph for those of the succinct one, the compact one
+// and the lazy one.
+class Fast_Graph {
+public:
+    Fast_Graph(AC_Buffer* buf) : _buf(buf) {
+        _buf_base = (unsigned char*)buf;
+        _root_goto = _buf_base + buf->root_goto_ofst;
+        _states_ofst_vect = (AC_Ofst*)(_buf_base + buf->states_ofst_ofst);
+    }
+
+    State_ID Root_Skip(const char* str, uint32 len, uint32& idx) const {
+        return ::Root_Skip<false>(_buf, _root_goto, str, len, idx);
+    }
+
+    bool Goto(State_ID id, InputTy c, State_ID& kid) const {
+        AC_State* s = Get_State_Addr(_buf_base, _states_ofst_vect, id);
+        int res;
+        if (!Binary_Search_Input(s->input_vect, s->goto_num, c, res))
+            return false;
+        kid = s->first_kid + res;
+        return true;
+    }
+
+    State_ID Get_Fail(State_ID id) const {
+        return Get_State_Addr(_buf_base, _states_ofst_vect, id)->fail_link;
+    }
+
+    uint32 Get_Tags(State_ID id) const {
+        return Get_State_Ofst(_buf_base, _states_ofst_vect, id) &
+               STATE_TAG_MASK;
+    }
+
+    uint32 Get_Depth(State_ID id) const {
+        return Get_State_Addr(_buf_base, _states_ofst_vect, id)->depth;
+    }
+
+    uint32 Get_Pattern_Idx(State_ID id) const {
+        return Get_State_Addr(_buf_base, _states_ofst_vect, id)->is_term - 1;
+    }
+
+private:
+    AC_Buffer* _buf;
+    unsigned char* _buf_base;
+    unsigned char* _root_goto;
+    AC_Ofst* _states_ofst_vect;
+};
+
+/* Match_All_Tmpl finds all matches, and save them to "result_v" if "save" is
+ * true, or just count them otherwise. The graph is accessed via "Graph",
+ * which is the regular one, the succinct one, the compact one, or the lazy
+ * one.
+ *
+ * Unlike Match_Tmpl, a terminal state is not the only state yielding
+ * matches; since all patterns being the suffix of the string the state
+ * stands for match as well, we need to walk the fail-link chain to report
+ * them all, which is what STATE_OUT_TAG is for. On the other hand, we do not
+ * report anything when we arrive a state via fail-link, as the matches at
+ * that offset were already reported by the state we fail from.
+ *
+ * The scan may stop early due to the "limit". In that case, the current
+ * state and the rest of the fail-link chain yet to be reported are saved to
+ * "scan" such that the scan can be resumed exactly.
+ */
+template<bool save, typename Graph> static uint32
+Match_All_Tmpl(AC_Buffer* buf, const char* str, uint32 len,
+               ac_result_t* result_v, uint32 result_cap,
+               const ac_limit_t* limit, ac_scan_t* scan) {
+    Graph g(buf);
+
+    uint32 idx = scan->resume_ofst;
+    State_ID state_id = scan->priv[0];
+    // The state, along with the states on its fail-link chain, whose
+    // matches ending at "idx - 1" are yet to be reported.
+    State_ID out_id = scan->priv[1];
+
+    uint32 max_match = (uint32)-1;
+    uint32 stop = len;
+    uint32 usec = 0;
+    if (limit) {
+        if (limit->max_matches)
+            max_match = limit->max_matches;
+        if (limit->max_bytes && limit->max_bytes < len - idx)
+            stop = idx + limit->max_bytes;
+        usec = limit->max_usec;
+    }
+    if (save && result_cap < max_match)
+        max_match = result_cap;
+    Scan_Budget budget(usec, idx);
+
+    uint32 match_num = 0;
+    for (;;) {
+        // Report the matches ending at "idx - 1".
+        while (out_id) {
+            uint32 tags = g.Get_Tags(out_id);
+            if (tags & STATE_TERM_TAG) {
+                if (match_num == max_match)
+                    goto truncated;
+
+                if (save) {
+                    ac_result_t& r = result_v[match_num];
+                    r.match_begin = idx - g.Get_Depth(out_id);
+                    r.match_end = idx - 1;
+                    r.pattern_idx = g.Get_Pattern_Idx(out_id);
+                }
+                match_num++;
+            }
+            out_id = (tags & STATE_OUT_TAG) ? g.Get_Fail(out_id) : 0;
+        }
+
+        if (idx >= stop)
+            break;
+
+        if (match_num == max_match)
+            goto truncated;
+
+        uint32 chunk_end = stop;
+        if (!budget.Check(idx, chunk_end))
+            goto truncated;
+
+        // Advance until reaching a state yielding matches.
+        while (idx < chunk_end) {
+            if (state_id == 0) {
+                // Skip leading chars that are not valid input of root-node.
+                state_id = g.Root_Skip(str, chunk_end, idx);
+                if (!state_id)
+                    continue;
+            } else {
+                State_ID kid;
+                if (g.Goto(state_id, str[idx], kid)) {
+                    state_id = kid;
+                    idx++;
+                } else {
+                    // Follow the fail-link without consuming the input.
+                    state_id = g.Get_Fail(state_id);
+                    continue;
+                }
+            }
+
+            if (unlikely(g.Get_Tags(state_id))) {
+                out_id = state_id;
+                break;
+            }
+        }
+    }
+
+    scan->status = idx < len ? AC_SCAN_TRUNCATED : AC_SCAN_DONE;
+    scan->resume_ofst = idx;
+    scan->priv[0] = state_id;
+    scan->priv[1] = 0;
+    return match_num;
+
+truncated:
+    scan->status = AC_SCAN_TRUNCATED;
+    scan->resume_ofst = idx;
+    scan->priv[0] = state_id;
+    scan->priv[1] = out_id;
+    return match_num;
+}
+
+uint32
+Match_All(AC_Buffer* buf, const char* str, uint32 len,
+          ac_result_t* result_v, uint32 result_cap,
+          const ac_limit_t* limit, ac_scan_t* scan) {
+    if (buf->flags & BUF_LAZY) {
+        return Match_All_Tmpl<true, Lazy_Graph>(buf, str, len, result_v,
+                                                result_cap, limit, scan);
+    }
+    if (buf->flags & BUF_LOUDS) {
+        return Match_All_Tmpl<true, LOUDS_Graph>(buf, str, len, result_v,
+                                                 result_cap, limit, scan);
+    }
+    if (buf->flags & BUF_COMPACT) {
+        return Match_All_Tmpl<true, Compact_Graph>(buf, str, len, result_v,
+                                                   result_cap, limit, scan);
+    }
+    if (buf->flags & BUF_COMPOSITE) {
+        return Composite_Match_All(buf, str, len, result_v, result_cap,
+                                   limit, scan);
+    }
+    return Match_All_Tmpl<true, Fast_Graph>(buf, str, len, result_v,
+                                            result_cap, limit, scan);
+}
+
+uint32
+Match_Count(AC_Buffer* buf, const char* str, uint32 len,
+            const ac_limit_t* limit, ac_scan_t* scan) {
+    if (buf->flags & BUF_LAZY) {
+        return Match_All_Tmpl<false, Lazy_Graph>(buf, str, len, 0, 0,
+                                                 limit, scan);
+    }
+    if (buf->flags & BUF_LOUDS) {
+        return Match_All_Tmpl<false, LOUDS_Graph>(buf, str, len, 0, 0,
+                                                  limit, scan);
+    }
+    if (buf->flags & BUF_COMPACT) {
+        return Match_All_Tmpl<false, Compact_Graph>(buf, str, len, 0, 0,
+                                                    limit, scan);
+    }
+    if (buf->flags & BUF_COMPOSITE)
+        return Composite_Match_Count(buf, str, len, limit, scan);
+    return Match_All_Tmpl<false, Fast_Graph>(buf, str, len, 0, 0,
+                                             limit, scan);
 }
 
 #ifdef DEBUG
@@ -438,9 +1452,9 @@ AC_Converter::dump_buffer(AC_Buffer* buf, FILE* f) {
 
     // dump root goto-function.
     fprintf(f, "root, fanout:%d goto {", buf->root_goto_num);
-    if (buf->root_goto_num != 255) {
+    if (buf->root_goto_num != 256) {
         unsigned char* root_goto = buf_base + buf->root_goto_ofst;
-        for (uint32 i = 0; i < 255; i++) {
+        for (uint32 i = 0; i < 256; i++) {
             if (root_goto[i] != 0)
                 fprintf(f, "%c->S:%d, ", (unsigned char)i, root_goto[i]);
         }
@@ -452,7 +1466,7 @@ AC_Converter::dump_buffer(AC_Buffer* buf, FILE* f) {
     // dump remaining states.
     AC_Ofst* state_ofst_vect = (AC_Ofst*)(buf_base + buf->states_ofst_ofst);
     for (uint32 i = 1, e = buf->state_num; i < e; i++) {
-        AC_Ofst ofst = state_ofst_vect[i];
+        AC_Ofst ofst = state_ofst_vect[i] & ~STATE_TAG_MASK;
         ASSERT(ofst == state_ofst[i]);
         fprintf(f, "S:%d, ofst:%d, goto={", i, ofst);
 
@@ -1,6 +1,8 @@
 #ifndef AC_FAST_H
 #define AC_FAST_H
 
+#include <string.h>     // for memcpy
+#include <time.h>       // for clock_gettime
 #include <vector>
 #include "ac.h"
 #include "ac_slow.hpp"
@@ -8,6 +10,8 @@
 using namespace std;
 
 class ACS_Constructor;
+class AC_Shadow;
+class AC_Telemetry;
 
 typedef uint32 AC_Ofst;
 typedef uint32 State_ID;
@@ -26,17 +30,44 @@ typedef uint32 State_ID;
 //      transition state (aka kid). To save space, we used 8-bit to represent
 //      the IDs. ID of root's kids starts with 1.
 //
-//        Root may have 255 valid inputs. In this speical case, i-th element
-//      stores value i -- i.e the i-th state. So, we don't need such array
+//        Root may have 256 valid inputs. In this speical case, the kid
+//      corresponding to input i has ID i+1. So, we don't need such array
 //      at all. On the other hand, 8-bit is insufficient to encode kids' ID.
 //
 //   3. An array indiced by state's id, and the element is the offset
-//      of corresponding state wrt the base address of the buffer.
+//      of corresponding state wrt the base address of the buffer. Since
+//      states are aligned, the least significant bit of the offset is
+//      free, and it is used to tell if the state is terminal (see
+//      STATE_TERM_TAG). So, as the matcher maps a kid's ID to its address,
+//      it learns if the kid is terminal for free, without touching the kid.
+//      Likewise, the 2nd least significant bit tells if any state along the
+//      fail-link chain is terminal (see STATE_OUT_TAG).
 //
 //   4. the contents of states.
+//   5. Optionally, the Sheng table of tiny graph (see ac_sheng.hpp), or the
+//      stride-2 tables of graph over small alphabet (see ac_stride2.hpp), or
+//      the double-array, if asked for (see ac_da.hpp), or the short-pattern
+//      DFA of the composite graph (see ac_composite.hpp), in which case the
+//      graph is that of the long patterns only, or the q-gram prefilter of
+//      the graph of long patterns (see ac_qgram.hpp).
 //
+// If the succinct graph is asked for, the buffer is just the header followed
+// by the LOUDS table (see ac_louds.hpp), in place of all the above. Likewise,
+// a tiny graph is just the header followed by the compact table (see
+// ac_compact.hpp).
+//
+// Either way, the pattern table (see PATTERN_TABLE_HDR_SZ), if asked for, is
+// at the end of the buffer; the graph ends where it begins (see
+// Get_Graph_Len()).
+//
+// The version of the buffer layout. Bump it whenever the layout changes, such
+// that the buffers saved by the previous versions (e.g. those in the on-disk
+// cache) are rejected rather than misinterpreted.
+#define AC_LAYOUT_VERSION 12
+
 typedef struct {
     buf_header_t hdr;         // The header exposed to the user using this lib.
+    uint16 layout_version;    // AC_LAYOUT_VERSION
 #ifdef VERIFY
     ACS_Constructor* slow_impl;
 #endif
@@ -44,15 +75,193 @@ typedef struct {
     AC_Ofst root_goto_ofst;   // addr of root node's goto() function.
     AC_Ofst states_ofst_ofst; // addr of state pointer vector (indiced by id)
     AC_Ofst first_state_ofst; // addr of the first state in the buffer.
+    AC_Ofst sheng_ofst;       // addr of the Sheng table, 0 if none.
+    AC_Ofst stride2_ofst;     // addr of the stride-2 tables, 0 if none.
+    AC_Ofst da_ofst;          // addr of the double-array, 0 if none.
+    AC_Ofst louds_ofst;       // addr of the LOUDS table, 0 if none.
+    AC_Ofst compact_ofst;     // addr of the compact table, 0 if none.
+    AC_Ofst composite_ofst;   // addr of the composite table, 0 if none.
+    AC_Ofst qgram_ofst;       // addr of the q-gram table, 0 if none.
+    AC_Ofst pattern_ofst;     // addr of the pattern table, 0 if none.
     uint16 root_goto_num;     // fan-out of root-node.
-    uint16 state_num;         // number of states
+    uint16 flags;             // Bitwise-or of BUF_XXX
+    uint32 state_num;         // number of states
+    uint32 pattern_num;       // number of patterns
+    AC_Shadow* shadow;        // The sampled shadow verifier, if any.
+    AC_Telemetry* telemetry;  // The per-pattern hit counters, if any.
+    void* reload_ver;         // The AC_Version of the reloader, if any.
 
     // Followed by the gut of the buffer:
     // 1. map: root's-valid-input -> kid's id
     // 2. map: state's ID -> offset of the state
     // 3. states' content.
+    // 4. the Sheng table, the stride-2 tables, the double-array, the
+    //    composite table, or the q-gram table, if any.
+    // Or, the LOUDS table or the compact table alone.
+    // 5. the pattern table, if any.
 } AC_Buffer;
 
+// Values of AC_Buffer::flags
+#define BUF_THREADED    1   // Use the direct-threaded interpreter to match.
+#define BUF_VALIDATED   2   // Passed Validate_Buffer().
+#define BUF_SHENG       4   // Use the Sheng table to match.
+#define BUF_STRIDE2     8   // Use the stride-2 tables to match.
+#define BUF_DA          16  // Use the double-array to match.
+#define BUF_LOUDS       32  // The graph is the succinct one.
+#define BUF_COMPACT     64  // The graph is the compact one.
+#define BUF_COMPOSITE   128 // Use the composite table to match.
+#define BUF_PATTERNS    256 // Has the pattern table.
+#define BUF_QGRAM       512 // Skip via the q-gram prefilter at root.
+#define BUF_POOLED      1024 // A tenant of a pool, freed along with it.
+#define BUF_ALL_FLAGS   (BUF_THREADED | BUF_VALIDATED | BUF_SHENG | \
+                         BUF_STRIDE2 | BUF_DA | BUF_LOUDS | BUF_COMPACT | \
+                         BUF_COMPOSITE | BUF_PATTERNS | BUF_QGRAM | \
+                         BUF_POOLED)
+
+// The flags meaningful only to the process using the buffer, which are not
+// part of the serialized buffer.
+#define BUF_MAPPED      0x8000  // The buffer is mmap-ed from a file.
+#define BUF_LOCKED      0x4000  // The buffer is mlock-ed by ac_warm().
+#define BUF_LAZY        0x2000  // The buffer is the header of AC_Lazy.
+#define BUF_RUNTIME_FLAGS (BUF_MAPPED | BUF_LOCKED | BUF_LAZY)
+
+// The pattern table is the copy of the patterns, such that the pattern index
+// of a match can be turned back into the string. As it's right after the
+// graph, which may end at any offset, it's a byte array rather than a struct,
+// and the integers in it are loaded with memcpy():
+//
+//   uint32 pattern_num;
+//   uint32 ofst, len;   for each pattern, relative to the table
+//   the bytes of the patterns, one after another.
+//
+#define PATTERN_TABLE_HDR_SZ    4
+#define PATTERN_LOC_SZ          8
+
+static inline uint32
+Load_Uint32(const unsigned char* p) {
+    uint32 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Return the size of the buffer less the pattern table.
+static inline uint32
+Get_Graph_Len(const AC_Buffer* buf) {
+    return buf->pattern_ofst ? buf->pattern_ofst : buf->buf_len;
+}
+
+// Clear the fields of the header which are meaningful only to the process
+// using the buffer. They are written only if need be, so as not to dirty the
+// page of a shared mapping needlessly.
+static inline void
+Clear_Runtime_Fields(AC_Buffer* buf) {
+#ifdef VERIFY
+    if (buf->slow_impl)
+        buf->slow_impl = 0;
+#endif
+    if (buf->shadow)
+        buf->shadow = 0;
+    if (buf->telemetry)
+        buf->telemetry = 0;
+    if (buf->reload_ver)
+        buf->reload_ver = 0;
+    if (buf->flags & BUF_RUNTIME_FLAGS)
+        buf->flags &= ~BUF_RUNTIME_FLAGS;
+}
+
+// The tags in the element of state offset vector. STATE_TERM_TAG indicates
+// the state is terminal, and STATE_OUT_TAG indicates some state reachable
+// via the fail-link chain is terminal, meaning some pattern is the proper
+// suffix of the string the state stands for.
+#define STATE_TERM_TAG  1
+#define STATE_OUT_TAG   2
+#define STATE_TAG_MASK  (STATE_TERM_TAG | STATE_OUT_TAG)
+
+// Return the time of the monotonic clock in microseconds.
+static inline uint64
+Now_Usec() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+// How often, in bytes, ac_limit_t::max_usec is checked.
+#define BUDGET_CHECK_INTERVAL 4096
+
+// The time budget of a scan, see ac_limit_t::max_usec. The clock is read
+// only when the scan crosses the next BUDGET_CHECK_INTERVAL bytes, however
+// often the scan stops for the matches, and not before the first interval
+// beginning at "idx" is scanned, such that each call makes some progress.
+class Scan_Budget {
+public:
+    Scan_Budget(uint32 usec, uint32 idx = 0) : _enabled(usec != 0) {
+        if (_enabled) {
+            clock_gettime(CLOCK_MONOTONIC, &_deadline);
+            uint64 nsec = _deadline.tv_nsec + (uint64)usec * 1000;
+            _deadline.tv_sec += nsec / 1000000000;
+            _deadline.tv_nsec = nsec % 1000000000;
+            Set_Next_Check(idx);
+        }
+    }
+
+    bool Enabled() const { return _enabled; }
+    bool Exhausted() const {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec > _deadline.tv_sec ||
+               (now.tv_sec == _deadline.tv_sec &&
+                now.tv_nsec >= _deadline.tv_nsec);
+    }
+
+    // Called before scanning on from "idx". Return false if it's time to
+    // check and the budget is exhausted; otherwise, pull "chunk_end" back
+    // to where it's time to check next.
+    bool Check(uint32 idx, uint32& chunk_end) {
+        if (!_enabled)
+            return true;
+
+        if (idx >= _next_check) {
+            if (Exhausted())
+                return false;
+            Set_Next_Check(idx);
+        }
+        if (chunk_end > _next_check)
+            chunk_end = _next_check;
+        return true;
+    }
+
+private:
+    void Set_Next_Check(uint32 idx) {
+        _next_check = idx < (uint32)-1 - BUDGET_CHECK_INTERVAL ?
+                      idx + BUDGET_CHECK_INTERVAL : (uint32)-1;
+    }
+
+    bool _enabled;
+    uint32 _next_check;
+    struct timespec _deadline;
+};
+
+// The kind of a state, which is what the direct-threaded interpreter
+// dispatches on (see Match_Threaded_Tmpl()). Lower two bits specify how to
+// look for a transition, and the remaining bits are orthogonal properties.
+typedef enum {
+    SK_LEAF = 0,        // No transition at all.
+    SK_ONE_KID = 1,     // Exactly one transition.
+    SK_SMALL = 2,       // A handful of transitions, searched linearly.
+    SK_DENSE = 3,       // Otherwise, searched with binary search.
+    SK_TRAN_MASK = 3,
+
+    SK_ROOT_FAIL = 4,   // The fail-link is the root node.
+    SK_TERM = 8,        // Terminal state.
+} State_Kind;
+
+// The limits due to the width of AC_State::is_term and AC_State::depth.
+#define MAX_PATTERN_NUM 65534
+#define MAX_PATTERN_LEN 32767
+
+// The max number of transitions of a SK_SMALL state.
+#define SK_SMALL_MAX 8
+
 // Depict the state of "fast" AC graph.
 typedef struct {
     // transition are sorted. For instance, state s1, has two transitions :
@@ -68,9 +277,39 @@ typedef struct {
     unsigned short is_term;  // Is terminal node. if is_term != 0, it encodes
                              // the value of "1 + pattern-index".
     unsigned char goto_num;  // The number of valid transition.
+    unsigned char kind;      // Bitwise-or of SK_XXX
     InputTy input_vect[1];   // Vector of valid input. Must be last field!
 } AC_State;
 
+// The accessors of the graph for deriving the auxiliary tables (e.g. the
+// Sheng table) from it. The matchers have their own, faster ones.
+static inline AC_State*
+Get_State(AC_Buffer* buf, State_ID id) {
+    unsigned char* buf_base = (unsigned char*)buf;
+    AC_Ofst* state_ofst_vect = (AC_Ofst*)(buf_base + buf->states_ofst_ofst);
+    return (AC_State*)(buf_base + (state_ofst_vect[id] & ~STATE_TAG_MASK));
+}
+
+// Return the state reached from the state "id" by goto(c), or -1 if the
+// goto function is not defined for the input "c".
+static inline int
+Get_Goto(AC_Buffer* buf, State_ID id, InputTy c) {
+    if (id == 0) {
+        if (buf->root_goto_num == 256)
+            return c + 1;
+
+        unsigned char* root_goto = (unsigned char*)buf + buf->root_goto_ofst;
+        return root_goto[c] ? root_goto[c] : -1;
+    }
+
+    AC_State* s = Get_State(buf, id);
+    for (uint32 i = 0; i < s->goto_num; i++) {
+        if (s->input_vect[i] == c)
+            return s->first_kid + i;
+    }
+    return -1;
+}
+
 class Buf_Allocator {
 public:
     Buf_Allocator() : _buf(0) {}
@@ -82,16 +321,71 @@ protected:
     AC_Buffer* _buf;
 };
 
+// Allocate the buffer off the heap, and free it as the allocator dies.
+class Heap_Buf_Alloc : public Buf_Allocator {
+public:
+    virtual ~Heap_Buf_Alloc() { free(); }
+
+    virtual AC_Buffer* alloc(int sz) {
+        free();
+        _buf = (AC_Buffer*)(void*)(new unsigned char[sz]);
+        return _buf;
+    }
+
+    virtual void free() {
+        delete[] (unsigned char*)(void*)_buf;
+        _buf = 0;
+    }
+};
+
 // Convert slow-AC-graph into fast one.
 class AC_Converter {
 public:
-    AC_Converter(ACS_Constructor& acs, Buf_Allocator& ba) :
-        _acs(acs), _buf_alloc(ba) {}
+    AC_Converter(ACS_Constructor& acs, Buf_Allocator& ba,
+                 const ac_opt_t* opt = 0) :
+        _acs(acs), _buf_alloc(ba), _opt_flags(opt ? opt->flags : 0) {}
     AC_Buffer* Convert();
 
+    // Return the size in byte needed to to save a state with "goto_num"
+    // transitions.
+    static uint32 Calc_State_Sz(uint32 goto_num);
+
+    // Calculate the layout of the buffer for an AC graph of "state_num"
+    // states (including root), with root having "root_fanout" transitions.
+    // Return the offset of the first state, i.e. the size of the buffer
+    // less the states' contents.
+    static uint64 Calc_Layout(uint32 root_fanout, uint64 state_num,
+                              AC_Ofst* root_goto_ofst,
+                              AC_Ofst* states_ofst_ofst);
+
+    // Return true if an AC graph of "state_num" states is to be converted
+    // into the compact one (see ac_compact.hpp).
+    static bool Is_Compact(uint64 state_num, uint32 opt_flags);
+
+    // Return the size in byte of the Sheng table of an AC graph of
+    // "state_num" states, or 0 if the graph doesn't have one.
+    static uint32 Calc_Sheng_Sz(uint64 state_num, uint32 opt_flags);
+
+    // Return the size in byte of the stride-2 tables of an AC graph of
+    // "state_num" states, with transitions on "input_num" distinct inputs,
+    // or 0 if the graph doesn't have them.
+    static uint32 Calc_Stride2_Sz(uint64 state_num, uint32 input_num,
+                                  uint32 opt_flags);
+
+    // Return true if the graph is to be the composite one (see
+    // ac_composite.hpp), given the number of states of the trie of the short
+    // patterns and that of the long ones, both including root.
+    static bool Is_Composite(uint64 short_state_num, uint64 long_state_num,
+                             uint32 opt_flags);
+
+    // Return the size in byte of the pattern table of "pattern_num" patterns
+    // of "total_len" bytes in total.
+    static uint64 Calc_Pattern_Table_Sz(uint32 pattern_num, uint64 total_len) {
+        return PATTERN_TABLE_HDR_SZ + (uint64)pattern_num * PATTERN_LOC_SZ +
+               total_len;
+    }
+
 private:
-    // Return the size in byte needed to to save the specified state.
-    uint32 Calc_State_Sz(const ACS_State *) const;
 
     // In fast-AC-graph, the ID is bit trikcy. Given a state of slow-graph,
     // this function is to return the ID of its counterpart in the fast-graph.
@@ -100,7 +394,33 @@ private:
         return m[s->Get_ID()];
     }
 
-    AC_Buffer* Alloc_Buffer();
+    // Convert into the regular graph, in the buffer allocated by "ba".
+    AC_Buffer* Convert_Graph(Buf_Allocator& ba);
+
+    // Convert the regular "graph" into the succinct one, or the compact
+    // one, respectively.
+    AC_Buffer* Convert_LOUDS(AC_Buffer* graph);
+    AC_Buffer* Convert_Compact(AC_Buffer* graph);
+
+    // Convert into the composite graph, or return 0 if it doesn't apply.
+    AC_Buffer* Convert_Composite();
+
+    // Convert into the regular graph with the q-gram prefilter, or return 0
+    // if it doesn't apply.
+    AC_Buffer* Convert_QGram();
+
+    // Convert into the graph without the pattern table, and append it.
+    AC_Buffer* Convert_With_Patterns();
+
+    // Allocate the "sz"-byte buffer of the graph derived from the regular
+    // "graph", and populate the header.
+    AC_Buffer* Alloc_Derived_Buffer(AC_Buffer* graph, uint32 sz);
+
+    AC_Buffer* Alloc_Buffer(Buf_Allocator& ba);
+
+    // Figure out the bases of the double-array (see ac_da.hpp), saving them
+    // to "_da_base_v". Return the number of cells.
+    uint32 Pack_DA();
     void Populate_Root_Goto_Func(AC_Buffer *, GotoVect&);
 
 #ifdef DEBUG
@@ -110,15 +430,56 @@ private:
 private:
     ACS_Constructor& _acs;
     Buf_Allocator& _buf_alloc;
+    uint32 _opt_flags;        // Bitwise-or of AC_OPT_XXX
 
     // map: ID of state in slow-graph -> ID of counterpart in fast-graph.
     vector<uint32> _id_map;
 
     // map: ID of state in slow-graph -> offset of counterpart in fast-graph.
     vector<AC_Ofst> _ofst_map;
+
+    // map: ID of state in fast-graph -> base in the double-array.
+    vector<uint32> _da_base_v;
 };
 
+// Check if the "len"-byte buffer, which may come from an untrusted source
+// (e.g. a file or shared memory), is a well-formed fast AC graph, such that
+// matching against it never goes out of the buffer or loops forever. The
+// verdict is cached in the buffer's flags; if "trust_verdict" is set, a
+// buffer already flagged BUF_VALIDATED only gets the cheap header checks.
+bool Validate_Buffer(AC_Buffer* buf, uint32 len, bool trust_verdict);
+
+typedef enum {
+    // Look for the first match. e.g. pattern set = {"ab", "abc", "def"},
+    // subject string "ababcdef". The first match would be "ab" at the
+    // beginning of the subject string.
+    MV_FIRST_MATCH,
+
+    // Look for the left-most longest match. Follow above example; there are
+    // two longest matches, "abc" and "def", and the left-most longest match
+    // is "abc".
+    MV_LEFT_LONGEST,
+
+    // Similar to the left-most longest match, except that it returns the
+    // *right* most longest match. Follow above example, the match would
+    // be "def". NYI.
+    MV_RIGHT_LONGEST,
+
+    // Return all patterns that match that given subject string. NYI.
+    MV_ALL_MATCHES,
+} MATCH_VARIANT;
+
 ac_result_t Match(AC_Buffer* buf, const char* str, uint32 len);
 ac_result_t Match_Longest_L(AC_Buffer* buf, const char* str, uint32 len);
 
+// Same as the above except that "str" is NUL-terminated.
+ac_result_t Match_Cstr(AC_Buffer* buf, const char* str);
+ac_result_t Match_Longest_Cstr(AC_Buffer* buf, const char* str);
+
+uint32 Match_All(AC_Buffer* buf, const char* str, uint32 len,
+                 ac_result_t* result_v, uint32 result_cap,
+                 const ac_limit_t* limit, ac_scan_t* scan);
+uint32 Match_Count(AC_Buffer* buf, const char* str, uint32 len,
+                   const ac_limit_t* limit, ac_scan_t* scan);
+
 #endif  // AC_FAST_H
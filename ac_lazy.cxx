@@ -0,0 +1,295 @@
+#include <string.h>
+#include "ac_slow.hpp"
+#include "ac_lazy.hpp"
+
+AC_Lazy::AC_Lazy(const char** strv, const unsigned int* strlenv,
+                 uint32 strnum, uint32 opt_flags) :
+    _state_num(0), _opt_flags(opt_flags) {
+    memset(&_buf, 0, sizeof(_buf));
+    _buf.hdr.magic_num = AC_MAGIC_NUM;
+    _buf.hdr.impl_variant = IMPL_FAST_VARIANT;
+    _buf.layout_version = AC_LAYOUT_VERSION;
+    _buf.buf_len = sizeof(AC_Buffer);
+    _buf.flags = BUF_LAZY;
+    _buf.pattern_num = strnum;
+    memset(_root_goto, 0, sizeof(_root_goto));
+    pthread_mutex_init(&_lock, 0);
+
+    // Copy the patterns. Empty patterns match nothing, as is the case with
+    // the regular graph, so they are not in the range of root.
+    uint64 total = 0;
+    _pattern_ofst.resize(strnum + 1);
+    for (uint32 i = 0; i < strnum; i++) {
+        _pattern_ofst[i] = total;
+        total += strlenv[i];
+        if (strlenv[i])
+            _perm.push_back(i);
+    }
+    ASSERT(total < (uint32)-1);
+    _pattern_ofst[strnum] = total;
+    _pattern_buf.resize(total);
+    for (uint32 i = 0; i < strnum; i++) {
+        if (strlenv[i])
+            memcpy(&_pattern_buf[_pattern_ofst[i]], strv[i], strlenv[i]);
+    }
+    _tmp.resize(_perm.size());
+
+    // There are no more states than the chars of the patterns plus root,
+    // and less than 256 IDs of each chunk are skipped.
+    _chunks.resize((total + 1) / (LAZY_CHUNK_SZ - 256) + 2, 0);
+
+    Lazy_State* root = Get_State(Alloc_States(1));
+    root->hi = _perm.size();
+    Warm(LAZY_EAGER_DEPTH);
+}
+
+AC_Lazy::~AC_Lazy() {
+    for (uint32 i = 0; i < _chunks.size(); i++)
+        delete[] _chunks[i];
+    pthread_mutex_destroy(&_lock);
+}
+
+// Assign "num" consecutive IDs, which are in the same chunk.
+State_ID
+AC_Lazy::Alloc_States(uint32 num) {
+    ASSERT(num <= 256);
+    State_ID id = _state_num;
+    if ((id & (LAZY_CHUNK_SZ - 1)) + num > LAZY_CHUNK_SZ)
+        id = (id | (LAZY_CHUNK_SZ - 1)) + 1;
+
+    uint32 chunk = id >> LAZY_CHUNK_SHIFT;
+    ASSERT(chunk < _chunks.size());
+    if (!_chunks[chunk]) {
+        _chunks[chunk] = new Lazy_State[LAZY_CHUNK_SZ];
+        memset(_chunks[chunk], 0, sizeof(Lazy_State) * LAZY_CHUNK_SZ);
+    }
+
+    _state_num = id + num;
+    return id;
+}
+
+void
+AC_Lazy::Materialize(State_ID id) {
+    pthread_mutex_lock(&_lock);
+    Materialize_Locked(id);
+    pthread_mutex_unlock(&_lock);
+}
+
+bool
+AC_Lazy::Goto_Locked(State_ID id, InputTy c, State_ID& kid) {
+    if (id == 0) {
+        kid = _root_goto[c];
+        return kid != 0;
+    }
+
+    Materialize_Locked(id);
+    Lazy_State* s = Get_State(id);
+    return Lazy_Find_Kid(Get_State(s->first_kid), s->goto_num, c,
+                         s->first_kid, kid);
+}
+
+void
+AC_Lazy::Materialize_Locked(State_ID id) {
+    Lazy_State* s = Get_State(id);
+    if (s->ready)
+        return;
+
+    // Step 1: Bucket-sort the range by the char following the prefix. As the
+    // patterns ending at this state are not in the range, all of them have
+    // the char.
+    uint32 lo = s->lo, hi = s->hi, depth = s->depth;
+    uint32 count[256];
+    memset(count, 0, sizeof(count));
+    for (uint32 i = lo; i < hi; i++)
+        count[Get_Char(_perm[i], depth)]++;
+
+    uint32 start[256];
+    uint32 goto_num = 0;
+    for (uint32 c = 0, ofst = lo; c < 256; c++) {
+        start[c] = ofst;
+        ofst += count[c];
+        if (count[c])
+            goto_num++;
+    }
+
+    uint32 pos[256];
+    memcpy(pos, start, sizeof(pos));
+    for (uint32 i = lo; i < hi; i++) {
+        uint32 p = _perm[i];
+        _tmp[pos[Get_Char(p, depth)]++] = p;
+    }
+    if (hi > lo)
+        memcpy(&_perm[lo], &_tmp[lo], (hi - lo) * sizeof(uint32));
+
+    // Step 2: Populate the kids, one for each bucket, in the order of their
+    // inputs.
+    State_ID first_kid = goto_num ? Alloc_States(goto_num) : 0;
+    State_ID kid_id = first_kid;
+    for (uint32 c = 0; c < 256; c++) {
+        if (!count[c])
+            continue;
+
+        // Move the patterns ending at the kid out of its range. The pattern
+        // added last wins if there are duplicates, as it does with the slow
+        // graph.
+        uint32 kid_lo = start[c], kid_hi = start[c] + count[c];
+        uint32 is_term = 0;
+        for (uint32 i = kid_lo; i < kid_hi; i++) {
+            uint32 p = _perm[i];
+            if (_pattern_ofst[p + 1] - _pattern_ofst[p] == depth + 1) {
+                _perm[i] = _perm[kid_lo];
+                _perm[kid_lo++] = p;
+                if (p + 1 > is_term)
+                    is_term = p + 1;
+            }
+        }
+
+        // The fail-link is the kid on "c" of the first state along the
+        // parent's fail-link chain having such kid. The states on the chain
+        // are shallower than the parent, so are their kids than the kid.
+        // Their ranges are disjoint from that of the parent, so they can be
+        // materialized while the parent's range is being partitioned.
+        State_ID fail = 0;
+        if (id != 0) {
+            for (State_ID f = s->fail; ; f = Get_State(f)->fail) {
+                if (Goto_Locked(f, c, fail) || f == 0)
+                    break;
+            }
+        }
+
+        Lazy_State* kid = Get_State(kid_id);
+        kid->lo = kid_lo;
+        kid->hi = kid_hi;
+        kid->fail = fail;
+        kid->depth = depth + 1;
+        kid->is_term = is_term;
+        kid->input = c;
+        kid->tags = is_term ? STATE_TERM_TAG : 0;
+        if (fail && Get_State(fail)->tags)
+            kid->tags |= STATE_OUT_TAG;
+        kid->ready = kid_lo == kid_hi;
+
+        if (id == 0)
+            _root_goto[c] = kid_id;
+        kid_id++;
+    }
+
+    // Step 3: Publish the kids.
+    s->first_kid = first_kid;
+    s->goto_num = goto_num;
+    __atomic_store_n(&s->ready, 1, __ATOMIC_RELEASE);
+}
+
+uint64
+AC_Lazy::Warm(uint32 max_depth) {
+    pthread_mutex_lock(&_lock);
+
+    // BFS the states shallower than "max_depth", materializing their kids.
+    vector<State_ID> wl(1, 0);
+    for (uint32 i = 0; i < wl.size(); i++) {
+        Lazy_State* s = Get_State(wl[i]);
+        if (s->depth >= max_depth)
+            continue;
+
+        Materialize_Locked(wl[i]);
+        for (uint32 k = 0; k < s->goto_num; k++)
+            wl.push_back(s->first_kid + k);
+    }
+    uint64 sz = (uint64)_state_num * sizeof(Lazy_State);
+
+    pthread_mutex_unlock(&_lock);
+    return sz;
+}
+
+const char*
+AC_Lazy::Get_Pattern(uint32 idx, uint32* len) const {
+    if (!(_opt_flags & AC_OPT_PATTERN_TABLE) || idx >= _buf.pattern_num)
+        return 0;
+
+    *len = _pattern_ofst[idx + 1] - _pattern_ofst[idx];
+    return _pattern_buf.empty() ? "" : &_pattern_buf[_pattern_ofst[idx]];
+}
+
+uint32
+AC_Lazy::Serialize(void* blob, uint32 cap) {
+    uint32 strnum = _buf.pattern_num;
+    const char* base = _pattern_buf.empty() ? "" : &_pattern_buf[0];
+    vector<const char*> strv(strnum + 1);
+    vector<unsigned int> strlenv(strnum + 1);
+    for (uint32 i = 0; i < strnum; i++) {
+        strv[i] = base + _pattern_ofst[i];
+        strlenv[i] = _pattern_ofst[i + 1] - _pattern_ofst[i];
+    }
+
+    ACS_Constructor acc;
+    acc.Construct(&strv[0], &strlenv[0], strnum);
+
+    ac_opt_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.flags = _opt_flags & ~AC_OPT_LAZY;
+    Heap_Buf_Alloc ba;
+    AC_Converter cvt(acc, ba, &opt);
+    AC_Buffer* buf = cvt.Convert();
+
+    uint32 len = buf->buf_len;
+    if (cap >= len)
+        memcpy(blob, buf, len);
+    return len;
+}
+
+// Same as Match_Tmpl(), except that the graph is the lazy one.
+template<MATCH_VARIANT variant> static ac_result_t
+Lazy_Match_Tmpl(AC_Buffer* buf, const char* str, uint32 len) {
+    Lazy_Graph g(buf);
+
+    ac_result_t r = {-1, -1};
+    uint32 idx = 0;
+    State_ID state = 0;
+    for (;;) {
+        if (state == 0) {
+            state = g.Root_Skip(str, len, idx);
+            if (state == 0)
+                break;
+        } else {
+            if (idx >= len)
+                break;
+
+            State_ID kid;
+            if (g.Goto(state, str[idx], kid)) {
+                state = kid;
+                idx++;
+            } else {
+                // Follow the fail-link without consuming the input.
+                state = g.Get_Fail(state);
+                if (state == 0)
+                    continue;
+            }
+        }
+
+        if (unlikely(g.Get_Tags(state) & STATE_TERM_TAG)) {
+            int match_begin = idx - g.Get_Depth(state);
+            int match_end = idx - 1;
+
+            if (variant == MV_FIRST_MATCH || r.match_begin == -1 ||
+                match_end - match_begin > r.match_end - r.match_begin) {
+                r.match_begin = match_begin;
+                r.match_end = match_end;
+                r.pattern_idx = g.Get_Pattern_Idx(state);
+            }
+            if (variant == MV_FIRST_MATCH)
+                return r;
+        }
+    }
+
+    return r;
+}
+
+ac_result_t
+Lazy_Match(AC_Buffer* buf, const char* str, uint32 len) {
+    return Lazy_Match_Tmpl<MV_FIRST_MATCH>(buf, str, len);
+}
+
+ac_result_t
+Lazy_Match_Longest_L(AC_Buffer* buf, const char* str, uint32 len) {
+    return Lazy_Match_Tmpl<MV_LEFT_LONGEST>(buf, str, len);
+}
@@ -0,0 +1,176 @@
+#ifndef AC_LAZY_H
+#define AC_LAZY_H
+
+#include <pthread.h>
+#include <vector>
+#include "ac_fast.hpp"
+
+using namespace std;
+
+// The lazy graph, for huge dictionaries only a small share of which is hit by
+// the traffic. Rather than building the whole graph before the first match,
+// it builds the top levels up front, and materializes the kids of any other
+// state the first time the matcher goes through it.
+//
+// The patterns are copied along with a permutation of them. The patterns
+// having the prefix a state stands for, except those ending at the state, are
+// a range of the permutation. Materializing a state's kids is to bucket-sort
+// its range by the next byte; each bucket is a kid's range. So the patterns
+// are sorted lazily and incrementally, like an MSD radix sort, and the cost of
+// materialization is linear to the size of the range. The fail-link of a kid
+// is computed as the kid is materialized, which may materialize the states on
+// its parent's fail-link chain, all of which are shallower than the kid.
+//
+// A state is never changed after its kids are materialized, and it's flagged
+// ready with the release semantics, after the kids are populated; so the
+// matcher doesn't synchronize with anything unless it comes across a state
+// whose kids are yet to be materialized, in which case it materializes them
+// under a lock. States are referred to by ID, which is assigned as they are
+// materialized, root first, and the kids of a state have consecutive IDs. The
+// states are kept in fixed-size chunks that never move, such that IDs stay
+// valid (e.g. in ac_scan_t) for the life of the instance.
+//
+// The instance is an AC_Buffer flagged BUF_LAZY, which is the header of the
+// lazy graph (see AC_Lazy::Get()), and which has nothing but the header.
+//
+#define LAZY_CHUNK_SHIFT    12
+#define LAZY_CHUNK_SZ       (1 << LAZY_CHUNK_SHIFT)
+#define LAZY_EAGER_DEPTH    2   // The states up to this deep are built up
+                                // front.
+
+typedef struct {
+    uint32 lo, hi;          // The range of the permutation of the patterns.
+    State_ID first_kid;     // Valid once ready.
+    State_ID fail;
+    uint32 depth;           // How far away from root.
+    uint16 is_term;         // 1 + pattern-index, or 0 if not terminal.
+    uint16 goto_num;        // Valid once ready.
+    InputTy input;          // The input leading to this state.
+    unsigned char tags;     // Bitwise-or of STATE_XXX_TAG
+    unsigned char ready;    // The kids are materialized.
+} Lazy_State;
+
+// Binary search the "num" kids starting with ID "first" at "kids", which never
+// straddle chunks (see AC_Lazy::Alloc_States()), for the one on input "c".
+static inline bool
+Lazy_Find_Kid(const Lazy_State* kids, uint32 num, InputTy c, State_ID first,
+              State_ID& kid) {
+    uint32 low = 0, high = num;
+    while (low < high) {
+        uint32 mid = (low + high) >> 1;
+        InputTy input = kids[mid].input;
+        if (input == c) {
+            kid = first + mid;
+            return true;
+        }
+        if (input < c)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return false;
+}
+
+class AC_Lazy {
+public:
+    // Create the lazy graph of the patterns, with "opt_flags" (see
+    // ac_opt_t::flags) applying to the regular graph, if it's ever built.
+    AC_Lazy(const char** strv, const unsigned int* strlenv, uint32 strnum,
+            uint32 opt_flags);
+    ~AC_Lazy();
+
+    static AC_Lazy* Get(AC_Buffer* buf) {
+        ASSERT(buf->flags & BUF_LAZY);
+        return (AC_Lazy*)(void*)buf;
+    }
+    AC_Buffer* Get_Buffer() { return &_buf; }
+
+    Lazy_State* Get_State(State_ID id) const {
+        return _chunks[id >> LAZY_CHUNK_SHIFT] + (id & (LAZY_CHUNK_SZ - 1));
+    }
+
+    // Return the state with its kids materialized.
+    const Lazy_State* Get_Ready_State(State_ID id) {
+        Lazy_State* s = Get_State(id);
+        if (unlikely(!__atomic_load_n(&s->ready, __ATOMIC_ACQUIRE)))
+            Materialize(id);
+        return s;
+    }
+
+    // The kids of root, indexed by their inputs; 0 if no such kid.
+    const State_ID* Get_Root_Goto() const { return _root_goto; }
+
+    // Materialize all the states no deeper than "max_depth", and return the
+    // size in bytes of the states materialized so far.
+    uint64 Warm(uint32 max_depth);
+
+    // Same as ac_serialize(), except that the regular graph is built for it.
+    uint32 Serialize(void* blob, uint32 cap);
+
+    // Same as ac_get_pattern(); the patterns are kept anyway.
+    const char* Get_Pattern(uint32 idx, uint32* len) const;
+
+private:
+    void Materialize(State_ID id);
+    void Materialize_Locked(State_ID id);
+    bool Goto_Locked(State_ID id, InputTy c, State_ID& kid);
+    State_ID Alloc_States(uint32 num);
+
+    InputTy Get_Char(uint32 pattern, uint32 pos) const {
+        return _pattern_buf[_pattern_ofst[pattern] + pos];
+    }
+
+    AC_Buffer _buf;     // Must be the first member.
+    State_ID _root_goto[256];
+    vector<char> _pattern_buf;
+    vector<uint32> _pattern_ofst;   // indexed by pattern-index, and one more
+                                    // for the end of the last pattern.
+    vector<uint32> _perm;           // The permutation of pattern-indices.
+    vector<uint32> _tmp;            // Scratch for the bucket sort.
+    vector<Lazy_State*> _chunks;    // Never resized after construction.
+    State_ID _state_num;            // IDs assigned so far.
+    uint32 _opt_flags;
+    pthread_mutex_t _lock;
+};
+
+// The accessors of the lazy graph, with the same interface as that of the
+// regular one used by Match_All_Tmpl().
+class Lazy_Graph {
+public:
+    Lazy_Graph(AC_Buffer* buf) : _lazy(AC_Lazy::Get(buf)) {
+        _root_goto = _lazy->Get_Root_Goto();
+    }
+
+    State_ID Root_Skip(const char* str, uint32 len, uint32& idx) const {
+        while (idx < len) {
+            if (State_ID kid = _root_goto[(InputTy)str[idx++]])
+                return kid;
+        }
+        return 0;
+    }
+
+    bool Goto(State_ID id, InputTy c, State_ID& kid) const {
+        const Lazy_State* s = _lazy->Get_Ready_State(id);
+        if (!s->goto_num)
+            return false;
+
+        return Lazy_Find_Kid(_lazy->Get_State(s->first_kid), s->goto_num, c,
+                             s->first_kid, kid);
+    }
+
+    State_ID Get_Fail(State_ID id) const { return St(id)->fail; }
+    uint32 Get_Tags(State_ID id) const { return St(id)->tags; }
+    uint32 Get_Depth(State_ID id) const { return St(id)->depth; }
+    uint32 Get_Pattern_Idx(State_ID id) const { return St(id)->is_term - 1; }
+
+private:
+    const Lazy_State* St(State_ID id) const { return _lazy->Get_State(id); }
+
+    AC_Lazy* _lazy;
+    const State_ID* _root_goto;
+};
+
+ac_result_t Lazy_Match(AC_Buffer* buf, const char* str, uint32 len);
+ac_result_t Lazy_Match_Longest_L(AC_Buffer* buf, const char* str, uint32 len);
+
+#endif  // AC_LAZY_H
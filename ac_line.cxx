@@ -0,0 +1,184 @@
+// Line-oriented scanning, see ac_line_match_all().
+//
+#ifdef __SSE2__
+    #include <emmintrin.h>  // for _mm_cmpeq_epi8
+#endif
+#include <string.h>
+#include "ac_fast.hpp"
+#include "ac_telemetry.hpp"
+#include "ac.h"
+
+// The number of matches ac_line_match_all() gets from the engine at a time.
+#define LINE_BATCH 64
+
+// Return the offset of the last newline in "str[from, to)", which must have
+// some.
+static uint32
+Find_Last_Newline(const char* str, uint32 from, uint32 to) {
+    uint32 i = to;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    while (i - from >= sizeof(__m128i)) {
+        i -= sizeof(__m128i);
+        __m128i blk = _mm_loadu_si128((const __m128i*)(const void*)(str + i));
+        uint32 mask = _mm_movemask_epi8(_mm_cmpeq_epi8(blk, nl));
+        if (mask)
+            return i + 31 - __builtin_clz(mask);
+    }
+#endif
+    while (i > from) {
+        if (str[--i] == '\n')
+            return i;
+    }
+    ASSERT(false);
+    return from;
+}
+
+// Return the number of newlines in "str[from, to)", and move "line_begin"
+// right after the last one, if any. The newlines of a block are counted all
+// at once: the lanes of the block equal to '\n' are all ones, i.e. -1, and
+// subtracting them accumulates the counts of the lanes, which are summed up
+// every 255 blocks, before any of them overflows.
+static uint32
+Count_Newlines(const char* str, uint32 from, uint32 to, uint32* line_begin) {
+    uint32 num = 0;
+    uint32 i = from;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    while (to - i >= sizeof(__m128i)) {
+        uint32 blk_num = (to - i) / sizeof(__m128i);
+        if (blk_num > 255)
+            blk_num = 255;
+
+        __m128i acc = zero;
+        for (uint32 k = 0; k < blk_num; k++, i += sizeof(__m128i)) {
+            __m128i blk = _mm_loadu_si128((const __m128i*)(const void*)
+                                          (str + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(blk, nl));
+        }
+        __m128i sum = _mm_sad_epu8(acc, zero);
+        num += _mm_cvtsi128_si32(sum) + _mm_extract_epi16(sum, 4);
+    }
+#endif
+    for (; i < to; i++)
+        num += str[i] == '\n' ? 1 : 0;
+
+    if (num)
+        *line_begin = Find_Last_Newline(str, from, to) + 1;
+    return num;
+}
+
+// The matches come from Match_All() a batch at a time, and the newlines are
+// counted from one match to the next. In the AC_LINE_FIRST_ONLY mode, the
+// engine is asked for one match, and then it's started afresh at the next
+// line, as if the string began there, such that the engines peeking at the
+// bytes before the current offset (see Composite_Match_All()) don't see the
+// line skipped.
+//
+// The "scan->priv" keeps the number of newlines before "resume_ofst - 1",
+// the beginning of the line it's in, and where the string begins for the
+// engine.
+//
+extern "C" int
+ac_line_match_all(ac_t* ac, const char* str, unsigned int len,
+                  unsigned int flags, ac_line_result_t* result_v,
+                  unsigned int result_cap, const ac_limit_t* limit,
+                  ac_line_scan_t* lscan) {
+    AC_Buffer* buf = (AC_Buffer*)(void*)ac;
+    ASSERT(((buf_header_t*)ac)->magic_num == AC_MAGIC_NUM);
+
+    ac_line_scan_t tmp;
+    if (!lscan) {
+        memset(&tmp, 0, sizeof(tmp));
+        lscan = &tmp;
+    }
+    ac_scan_t& scan = lscan->scan;
+    bool first_only = flags & AC_LINE_FIRST_ONLY;
+
+    uint32 line_num = lscan->priv[0];
+    uint32 line_begin = lscan->priv[1];
+    uint32 base = lscan->priv[2];
+    uint32 counted = scan.resume_ofst ? scan.resume_ofst - 1 : 0;
+
+    uint32 max_match = result_cap;
+    uint32 stop = len;
+    uint32 usec = 0;
+    if (limit) {
+        if (limit->max_matches && limit->max_matches < max_match)
+            max_match = limit->max_matches;
+        if (limit->max_bytes && limit->max_bytes < len - scan.resume_ofst)
+            stop = scan.resume_ofst + limit->max_bytes;
+        usec = limit->max_usec;
+    }
+    Scan_Budget budget(usec, scan.resume_ofst);
+
+    uint32 match_num = 0;
+    ac_result_t r[LINE_BATCH];
+    for (;;) {
+        if (scan.resume_ofst >= len && !scan.priv[1]) {
+            scan.status = AC_SCAN_DONE;
+            break;
+        }
+
+        // The matches pending at "stop" are left to the next call, unless
+        // it's the end of the string. The batches stop where it's time to
+        // check the budget as well, such that the clock is read once per
+        // BUDGET_CHECK_INTERVAL bytes rather than once per batch.
+        uint32 batch_stop = stop;
+        if ((scan.resume_ofst >= stop && stop < len) ||
+            match_num == max_match ||
+            !budget.Check(scan.resume_ofst, batch_stop)) {
+            scan.status = AC_SCAN_TRUNCATED;
+            break;
+        }
+
+        ac_limit_t batch_lim;
+        memset(&batch_lim, 0, sizeof(batch_lim));
+        batch_lim.max_matches = first_only ? 1 : max_match - match_num;
+        if (batch_stop < len)
+            batch_lim.max_bytes = batch_stop - scan.resume_ofst;
+
+        scan.resume_ofst -= base;
+        uint32 num = Match_All(buf, str + base, len - base, r, LINE_BATCH,
+                               &batch_lim, &scan);
+        scan.resume_ofst += base;
+
+        for (uint32 i = 0; i < num; i++) {
+            uint32 end = r[i].match_end + base;
+            line_num += Count_Newlines(str, counted, end, &line_begin);
+            counted = end;
+
+            ac_line_result_t& lr = result_v[match_num++];
+            lr.match.match_begin = r[i].match_begin + base;
+            lr.match.match_end = end;
+            lr.match.pattern_idx = r[i].pattern_idx;
+            lr.line_num = line_num + 1;
+            lr.line_begin = line_begin;
+            Count_Hits(buf, lr.match);
+        }
+
+        if (first_only && num) {
+            // Move on to the next line, if any. The newline is left to be
+            // counted along with those after it.
+            const void* nl = memchr(str + counted, '\n', len - counted);
+            if (nl) {
+                counted = (const char*)nl - str;
+                base = counted + 1;
+            } else {
+                base = len;
+            }
+            scan.status = base < len ? AC_SCAN_TRUNCATED : AC_SCAN_DONE;
+            scan.resume_ofst = base;
+            scan.priv[0] = scan.priv[1] = 0;
+        }
+    }
+
+    uint32 resume_counted = scan.resume_ofst ? scan.resume_ofst - 1 : 0;
+    if (resume_counted > counted)
+        line_num += Count_Newlines(str, counted, resume_counted, &line_begin);
+    lscan->priv[0] = line_num;
+    lscan->priv[1] = line_begin;
+    lscan->priv[2] = base;
+    return match_num;
+}
@@ -0,0 +1,406 @@
+#include <strings.h>    // for bzero
+#include "ac_louds.hpp"
+
+unsigned char louds_select_in_byte[256 * 8];
+
+static bool
+Init_Select_In_Byte() {
+    for (uint32 b = 0; b < 256; b++) {
+        uint32 i = 0;
+        for (uint32 bit = 0; bit < 8; bit++) {
+            if (b & (1 << bit))
+                louds_select_in_byte[b * 8 + i++] = bit;
+        }
+    }
+    return true;
+}
+
+static const bool select_in_byte_ready = Init_Select_In_Byte();
+
+static inline uint64
+Word_Num(uint64 bits) {
+    return (bits + 63) / 64;
+}
+
+static inline uint64
+Align_Word(uint64 sz) {
+    return (sz + sizeof(LOUDS_Word) - 1) & ~(sizeof(LOUDS_Word) - 1);
+}
+
+uint64
+Calc_LOUDS_Layout(uint64 state_num, uint64 term_num, uint32 fail_bits,
+                  uint32 pattern_bits, uint32 depth_bits,
+                  LOUDS_Layout* l) {
+    ASSERT(state_num != 0);
+    uint64 sz = Align_Word(sizeof(LOUDS_Table));
+
+    // A 1-bit per state but root, and a 0-bit per state.
+    l->louds = sz;
+    sz += Word_Num(2 * state_num - 1) * sizeof(LOUDS_Word);
+
+    l->select = sz;
+    sz += Align_Word(((state_num - 1) / LOUDS_SELECT_RATE + 1) *
+                     sizeof(uint32));
+
+    l->labels = sz;
+    sz += Align_Word(state_num * sizeof(InputTy));
+
+    uint64 tag_words = Word_Num(2 * state_num);
+    l->tags = sz;
+    sz += tag_words * sizeof(LOUDS_Word);
+
+    l->rank = sz;
+    sz += Align_Word(((tag_words - 1) / LOUDS_RANK_RATE + 1) * sizeof(uint32));
+
+    // The packed arrays have one extra word, see LOUDS_Graph::Get_Bits().
+    l->fail = sz;
+    sz += (Word_Num(state_num * fail_bits) + 1) * sizeof(LOUDS_Word);
+
+    l->pattern = sz;
+    sz += (Word_Num(term_num * pattern_bits) + 1) * sizeof(LOUDS_Word);
+
+    l->depth = sz;
+    sz += (Word_Num(term_num * depth_bits) + 1) * sizeof(LOUDS_Word);
+
+    l->size = sz;
+    return sz;
+}
+
+static inline uint32
+Get_Pattern_Bits(uint32 pattern_num) {
+    return LOUDS_Bit_Width(pattern_num ? pattern_num - 1 : 0);
+}
+
+uint64
+Calc_LOUDS_Sz(uint64 state_num, uint64 term_num, uint32 pattern_num,
+              uint32 max_depth) {
+    LOUDS_Layout l;
+    return Calc_LOUDS_Layout(state_num, term_num,
+                             LOUDS_Bit_Width(state_num - 1),
+                             Get_Pattern_Bits(pattern_num),
+                             LOUDS_Bit_Width(max_depth), &l);
+}
+
+// Return the number of terminal states of the "graph", along with the depth
+// of the deepest one.
+static uint32
+Get_Term_Num(AC_Buffer* graph, uint32* max_depth) {
+    uint32 term_num = 0;
+    *max_depth = 0;
+    for (State_ID id = 1; id < graph->state_num; id++) {
+        AC_State* s = Get_State(graph, id);
+        if (s->is_term) {
+            term_num++;
+            if ((uint32)s->depth > *max_depth)
+                *max_depth = s->depth;
+        }
+    }
+    return term_num;
+}
+
+uint64
+Calc_LOUDS_Sz(AC_Buffer* graph) {
+    uint32 max_depth;
+    uint32 term_num = Get_Term_Num(graph, &max_depth);
+    return Calc_LOUDS_Sz(graph->state_num, term_num, graph->pattern_num,
+                         max_depth);
+}
+
+static inline void
+Set_Bit(LOUDS_Word* v, uint64 pos) {
+    v[pos / 64] |= (LOUDS_Word)1 << (pos % 64);
+}
+
+static inline bool
+Test_Bit(const LOUDS_Word* v, uint64 pos) {
+    return (v[pos / 64] >> (pos % 64)) & 1;
+}
+
+// Write "val" to the "width"-bit element at bit "pos" of the zeroed array.
+static inline void
+Set_Bits(LOUDS_Word* v, uint64 pos, uint32 width, uint32 val) {
+    uint64 w = pos / 64;
+    uint32 shift = pos % 64;
+    v[w] |= (LOUDS_Word)val << shift;
+    if (shift + width > 64)
+        v[w + 1] |= (LOUDS_Word)val >> (64 - shift);
+}
+
+void
+Build_LOUDS_Table(AC_Buffer* graph, LOUDS_Table* tbl) {
+    uint32 state_num = graph->state_num;
+    uint32 max_depth;
+    uint32 term_num = Get_Term_Num(graph, &max_depth);
+
+    LOUDS_Layout l;
+    uint32 fail_bits = LOUDS_Bit_Width(state_num - 1);
+    uint32 pattern_bits = Get_Pattern_Bits(graph->pattern_num);
+    uint32 depth_bits = LOUDS_Bit_Width(max_depth);
+    Calc_LOUDS_Layout(state_num, term_num, fail_bits, pattern_bits,
+                      depth_bits, &l);
+
+    bzero(tbl, l.size);
+    tbl->term_num = term_num;
+    tbl->fail_bits = fail_bits;
+    tbl->pattern_bits = pattern_bits;
+    tbl->depth_bits = depth_bits;
+
+    unsigned char* base = (unsigned char*)tbl;
+    LOUDS_Word* louds = (LOUDS_Word*)(void*)(base + l.louds);
+    uint32* select = (uint32*)(void*)(base + l.select);
+    InputTy* labels = base + l.labels;
+    LOUDS_Word* tags = (LOUDS_Word*)(void*)(base + l.tags);
+    uint32* rank = (uint32*)(void*)(base + l.rank);
+    LOUDS_Word* fail = (LOUDS_Word*)(void*)(base + l.fail);
+    LOUDS_Word* pattern = (LOUDS_Word*)(void*)(base + l.pattern);
+    LOUDS_Word* depth = (LOUDS_Word*)(void*)(base + l.depth);
+
+    // Step 1: Root's kids.
+    uint64 pos = 0;
+    for (uint32 c = 0; c < 256; c++) {
+        int kid = Get_Goto(graph, 0, c);
+        if (kid >= 0) {
+            tbl->root_inputs[c / 64] |= (LOUDS_Word)1 << (c % 64);
+            labels[kid] = c;
+            Set_Bit(louds, pos++);
+        }
+    }
+    select[0] = pos++;
+
+    // Step 2: The rest of the states, in the order of their IDs.
+    uint32 term_rank = 0;
+    for (State_ID id = 1; id < state_num; id++) {
+        AC_State* s = Get_State(graph, id);
+        for (uint32 i = 0; i < s->goto_num; i++) {
+            labels[s->first_kid + i] = s->input_vect[i];
+            Set_Bit(louds, pos++);
+        }
+        if (id % LOUDS_SELECT_RATE == 0)
+            select[id / LOUDS_SELECT_RATE] = pos;
+        pos++;
+
+        Set_Bits(fail, (uint64)id * fail_bits, fail_bits, s->fail_link);
+
+        // As the fail-link target has smaller ID, its tags are settled.
+        uint32 tag = 0;
+        if (s->is_term) {
+            tag |= STATE_TERM_TAG;
+            Set_Bits(pattern, (uint64)term_rank * pattern_bits, pattern_bits,
+                     s->is_term - 1);
+            Set_Bits(depth, (uint64)term_rank * depth_bits, depth_bits,
+                     s->depth);
+            term_rank++;
+        }
+        State_ID fl = s->fail_link;
+        if (fl && ((tags[fl / 32] >> (fl % 32 * 2)) & STATE_TAG_MASK))
+            tag |= STATE_OUT_TAG;
+        tags[id / 32] |= (LOUDS_Word)tag << (id % 32 * 2);
+    }
+    ASSERT(pos == 2 * (uint64)state_num - 1 && term_rank == term_num);
+
+    // Step 3: The number of terminal states before every LOUDS_RANK_RATE
+    // words of tags.
+    uint64 tag_words = Word_Num(2 * (uint64)state_num);
+    term_rank = 0;
+    for (uint64 w = 0; w < tag_words; w++) {
+        if (w % LOUDS_RANK_RATE == 0)
+            rank[w / LOUDS_RANK_RATE] = term_rank;
+        term_rank += LOUDS_Popcount(tags[w] & 0x5555555555555555ULL);
+    }
+}
+
+// Like Validate_Buffer(), it's a single pass over the states, checking the
+// properties the matchers rely on:
+//  - the LOUDS has one 0-bit per state and one 1-bit per state but root, and
+//    a state's kids have greater IDs, so each state but root has exactly one
+//    parent, and the labels of the kids are sorted,
+//  - the select and rank samples are right,
+//  - the fail-link points to a state with smaller ID,
+//  - the tags agree with the fail-links, and the pattern index and depth of
+//    a terminal state are within range and right, respectively.
+//
+bool
+Validate_LOUDS_Table(AC_Buffer* buf) {
+    AC_Ofst ofst = buf->louds_ofst;
+    uint32 state_num = buf->state_num;
+    if (state_num == 0 || ofst < sizeof(AC_Buffer) ||
+        ofst % __alignof__(LOUDS_Table) ||
+        (uint64)ofst + sizeof(LOUDS_Table) > Get_Graph_Len(buf)) {
+        return false;
+    }
+
+    LOUDS_Table* tbl = (LOUDS_Table*)((unsigned char*)buf + ofst);
+    uint32 fail_bits = LOUDS_Bit_Width(state_num - 1);
+    if (tbl->term_num >= state_num || tbl->fail_bits != fail_bits ||
+        tbl->pattern_bits != Get_Pattern_Bits(buf->pattern_num) ||
+        tbl->depth_bits == 0 ||
+        tbl->depth_bits > LOUDS_Bit_Width(MAX_PATTERN_LEN) ||
+        tbl->reserved) {
+        return false;
+    }
+
+    LOUDS_Layout l;
+    Calc_LOUDS_Layout(state_num, tbl->term_num, fail_bits, tbl->pattern_bits,
+                      tbl->depth_bits, &l);
+    if ((uint64)ofst + l.size != Get_Graph_Len(buf))
+        return false;
+
+    unsigned char* base = (unsigned char*)tbl;
+    const LOUDS_Word* louds = (LOUDS_Word*)(void*)(base + l.louds);
+    const uint32* select = (uint32*)(void*)(base + l.select);
+    const InputTy* labels = base + l.labels;
+    const uint32* rank = (uint32*)(void*)(base + l.rank);
+    LOUDS_Graph g(buf);
+
+    // Step 1: Check the LOUDS, along with the labels and the select samples.
+    uint64 bit_num = 2 * (uint64)state_num - 1;
+    if (bit_num % 64 && (louds[bit_num / 64] >> (bit_num % 64)))
+        return false;
+
+    vector<uint32> depth_v(state_num, 0);
+    State_ID next_kid = 1;
+    uint64 pos = 0;
+    for (State_ID id = 0; id < state_num; id++) {
+        uint32 kid_num = 0;
+        while (pos < bit_num && Test_Bit(louds, pos)) {
+            pos++;
+            kid_num++;
+        }
+        if (pos >= bit_num)
+            return false;
+
+        if (id % LOUDS_SELECT_RATE == 0 &&
+            select[id / LOUDS_SELECT_RATE] != pos) {
+            return false;
+        }
+        pos++;
+
+        if (kid_num) {
+            if (next_kid <= id || (uint64)next_kid + kid_num > state_num)
+                return false;
+
+            for (uint32 i = 0; i < kid_num; i++) {
+                State_ID kid = next_kid + i;
+                if (i && labels[kid - 1] >= labels[kid])
+                    return false;
+                depth_v[kid] = depth_v[id] + 1;
+            }
+        }
+
+        if (id == 0) {
+            // The bitmap has exactly the labels of root's kids.
+            uint32 input_num = 0;
+            for (uint32 i = 0; i < 4; i++)
+                input_num += LOUDS_Popcount(tbl->root_inputs[i]);
+            if (input_num != kid_num || kid_num != buf->root_goto_num)
+                return false;
+
+            for (State_ID kid = 1; kid <= kid_num; kid++) {
+                InputTy c = labels[kid];
+                if (!((tbl->root_inputs[c / 64] >> (c % 64)) & 1))
+                    return false;
+            }
+        }
+        next_kid += kid_num;
+    }
+    if (next_kid != state_num || pos != bit_num)
+        return false;
+
+    // Step 2: Check the rank samples, and that no tag is beyond the states.
+    const LOUDS_Word* tag_v = (LOUDS_Word*)(void*)(base + l.tags);
+    uint64 tag_bits = 2 * (uint64)state_num;
+    uint64 tag_words = Word_Num(tag_bits);
+    if (tag_bits % 64 && (tag_v[tag_words - 1] >> (tag_bits % 64)))
+        return false;
+
+    uint32 term_rank = 0;
+    for (uint64 w = 0; w < tag_words; w++) {
+        if (w % LOUDS_RANK_RATE == 0 && rank[w / LOUDS_RANK_RATE] != term_rank)
+            return false;
+        term_rank += LOUDS_Popcount(tag_v[w] & 0x5555555555555555ULL);
+    }
+    if (term_rank != tbl->term_num)
+        return false;
+
+    // Step 3: Check the fail-links, the tags and the terminal states. As
+    // the rank samples are right, so is the rank of each terminal state.
+    if (g.Get_Fail(0) != 0 || g.Get_Tags(0) != 0)
+        return false;
+
+    for (State_ID id = 1; id < state_num; id++) {
+        State_ID fl = g.Get_Fail(id);
+        if (fl >= id || (depth_v[id] == 1 && fl != 0))
+            return false;
+
+        uint32 tags = g.Get_Tags(id);
+        uint32 expect = tags & STATE_TERM_TAG;
+        if (fl && g.Get_Tags(fl))
+            expect |= STATE_OUT_TAG;
+        if (tags != expect)
+            return false;
+
+        if ((tags & STATE_TERM_TAG) &&
+            (g.Get_Pattern_Idx(id) >= buf->pattern_num ||
+             g.Get_Depth(id) != depth_v[id])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Same as Match_Tmpl(), except that the graph is the succinct one.
+template<MATCH_VARIANT variant> static ac_result_t
+LOUDS_Match_Tmpl(AC_Buffer* buf, const char* str, uint32 len) {
+    LOUDS_Graph g(buf);
+
+    ac_result_t r = {-1, -1};
+    uint32 idx = 0;
+    State_ID state = 0;
+    for (;;) {
+        if (state == 0) {
+            state = g.Root_Skip(str, len, idx);
+            if (state == 0)
+                break;
+        } else {
+            if (idx >= len)
+                break;
+
+            State_ID kid;
+            if (g.Goto(state, str[idx], kid)) {
+                state = kid;
+                idx++;
+            } else {
+                // Follow the fail-link without consuming the input.
+                state = g.Get_Fail(state);
+                if (state == 0)
+                    continue;
+            }
+        }
+
+        if (unlikely(g.Get_Tags(state) & STATE_TERM_TAG)) {
+            int match_begin = idx - g.Get_Depth(state);
+            int match_end = idx - 1;
+
+            if (variant == MV_FIRST_MATCH || r.match_begin == -1 ||
+                match_end - match_begin > r.match_end - r.match_begin) {
+                r.match_begin = match_begin;
+                r.match_end = match_end;
+                r.pattern_idx = g.Get_Pattern_Idx(state);
+            }
+            if (variant == MV_FIRST_MATCH)
+                return r;
+        }
+    }
+
+    return r;
+}
+
+ac_result_t
+LOUDS_Match(AC_Buffer* buf, const char* str, uint32 len) {
+    return LOUDS_Match_Tmpl<MV_FIRST_MATCH>(buf, str, len);
+}
+
+ac_result_t
+LOUDS_Match_Longest_L(AC_Buffer* buf, const char* str, uint32 len) {
+    return LOUDS_Match_Tmpl<MV_LEFT_LONGEST>(buf, str, len);
+}
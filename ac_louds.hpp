@@ -0,0 +1,308 @@
+#ifndef AC_LOUDS_H
+#define AC_LOUDS_H
+
+#include <vector>
+#include "ac_fast.hpp"
+
+using namespace std;
+
+// The succinct layout of the AC graph, for huge dictionaries where memory
+// matters more than speed. It replaces, rather than accompanies, the states
+// of the graph; the buffer is just the header followed by the LOUDS table.
+//
+// The shape of the trie is encoded with LOUDS (level-order unary degree
+// sequence): visiting the states in the order of their IDs, i.e. in BFS
+// order, a state with "k" kids contributes "k" 1-bits followed by a 0-bit.
+// The j-th 1-bit (0-based) stands for the state with ID j+1. So the block
+// of the state "i" (other than root) starts right after the (i-1)-th 0-bit
+// (0-based), and its first kid has the ID "start - i + 1".
+// Finding the block takes a select over the 0-bits, which is sped up by
+// sampling the position of every LOUDS_SELECT_RATE-th 0-bit.
+//
+// The rest are arrays indiced by state ID:
+//  - labels: the input on which the parent goes to the state. The labels of
+//    the kids of a state are consecutive and sorted.
+//  - tags: two bits per state, STATE_TERM_TAG and STATE_OUT_TAG, along with
+//    the number of terminal states before every LOUDS_RANK_RATE words.
+//  - fail: the fail-links, each taking as many bits as the greatest ID.
+//
+// and the arrays indiced by the rank of the terminal state, i.e. the number
+// of terminal states with smaller ID:
+//  - pattern: the pattern index, in as many bits as the greatest index.
+//  - depth: the depth, in as many bits as the greatest depth.
+//
+// Root's valid inputs are also kept in a bitmap, such that the matcher skips
+// the chars that are not without going through the LOUDS.
+//
+#define LOUDS_SELECT_RATE   64      // 0-bits per select sample
+#define LOUDS_RANK_RATE     4       // words of tags per rank sample
+
+typedef uint64 LOUDS_Word;
+
+typedef struct {
+    uint32 term_num;            // number of terminal states
+    unsigned char fail_bits;    // width of the fail-links
+    unsigned char pattern_bits; // width of the pattern indices
+    unsigned char depth_bits;   // width of the depths
+    unsigned char reserved;
+    LOUDS_Word root_inputs[4];  // bitmap of root's valid inputs
+
+    // Followed by the arrays, each starting at the alignment of LOUDS_Word,
+    // see LOUDS_Layout.
+} LOUDS_Table;
+
+// The offsets of the arrays wrt the table, and its size in byte.
+typedef struct {
+    uint32 louds;       // LOUDS_Word louds[]
+    uint32 select;      // uint32 select[]
+    uint32 labels;      // InputTy labels[state_num]
+    uint32 tags;        // LOUDS_Word tags[]
+    uint32 rank;        // uint32 rank[]
+    uint32 fail;        // LOUDS_Word fail[]
+    uint32 pattern;     // LOUDS_Word pattern[]
+    uint32 depth;       // LOUDS_Word depth[]
+    uint64 size;
+} LOUDS_Layout;
+
+// Return the number of bits needed to represent "v", which is at least 1.
+static inline uint32
+LOUDS_Bit_Width(uint32 v) {
+    return v ? 32 - __builtin_clz(v) : 1;
+}
+
+// Return the word whose k-th byte is the number of 1-bits in the k-th byte
+// of "word".
+static inline LOUDS_Word
+LOUDS_Byte_Popcount(LOUDS_Word word) {
+    word -= (word >> 1) & 0x5555555555555555ULL;
+    word = (word & 0x3333333333333333ULL) +
+           ((word >> 2) & 0x3333333333333333ULL);
+    return (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+}
+
+// Return the number of 1-bits of "word". Unlike __builtin_popcountll(),
+// it doesn't end up with a libgcc call where the POPCNT instruction is not
+// assumed.
+static inline uint32
+LOUDS_Popcount(LOUDS_Word word) {
+    return (LOUDS_Byte_Popcount(word) * 0x0101010101010101ULL) >> 56;
+}
+
+// The position of the i-th 1-bit of the byte "b" is the element [b * 8 + i].
+extern unsigned char louds_select_in_byte[256 * 8];
+
+// Calculate the layout of the table of "state_num" states, of which
+// "term_num" are terminal, with the given widths. Return the size in byte.
+uint64 Calc_LOUDS_Layout(uint64 state_num, uint64 term_num,
+                         uint32 fail_bits, uint32 pattern_bits,
+                         uint32 depth_bits, LOUDS_Layout* layout);
+
+// Return the size in byte of the table of an AC graph of "state_num" states,
+// of which "term_num" are terminal, with "pattern_num" patterns no longer
+// than "max_depth".
+uint64 Calc_LOUDS_Sz(uint64 state_num, uint64 term_num, uint32 pattern_num,
+                     uint32 max_depth);
+
+// Return the size in byte of the table of the well-formed "graph".
+uint64 Calc_LOUDS_Sz(AC_Buffer* graph);
+
+// Populate the table, which is allocated by Calc_LOUDS_Sz(graph) bytes, out
+// of the well-formed "graph".
+void Build_LOUDS_Table(AC_Buffer* graph, LOUDS_Table* tbl);
+
+// Check if the table of the succinct "buf" is well-formed, such that the
+// matchers never go out of the buffer or loop forever.
+bool Validate_LOUDS_Table(AC_Buffer* buf);
+
+// The accessors of the succinct graph, with the same interface as that of
+// the regular one used by Match_All_Tmpl().
+class LOUDS_Graph {
+public:
+    LOUDS_Graph(AC_Buffer* buf) {
+        _tbl = (const LOUDS_Table*)((unsigned char*)buf + buf->louds_ofst);
+        LOUDS_Layout l;
+        Calc_LOUDS_Layout(buf->state_num, _tbl->term_num, _tbl->fail_bits,
+                          _tbl->pattern_bits, _tbl->depth_bits, &l);
+        const unsigned char* base = (const unsigned char*)_tbl;
+        _louds = (const LOUDS_Word*)(const void*)(base + l.louds);
+        _select = (const uint32*)(const void*)(base + l.select);
+        _labels = (const InputTy*)(base + l.labels);
+        _tags = (const LOUDS_Word*)(const void*)(base + l.tags);
+        _rank = (const uint32*)(const void*)(base + l.rank);
+        _fail = (const LOUDS_Word*)(const void*)(base + l.fail);
+        _pattern = (const LOUDS_Word*)(const void*)(base + l.pattern);
+        _depth = (const LOUDS_Word*)(const void*)(base + l.depth);
+    }
+
+    // Skip the chars starting from "idx" that are not valid input of the
+    // root-node. Return the ID of the root's kid reached by the first valid
+    // char (with "idx" pointing right after it), or 0 if the subject string
+    // is exhausted.
+    State_ID Root_Skip(const char* str, uint32 len, uint32& idx) const {
+        while (idx < len) {
+            InputTy c = str[idx++];
+            if (Is_Root_Input(c))
+                return Root_Kid(c);
+        }
+        return 0;
+    }
+
+    // Return true, with "kid" set, if the goto function of the state "id" is
+    // defined for the input "c".
+    bool Goto(State_ID id, InputTy c, State_ID& kid) const {
+        if (id == 0) {
+            if (!Is_Root_Input(c))
+                return false;
+            kid = Root_Kid(c);
+            return true;
+        }
+
+        uint32 start = Select0(id - 1) + 1;
+        uint32 num = Ones_From(start);
+        State_ID first = start - id + 1;
+        const InputTy* labels = _labels + first;
+
+        // Binary search for the wide, and then linear search for the rest.
+        uint32 low = 0, high = num;
+        while (high - low > 8) {
+            uint32 mid = (low + high) >> 1;
+            if (c < labels[mid])
+                high = mid;
+            else
+                low = mid;
+        }
+        for (; low < high; low++) {
+            if (labels[low] == c) {
+                kid = first + low;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    State_ID Get_Fail(State_ID id) const {
+        return Get_Bits(_fail, (uint64)id * _tbl->fail_bits, _tbl->fail_bits);
+    }
+
+    // Return STATE_XXX_TAG of the state.
+    uint32 Get_Tags(State_ID id) const {
+        return (_tags[id / 32] >> (id % 32 * 2)) & STATE_TAG_MASK;
+    }
+
+    // Return the depth and the pattern index of the terminal state "id".
+    uint32 Get_Depth(State_ID id) const {
+        uint32 r = Term_Rank(id);
+        return Get_Bits(_depth, (uint64)r * _tbl->depth_bits,
+                        _tbl->depth_bits);
+    }
+    uint32 Get_Pattern_Idx(State_ID id) const {
+        uint32 r = Term_Rank(id);
+        return Get_Bits(_pattern, (uint64)r * _tbl->pattern_bits,
+                        _tbl->pattern_bits);
+    }
+
+    // Return the number of terminal states with ID less than "id".
+    uint32 Term_Rank(State_ID id) const {
+        // The STATE_TERM_TAG of each state in a word of tags.
+        const LOUDS_Word term_mask = 0x5555555555555555ULL;
+        uint32 w = id / 32;
+        uint32 r = _rank[w / LOUDS_RANK_RATE];
+        for (uint32 i = w - w % LOUDS_RANK_RATE; i < w; i++)
+            r += LOUDS_Popcount(_tags[i] & term_mask);
+
+        LOUDS_Word below = ((LOUDS_Word)1 << (id % 32 * 2)) - 1;
+        return r + LOUDS_Popcount(_tags[w] & term_mask & below);
+    }
+
+    // Return the position of the i-th 0-bit (0-based) of the LOUDS.
+    uint32 Select0(uint32 i) const {
+        uint32 pos = _select[i / LOUDS_SELECT_RATE];
+        uint32 rem = i % LOUDS_SELECT_RATE;
+
+        uint32 w = pos / 64;
+        LOUDS_Word zeros = ~_louds[w] & (~(LOUDS_Word)0 << (pos % 64));
+        for (;;) {
+            uint32 n = LOUDS_Popcount(zeros);
+            if (rem < n)
+                break;
+            rem -= n;
+            zeros = ~_louds[++w];
+        }
+        return w * 64 + Select_In_Word(zeros, rem);
+    }
+
+    // Return the position of the i-th 1-bit (0-based) of "word". It's
+    // branch-free, as the position is hardly predictable: the byte is
+    // found by comparing the running count of each byte against "i" all at
+    // once, and then the bit within the byte is looked up.
+    static uint32 Select_In_Word(LOUDS_Word word, uint32 i) {
+        const LOUDS_Word ones = 0x0101010101010101ULL;
+        const LOUDS_Word highs = 0x8080808080808080ULL;
+
+        // The k-th byte is the number of 1-bits in bytes [0, k].
+        LOUDS_Word cnt = LOUDS_Byte_Popcount(word) * ones;
+
+        // The high bit of the k-th byte tells if the count is no more than
+        // "i", and the bit is in the byte right after the last of them.
+        LOUDS_Word le = ((i * ones | highs) - cnt) & highs;
+        uint32 byte = ((le >> 7) * ones) >> 56;
+        uint32 before = (cnt << 8) >> (byte * 8) & 0xff;
+        uint32 b = (word >> (byte * 8)) & 0xff;
+        return byte * 8 + louds_select_in_byte[b * 8 + i - before];
+    }
+
+    // Return the number of consecutive 1-bits starting from "pos".
+    uint32 Ones_From(uint32 pos) const {
+        uint32 w = pos / 64;
+        LOUDS_Word zeros = ~_louds[w] >> (pos % 64);
+        if (likely(zeros))
+            return __builtin_ctzll(zeros);
+
+        uint32 n = 64 - pos % 64;
+        while (!(zeros = ~_louds[++w]))
+            n += 64;
+        return n + __builtin_ctzll(zeros);
+    }
+
+    // Read the "width"-bit element at bit "pos" of the packed array, which
+    // has one extra word at the end.
+    static uint32 Get_Bits(const LOUDS_Word* v, uint64 pos, uint32 width) {
+        uint64 w = pos / 64;
+        uint32 shift = pos % 64;
+        LOUDS_Word bits = v[w] >> shift;
+        if (shift + width > 64)
+            bits |= v[w + 1] << (64 - shift);
+        return bits & (((LOUDS_Word)1 << width) - 1);
+    }
+
+private:
+    bool Is_Root_Input(InputTy c) const {
+        return (_tbl->root_inputs[c / 64] >> (c % 64)) & 1;
+    }
+
+    // The root's kids are numbered in the order of their inputs.
+    State_ID Root_Kid(InputTy c) const {
+        const LOUDS_Word* m = _tbl->root_inputs;
+        LOUDS_Word below = ((LOUDS_Word)1 << (c % 64)) - 1;
+        uint32 n = LOUDS_Popcount(m[c / 64] & below);
+        for (uint32 i = 0; i < c / 64; i++)
+            n += LOUDS_Popcount(m[i]);
+        return n + 1;
+    }
+
+    const LOUDS_Table* _tbl;
+    const LOUDS_Word* _louds;
+    const uint32* _select;
+    const InputTy* _labels;
+    const LOUDS_Word* _tags;
+    const uint32* _rank;
+    const LOUDS_Word* _fail;
+    const LOUDS_Word* _pattern;
+    const LOUDS_Word* _depth;
+};
+
+ac_result_t LOUDS_Match(AC_Buffer* buf, const char* str, uint32 len);
+ac_result_t LOUDS_Match_Longest_L(AC_Buffer* buf, const char* str,
+                                  uint32 len);
+
+#endif  // AC_LOUDS_H
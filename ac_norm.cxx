@@ -0,0 +1,219 @@
+// The input normalization of ac_norm_match_all().
+//
+#include <string.h>
+#include "ac_norm.hpp"
+#include "ac.h"
+
+static inline int
+Hex_Val(unsigned char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static inline bool
+Is_Space(unsigned char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline bool
+Is_Entity_Char(unsigned char c) {
+    return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') ||
+           c == '#';
+}
+
+// Return the byte the entity "q[0, num)" stands for, or -1 if it's not an
+// entity, or it stands for a code point beyond a byte.
+static int
+Decode_Entity(const Norm_Byte* q, uint32 num) {
+    if (num < 3 || q[num - 1].c != ';')
+        return -1;
+
+    char name[NORM_ENTITY_MAX];
+    uint32 len = num - 2;
+    for (uint32 i = 0; i < len; i++)
+        name[i] = q[i + 1].c;
+
+    if (name[0] == '#') {
+        uint32 i = 1, base = 10;
+        if (len > 1 && (name[1] | 0x20) == 'x') {
+            i = 2;
+            base = 16;
+        }
+        if (i == len)
+            return -1;
+
+        uint32 v = 0;
+        for (; i < len; i++) {
+            int d = Hex_Val(name[i]);
+            if (d < 0 || d >= (int)base)
+                return -1;
+            v = v * base + d;
+        }
+        return v < 256 ? (int)v : -1;
+    }
+
+    static const struct {
+        const char* name;
+        uint32 len;
+        unsigned char c;
+    } named[] = {
+        { "lt", 2, '<' }, { "gt", 2, '>' }, { "amp", 3, '&' },
+        { "quot", 4, '"' }, { "apos", 4, '\'' }, { "nbsp", 4, 0xa0 },
+    };
+    for (uint32 i = 0; i < sizeof(named) / sizeof(named[0]); i++) {
+        if (len == named[i].len && !memcmp(name, named[i].name, len))
+            return named[i].c;
+    }
+    return -1;
+}
+
+void
+AC_Normalizer::Alloc() {
+    if (!_chunk) {
+        _chunk = new char[NORM_CHUNK_LEN];
+        _ends = new uint32[NORM_RING_LEN];
+    }
+}
+
+void
+AC_Normalizer::Start(uint32 flags) {
+    ASSERT(_chunk);
+    _flags = flags;
+    _raw_pos = 0;
+    _q_num = 0;
+    _held = false;
+    _chunk_base = 0;
+    _chunk_len = 0;
+}
+
+// "%XX" stands for the byte of hex "XX", and '+' for a space; a '%' not
+// followed by two hex digits stands for itself.
+bool
+AC_Normalizer::Pull_URL(const char* str, uint32 len, Norm_Byte* b) {
+    if (_raw_pos >= len)
+        return false;
+
+    unsigned char c = str[_raw_pos];
+    if (_flags & AC_NORM_URL_DECODE) {
+        if (c == '+') {
+            c = ' ';
+        } else if (c == '%' && len - _raw_pos > 2) {
+            int hi = Hex_Val(str[_raw_pos + 1]);
+            int lo = Hex_Val(str[_raw_pos + 2]);
+            if (hi >= 0 && lo >= 0) {
+                c = hi * 16 + lo;
+                _raw_pos += 2;
+            }
+        }
+    }
+    b->c = c;
+    b->raw_end = _raw_pos++;
+    return true;
+}
+
+// The entities are decoded only if they are terminated by ';', and the
+// numeric ones only if they stand for a byte. Otherwise, the '&' stands for
+// itself, and the bytes looked ahead are yielded as they are, any of which
+// may begin an entity in turn.
+bool
+AC_Normalizer::Pull_HTML(const char* str, uint32 len, Norm_Byte* b) {
+    if (!(_flags & AC_NORM_HTML_DECODE))
+        return Pull_URL(str, len, b);
+
+    if (!_q_num) {
+        if (!Pull_URL(str, len, &_q[0]))
+            return false;
+        _q_num = 1;
+    }
+
+    if (_q[0].c == '&') {
+        // Look ahead until the ';', or a byte no entity has.
+        while (_q_num < NORM_ENTITY_MAX &&
+               (_q_num == 1 || Is_Entity_Char(_q[_q_num - 1].c)) &&
+               Pull_URL(str, len, &_q[_q_num])) {
+            _q_num++;
+        }
+
+        int c = Decode_Entity(_q, _q_num);
+        if (c >= 0) {
+            b->c = c;
+            b->raw_end = _q[_q_num - 1].raw_end;
+            _q_num = 0;
+            return true;
+        }
+    }
+
+    *b = _q[0];
+    _q_num--;
+    memmove(_q, _q + 1, _q_num * sizeof(_q[0]));
+    return true;
+}
+
+bool
+AC_Normalizer::Pull_Fold(const char* str, uint32 len, Norm_Byte* b) {
+    if (!Pull_HTML(str, len, b))
+        return false;
+
+    if ((_flags & AC_NORM_CASE_FOLD) && b->c >= 'A' && b->c <= 'Z')
+        b->c |= 0x20;
+    return true;
+}
+
+// A run of whitespaces stands for one space.
+bool
+AC_Normalizer::Pull_Space(const char* str, uint32 len, Norm_Byte* b) {
+    if (_held) {
+        *b = _held_byte;
+        _held = false;
+    } else if (!Pull_Fold(str, len, b)) {
+        return false;
+    }
+
+    if ((_flags & AC_NORM_WS_COLLAPSE) && Is_Space(b->c)) {
+        b->c = ' ';
+        Norm_Byte next;
+        while (Pull_Fold(str, len, &next)) {
+            if (!Is_Space(next.c)) {
+                _held_byte = next;
+                _held = true;
+                break;
+            }
+            b->raw_end = next.raw_end;
+        }
+    }
+    return true;
+}
+
+uint32
+AC_Normalizer::Next_Chunk(const char* str, uint32 len) {
+    _chunk_base += _chunk_len;
+
+    uint32 n = 0;
+    if (!(_flags & (AC_NORM_URL_DECODE | AC_NORM_HTML_DECODE |
+                    AC_NORM_WS_COLLAPSE))) {
+        // One raw byte for one normalized byte.
+        n = len - _raw_pos < NORM_CHUNK_LEN ? len - _raw_pos : NORM_CHUNK_LEN;
+        for (uint32 i = 0; i < n; i++) {
+            unsigned char c = str[_raw_pos + i];
+            if ((_flags & AC_NORM_CASE_FOLD) && c >= 'A' && c <= 'Z')
+                c |= 0x20;
+            _chunk[i] = c;
+            _ends[(_chunk_base + i) & (NORM_RING_LEN - 1)] = _raw_pos + i;
+        }
+        _raw_pos += n;
+    } else {
+        Norm_Byte b;
+        while (n < NORM_CHUNK_LEN && Pull_Space(str, len, &b)) {
+            _chunk[n] = b.c;
+            _ends[(_chunk_base + n) & (NORM_RING_LEN - 1)] = b.raw_end;
+            n++;
+        }
+    }
+
+    _chunk_len = n;
+    return n;
+}
@@ -0,0 +1,103 @@
+#ifndef AC_NORM_H
+#define AC_NORM_H
+
+#include "ac_fast.hpp"
+
+// The normalized string is produced in chunks of this many bytes, each of
+// which is matched right after it's produced, while it's still in cache.
+#define NORM_CHUNK_LEN  4096
+
+// The raw offsets of the last this many normalized bytes are kept, which is
+// enough for the matches ending in the current chunk, as a match is no longer
+// than MAX_PATTERN_LEN. Must be a power of 2.
+#define NORM_RING_LEN   65536
+
+// The longest entity decoded, e.g. "&#x0003c;".
+#define NORM_ENTITY_MAX 10
+
+// A normalized byte, and the offset of the last raw byte it's made of. The
+// raw bytes of the consecutive normalized bytes are consecutive, so the first
+// raw byte of one is right after the last one of its predecessor.
+typedef struct {
+    unsigned char c;
+    uint32 raw_end;
+} Norm_Byte;
+
+// The chain of the transforms of ac_norm_match_all(), fused into one pass
+// over the raw string. Each transform pulls the bytes from the previous one,
+// looking ahead no more than a few bytes, such that the string is normalized
+// as a stream, and the chunks are where they are for no other reason than
+// the buffer being full.
+//
+class AC_Normalizer {
+public:
+    AC_Normalizer() : _chunk(0), _ends(0) {}
+    ~AC_Normalizer() {
+        delete[] _chunk;
+        delete[] _ends;
+    }
+
+    // Allocate the chunk and the raw offsets, which must be done before
+    // anything is normalized.
+    void Alloc();
+    bool Is_Alloc() const { return _chunk != 0; }
+
+    // Start normalizing a string with the transforms "flags", the
+    // bitwise-or of AC_NORM_XXX.
+    void Start(uint32 flags);
+
+    // Normalize the next chunk of the "len"-byte raw string "str", which
+    // must be the same for all the chunks of it. Return the length of the
+    // chunk, which is zero only if the string is done.
+    uint32 Next_Chunk(const char* str, uint32 len);
+
+    bool Is_Done(uint32 len) const {
+        return _raw_pos >= len && !_q_num && !_held;
+    }
+
+    const char* Get_Chunk() const { return _chunk; }
+    uint32 Get_Chunk_Len() const { return _chunk_len; }
+
+    // The normalized offset of the beginning of the current chunk.
+    uint32 Get_Chunk_Base() const { return _chunk_base; }
+
+    // Return the offset of the first and the last raw byte, respectively,
+    // of the normalized byte at "ofst", which is in the current chunk or
+    // no more than MAX_PATTERN_LEN bytes before it. Get_Raw_Begin() also
+    // takes the end of the current chunk, where the raw string resumes.
+    uint32 Get_Raw_Begin(uint32 ofst) const {
+        return ofst ? _ends[(ofst - 1) & (NORM_RING_LEN - 1)] + 1 : 0;
+    }
+    uint32 Get_Raw_End(uint32 ofst) const {
+        return _ends[ofst & (NORM_RING_LEN - 1)];
+    }
+
+private:
+    // The transforms, in the order they apply, each of which yields the
+    // next byte, or returns false if the string is done.
+    bool Pull_URL(const char* str, uint32 len, Norm_Byte* b);
+    bool Pull_HTML(const char* str, uint32 len, Norm_Byte* b);
+    bool Pull_Fold(const char* str, uint32 len, Norm_Byte* b);
+    bool Pull_Space(const char* str, uint32 len, Norm_Byte* b);
+
+    uint32 _flags;
+    uint32 _raw_pos;        // The raw bytes before it are consumed.
+
+    // The bytes looked ahead by the HTML entity decoding.
+    Norm_Byte _q[NORM_ENTITY_MAX];
+    uint32 _q_num;
+
+    // The byte ending a run of whitespaces, looked ahead by the collapsing.
+    Norm_Byte _held_byte;
+    bool _held;
+
+    char* _chunk;
+    uint32 _chunk_base;
+    uint32 _chunk_len;
+
+    // The raw end offsets of the normalized bytes, indexed by their
+    // normalized offsets modulo NORM_RING_LEN.
+    uint32* _ends;
+};
+
+#endif // AC_NORM_H
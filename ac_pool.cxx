@@ -0,0 +1,287 @@
+// Multi-tenant pool, see ac_pool_create().
+//
+#include <sys/mman.h>   // for munmap
+#include <string.h>
+#include <vector>
+#include "ac_slow.hpp"
+#include "ac_fast.hpp"
+#include "ac_cache.hpp"
+#include "ac_warm.hpp"
+#include "ac_telemetry.hpp"
+#include "ac.h"
+
+using namespace std;
+
+// The pool is laid-out as following:
+//
+//   1. The pool header. (i.e. the AC_Pool_Header content)
+//   2. The offset of each tenant's graph wrt the base address of the pool.
+//   3. The graphs, in the order of the tenants, each aligned to POOL_ALIGN,
+//      with zeroed padding in between.
+//
+// Each graph is a position-independent AC_Buffer on its own, hence a tenant
+// is used in place, and so is the pool as a whole.
+//
+#define POOL_ALIGN  8
+
+typedef struct {
+    buf_header_t hdr;         // IMPL_POOL_VARIANT
+    uint16 layout_version;    // AC_LAYOUT_VERSION
+    uint32 pool_len;
+    uint32 tenant_num;
+    uint32 pattern_num;       // total of all tenants
+
+    // Followed by:
+    //  AC_Ofst tenant_ofst[tenant_num];
+    //  the graphs.
+} AC_Pool_Header;
+
+static inline uint64
+Pool_Align(uint64 ofst) {
+    return (ofst + POOL_ALIGN - 1) & ~(uint64)(POOL_ALIGN - 1);
+}
+
+// Clear the runtime fields of the tenants (see Clear_Runtime_Fields()), which
+// are set by ac_warm(). Return true if any tenant is locked.
+static bool
+Clear_Tenants(AC_Pool_Header* hdr) {
+    const AC_Ofst* ofst_v = (const AC_Ofst*)(const void*)(hdr + 1);
+    bool locked = false;
+    for (uint32 i = 0; i < hdr->tenant_num; i++) {
+        AC_Buffer* buf = (AC_Buffer*)(void*)((unsigned char*)hdr + ofst_v[i]);
+        if (buf->flags & BUF_LOCKED)
+            locked = true;
+        Clear_Runtime_Fields(buf);
+    }
+    return locked;
+}
+
+namespace {
+// Allocate the buffer at the end of the arena being built. The buffer is
+// part of the arena, so it doesn't outlive the arena's next growth.
+class Arena_Alloc : public Buf_Allocator {
+public:
+    Arena_Alloc(vector<unsigned char>& arena) : _arena(arena), _ofst(0) {}
+
+    virtual AC_Buffer* alloc(int sz) {
+        _ofst = Pool_Align(_arena.size());
+        _arena.resize(_ofst + sz);
+        return (AC_Buffer*)(void*)&_arena[_ofst];
+    }
+
+    uint64 Get_Ofst() const { return _ofst; }
+
+private:
+    vector<unsigned char>& _arena;
+    uint64 _ofst;
+};
+
+class AC_Pool {
+public:
+    AC_Pool(AC_Pool_Header* hdr, bool mapped) : _hdr(hdr), _mapped(mapped) {}
+    ~AC_Pool() {
+        for (uint32 i = 0; i < _hdr->tenant_num; i++)
+            Free_Telemetry(Get_Tenant(i));
+
+        // Unmapping unlocks the pages as well, if any tenant is locked.
+        if (_mapped) {
+            munmap(_hdr, _hdr->pool_len);
+        } else {
+            if (Clear_Tenants(_hdr))
+                Unlock_Pages(_hdr, _hdr->pool_len);
+            delete[] (unsigned char*)(void*)_hdr;
+        }
+    }
+
+    AC_Pool_Header* Get_Header() const { return _hdr; }
+
+    AC_Buffer* Get_Tenant(uint32 tenant) const {
+        if (tenant >= _hdr->tenant_num)
+            return 0;
+
+        const AC_Ofst* ofst_v = (const AC_Ofst*)(const void*)(_hdr + 1);
+        return (AC_Buffer*)(void*)((unsigned char*)_hdr + ofst_v[tenant]);
+    }
+
+private:
+    AC_Pool_Header* _hdr;
+    bool _mapped;
+};
+} // end of anonymous namespace
+
+// Check if the "len"-byte pool, which may come from an untrusted source, is
+// well-formed: the graphs are back to back as laid-out by ac_pool_create(),
+// and each of them is marked BUF_POOLED and passes Validate_Buffer().
+static bool
+Validate_Pool(AC_Pool_Header* hdr, uint32 len, bool trust_verdict) {
+    if (len < sizeof(AC_Pool_Header) || len % POOL_ALIGN ||
+        hdr->pool_len != len || hdr->hdr.magic_num != AC_MAGIC_NUM ||
+        hdr->hdr.impl_variant != IMPL_POOL_VARIANT ||
+        hdr->layout_version != AC_LAYOUT_VERSION) {
+        return false;
+    }
+
+    uint64 ofst = sizeof(AC_Pool_Header) +
+                  (uint64)hdr->tenant_num * sizeof(AC_Ofst);
+    if (ofst > len)
+        return false;
+
+    unsigned char* base = (unsigned char*)(void*)hdr;
+    const AC_Ofst* ofst_v = (const AC_Ofst*)(const void*)(hdr + 1);
+    uint64 pattern_num = 0;
+    for (uint32 i = 0; i <= hdr->tenant_num; i++) {
+        uint64 start = Pool_Align(ofst);
+        for (; ofst < start; ofst++) {
+            if (base[ofst])
+                return false;
+        }
+        if (i == hdr->tenant_num)
+            break;
+
+        if (ofst_v[i] != start || start + sizeof(AC_Buffer) > len)
+            return false;
+
+        AC_Buffer* buf = (AC_Buffer*)(void*)(base + start);
+        uint32 buf_len = buf->buf_len;
+        if (start + buf_len > len)
+            return false;
+
+        Clear_Runtime_Fields(buf);
+        if (!(buf->flags & BUF_POOLED) ||
+            !Validate_Buffer(buf, buf_len, trust_verdict)) {
+            return false;
+        }
+
+        pattern_num += buf->pattern_num;
+        ofst = start + buf_len;
+    }
+
+    return ofst == len && pattern_num == hdr->pattern_num;
+}
+
+extern "C" ac_pool_t*
+ac_pool_create(const ac_dict_t* dict_v, unsigned int dict_num,
+               const ac_opt_t* opt) {
+    // Neither the verification, the cache, nor the lazy graph applies to the
+    // tenants.
+    ac_opt_t tenant_opt;
+    memset(&tenant_opt, 0, sizeof(tenant_opt));
+    tenant_opt.flags = opt ? opt->flags & ~AC_OPT_LAZY : 0;
+
+    uint64 index_end = sizeof(AC_Pool_Header) +
+                       (uint64)dict_num * sizeof(AC_Ofst);
+    if (index_end > (uint32)-1)
+        return 0;
+
+    // The graphs are converted right into the arena, which is copied once
+    // its size is known.
+    vector<unsigned char> arena(index_end, 0);
+    vector<AC_Ofst> ofst_v(dict_num);
+    uint32 pattern_num = 0;
+    for (uint32 i = 0; i < dict_num; i++) {
+        const ac_dict_t& d = dict_v[i];
+        if (d.pattern_num > MAX_PATTERN_NUM)
+            return 0;
+
+        ACS_Constructor acc;
+        acc.Construct(d.pattern_v, d.pattern_len_v, d.pattern_num);
+
+        Arena_Alloc ba(arena);
+        AC_Converter cvt(acc, ba, &tenant_opt);
+        cvt.Convert();
+        if (Pool_Align(arena.size()) > (uint32)-1)
+            return 0;
+
+        // Marked in the arena, such that ac_free() leaves the tenant alone,
+        // and nothing is written to the pool once it's mapped.
+        ofst_v[i] = ba.Get_Ofst();
+        ((AC_Buffer*)(void*)&arena[ofst_v[i]])->flags |= BUF_POOLED;
+        pattern_num += d.pattern_num;
+    }
+    arena.resize(Pool_Align(arena.size()), 0);
+
+    uint32 len = arena.size();
+    unsigned char* base = new unsigned char[len];
+    memcpy(base, &arena[0], len);
+
+    AC_Pool_Header* hdr = (AC_Pool_Header*)(void*)base;
+    hdr->hdr.magic_num = AC_MAGIC_NUM;
+    hdr->hdr.impl_variant = IMPL_POOL_VARIANT;
+    hdr->layout_version = AC_LAYOUT_VERSION;
+    hdr->pool_len = len;
+    hdr->tenant_num = dict_num;
+    hdr->pattern_num = pattern_num;
+    if (dict_num)
+        memcpy(hdr + 1, &ofst_v[0], dict_num * sizeof(AC_Ofst));
+
+    ASSERT(Validate_Pool(hdr, len, false));
+    return (ac_pool_t*)(void*)(new AC_Pool(hdr, false));
+}
+
+extern "C" ac_t*
+ac_pool_get(ac_pool_t* pool, unsigned int tenant) {
+    return (ac_t*)(void*)((AC_Pool*)(void*)pool)->Get_Tenant(tenant);
+}
+
+extern "C" void
+ac_pool_get_stat(ac_pool_t* pool, ac_pool_stat_t* stat) {
+    AC_Pool_Header* hdr = ((AC_Pool*)(void*)pool)->Get_Header();
+    stat->tenant_num = hdr->tenant_num;
+    stat->pattern_num = hdr->pattern_num;
+    stat->size = hdr->pool_len;
+}
+
+extern "C" unsigned int
+ac_pool_serialize(ac_pool_t* pool, void* blob, unsigned int cap) {
+    AC_Pool_Header* hdr = ((AC_Pool*)(void*)pool)->Get_Header();
+    uint32 len = hdr->pool_len;
+    if (cap >= len) {
+        memcpy(blob, hdr, len);
+        Clear_Tenants((AC_Pool_Header*)blob);
+    }
+    return len;
+}
+
+extern "C" ac_pool_t*
+ac_pool_load(const void* blob, unsigned int len, unsigned int flags) {
+    if (len < sizeof(AC_Pool_Header))
+        return 0;
+
+    unsigned char* base = new unsigned char[len];
+    memcpy(base, blob, len);
+
+    AC_Pool_Header* hdr = (AC_Pool_Header*)(void*)base;
+    if (!Validate_Pool(hdr, len, flags & AC_LOAD_TRUSTED)) {
+        delete[] base;
+        return 0;
+    }
+    return (ac_pool_t*)(void*)(new AC_Pool(hdr, false));
+}
+
+extern "C" int
+ac_pool_save(ac_pool_t* pool, const char* path) {
+    AC_Pool_Header* hdr = ((AC_Pool*)(void*)pool)->Get_Header();
+    vector<unsigned char> blob(hdr->pool_len);
+    ac_pool_serialize(pool, &blob[0], blob.size());
+    return Write_File(path, &blob[0], blob.size()) ? 0 : -1;
+}
+
+extern "C" ac_pool_t*
+ac_pool_map(const char* path, unsigned int flags) {
+    uint32 len;
+    void* p = Map_File(path, sizeof(AC_Pool_Header), &len);
+    if (!p)
+        return 0;
+
+    AC_Pool_Header* hdr = (AC_Pool_Header*)p;
+    if (!Validate_Pool(hdr, len, flags & AC_LOAD_TRUSTED)) {
+        munmap(p, len);
+        return 0;
+    }
+    return (ac_pool_t*)(void*)(new AC_Pool(hdr, true));
+}
+
+extern "C" void
+ac_pool_free(ac_pool_t* pool) {
+    delete (AC_Pool*)(void*)pool;
+}
@@ -0,0 +1,155 @@
+#include <string.h>     // for memcmp
+#include <strings.h>    // for bzero
+#include <vector>
+#include "ac_slow.hpp"
+#include "ac_qgram.hpp"
+
+uint32
+QGram_Hash_Bits(uint64 window_num, uint32 window) {
+    uint64 gram_num = window_num * (window - QGRAM_Q + 1);
+    uint32 hash_bits = QGRAM_HASH_BITS_MIN;
+    while (hash_bits < QGRAM_HASH_BITS_MAX &&
+           ((uint64)1 << hash_bits) < gram_num * QGRAM_LOAD_INV) {
+        hash_bits++;
+    }
+    return hash_bits;
+}
+
+bool
+Calc_QGram_Shape(AC_Buffer* graph, uint32* window, uint32* hash_bits) {
+    uint32 state_num = graph->state_num;
+    uint32 min_len = 0;
+    for (State_ID id = 1; id < state_num; id++) {
+        AC_State* s = Get_State(graph, id);
+        if (s->is_term && (!min_len || (uint32)s->depth < min_len))
+            min_len = s->depth;
+    }
+    if (min_len < QGRAM_MIN_LEN)
+        return false;
+
+    // Each state of the depth stands for a distinct window.
+    uint32 w = min_len < QGRAM_WINDOW_MAX ? min_len : QGRAM_WINDOW_MAX;
+    uint64 window_num = 0;
+    for (State_ID id = 1; id < state_num; id++)
+        window_num += (Get_State(graph, id)->depth == (int)w) ? 1 : 0;
+
+    *window = w;
+    *hash_bits = QGram_Hash_Bits(window_num, w);
+    return true;
+}
+
+void
+Build_QGram_Table(AC_Buffer* graph, QGram_Table* tbl) {
+    uint32 w, hash_bits;
+    bool ok = Calc_QGram_Shape(graph, &w, &hash_bits);
+    ASSERT(ok);
+    (void)ok;
+
+    bzero(tbl, QGram_Table_Sz(hash_bits));
+    tbl->window = w;
+    tbl->hash_bits = hash_bits;
+    uint64* bits = (uint64*)(void*)(tbl + 1);
+
+    // The parent of each state, and the input leading to it, from which
+    // the windows are spelled out.
+    uint32 state_num = graph->state_num;
+    vector<State_ID> parent(state_num, 0);
+    vector<InputTy> input(state_num, 0);
+    for (uint32 c = 0; c < 256; c++) {
+        int kid = Get_Goto(graph, 0, c);
+        if (kid >= 0)
+            input[kid] = c;
+    }
+    for (State_ID id = 1; id < state_num; id++) {
+        AC_State* s = Get_State(graph, id);
+        for (uint32 i = 0; i < s->goto_num; i++) {
+            parent[s->first_kid + i] = id;
+            input[s->first_kid + i] = s->input_vect[i];
+        }
+    }
+
+    char win[QGRAM_WINDOW_MAX];
+    for (State_ID id = 1; id < state_num; id++) {
+        if (Get_State(graph, id)->depth != (int)w)
+            continue;
+
+        State_ID cur = id;
+        for (uint32 i = w; i > 0; i--) {
+            win[i - 1] = input[cur];
+            cur = parent[cur];
+        }
+        for (uint32 i = 0; i + QGRAM_Q <= w; i++) {
+            uint32 h = QGram_Hash(win + i, hash_bits);
+            bits[h / 64] |= (uint64)1 << (h % 64);
+        }
+    }
+}
+
+bool
+Validate_QGram_Table(AC_Buffer* buf) {
+    AC_Ofst ofst = buf->qgram_ofst;
+    if (ofst < buf->first_state_ofst || ofst % __alignof__(uint64) ||
+        (uint64)ofst + sizeof(QGram_Table) > Get_Graph_Len(buf)) {
+        return false;
+    }
+
+    uint32 w, hash_bits;
+    if (!Calc_QGram_Shape(buf, &w, &hash_bits))
+        return false;
+
+    uint64 sz = QGram_Table_Sz(hash_bits);
+    if ((uint64)ofst + sz != Get_Graph_Len(buf))
+        return false;
+
+    // Build the table again, and compare.
+    vector<uint64> tmp((sz + sizeof(uint64) - 1) / sizeof(uint64));
+    QGram_Table* tmp_tbl = (QGram_Table*)(void*)&tmp[0];
+    Build_QGram_Table(buf, tmp_tbl);
+    return !memcmp(tmp_tbl, (unsigned char*)buf + ofst, sz);
+}
+
+AC_Buffer*
+AC_Converter::Convert_QGram() {
+    if ((_opt_flags & (AC_OPT_QGRAM_FILTER | AC_OPT_SUCCINCT |
+                       AC_OPT_DOUBLE_ARRAY)) != AC_OPT_QGRAM_FILTER) {
+        return 0;
+    }
+
+    // Step 1: Check the patterns are long enough before converting anything.
+    // The empty ones match nothing.
+    for (uint32 i = 0, e = _acs.Get_Pattern_Num(); i < e; i++) {
+        uint32 len = _acs.get_ith_Pattern_Len(i);
+        if (len && len < QGRAM_MIN_LEN)
+            return 0;
+    }
+
+    // Step 2: Convert the regular graph, with no tables of its own, and
+    // append the table to it.
+    ac_opt_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.flags = (_opt_flags & AC_OPT_THREADED) | AC_OPT_NO_SHENG |
+                AC_OPT_NO_STRIDE2 | AC_OPT_NO_COMPACT;
+    Heap_Buf_Alloc tmp;
+    AC_Converter cvt(_acs, tmp, &opt);
+    AC_Buffer* graph = cvt.Convert();
+
+    uint32 window, hash_bits;
+    if (!Calc_QGram_Shape(graph, &window, &hash_bits))
+        return 0;
+
+    uint32 graph_sz = graph->buf_len;
+    AC_Ofst ofst = QGram_Table_Ofst(graph_sz);
+    uint32 sz = ofst + QGram_Table_Sz(hash_bits);
+    AC_Buffer* buf = _buf_alloc.alloc(sz);
+    memcpy(buf, graph, graph_sz);
+    bzero((unsigned char*)buf + graph_sz, ofst - graph_sz);
+
+    buf->buf_len = sz;
+    buf->qgram_ofst = ofst;
+    buf->flags = (graph->flags & ~BUF_VALIDATED) | BUF_QGRAM;
+    Build_QGram_Table(buf, (QGram_Table*)((unsigned char*)buf + ofst));
+
+    ASSERT(Validate_Buffer(buf, buf->buf_len, false));
+    buf->flags |= BUF_VALIDATED;
+    return buf;
+}
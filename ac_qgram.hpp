@@ -0,0 +1,104 @@
+#ifndef AC_QGRAM_H
+#define AC_QGRAM_H
+
+#include "ac_fast.hpp"
+
+// The q-gram prefilter, in the style of Wu-Manber, for dictionaries of long
+// patterns (none shorter than QGRAM_MIN_LEN) whose first bytes are so diverse
+// that nearly every char is a valid input of root, and the skip loop of the
+// matcher never skips.
+//
+// Let "w" be the length of the shortest pattern, capped at QGRAM_WINDOW_MAX,
+// and call the first "w" bytes of a pattern its window. Wherever a pattern
+// begins, its window is there, and so is each of the q-grams of the window.
+// The filter is a bitset of the hashes of the q-grams of all the windows.
+//
+// At root, the matcher looks up the q-grams at "w - q" bytes after the
+// current offset, and then every "w - q + 1" bytes. The "w - q + 1" offsets
+// up to and including "w - q" bytes before a q-gram are exactly those of the
+// windows covering it, so if it's not in the bitset, none of them begins a
+// window, let alone a pattern. Such offsets are skipped in one go, before
+// the usual skip over the chars not being valid input of root.
+//
+// Skipping the offsets no pattern begins at is invisible. The states the
+// matcher would go through, beginning at these offsets, are no deeper than
+// "w - 1", and are not terminal; neither are the states on their fail-link
+// chains. So the terminal states Match_Tmpl() visits are exactly the same
+// (see the comment of ac_composite.hpp about which ones it visits).
+//
+#define QGRAM_Q             4
+#define QGRAM_MIN_LEN       8
+#define QGRAM_WINDOW_MAX    16
+
+// The bitset is sized for no more than one in QGRAM_LOAD_INV bits to be set,
+// within the range below.
+#define QGRAM_LOAD_INV      8
+#define QGRAM_HASH_BITS_MIN 10
+#define QGRAM_HASH_BITS_MAX 20
+
+typedef struct {
+    uint32 window;      // The length of the windows.
+    uint32 hash_bits;   // The bitset has "1 << hash_bits" bits.
+
+    // Followed by:
+    //  uint64 bits[(1 << hash_bits) / 64];
+} QGram_Table;
+
+// Return the offset of the table following the regular graph of "graph_sz"
+// bytes, such that the bitset is aligned.
+static inline uint64
+QGram_Table_Ofst(uint64 graph_sz) {
+    uint64 align = __alignof__(uint64);
+    return (graph_sz + align - 1) & ~(align - 1);
+}
+
+// Return the size of the table whose bitset has "1 << hash_bits" bits.
+static inline uint64
+QGram_Table_Sz(uint32 hash_bits) {
+    return sizeof(QGram_Table) + ((uint64)1 << hash_bits) / 8;
+}
+
+// Return the "hash_bits" of the table of "window_num" distinct windows of
+// "window" bytes.
+uint32 QGram_Hash_Bits(uint64 window_num, uint32 window);
+
+static inline uint32
+QGram_Hash(const char* p, uint32 hash_bits) {
+    uint32 v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 0x9e3779b1u) >> (32 - hash_bits);
+}
+
+// Return the first offset from "idx" at which a window may begin, or past
+// which it's not known, as the windows would go beyond "end".
+static inline uint32
+QGram_Skip(const QGram_Table* tbl, const char* str, uint32 end, uint32 idx) {
+    const uint64* bits = (const uint64*)(const void*)(tbl + 1);
+    uint32 hash_bits = tbl->hash_bits;
+    uint32 lead = tbl->window - QGRAM_Q;
+
+    uint64 pos = (uint64)idx + lead;
+    while (pos + QGRAM_Q <= end) {
+        uint32 h = QGram_Hash(str + pos, hash_bits);
+        if (bits[h / 64] & ((uint64)1 << (h % 64)))
+            break;
+        pos += lead + 1;
+    }
+    return pos - lead;
+}
+
+// Figure out the window and the "hash_bits" of the table of the regular
+// "graph". Return false if the filter doesn't apply, i.e. the graph has some
+// pattern shorter than QGRAM_MIN_LEN, or none at all.
+bool Calc_QGram_Shape(AC_Buffer* graph, uint32* window, uint32* hash_bits);
+
+// Populate the table of the regular "graph", with the shape figured out by
+// Calc_QGram_Shape(). The table is zeroed before populated, such that
+// identical graphs yield byte-identical tables.
+void Build_QGram_Table(AC_Buffer* graph, QGram_Table* tbl);
+
+// Check if the table of "buf" is exactly what Build_QGram_Table() would
+// produce; the rest of the buffer must be already validated.
+bool Validate_QGram_Table(AC_Buffer* buf);
+
+#endif  // AC_QGRAM_H
@@ -0,0 +1,447 @@
+// Hot-reload of dictionary file, see ac_reloader_create().
+//
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>   // for setpriority
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#ifdef __linux
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
+
+#include <string>
+#include <vector>
+#include "ac.h"
+#include "ac_util.hpp"
+#include "ac_fast.hpp"
+#include "ac_cache.hpp"
+
+using namespace std;
+
+// The identity of a version of the file. The file is considered changed if
+// any of them changes.
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+} File_Sig;
+
+static bool
+Get_File_Sig(const char* path, File_Sig* sig) {
+    struct stat st;
+    if (stat(path, &st))
+        return false;
+
+    memset(sig, 0, sizeof(*sig));
+    sig->dev = st.st_dev;
+    sig->ino = st.st_ino;
+    sig->size = st.st_size;
+#ifdef __APPLE__
+    sig->mtime = st.st_mtimespec;
+#else
+    sig->mtime = st.st_mtim;
+#endif
+    return true;
+}
+
+static bool
+Same_File_Sig(const File_Sig& s1, const File_Sig& s2) {
+    return s1.dev == s2.dev && s1.ino == s2.ino && s1.size == s2.size &&
+           s1.mtime.tv_sec == s2.mtime.tv_sec &&
+           s1.mtime.tv_nsec == s2.mtime.tv_nsec;
+}
+
+// Build an instance from the dictionary file. Return NULL and set "err" to
+// the errno on failure.
+static ac_t*
+Build_From_File(const char* path, const ac_opt_t* opt, int& err) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        err = errno;
+        return 0;
+    }
+
+    string content;
+    char buf[64 * 1024];
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n > 0) {
+            content.append(buf, n);
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            err = errno;
+            close(fd);
+            return 0;
+        }
+        break;
+    }
+    close(fd);
+
+    // One pattern per line.
+    vector<const char*> pat_v;
+    vector<unsigned int> len_v;
+    const char* p = content.data();
+    for (size_t i = 0, b = 0, e = content.size(); i <= e; i++) {
+        if (i == e || p[i] == '\n' || p[i] == '\r') {
+            if (i > b) {
+                pat_v.push_back(p + b);
+                len_v.push_back(i - b);
+            }
+            b = i + 1;
+        }
+    }
+
+    if (pat_v.empty()) {
+        err = EINVAL;
+        return 0;
+    }
+
+    ac_t* ac = ac_create_opt(&pat_v[0], &len_v[0], pat_v.size(), opt);
+    err = ac ? 0 : EINVAL;
+    return ac;
+}
+
+namespace {
+// A published instance. It is referenced by the reloader while it's the
+// current one, and by each reader acquiring it; the instance is freed by
+// whoever drops the last reference. The struct itself outlives the instance,
+// as a reader may still be looking at it as the current one: a reference is
+// only taken while the count is non-zero, and a struct whose count is zero is
+// reused for a later instance, which is as good as the current one to such a
+// reader.
+typedef struct {
+    ac_t* ac;
+    uint32 ref;
+} AC_Version;
+
+class AC_Reloader {
+public:
+    AC_Reloader(const char* path, const ac_opt_t* opt,
+                const ac_reload_opt_t* reload_opt);
+    ~AC_Reloader();
+
+    // Build the initial instance, and start the watcher thread.
+    bool Start();
+
+    ac_t* Acquire();
+    void Release(ac_t*);
+    void Get_Stat(ac_reload_stat_t* stat);
+
+private:
+    static void* Watcher_Entry(void* arg);
+    void Watch();
+    int Init_Inotify();
+    void Check_And_Rebuild();
+    void Publish(ac_t* ac, uint64 build_usec);
+    static void Drop_Ref(AC_Version* v, ac_t* ac);
+
+    string _path;
+    ac_opt_t _opt;
+    string _cache_dir;
+    uint32 _flags;          // Bitwise-or of AC_RELOAD_XXX
+    uint32 _poll_msec;
+
+    bool _thread_started;
+    pthread_t _thread;
+    int _wakeup_pipe[2];    // Written to stop the watcher.
+    int _inotify_fd;        // -1 if polling.
+
+    // Accessed by the watcher thread only, after Start().
+    File_Sig _sig;
+    vector<AC_Version*> _versions;  // All of them, current or not.
+
+    // Accessed atomically by the readers, and set by the watcher.
+    AC_Version* _cur;
+
+    // Protect the fields below.
+    pthread_mutex_t _lock;
+    ac_reload_stat_t _stat;
+};
+} // end of anonymous namespace
+
+AC_Reloader::AC_Reloader(const char* path, const ac_opt_t* opt,
+                         const ac_reload_opt_t* reload_opt) :
+    _path(path), _thread_started(false), _cur(0) {
+    // The options are used by every rebuild, long after the call.
+    Copy_Opt(opt, &_opt, &_cache_dir);
+
+    _flags = reload_opt ? reload_opt->flags : 0;
+    _poll_msec = reload_opt ? reload_opt->poll_msec : 0;
+    if (_poll_msec == 0)
+        _poll_msec = 1000;
+
+    memset(&_sig, 0, sizeof(_sig));
+    memset(&_stat, 0, sizeof(_stat));
+    pthread_mutex_init(&_lock, 0);
+    _wakeup_pipe[0] = _wakeup_pipe[1] = -1;
+    _inotify_fd = -1;
+}
+
+AC_Reloader::~AC_Reloader() {
+    if (_thread_started) {
+        // Wake up the watcher, and wait for it to finish.
+        char c = 0;
+        while (write(_wakeup_pipe[1], &c, 1) == -1 && errno == EINTR) {}
+        pthread_join(_thread, 0);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (_wakeup_pipe[i] != -1)
+            close(_wakeup_pipe[i]);
+    }
+    if (_inotify_fd != -1)
+        close(_inotify_fd);
+
+    for (vector<AC_Version*>::iterator i = _versions.begin(),
+            e = _versions.end(); i != e; i++) {
+        AC_Version* v = *i;
+        ASSERT(v->ref == (v == _cur ? 1u : 0u) &&
+               "some instance is not yet released");
+        if (v == _cur)
+            ac_free(v->ac);
+        delete v;
+    }
+    pthread_mutex_destroy(&_lock);
+}
+
+bool
+AC_Reloader::Start() {
+    // Start watching before taking the signature of the file, so that any
+    // change after that is noticed.
+    _inotify_fd = Init_Inotify();
+
+    // The initial instance is built synchronously, in the caller's thread.
+    Get_File_Sig(_path.c_str(), &_sig);
+
+    uint64 start = Now_Usec();
+    int err;
+    ac_t* ac = Build_From_File(_path.c_str(), &_opt, err);
+    if (!ac)
+        return false;
+
+    Publish(ac, Now_Usec() - start);
+
+    if (pipe(_wakeup_pipe))
+        return false;
+
+    if (pthread_create(&_thread, 0, Watcher_Entry, this))
+        return false;
+    _thread_started = true;
+    return true;
+}
+
+// Take a reference to the current version, unless it has been retired and
+// released by all in the meantime, in which case there is a newer one.
+ac_t*
+AC_Reloader::Acquire() {
+    for (;;) {
+        AC_Version* v = __atomic_load_n(&_cur, __ATOMIC_ACQUIRE);
+        uint32 ref = __atomic_load_n(&v->ref, __ATOMIC_RELAXED);
+        while (ref != 0) {
+            if (__atomic_compare_exchange_n(&v->ref, &ref, ref + 1, true,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED)) {
+                return v->ac;
+            }
+        }
+    }
+}
+
+void
+AC_Reloader::Release(ac_t* ac) {
+    AC_Version* v = (AC_Version*)((AC_Buffer*)(void*)ac)->reload_ver;
+    ASSERT(v && v->ac == ac &&
+           "releasing instance not acquired from this reloader");
+    Drop_Ref(v, ac);
+}
+
+// The instance is passed along, as the struct may be reused as soon as the
+// count drops to zero.
+void
+AC_Reloader::Drop_Ref(AC_Version* v, ac_t* ac) {
+    ASSERT(v->ref > 0);
+    if (__atomic_sub_fetch(&v->ref, 1, __ATOMIC_ACQ_REL) == 0)
+        ac_free(ac);
+}
+
+void
+AC_Reloader::Publish(ac_t* ac, uint64 build_usec) {
+    AC_Version* v = 0;
+    for (vector<AC_Version*>::iterator i = _versions.begin(),
+            e = _versions.end(); i != e; i++) {
+        if (__atomic_load_n(&(*i)->ref, __ATOMIC_ACQUIRE) == 0) {
+            v = *i;
+            break;
+        }
+    }
+    if (!v) {
+        v = new AC_Version;
+        v->ref = 0;
+        _versions.push_back(v);
+    }
+    v->ac = ac;
+    ((AC_Buffer*)(void*)ac)->reload_ver = v;
+    __atomic_store_n(&v->ref, 1, __ATOMIC_RELEASE);
+
+    AC_Version* old = _cur;
+    __atomic_store_n(&_cur, v, __ATOMIC_RELEASE);
+    if (old)
+        Drop_Ref(old, old->ac);
+
+    pthread_mutex_lock(&_lock);
+    _stat.generation++;
+    _stat.last_error = 0;
+    _stat.last_build_usec = build_usec;
+    pthread_mutex_unlock(&_lock);
+}
+
+void
+AC_Reloader::Get_Stat(ac_reload_stat_t* stat) {
+    pthread_mutex_lock(&_lock);
+    *stat = _stat;
+    pthread_mutex_unlock(&_lock);
+}
+
+void*
+AC_Reloader::Watcher_Entry(void* arg) {
+    ((AC_Reloader*)arg)->Watch();
+    return 0;
+}
+
+// Return the inotify fd watching the directory of the file, or -1 if
+// inotify is not available. The directory rather than the file is watched,
+// such that the replacement of the file via rename(2) is noticed.
+int
+AC_Reloader::Init_Inotify() {
+#ifdef __linux
+    if (_flags & AC_RELOAD_POLL)
+        return -1;
+
+    int fd = inotify_init();
+    if (fd == -1)
+        return -1;
+
+    string dir = ".";
+    size_t slash = _path.rfind('/');
+    if (slash != string::npos)
+        dir = slash ? _path.substr(0, slash) : "/";
+
+    uint32 mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE |
+                  IN_ATTRIB;
+    if (inotify_add_watch(fd, dir.c_str(), mask) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+void
+AC_Reloader::Watch() {
+    // Rebuilding should not steal the CPU from the workers. On Linux, the
+    // nice value is per-thread.
+#ifdef __linux
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+
+    int inotify_fd = _inotify_fd;
+    for (;;) {
+        struct pollfd fds[2];
+        fds[0].fd = _wakeup_pipe[0];
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = inotify_fd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        int fd_num = inotify_fd != -1 ? 2 : 1;
+        int timeout = inotify_fd != -1 ? -1 : (int)_poll_msec;
+        int n = poll(fds, fd_num, timeout);
+        if (n == -1 && errno != EINTR)
+            break;
+
+        if (fds[0].revents)
+            break;
+
+        if (fds[1].revents) {
+            // The events are about any file in the directory; rather than
+            // looking into them, just check if our file has changed.
+            char buf[4096];
+            if (read(inotify_fd, buf, sizeof(buf)) <= 0)
+                continue;
+        }
+
+        Check_And_Rebuild();
+    }
+}
+
+void
+AC_Reloader::Check_And_Rebuild() {
+    File_Sig sig;
+    if (!Get_File_Sig(_path.c_str(), &sig) || Same_File_Sig(sig, _sig))
+        return;
+
+    // Remember the version even if the rebuild fails; there is no point to
+    // rebuild from the same bad file again.
+    _sig = sig;
+
+    uint64 start = Now_Usec();
+    int err;
+    ac_t* ac = Build_From_File(_path.c_str(), &_opt, err);
+    uint64 duration = Now_Usec() - start;
+
+    if (ac) {
+        Publish(ac, duration);
+        return;
+    }
+
+    pthread_mutex_lock(&_lock);
+    _stat.fail_num++;
+    _stat.last_error = err;
+    _stat.last_build_usec = duration;
+    pthread_mutex_unlock(&_lock);
+}
+
+extern "C" ac_reloader_t*
+ac_reloader_create(const char* dict_path, const ac_opt_t* opt,
+                   const ac_reload_opt_t* reload_opt) {
+    AC_Reloader* r = new AC_Reloader(dict_path, opt, reload_opt);
+    if (!r->Start()) {
+        delete r;
+        return 0;
+    }
+    return (ac_reloader_t*)(void*)r;
+}
+
+extern "C" ac_t*
+ac_reloader_acquire(ac_reloader_t* r) {
+    return ((AC_Reloader*)(void*)r)->Acquire();
+}
+
+extern "C" void
+ac_reloader_release(ac_reloader_t* r, ac_t* ac) {
+    ((AC_Reloader*)(void*)r)->Release(ac);
+}
+
+extern "C" void
+ac_reloader_get_stat(ac_reloader_t* r, ac_reload_stat_t* stat) {
+    ((AC_Reloader*)(void*)r)->Get_Stat(stat);
+}
+
+extern "C" void
+ac_reloader_free(ac_reloader_t* r) {
+    delete (AC_Reloader*)(void*)r;
+}
@@ -0,0 +1,378 @@
+// Scratch space of the advanced match APIs, see ac_scratch_t.
+//
+#include <string.h>
+#include "ac_composite.hpp"
+#include "ac_scratch.hpp"
+#include "ac_telemetry.hpp"
+#include "ac.h"
+
+uint32
+AC_Scratch::Calc_Hist_Len(AC_Buffer* buf) {
+    // See Composite_Match_All_Tmpl() about the DFA of the short patterns.
+    return (buf->flags & BUF_COMPOSITE) ? COMPOSITE_SHORT_LEN : 0;
+}
+
+void
+AC_Scratch::Fit(AC_Buffer* buf) {
+    uint32 need = Calc_Hist_Len(buf);
+    if (need <= _hist_cap)
+        return;
+
+    delete[] _mem;
+    _mem = new char[3 * need];
+    _hist_cap = need;
+    Reset();
+}
+
+// Keep the last "need" bytes of the string scanned so far, which ends with
+// the "len" bytes of "seg".
+void
+AC_Scratch::Save_Hist(const char* seg, uint32 len, uint32 need) {
+    if (!need)
+        return;
+
+    if (len >= need) {
+        memcpy(_mem, seg + len - need, need);
+        _hist_len = need;
+        return;
+    }
+
+    uint32 keep = _hist_len < need - len ? _hist_len : need - len;
+    memmove(_mem, _mem + _hist_len - keep, keep);
+    memcpy(_mem + keep, seg, len);
+    _hist_len = keep + len;
+}
+
+// The counterpart of Match_All() and Match_Count() for the segment "seg" of
+// the string, which picks up the state where the previous segment left it.
+// The "scan" is the progress within the segment; unless it's truncated, the
+// segment is scanned from the beginning.
+template<bool save> uint32
+AC_Scratch::Stream_Tmpl(AC_Buffer* buf, const char* seg, uint32 len,
+                        ac_result_t* result_v, uint32 result_cap,
+                        const ac_limit_t* limit, ac_scan_t* scan) {
+    uint32 need = Calc_Hist_Len(buf);
+    ASSERT(need <= _hist_cap);
+
+    ac_scan_t s;
+    if (scan->status == AC_SCAN_TRUNCATED) {
+        s = *scan;
+    } else {
+        memset(&s, 0, sizeof(s));
+        s.priv[0] = _state;
+    }
+
+    ac_limit_t lim;
+    if (limit)
+        lim = *limit;
+    else
+        memset(&lim, 0, sizeof(lim));
+
+    uint32 match_num = 0;
+    // The matches pending at the end of the head are reported in the
+    // stitch buffer as well, where the bytes before them are.
+    uint32 head = len < need ? len : need;
+    if (s.resume_ofst < head ||
+        (head && s.resume_ofst == head && s.priv[1])) {
+        // Scan the head of the segment along with the history, such that
+        // the engine finds the bytes before it right where it expects.
+        char* stitch = _mem + _hist_cap;
+        memcpy(stitch, _mem, _hist_len);
+        memcpy(stitch + _hist_len, seg, head);
+
+        uint32 start = s.resume_ofst;
+        s.resume_ofst += _hist_len;
+        if (save) {
+            match_num = Match_All(buf, stitch, _hist_len + head, result_v,
+                                  result_cap, &lim, &s);
+            for (uint32 i = 0; i < match_num; i++) {
+                result_v[i].match_begin -= _hist_len;
+                result_v[i].match_end -= _hist_len;
+            }
+        } else {
+            match_num = Match_Count(buf, stitch, _hist_len + head, &lim, &s);
+        }
+        s.resume_ofst -= _hist_len;
+        if (s.status == AC_SCAN_TRUNCATED)
+            goto truncated;
+
+        // Charge the head to the limits of the rest.
+        if (head < len) {
+            uint32 consumed = head - start;
+            if ((lim.max_matches && match_num >= lim.max_matches) ||
+                (save && match_num >= result_cap) ||
+                (lim.max_bytes && consumed >= lim.max_bytes)) {
+                goto truncated;
+            }
+            if (lim.max_matches)
+                lim.max_matches -= match_num;
+            if (lim.max_bytes)
+                lim.max_bytes -= consumed;
+        }
+    }
+
+    if (s.resume_ofst < len || s.priv[1]) {
+        if (save) {
+            match_num += Match_All(buf, seg, len, result_v + match_num,
+                                   result_cap - match_num, &lim, &s);
+        } else {
+            match_num += Match_Count(buf, seg, len, &lim, &s);
+        }
+        if (s.status == AC_SCAN_TRUNCATED)
+            goto truncated;
+    }
+
+    if (save) {
+        for (uint32 i = 0; i < match_num; i++) {
+            result_v[i].match_begin += _base;
+            result_v[i].match_end += _base;
+        }
+    }
+
+    // The segment is done; the next one picks up from here.
+    Save_Hist(seg, len, need);
+    _state = s.priv[0];
+    _base += len;
+
+    scan->status = AC_SCAN_DONE;
+    scan->resume_ofst = len;
+    scan->priv[0] = scan->priv[1] = 0;
+    return match_num;
+
+truncated:
+    if (save) {
+        for (uint32 i = 0; i < match_num; i++) {
+            result_v[i].match_begin += _base;
+            result_v[i].match_end += _base;
+        }
+    }
+    scan->status = AC_SCAN_TRUNCATED;
+    scan->resume_ofst = s.resume_ofst;
+    scan->priv[0] = s.priv[0];
+    scan->priv[1] = s.priv[1];
+    return match_num;
+}
+
+uint32
+AC_Scratch::Stream_Match_All(AC_Buffer* buf, const char* seg, uint32 len,
+                             ac_result_t* result_v, uint32 result_cap,
+                             const ac_limit_t* limit, ac_scan_t* scan) {
+    return Stream_Tmpl<true>(buf, seg, len, result_v, result_cap, limit,
+                             scan);
+}
+
+uint32
+AC_Scratch::Stream_Match_Count(AC_Buffer* buf, const char* seg, uint32 len,
+                               const ac_limit_t* limit, ac_scan_t* scan) {
+    return Stream_Tmpl<false>(buf, seg, len, 0, 0, limit, scan);
+}
+
+// Scan the chunks of the normalized string as segments, one after another,
+// each right after it's produced. The progress is kept in "_norm" and
+// "_norm_scan", and "scan" just tells whether to resume it.
+template<bool save> uint32
+AC_Scratch::Norm_Tmpl(AC_Buffer* buf, uint32 norm, const char* str,
+                      uint32 len, ac_result_t* result_v, uint32 result_cap,
+                      const ac_limit_t* limit, ac_scan_t* scan) {
+    if (scan->status != AC_SCAN_TRUNCATED) {
+        Reset();
+        _norm.Start(norm);
+        memset(&_norm_scan, 0, sizeof(_norm_scan));
+    }
+
+    ac_limit_t lim;
+    if (limit)
+        lim = *limit;
+    else
+        memset(&lim, 0, sizeof(lim));
+
+    // The time budget is checked between the chunks, which are no larger
+    // than BUDGET_CHECK_INTERVAL, by the normalized bytes scanned so far;
+    // the first chunk of a call is always scanned.
+    Scan_Budget budget(lim.max_usec);
+    lim.max_usec = 0;
+
+    uint32 match_num = 0;
+    uint32 scanned = 0;
+    for (;;) {
+        if (_norm_scan.status != AC_SCAN_TRUNCATED) {
+            if (_norm.Is_Done(len))
+                break;
+
+            uint32 chunk_end = (uint32)-1;
+            if ((lim.max_matches && match_num >= lim.max_matches) ||
+                (save && match_num >= result_cap) ||
+                (lim.max_bytes && scanned >= lim.max_bytes) ||
+                !budget.Check(scanned, chunk_end)) {
+                goto truncated;
+            }
+
+            _norm.Next_Chunk(str, len);
+            memset(&_norm_scan, 0, sizeof(_norm_scan));
+        }
+
+        ac_limit_t chunk_lim;
+        memset(&chunk_lim, 0, sizeof(chunk_lim));
+        if (lim.max_matches)
+            chunk_lim.max_matches = lim.max_matches - match_num;
+        if (lim.max_bytes)
+            chunk_lim.max_bytes = lim.max_bytes - scanned;
+
+        uint32 start = _norm_scan.resume_ofst;
+        uint32 num = Stream_Tmpl<save>(buf, _norm.Get_Chunk(),
+                                       _norm.Get_Chunk_Len(),
+                                       result_v + match_num,
+                                       save ? result_cap - match_num : 0,
+                                       &chunk_lim, &_norm_scan);
+        if (save) {
+            for (uint32 i = match_num; i < match_num + num; i++) {
+                ac_result_t& r = result_v[i];
+                r.match_begin = _norm.Get_Raw_Begin(r.match_begin);
+                r.match_end = _norm.Get_Raw_End(r.match_end);
+            }
+        }
+        match_num += num;
+        scanned += _norm_scan.resume_ofst - start;
+        if (_norm_scan.status == AC_SCAN_TRUNCATED)
+            goto truncated;
+    }
+
+    scan->status = AC_SCAN_DONE;
+    scan->resume_ofst = len;
+    scan->priv[0] = scan->priv[1] = 0;
+    return match_num;
+
+truncated:
+    scan->status = AC_SCAN_TRUNCATED;
+    scan->resume_ofst = _norm.Get_Raw_Begin(_norm.Get_Chunk_Base() +
+                                            _norm_scan.resume_ofst);
+    scan->priv[0] = scan->priv[1] = 0;
+    return match_num;
+}
+
+uint32
+AC_Scratch::Norm_Match_All(AC_Buffer* buf, uint32 norm, const char* str,
+                           uint32 len, ac_result_t* result_v,
+                           uint32 result_cap, const ac_limit_t* limit,
+                           ac_scan_t* scan) {
+    return Norm_Tmpl<true>(buf, norm, str, len, result_v, result_cap, limit,
+                           scan);
+}
+
+uint32
+AC_Scratch::Norm_Match_Count(AC_Buffer* buf, uint32 norm, const char* str,
+                             uint32 len, const ac_limit_t* limit,
+                             ac_scan_t* scan) {
+    return Norm_Tmpl<false>(buf, norm, str, len, 0, 0, limit, scan);
+}
+
+extern "C" ac_scratch_t*
+ac_scratch_create(ac_t* ac) {
+    AC_Scratch* scratch = new AC_Scratch;
+    scratch->Fit((AC_Buffer*)(void*)ac);
+    return (ac_scratch_t*)(void*)scratch;
+}
+
+extern "C" void
+ac_scratch_fit(ac_scratch_t* scratch, ac_t* ac) {
+    ((AC_Scratch*)(void*)scratch)->Fit((AC_Buffer*)(void*)ac);
+}
+
+extern "C" void
+ac_scratch_fit_norm(ac_scratch_t* scratch) {
+    ((AC_Scratch*)(void*)scratch)->Fit_Norm();
+}
+
+extern "C" void
+ac_scratch_free(ac_scratch_t* scratch) {
+    delete (AC_Scratch*)(void*)scratch;
+}
+
+extern "C" void
+ac_stream_reset(ac_scratch_t* scratch) {
+    ((AC_Scratch*)(void*)scratch)->Reset();
+}
+
+extern "C" int
+ac_stream_match_all(ac_t* ac, ac_scratch_t* scratch, const char* seg,
+                    unsigned int len, ac_result_t* result_v,
+                    unsigned int result_cap, const ac_limit_t* limit,
+                    ac_scan_t* scan) {
+    AC_Buffer* buf = (AC_Buffer*)(void*)ac;
+    ASSERT(((buf_header_t*)ac)->magic_num == AC_MAGIC_NUM);
+
+    AC_Scratch* sc = (AC_Scratch*)(void*)scratch;
+    if (!sc->Is_Fit(buf))
+        return -1;
+
+    ac_scan_t tmp;
+    if (!scan) {
+        memset(&tmp, 0, sizeof(tmp));
+        scan = &tmp;
+    }
+    int num = sc->Stream_Match_All(buf, seg, len, result_v, result_cap,
+                                   limit, scan);
+    Count_Hits(buf, result_v, num);
+    return num;
+}
+
+extern "C" int
+ac_stream_match_count(ac_t* ac, ac_scratch_t* scratch, const char* seg,
+                      unsigned int len, const ac_limit_t* limit,
+                      ac_scan_t* scan) {
+    AC_Buffer* buf = (AC_Buffer*)(void*)ac;
+    ASSERT(((buf_header_t*)ac)->magic_num == AC_MAGIC_NUM);
+
+    AC_Scratch* sc = (AC_Scratch*)(void*)scratch;
+    if (!sc->Is_Fit(buf))
+        return -1;
+
+    ac_scan_t tmp;
+    if (!scan) {
+        memset(&tmp, 0, sizeof(tmp));
+        scan = &tmp;
+    }
+    return sc->Stream_Match_Count(buf, seg, len, limit, scan);
+}
+
+extern "C" int
+ac_norm_match_all(ac_t* ac, ac_scratch_t* scratch, unsigned int norm,
+                  const char* str, unsigned int len, ac_result_t* result_v,
+                  unsigned int result_cap, const ac_limit_t* limit,
+                  ac_scan_t* scan) {
+    AC_Buffer* buf = (AC_Buffer*)(void*)ac;
+    ASSERT(((buf_header_t*)ac)->magic_num == AC_MAGIC_NUM);
+
+    AC_Scratch* sc = (AC_Scratch*)(void*)scratch;
+    if (!sc->Is_Norm_Fit(buf))
+        return -1;
+
+    ac_scan_t tmp;
+    if (!scan) {
+        memset(&tmp, 0, sizeof(tmp));
+        scan = &tmp;
+    }
+    int num = sc->Norm_Match_All(buf, norm, str, len, result_v, result_cap,
+                                 limit, scan);
+    Count_Hits(buf, result_v, num);
+    return num;
+}
+
+extern "C" int
+ac_norm_match_count(ac_t* ac, ac_scratch_t* scratch, unsigned int norm,
+                    const char* str, unsigned int len,
+                    const ac_limit_t* limit, ac_scan_t* scan) {
+    AC_Buffer* buf = (AC_Buffer*)(void*)ac;
+    ASSERT(((buf_header_t*)ac)->magic_num == AC_MAGIC_NUM);
+
+    AC_Scratch* sc = (AC_Scratch*)(void*)scratch;
+    if (!sc->Is_Norm_Fit(buf))
+        return -1;
+
+    ac_scan_t tmp;
+    if (!scan) {
+        memset(&tmp, 0, sizeof(tmp));
+        scan = &tmp;
+    }
+    return sc->Norm_Match_Count(buf, norm, str, len, limit, scan);
+}
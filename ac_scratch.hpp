@@ -0,0 +1,85 @@
+#ifndef AC_SCRATCH_H
+#define AC_SCRATCH_H
+
+#include "ac_fast.hpp"
+#include "ac_norm.hpp"
+
+// The per-thread scratch space of the advanced match APIs, see ac_scratch_t.
+//
+// The only thing the scan of a string fed in segments needs, besides the
+// state of the automaton, is the last few bytes of the previous segment for
+// the engines whose state is partly recomputed from them on resumption (see
+// Composite_Match_All()). So the first few bytes of a segment are scanned
+// along with them in a stitch buffer, and the rest are scanned in place.
+//
+// The normalizing scan is that of the string fed in segments as well, where
+// the segments are the chunks of the normalized string (see AC_Normalizer).
+//
+class AC_Scratch {
+public:
+    AC_Scratch() : _hist_cap(0), _mem(0) { Reset(); }
+    ~AC_Scratch() { delete[] _mem; }
+
+    // Return the number of bytes of the history the engine of "buf" needs.
+    static uint32 Calc_Hist_Len(AC_Buffer* buf);
+
+    // Make it fit "buf" as well, which starts a new string if it grows.
+    void Fit(AC_Buffer* buf);
+    bool Is_Fit(AC_Buffer* buf) const {
+        return Calc_Hist_Len(buf) <= _hist_cap;
+    }
+
+    // Make it fit the normalizing scan as well.
+    void Fit_Norm() { _norm.Alloc(); }
+    bool Is_Norm_Fit(AC_Buffer* buf) const {
+        return Is_Fit(buf) && _norm.Is_Alloc();
+    }
+
+    // Start a new string.
+    void Reset() {
+        _base = 0;
+        _state = 0;
+        _hist_len = 0;
+    }
+
+    uint32 Stream_Match_All(AC_Buffer* buf, const char* seg, uint32 len,
+                            ac_result_t* result_v, uint32 result_cap,
+                            const ac_limit_t* limit, ac_scan_t* scan);
+    uint32 Stream_Match_Count(AC_Buffer* buf, const char* seg, uint32 len,
+                              const ac_limit_t* limit, ac_scan_t* scan);
+
+    uint32 Norm_Match_All(AC_Buffer* buf, uint32 norm, const char* str,
+                          uint32 len, ac_result_t* result_v,
+                          uint32 result_cap, const ac_limit_t* limit,
+                          ac_scan_t* scan);
+    uint32 Norm_Match_Count(AC_Buffer* buf, uint32 norm, const char* str,
+                            uint32 len, const ac_limit_t* limit,
+                            ac_scan_t* scan);
+
+private:
+    template<bool save> uint32
+    Norm_Tmpl(AC_Buffer* buf, uint32 norm, const char* str, uint32 len,
+              ac_result_t* result_v, uint32 result_cap,
+              const ac_limit_t* limit, ac_scan_t* scan);
+
+    template<bool save> uint32
+    Stream_Tmpl(AC_Buffer* buf, const char* seg, uint32 len,
+                ac_result_t* result_v, uint32 result_cap,
+                const ac_limit_t* limit, ac_scan_t* scan);
+
+    void Save_Hist(const char* seg, uint32 len, uint32 need);
+
+    uint32 _base;           // The offset of the current segment.
+    State_ID _state;        // The state at the beginning of it.
+    uint32 _hist_len;
+
+    // The history, followed by the stitch buffer twice as large.
+    uint32 _hist_cap;
+    char* _mem;
+
+    // The normalizer of the string, and the scan of its current chunk.
+    AC_Normalizer _norm;
+    ac_scan_t _norm_scan;
+};
+
+#endif // AC_SCRATCH_H
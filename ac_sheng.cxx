@@ -0,0 +1,215 @@
+#include <string.h>     // for memcmp
+#include <strings.h>    // for bzero
+#include "ac_sheng.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define SHENG_SIMD
+    #include <tmmintrin.h>  // for _mm_shuffle_epi8
+#endif
+
+// The number of steps taken between two checks of the SHENG_XXX flags.
+#define SHENG_BLOCK 8
+
+void
+Build_Sheng_Table(AC_Buffer* buf, Sheng_Table* tbl) {
+    uint32 state_num = buf->state_num;
+    ASSERT(state_num <= SHENG_STATE_MAX);
+
+    bzero(tbl, sizeof(*tbl));
+    for (State_ID id = 1; id < state_num; id++) {
+        AC_State* s = Get_State(buf, id);
+        tbl->is_term[id] = s->is_term;
+        tbl->depth[id] = s->depth;
+    }
+
+    for (uint32 c = 0; c < 256; c++) {
+        unsigned char mask[SHENG_STATE_MAX];
+        unsigned char prehit[SHENG_STATE_MAX];
+        bzero(mask, sizeof(mask));
+        bzero(prehit, sizeof(prehit));
+
+        for (State_ID id = 0; id < state_num; id++) {
+            // Follow the fail-links, like Match_Tmpl() does, until the goto
+            // function is defined. Root goes nowhere if it's not.
+            State_ID cur = id;
+            State_ID hit = 0;
+            int next;
+            while ((next = Get_Goto(buf, cur, c)) < 0) {
+                if (cur == 0) {
+                    next = 0;
+                    break;
+                }
+                cur = Get_State(buf, cur)->fail_link;
+                if (cur && !hit && Get_State(buf, cur)->is_term)
+                    hit = cur;
+            }
+
+            mask[id] = next;
+            if (next && Get_State(buf, next)->is_term)
+                mask[id] |= SHENG_TERM;
+            if (hit) {
+                mask[id] |= SHENG_PREHIT;
+                prehit[id] = hit;
+            }
+        }
+
+        // Inputs with the same transitions share the class.
+        uint32 cls;
+        for (cls = 0; cls < tbl->class_num; cls++) {
+            if (!memcmp(tbl->masks[cls], mask, sizeof(mask)) &&
+                !memcmp(tbl->prehit[cls], prehit, sizeof(prehit))) {
+                break;
+            }
+        }
+
+        if (cls == tbl->class_num) {
+            // Only the inputs of the transitions of the non-root states, and
+            // the others as a whole, make a difference.
+            ASSERT(cls < SHENG_CLASS_MAX);
+            memcpy(tbl->masks[cls], mask, sizeof(mask));
+            memcpy(tbl->prehit[cls], prehit, sizeof(prehit));
+            tbl->class_num++;
+        }
+        tbl->class_map[c] = cls;
+    }
+}
+
+bool
+Validate_Sheng_Table(AC_Buffer* buf) {
+    AC_Ofst ofst = buf->sheng_ofst;
+    if (buf->state_num > SHENG_STATE_MAX ||
+        ofst < buf->first_state_ofst || ofst % __alignof__(Sheng_Table) ||
+        (uint64)ofst + sizeof(Sheng_Table) > Get_Graph_Len(buf)) {
+        return false;
+    }
+
+    // The table is small, and so is the graph; just build it again.
+    Sheng_Table tbl;
+    Build_Sheng_Table(buf, &tbl);
+    return !memcmp(&tbl, (unsigned char*)buf + ofst, sizeof(tbl));
+}
+
+// Report the match ending at "end" by the terminal state "s". Return true if
+// no more match is needed.
+template<MATCH_VARIANT variant> static inline bool
+Sheng_Report(const Sheng_Table* tbl, uint32 s, uint32 end, ac_result_t& r) {
+    int match_begin = end + 1 - tbl->depth[s];
+    int match_end = end;
+
+    if (variant == MV_FIRST_MATCH || r.match_begin == -1 ||
+        match_end - match_begin > r.match_end - r.match_begin) {
+        r.match_begin = match_begin;
+        r.match_end = match_end;
+        r.pattern_idx = tbl->is_term[s] - 1;
+    }
+    return variant == MV_FIRST_MATCH;
+}
+
+// Move from the state "s" on the input str[idx], reporting the matches in
+// the same order as Match_Tmpl() does. Return true if no more match is
+// needed.
+template<MATCH_VARIANT variant> static inline bool
+Sheng_Step(const Sheng_Table* tbl, uint32& s, const char* str, uint32 idx,
+           ac_result_t& r) {
+    uint32 cls = tbl->class_map[(InputTy)str[idx]];
+    uint32 next = tbl->masks[cls][s];
+    if (unlikely(next & SHENG_FLAGS)) {
+        // Root is never a prehit, so "idx" is non-zero.
+        if ((next & SHENG_PREHIT) &&
+            Sheng_Report<variant>(tbl, tbl->prehit[cls][s], idx - 1, r)) {
+            return true;
+        }
+
+        if ((next & SHENG_TERM) &&
+            Sheng_Report<variant>(tbl, next & SHENG_STATE_MASK, idx, r)) {
+            return true;
+        }
+    }
+    s = next & SHENG_STATE_MASK;
+    return false;
+}
+
+template<MATCH_VARIANT variant> static ac_result_t
+Sheng_Match_Scalar(const Sheng_Table* tbl, const char* str, uint32 len) {
+    ac_result_t r = {-1, -1};
+    uint32 s = 0;
+    for (uint32 idx = 0; idx < len; idx++) {
+        if (Sheng_Step<variant>(tbl, s, str, idx, r))
+            break;
+    }
+    return r;
+}
+
+#ifdef SHENG_SIMD
+template<MATCH_VARIANT variant> static ac_result_t
+__attribute__((target("ssse3")))
+Sheng_Match_SSSE3(const Sheng_Table* tbl, const char* str, uint32 len) {
+    const unsigned char* class_map = tbl->class_map;
+    const __m128i* masks = (const __m128i*)(const void*)tbl->masks;
+
+    ac_result_t r = {-1, -1};
+    uint32 idx = 0;
+
+    // The current state, in every byte of the register.
+    __m128i state = _mm_setzero_si128();
+    for (; idx + SHENG_BLOCK <= len; idx += SHENG_BLOCK) {
+        __m128i start = state;
+        __m128i flags = _mm_setzero_si128();
+        for (uint32 i = 0; i < SHENG_BLOCK; i++) {
+            InputTy c = str[idx + i];
+            __m128i mask = _mm_loadu_si128(masks + class_map[c]);
+            state = _mm_shuffle_epi8(mask, state);
+            flags = _mm_or_si128(flags, state);
+        }
+
+        if (likely(!(_mm_cvtsi128_si32(flags) & SHENG_FLAGS)))
+            continue;
+
+        // Some step of the block has something to report; re-run the block
+        // one step a time.
+        uint32 s = _mm_cvtsi128_si32(start) & SHENG_STATE_MASK;
+        for (uint32 i = 0; i < SHENG_BLOCK; i++) {
+            if (Sheng_Step<variant>(tbl, s, str, idx + i, r))
+                return r;
+        }
+        state = _mm_set1_epi8(s);
+    }
+
+    uint32 s = _mm_cvtsi128_si32(state) & SHENG_STATE_MASK;
+    for (; idx < len; idx++) {
+        if (Sheng_Step<variant>(tbl, s, str, idx, r))
+            break;
+    }
+    return r;
+}
+
+static bool
+Has_SSSE3() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+
+static const bool has_ssse3 = Has_SSSE3();
+#endif
+
+template<MATCH_VARIANT variant> static inline ac_result_t
+Sheng_Match_Tmpl(AC_Buffer* buf, const char* str, uint32 len) {
+    const Sheng_Table* tbl =
+        (const Sheng_Table*)((unsigned char*)buf + buf->sheng_ofst);
+
+#ifdef SHENG_SIMD
+    if (likely(has_ssse3))
+        return Sheng_Match_SSSE3<variant>(tbl, str, len);
+#endif
+    return Sheng_Match_Scalar<variant>(tbl, str, len);
+}
+
+ac_result_t
+Sheng_Match(AC_Buffer* buf, const char* str, uint32 len) {
+    return Sheng_Match_Tmpl<MV_FIRST_MATCH>(buf, str, len);
+}
+
+ac_result_t
+Sheng_Match_Longest_L(AC_Buffer* buf, const char* str, uint32 len) {
+    return Sheng_Match_Tmpl<MV_LEFT_LONGEST>(buf, str, len);
+}
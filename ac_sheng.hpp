@@ -0,0 +1,66 @@
+#ifndef AC_SHENG_H
+#define AC_SHENG_H
+
+#include "ac_fast.hpp"
+
+// The shuffle-based DFA engine (aka "Sheng") for tiny AC graphs, i.e. those
+// with no more than SHENG_STATE_MAX states including root.
+//
+// The AC graph is first turned into a DFA by resolving the fail-links, such
+// that each input takes exactly one transition. Then the DFA's transitions on
+// an input are put in a 16-byte vector indiced by the current state, and one
+// step of the DFA is just a "pshufb" of the vector, with the current state
+// being the shuffle control. So the matcher runs at one shuffle per input
+// byte, no matter how the graph looks like.
+//
+// The element of the vector is the ID of the next state in the low 4 bits,
+// which are all the shuffle looks at (bit 7 being clear), and the remaining
+// bits are free to carry the SHENG_XXX flags:
+//
+//  - SHENG_TERM: the next state is terminal.
+//  - SHENG_PREHIT: one of the states visited via fail-link, before the
+//    transition is taken, is terminal. Match_Tmpl() reports such a state
+//    as a match ending right before the input, which must be replicated.
+//
+// The matcher ORs the flags of a block of steps together, and only when the
+// result is non-zero does it re-run the block one step a time to find out
+// the details. So matching a text with few matches is branch-free.
+//
+// Inputs having exactly the same transitions are put in the same class, and
+// the vectors are indiced by class, rather than by input. It's easy to see
+// the number of classes cannot exceed the number of states.
+//
+#define SHENG_STATE_MAX 16
+#define SHENG_CLASS_MAX SHENG_STATE_MAX
+
+#define SHENG_STATE_MASK    0x0f
+#define SHENG_TERM          0x10
+#define SHENG_PREHIT        0x20
+#define SHENG_FLAGS         (SHENG_TERM | SHENG_PREHIT)
+
+typedef struct {
+    unsigned char class_map[256];           // input -> class
+    uint16 is_term[SHENG_STATE_MAX];        // AC_State::is_term of each state
+    uint16 depth[SHENG_STATE_MAX];          // AC_State::depth of each state
+    uint32 class_num;
+
+    // Indiced by class and state. The element of "masks" is the next state
+    // tagged with SHENG_XXX flags. If SHENG_PREHIT is set, the element of
+    // "prehit" is the first terminal state visited via fail-link.
+    unsigned char masks[SHENG_CLASS_MAX][SHENG_STATE_MAX];
+    unsigned char prehit[SHENG_CLASS_MAX][SHENG_STATE_MAX];
+} Sheng_Table;
+
+// Populate the Sheng table of the well-formed "buf", which must have no more
+// than SHENG_STATE_MAX states. The table is zeroed before populated, such
+// that identical graphs yield byte-identical tables.
+void Build_Sheng_Table(AC_Buffer* buf, Sheng_Table* tbl);
+
+// Check if the Sheng table of "buf" is exactly what Build_Sheng_Table()
+// would produce; the rest of the buffer must be already validated.
+bool Validate_Sheng_Table(AC_Buffer* buf);
+
+ac_result_t Sheng_Match(AC_Buffer* buf, const char* str, uint32 len);
+ac_result_t Sheng_Match_Longest_L(AC_Buffer* buf, const char* str, uint32 len);
+
+#endif  // AC_SHENG_H
@@ -10,14 +10,13 @@
 //
 //////////////////////////////////////////////////////////////////////////
 //
-ACS_Constructor::ACS_Constructor() : _next_node_id(1) {
+ACS_Constructor::ACS_Constructor() : _next_node_id(1), _pattern_num(0) {
     _root = new_state();
     _root_char = new InputTy[256];
     bzero((void*)_root_char, 256);
-
-#ifdef VERIFY
+    _strv = 0;
+    _strlenv = 0;
     _pattern_buf = 0;
-#endif
 }
 
 ACS_Constructor::~ACS_Constructor() {
@@ -27,10 +26,7 @@ ACS_Constructor::~ACS_Constructor() {
     }
     _all_states.clear();
     delete[] _root_char;
-
-#ifdef VERIFY
     delete[] _pattern_buf;
-#endif
 }
 
 ACS_State*
@@ -43,6 +39,11 @@ ACS_Constructor::new_state() {
 void
 ACS_Constructor::Add_Pattern(const char* str, unsigned int str_len,
                              int pattern_idx) {
+    // The empty pattern never matches, as the root of the fast
+    // implementation is never terminal.
+    if (str_len == 0)
+        return;
+
     ACS_State* state = _root;
     for (unsigned int i = 0; i < str_len; i++) {
         const char c = str[i];
@@ -110,8 +111,15 @@ ACS_Constructor::Propagate_faillink() {
 
 void
 ACS_Constructor::Construct(const char** strv, unsigned int* strlenv,
-                           uint32 strnum) {
-    Save_Patterns(strv, strlenv, strnum);
+                           uint32 strnum, bool copy) {
+#ifdef VERIFY
+    copy = true;
+#endif
+    _strv = strv;
+    _strlenv = strlenv;
+    if (copy)
+        Save_Patterns(strv, strlenv, strnum);
+    _pattern_num = strnum;
 
     for (uint32 i = 0; i < strnum; i++) {
         Add_Pattern(strv[i], strlenv[i], i);
@@ -282,6 +290,7 @@ ACS_Constructor::Verify_Result(const char* subject, const Match_Result* r)
                memcmp(subject + r->begin, get_ith_Pattern(ptn_idx), len) == 0);
     }
 }
+#endif
 
 void
 ACS_Constructor::Save_Patterns(const char** strv, unsigned int* strlenv,
@@ -315,4 +324,3 @@ ACS_Constructor::Save_Patterns(const char** strv, unsigned int* strlenv,
     #undef MAGIC_NUM
 }
 
-#endif
@@ -92,8 +92,11 @@ public:
     ACS_Constructor();
     ~ACS_Constructor();
 
+    // The patterns are looked at, rather than copied, unless "copy" is set
+    // (or in the VERIFY build), in which case the slow graph can outlive
+    // them, e.g. as the reference of the shadow verification.
     void Construct(const char** strv, unsigned int* strlenv,
-                   unsigned int strnum);
+                   unsigned int strnum, bool copy = false);
 
     Match_Result Match(const char* s, uint32 len) const {
         Match_Result r = MatchHelper(s, len);
@@ -114,6 +117,18 @@ public:
 
     uint32 Get_Next_Node_Id() const { return _next_node_id; }
     uint32 Get_State_Num() const { return _next_node_id - 1; }
+    uint32 Get_Pattern_Num() const { return _pattern_num; }
+
+    // The i-th pattern, for the verification and the tables of the fast
+    // graph. It's the caller's, which must be alive, unless it's copied.
+    const char* get_ith_Pattern(unsigned i) const {
+        ASSERT(i < _pattern_num);
+        return _pattern_buf ? _pattern_vect[i] : _strv[i];
+    }
+    unsigned get_ith_Pattern_Len(unsigned i) const {
+        ASSERT(i < _pattern_num);
+        return _pattern_buf ? _pattern_lens[i] : _strlenv[i];
+    }
 
 private:
     void Add_Pattern(const char* str, unsigned int str_len, int pattern_idx);
@@ -121,25 +136,14 @@ private:
     void Propagate_faillink();
 
     Match_Result MatchHelper(const char*, uint32 len) const;
+    void Save_Patterns(const char** strv, unsigned int* strlenv, int vect_len);
 
 #ifdef VERIFY
     void Verify_Result(const char* subject, const Match_Result* r) const;
-    void Save_Patterns(const char** strv, unsigned int* strlenv, int vect_len);
-    const char* get_ith_Pattern(unsigned i) const {
-        ASSERT(i < _pattern_vect.size());
-        return _pattern_vect.at(i);
-    }
-    unsigned get_ith_Pattern_Len(unsigned i) const {
-        ASSERT(i < _pattern_lens.size());
-        return _pattern_lens.at(i);
-    }
 #else
     void Verify_Result(const char* subject, const Match_Result* r) const {
         (void)subject; (void)r;
     }
-    void Save_Patterns(const char** strv, unsigned int* strlenv, int vect_len) {
-        (void)strv; (void)strlenv;
-    }
 #endif
 
 private:
@@ -147,12 +151,14 @@ private:
     vector<ACS_State*> _all_states;
     unsigned char* _root_char;
     uint32 _next_node_id;
+    uint32 _pattern_num;
 
-#ifdef VERIFY
+    // The caller's patterns, or the copy of them.
+    const char** _strv;
+    const unsigned int* _strlenv;
     char* _pattern_buf;
     vector<int> _pattern_lens;
     vector<char*> _pattern_vect;
-#endif
 };
 
 #endif
@@ -0,0 +1,232 @@
+#include <string.h>     // for memcmp
+#include <strings.h>    // for bzero
+#include <vector>
+#include "ac_stride2.hpp"
+
+static inline uint32*
+Get_Step1(const Stride2_Table* tbl) {
+    return (uint32*)(void*)(tbl + 1);
+}
+
+static inline uint32*
+Get_Step2(const Stride2_Table* tbl, uint32 state_num) {
+    return Get_Step1(tbl) + state_num * tbl->class_num;
+}
+
+// Figure out the inputs of the transitions of the graph. Return the number
+// of such inputs.
+static uint32
+Get_Used_Inputs(AC_Buffer* buf, bool used[256]) {
+    uint32 state_num = buf->state_num;
+    bzero(used, 256 * sizeof(used[0]));
+    for (uint32 c = 0; c < 256; c++) {
+        if (Get_Goto(buf, 0, c) >= 0)
+            used[c] = true;
+    }
+    for (State_ID id = 1; id < state_num; id++) {
+        AC_State* s = Get_State(buf, id);
+        for (uint32 i = 0; i < s->goto_num; i++)
+            used[s->input_vect[i]] = true;
+    }
+
+    uint32 input_num = 0;
+    for (uint32 c = 0; c < 256; c++)
+        input_num += used[c] ? 1 : 0;
+    return input_num;
+}
+
+void
+Build_Stride2_Table(AC_Buffer* buf, Stride2_Table* tbl) {
+    uint32 state_num = buf->state_num;
+
+    // Step 1: Classify the inputs. The inputs of no transition, if any, are
+    // class 0.
+    bool used[256];
+    uint32 input_num = Get_Used_Inputs(buf, used);
+    uint32 class_num = Stride2_Class_Num(input_num);
+    bzero(tbl, Stride2_Table_Sz(state_num, class_num));
+    tbl->class_num = class_num;
+
+    // The representative input of each class.
+    vector<InputTy> class_input(class_num, 0);
+    uint32 cls = (class_num == input_num) ? 0 : 1;
+    for (uint32 c = 0; c < 256; c++) {
+        if (used[c]) {
+            tbl->class_map[c] = cls;
+            class_input[cls++] = c;
+        } else if (class_input[0] == 0) {
+            class_input[0] = c;
+        }
+    }
+
+    // Step 2: Populate step1. As states are numbered in BFS order, the
+    // fail-link target has smaller ID, and its transitions are settled.
+    uint32* step1 = Get_Step1(tbl);
+    for (State_ID id = 0; id < state_num; id++) {
+        uint32* row = step1 + id * class_num;
+        State_ID fl = id ? Get_State(buf, id)->fail_link : 0;
+        bool fl_term = fl && Get_State(buf, fl)->is_term;
+        uint32* fl_row = step1 + fl * class_num;
+
+        for (cls = 0; cls < class_num; cls++) {
+            int next = Get_Goto(buf, id, class_input[cls]);
+            if (next >= 0) {
+                row[cls] = next << 2;
+                if (next && Get_State(buf, next)->is_term)
+                    row[cls] |= STRIDE2_TERM;
+            } else if (id == 0) {
+                row[cls] = 0;
+            } else if (fl == 0) {
+                // Skip via root, which is not a prehit.
+                row[cls] = step1[cls];
+            } else {
+                row[cls] = fl_row[cls];
+                if (fl_term)
+                    row[cls] |= STRIDE2_PREHIT;
+            }
+        }
+    }
+
+    // Step 3: Populate step2 by taking step1 twice.
+    uint32 class_num2 = class_num * class_num;
+    uint32* step2 = Get_Step2(tbl, state_num);
+    for (State_ID id = 0; id < state_num; id++) {
+        uint32* row = step2 + id * class_num2;
+        for (uint32 c1 = 0; c1 < class_num; c1++) {
+            uint32 e1 = step1[id * class_num + c1];
+            uint32* mid_row = step1 + (e1 >> 2) * class_num;
+            for (uint32 c2 = 0; c2 < class_num; c2++) {
+                uint32 e2 = mid_row[c2];
+                uint32 e = ((e2 >> 2) * class_num2) << 1;
+                if ((e1 | e2) & (STRIDE2_TERM | STRIDE2_PREHIT))
+                    e |= STRIDE2_HIT;
+                row[c1 * class_num + c2] = e;
+            }
+        }
+    }
+}
+
+bool
+Validate_Stride2_Table(AC_Buffer* buf) {
+    AC_Ofst ofst = buf->stride2_ofst;
+    if (ofst < buf->first_state_ofst || ofst % __alignof__(Stride2_Table) ||
+        (uint64)ofst + sizeof(Stride2_Table) > Get_Graph_Len(buf)) {
+        return false;
+    }
+
+    bool used[256];
+    uint32 class_num = Stride2_Class_Num(Get_Used_Inputs(buf, used));
+    uint64 sz = Stride2_Table_Sz(buf->state_num, class_num);
+    Stride2_Table* tbl = (Stride2_Table*)((unsigned char*)buf + ofst);
+    if (tbl->class_num != class_num || sz > STRIDE2_MAX_SZ ||
+        (uint64)ofst + sz > Get_Graph_Len(buf)) {
+        return false;
+    }
+
+    // Build the tables again, and compare.
+    vector<uint32> tmp((sz + sizeof(uint32) - 1) / sizeof(uint32));
+    Stride2_Table* tmp_tbl = (Stride2_Table*)(void*)&tmp[0];
+    Build_Stride2_Table(buf, tmp_tbl);
+    return !memcmp(tmp_tbl, tbl, sz);
+}
+
+// Return the first terminal state visited via fail-link, starting from the
+// state "id", before the goto function is defined for the input "c".
+static State_ID
+Get_Prehit(AC_Buffer* buf, State_ID id, InputTy c) {
+    while (id && Get_Goto(buf, id, c) < 0) {
+        id = Get_State(buf, id)->fail_link;
+        if (id && Get_State(buf, id)->is_term)
+            return id;
+    }
+    return 0;
+}
+
+// Report the match ending at "end" by the terminal state "id". Return true
+// if no more match is needed.
+template<MATCH_VARIANT variant> static inline bool
+Stride2_Report(AC_Buffer* buf, State_ID id, uint32 end, ac_result_t& r) {
+    AC_State* s = Get_State(buf, id);
+    int match_begin = end + 1 - s->depth;
+    int match_end = end;
+
+    if (variant == MV_FIRST_MATCH || r.match_begin == -1 ||
+        match_end - match_begin > r.match_end - r.match_begin) {
+        r.match_begin = match_begin;
+        r.match_end = match_end;
+        r.pattern_idx = s->is_term - 1;
+    }
+    return variant == MV_FIRST_MATCH;
+}
+
+// Move from the state "s" on the input str[idx] with step1, reporting the
+// matches in the same order as Match_Tmpl() does. Return true if no more
+// match is needed.
+template<MATCH_VARIANT variant> static inline bool
+Stride2_Step(AC_Buffer* buf, const Stride2_Table* tbl, uint32& s,
+             const char* str, uint32 idx, ac_result_t& r) {
+    InputTy c = str[idx];
+    uint32 e = Get_Step1(tbl)[s * tbl->class_num + tbl->class_map[c]];
+    if (unlikely(e & (STRIDE2_TERM | STRIDE2_PREHIT))) {
+        // Root is never a prehit, so "idx" is non-zero.
+        if ((e & STRIDE2_PREHIT) &&
+            Stride2_Report<variant>(buf, Get_Prehit(buf, s, c), idx - 1, r)) {
+            return true;
+        }
+
+        if ((e & STRIDE2_TERM) &&
+            Stride2_Report<variant>(buf, e >> 2, idx, r)) {
+            return true;
+        }
+    }
+    s = e >> 2;
+    return false;
+}
+
+template<MATCH_VARIANT variant> static ac_result_t
+Stride2_Match_Tmpl(AC_Buffer* buf, const char* str, uint32 len) {
+    const Stride2_Table* tbl =
+        (const Stride2_Table*)((unsigned char*)buf + buf->stride2_ofst);
+    const unsigned char* class_map = tbl->class_map;
+    uint32 class_num = tbl->class_num;
+    uint32 class_num2 = class_num * class_num;
+    const uint32* step2 = Get_Step2(tbl, buf->state_num);
+
+    ac_result_t r = {-1, -1};
+    uint32 row = 0;     // The row of the current state in step2.
+    uint32 idx = 0;
+    for (; idx + 2 <= len; idx += 2) {
+        uint32 pair = class_map[(InputTy)str[idx]] * class_num +
+                      class_map[(InputTy)str[idx + 1]];
+        uint32 e = step2[row + pair];
+        if (likely(!(e & STRIDE2_HIT))) {
+            row = e >> 1;
+            continue;
+        }
+
+        // Either step has something to report; take them one at a time.
+        uint32 s = row / class_num2;
+        if (Stride2_Step<variant>(buf, tbl, s, str, idx, r) ||
+            Stride2_Step<variant>(buf, tbl, s, str, idx + 1, r)) {
+            return r;
+        }
+        row = s * class_num2;
+    }
+
+    // The last byte at odd position.
+    if (idx < len) {
+        uint32 s = row / class_num2;
+        Stride2_Step<variant>(buf, tbl, s, str, idx, r);
+    }
+    return r;
+}
+
+ac_result_t
+Stride2_Match(AC_Buffer* buf, const char* str, uint32 len) {
+    return Stride2_Match_Tmpl<MV_FIRST_MATCH>(buf, str, len);
+}
+
+ac_result_t
+Stride2_Match_Longest_L(AC_Buffer* buf, const char* str, uint32 len) {
+    return Stride2_Match_Tmpl<MV_LEFT_LONGEST>(buf, str, len);
+}
@@ -0,0 +1,80 @@
+#ifndef AC_STRIDE2_H
+#define AC_STRIDE2_H
+
+#include "ac_fast.hpp"
+
+// The stride-2 DFA engine, which consumes two bytes per transition.
+//
+// Like the Sheng table (see ac_sheng.hpp), the AC graph is turned into a DFA
+// by resolving the fail-links, and inputs with the same transitions are put
+// in the same class. Since only the inputs of the transitions make a
+// difference, a dictionary over a small alphabet (e.g. hex digits) has few
+// classes, and the transitions on each pair of classes can be tabulated,
+// halving the number of steps depending on each other.
+//
+// There are two tables, both indiced by state and then class(es):
+//
+//  - step1: the element is the next state, shifted by 2, tagged with
+//    STRIDE2_TERM if the next state is terminal, and STRIDE2_PREHIT if some
+//    state visited via fail-link before taking the transition is terminal.
+//    It's Match_Tmpl() which reports the latter.
+//
+//  - step2: the element is the index of the row of the state two steps
+//    away, shifted by 1, tagged with STRIDE2_HIT if either step has any tag.
+//
+// The matcher takes two bytes at a time with step2, and only if the step
+// yields STRIDE2_HIT, or there is one byte left, it takes the bytes one at
+// a time with step1 to find out which match ends at which position.
+//
+// The engine is used only if the tables fit in STRIDE2_MAX_SZ bytes, and
+// unless asked for with AC_OPT_STRIDE2, only if there are no more than
+// STRIDE2_CLASS_MAX classes, as the tables grow with the square of it.
+//
+#define STRIDE2_TERM    1
+#define STRIDE2_PREHIT  2
+#define STRIDE2_HIT     1
+
+#define STRIDE2_MAX_SZ  (1 << 20)
+
+// The classes of the hex digits, plus that of the rest.
+#define STRIDE2_CLASS_MAX   17
+
+typedef struct {
+    unsigned char class_map[256];   // input -> class
+    uint32 class_num;
+
+    // Followed by:
+    // uint32 step1[state_num][class_num];
+    // uint32 step2[state_num][class_num * class_num];
+} Stride2_Table;
+
+// Return the number of classes of the graph, whose transitions are on
+// "input_num" distinct inputs. Each such input is a class of its own, and
+// the rest, if any, make up one class.
+static inline uint32
+Stride2_Class_Num(uint32 input_num) {
+    return input_num < 256 ? input_num + 1 : 256;
+}
+
+// Return the size in byte of the stride-2 tables.
+static inline uint64
+Stride2_Table_Sz(uint64 state_num, uint32 class_num) {
+    uint64 class_num2 = (uint64)class_num * class_num;
+    return sizeof(Stride2_Table) +
+           state_num * (class_num + class_num2) * sizeof(uint32);
+}
+
+// Populate the stride-2 tables of the well-formed "buf", which is allocated
+// by Stride2_Table_Sz() bytes.
+void Build_Stride2_Table(AC_Buffer* buf, Stride2_Table* tbl);
+
+// Check if the stride-2 tables of "buf" are exactly what
+// Build_Stride2_Table() would produce; the rest of the buffer must be
+// already validated.
+bool Validate_Stride2_Table(AC_Buffer* buf);
+
+ac_result_t Stride2_Match(AC_Buffer* buf, const char* str, uint32 len);
+ac_result_t Stride2_Match_Longest_L(AC_Buffer* buf, const char* str,
+                                   uint32 len);
+
+#endif  // AC_STRIDE2_H
@@ -0,0 +1,92 @@
+// Per-pattern hit telemetry, see ac_telemetry_enable().
+//
+#include <stdlib.h>     // for posix_memalign
+#include <string.h>
+#include "ac_telemetry.hpp"
+#include "ac.h"
+
+__thread uint32 AC_Telemetry::_thread_slot = (uint32)-1;
+uint32 AC_Telemetry::_next_slot = 0;
+
+AC_Telemetry::AC_Telemetry(uint32 pattern_num) : _pattern_num(pattern_num) {
+    memset(_stripes, 0, sizeof(_stripes));
+}
+
+AC_Telemetry::~AC_Telemetry() {
+    for (uint32 i = 0; i < TELEMETRY_STRIPE_NUM; i++)
+        free(_stripes[i]);
+}
+
+uint64*
+AC_Telemetry::Alloc_Stripe(uint32 slot) {
+    // Round the size up to whole cache lines, such that the array doesn't
+    // share any line with others.
+    uint64 sz = (uint64)_pattern_num * sizeof(uint64);
+    sz = (sz + TELEMETRY_LINE_SZ - 1) & ~(uint64)(TELEMETRY_LINE_SZ - 1);
+
+    void* p;
+    if (posix_memalign(&p, TELEMETRY_LINE_SZ, sz))
+        abort();
+    memset(p, 0, sz);
+
+    // Some other thread sharing the slot may have beaten us to it.
+    uint64* stripe = (uint64*)p;
+    uint64* expected = 0;
+    if (!__atomic_compare_exchange_n(&_stripes[slot], &expected, stripe,
+                                     false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        free(p);
+        stripe = expected;
+    }
+    return stripe;
+}
+
+void
+AC_Telemetry::Snapshot(unsigned long long* hits_v, bool reset) {
+    memset(hits_v, 0, _pattern_num * sizeof(hits_v[0]));
+    for (uint32 s = 0; s < TELEMETRY_STRIPE_NUM; s++) {
+        uint64* stripe = __atomic_load_n(&_stripes[s], __ATOMIC_ACQUIRE);
+        if (!stripe)
+            continue;
+
+        // Swapping the counters for zeros, rather than reading and then
+        // zeroing them, doesn't lose the hits counted in between.
+        for (uint32 i = 0; i < _pattern_num; i++) {
+            hits_v[i] += reset ?
+                __atomic_exchange_n(stripe + i, 0, __ATOMIC_RELAXED) :
+                __atomic_load_n(stripe + i, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+extern "C" void
+ac_telemetry_enable(ac_t* ac) {
+    AC_Buffer* buf = (AC_Buffer*)(void*)ac;
+    ASSERT(((buf_header_t*)ac)->magic_num == AC_MAGIC_NUM);
+    if (__atomic_load_n(&buf->telemetry, __ATOMIC_ACQUIRE))
+        return;
+
+    // Racing with another thread turning it on is harmless.
+    AC_Telemetry* t = new AC_Telemetry(buf->pattern_num);
+    AC_Telemetry* expected = 0;
+    if (!__atomic_compare_exchange_n(&buf->telemetry, &expected, t, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        delete t;
+    }
+}
+
+extern "C" int
+ac_telemetry_snapshot(ac_t* ac, unsigned long long* hits_v,
+                      unsigned int cap, int reset) {
+    AC_Buffer* buf = (AC_Buffer*)(void*)ac;
+    ASSERT(((buf_header_t*)ac)->magic_num == AC_MAGIC_NUM);
+
+    AC_Telemetry* t = __atomic_load_n(&buf->telemetry, __ATOMIC_ACQUIRE);
+    if (!t)
+        return -1;
+
+    uint32 pattern_num = t->Get_Pattern_Num();
+    if (cap >= pattern_num)
+        t->Snapshot(hits_v, reset != 0);
+    return pattern_num;
+}
@@ -0,0 +1,110 @@
+#ifndef AC_TELEMETRY_H
+#define AC_TELEMETRY_H
+
+#include "ac_fast.hpp"
+
+// The number of counter arrays, i.e. stripes, of an instance. Must be a
+// power of 2.
+#define TELEMETRY_STRIPE_NUM    16
+#define TELEMETRY_LINE_SZ       64
+
+// Per-pattern hit counters, see ac_telemetry_enable().
+//
+// The counters are striped rather than per thread: a thread is handed a
+// stripe the first time it counts into any instance, the next one of the
+// TELEMETRY_STRIPE_NUM stripes in round robin, and uses the same stripe of
+// every instance from then on. So, a thread has a stripe to itself only if
+// no more than TELEMETRY_STRIPE_NUM threads have ever counted; otherwise,
+// the threads sharing a stripe bounce its cache lines among them.
+//
+// The counters are bumped with relaxed atomic adds, which are locked
+// read-modify-writes on x86, whether the stripe is shared or not. They keep
+// the threads sharing a stripe from losing counts, and let a snapshot be
+// taken and the counters reset while the matchers are running. The stripes
+// are allocated on first use, each in its own cache lines.
+//
+class AC_Telemetry {
+public:
+    AC_Telemetry(uint32 pattern_num);
+    ~AC_Telemetry();
+
+    void Count(uint32 pattern_idx) {
+        ASSERT(pattern_idx < _pattern_num);
+        __atomic_fetch_add(Get_Stripe() + pattern_idx, 1, __ATOMIC_RELAXED);
+    }
+
+    void Count(const ac_result_t* result_v, uint32 num) {
+        if (!num)
+            return;
+
+        uint64* stripe = Get_Stripe();
+        for (uint32 i = 0; i < num; i++) {
+            ASSERT((uint32)result_v[i].pattern_idx < _pattern_num);
+            __atomic_fetch_add(stripe + result_v[i].pattern_idx, 1,
+                               __ATOMIC_RELAXED);
+        }
+    }
+
+    // Add up the counters of all the arrays to "hits_v", and zero them if
+    // "reset" is true.
+    void Snapshot(unsigned long long* hits_v, bool reset);
+
+    uint32 Get_Pattern_Num() const { return _pattern_num; }
+
+    // Return the calling thread's slot, which is less than
+    // TELEMETRY_STRIPE_NUM. It's also used by the shadow verification.
+    static uint32 Get_Thread_Slot() {
+        if (unlikely(_thread_slot == (uint32)-1)) {
+            _thread_slot = __atomic_fetch_add(&_next_slot, 1,
+                                              __ATOMIC_RELAXED) &
+                           (TELEMETRY_STRIPE_NUM - 1);
+        }
+        return _thread_slot;
+    }
+
+private:
+    uint64* Get_Stripe() {
+        uint32 slot = Get_Thread_Slot();
+        uint64* stripe = __atomic_load_n(&_stripes[slot], __ATOMIC_ACQUIRE);
+        if (unlikely(!stripe))
+            stripe = Alloc_Stripe(slot);
+        return stripe;
+    }
+
+    uint64* Alloc_Stripe(uint32 slot);
+
+    uint32 _pattern_num;
+    uint64* _stripes[TELEMETRY_STRIPE_NUM];
+
+    // Shared by all instances, such that a thread uses the same slot of
+    // every instance.
+    static __thread uint32 _thread_slot;
+    static uint32 _next_slot;
+};
+
+// Count the matches reported by the API, if the telemetry is on. The check
+// is all it costs otherwise.
+static inline void
+Count_Hits(AC_Buffer* buf, const ac_result_t& r) {
+    AC_Telemetry* t = __atomic_load_n(&buf->telemetry, __ATOMIC_ACQUIRE);
+    if (unlikely(t != 0) && r.match_begin >= 0)
+        t->Count(r.pattern_idx);
+}
+
+static inline void
+Count_Hits(AC_Buffer* buf, const ac_result_t* result_v, int num) {
+    AC_Telemetry* t = __atomic_load_n(&buf->telemetry, __ATOMIC_ACQUIRE);
+    if (unlikely(t != 0) && num > 0)
+        t->Count(result_v, num);
+}
+
+// Free the counters of the instance about to go away.
+static inline void
+Free_Telemetry(AC_Buffer* buf) {
+    if (buf->telemetry) {
+        delete buf->telemetry;
+        buf->telemetry = 0;
+    }
+}
+
+#endif // AC_TELEMETRY_H
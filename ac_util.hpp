@@ -58,6 +58,7 @@ typedef unsigned char InputTy;
 typedef enum {
     IMPL_SLOW_VARIANT = 1,
     IMPL_FAST_VARIANT = 2,
+    IMPL_POOL_VARIANT = 3,
 } impl_var_t;
 
 #define AC_MAGIC_NUM 0x5a
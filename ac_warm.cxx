@@ -0,0 +1,183 @@
+// Warm-up of instances, see ac_warm().
+//
+#include <sys/mman.h>   // for madvise, mlock2
+#include <errno.h>
+#include <stdint.h>     // for uintptr_t
+#include <string.h>
+#include <unistd.h>     // for sysconf
+#include "ac_fast.hpp"
+#include "ac_lazy.hpp"
+#include "ac_warm.hpp"
+#include "ac.h"
+
+#define DEFAULT_WARM_DEPTH  3
+#define CACHE_LINE_SZ       64
+
+// Where the loads of Touch() go, such that they are not optimized away.
+static volatile unsigned char touch_sink;
+
+// Round the range [p, p+len) to the page boundaries, as madvise() and
+// friends want: outwards, or inwards such that only the pages entirely in
+// the range are covered.
+static void
+Page_Range(const void* p, uint64 len, bool inner, void** start,
+           size_t* page_len) {
+    uintptr_t page_sz = sysconf(_SC_PAGESIZE);
+    uintptr_t lo, hi;
+    if (inner) {
+        lo = ((uintptr_t)p + page_sz - 1) & ~(page_sz - 1);
+        hi = ((uintptr_t)p + len) & ~(page_sz - 1);
+        if (hi < lo)
+            hi = lo;
+    } else {
+        lo = (uintptr_t)p & ~(page_sz - 1);
+        hi = ((uintptr_t)p + len + page_sz - 1) & ~(page_sz - 1);
+    }
+    *start = (void*)lo;
+    *page_len = hi - lo;
+}
+
+// The pages at either end of a heap buffer may hold other allocations, which
+// may be locked on their own, and are unlocked by whoever locked them. So, the
+// locking of a heap buffer covers only the pages entirely in it, whereas that
+// of a mapped one covers all of its pages.
+void
+Unlock_Pages(const void* p, uint64 len) {
+    void* start;
+    size_t page_len;
+    Page_Range(p, len, true, &start, &page_len);
+    if (page_len)
+        munlock(start, page_len);
+}
+
+// Read one byte per "stride" bytes of [p, p+len), such that the memory is
+// faulted in or loaded into the cache. Return the number of bytes covered.
+static uint64
+Touch(const void* p, uint64 len, uint32 stride) {
+    const volatile unsigned char* b = (const volatile unsigned char*)p;
+    unsigned char sum = 0;
+    for (uint64 i = 0; i < len; i += stride)
+        sum += b[i];
+    if (len)
+        sum += b[len - 1];
+    touch_sink = sum;
+    return len;
+}
+
+// Touch the hot part of the buffer: the header and everything the matcher
+// looks at for the states no deeper than "max_depth". As the states are laid
+// out in BFS order, they are a prefix of the states, and the IDs of them are
+// a prefix of the state offset vector. The pattern table is not looked at by
+// the matcher.
+static uint64
+Touch_Hot(AC_Buffer* buf, uint32 max_depth) {
+    unsigned char* base = (unsigned char*)buf;
+
+    // The derived graphs and the DFA tables are used as a whole.
+    if (buf->flags & (BUF_LOUDS | BUF_COMPACT))
+        return Touch(base, Get_Graph_Len(buf), CACHE_LINE_SZ);
+
+    uint32 graph_len = Get_Graph_Len(buf);
+    AC_Ofst states_end = buf->sheng_ofst ? buf->sheng_ofst :
+                         buf->stride2_ofst ? buf->stride2_ofst :
+                         buf->da_ofst ? buf->da_ofst :
+                         buf->composite_ofst ? buf->composite_ofst :
+                         buf->qgram_ofst ? buf->qgram_ofst :
+                         graph_len;
+    uint64 sz = Touch(base, buf->states_ofst_ofst, CACHE_LINE_SZ);
+    sz += Touch(base + states_end, graph_len - states_end, CACHE_LINE_SZ);
+
+    State_ID hot_num = 1;
+    while (hot_num < buf->state_num &&
+           (uint32)Get_State(buf, hot_num)->depth <= max_depth) {
+        hot_num++;
+    }
+
+    AC_Ofst hot_end = states_end;
+    if (hot_num < buf->state_num)
+        hot_end = (unsigned char*)Get_State(buf, hot_num) - base;
+
+    sz += Touch(base + buf->states_ofst_ofst, hot_num * sizeof(AC_Ofst),
+                CACHE_LINE_SZ);
+    sz += Touch(base + buf->first_state_ofst,
+                hot_end - buf->first_state_ofst, CACHE_LINE_SZ);
+    return sz;
+}
+
+extern "C" int
+ac_warm(ac_t* ac, unsigned int flags, const ac_warm_opt_t* opt,
+        ac_warm_stat_t* stat) {
+    AC_Buffer* buf = (AC_Buffer*)(void*)ac;
+    ASSERT(buf->hdr.magic_num == AC_MAGIC_NUM);
+
+    uint64 start_usec = Now_Usec();
+    uint64 fault_bytes = 0, touch_bytes = 0;
+    int err = 0;
+
+    uint32 max_depth = DEFAULT_WARM_DEPTH;
+    if (opt && opt->max_depth)
+        max_depth = opt->max_depth;
+
+    // The lazy graph is allocated as it's materialized, which is what warming
+    // it up is about.
+    if (buf->flags & BUF_LAZY) {
+        flags &= ~(AC_WARM_PREFAULT | AC_WARM_LOCK);
+        if (flags & AC_WARM_TOUCH)
+            touch_bytes = AC_Lazy::Get(buf)->Warm(max_depth);
+        flags &= ~AC_WARM_TOUCH;
+    }
+
+    void* page_start;
+    size_t page_len;
+    Page_Range(buf, buf->buf_len, false, &page_start, &page_len);
+
+    // A mapped buffer is read ahead as a whole, rather than a page per fault.
+    // Either way, the pages are then faulted in one after another.
+    if (flags & AC_WARM_PREFAULT) {
+        madvise(page_start, page_len, MADV_WILLNEED);
+        fault_bytes = Touch(buf, buf->buf_len, sysconf(_SC_PAGESIZE));
+    }
+
+    // The pages are faulted in by reading them, and then locked as they are.
+    // A plain mlock() would fault them in for writing, as the mappings are
+    // private and writable (see Map_File()), turning each page of a mapped
+    // buffer or pool into a private copy rather than that of the page cache.
+    // The mapped buffer is unlocked by unmapping it, which unlocks all of its
+    // pages.
+    if (flags & AC_WARM_LOCK) {
+        void* lock_start;
+        size_t lock_len;
+        Page_Range(buf, buf->buf_len, !(buf->flags & BUF_MAPPED), &lock_start,
+                   &lock_len);
+        if (!(flags & AC_WARM_PREFAULT))
+            Touch(buf, buf->buf_len, sysconf(_SC_PAGESIZE));
+        if (!lock_len || mlock2(lock_start, lock_len, MLOCK_ONFAULT) == 0) {
+            if (!(buf->flags & BUF_LOCKED))
+                buf->flags |= BUF_LOCKED;
+            fault_bytes = buf->buf_len;
+        } else {
+            err = errno;
+        }
+    }
+
+    if (flags & AC_WARM_TOUCH)
+        touch_bytes = Touch_Hot(buf, max_depth);
+
+    if (opt && opt->sample) {
+        ac_scan_t scan;
+        memset(&scan, 0, sizeof(scan));
+        Match_Count(buf, opt->sample, opt->sample_len, 0, &scan);
+    }
+
+    if (stat) {
+        stat->usec = Now_Usec() - start_usec;
+        stat->fault_bytes = fault_bytes;
+        stat->touch_bytes = touch_bytes;
+    }
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
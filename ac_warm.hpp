@@ -0,0 +1,10 @@
+#ifndef AC_WARM_H
+#define AC_WARM_H
+
+#include "ac_util.hpp"
+
+// Undo the mlock(2) of ac_warm() on the "len" bytes at "p", which is called
+// before the memory is freed.
+void Unlock_Pages(const void* p, uint64 len);
+
+#endif // AC_WARM_H
@@ -27,6 +27,34 @@ static string dict_dir;
 static string obj_file_dir;
 static bool print_help = false;
 static int piece_size = 1024;
+static bool adversarial_only = false;
+
+// The match engines to be compared against each other.
+typedef struct {
+    const char* name;
+    unsigned int opt_flags; // The ac_opt_t::flags passed to ac_create_opt()
+} Engine;
+
+static const Engine engines[] = {
+    { "loop",     AC_OPT_NO_SHENG | AC_OPT_NO_STRIDE2 | AC_OPT_NO_COMPACT },
+    { "threaded", AC_OPT_THREADED },
+
+    // Same as "loop" unless the dictionary is tiny, has the stride-2 tables
+    // fitting in 1MB, or is tiny, respectively.
+    { "sheng",    AC_OPT_NO_STRIDE2 | AC_OPT_NO_COMPACT },
+    { "stride2",  AC_OPT_STRIDE2 | AC_OPT_NO_SHENG | AC_OPT_NO_COMPACT },
+    { "compact",  AC_OPT_NO_SHENG | AC_OPT_NO_STRIDE2 },
+    { "double-array", AC_OPT_DOUBLE_ARRAY },
+    { "succinct", AC_OPT_SUCCINCT },
+    { "lazy",     AC_OPT_LAZY },
+
+    // Same as "loop" unless the dictionary mixes short and long patterns.
+    { "composite", AC_OPT_COMPOSITE },
+
+    // Same as the automatic pick unless no pattern is shorter than 8 bytes.
+    { "qgram",    AC_OPT_QGRAM_FILTER },
+};
+static const int engine_num = sizeof(engines)/sizeof(engines[0]);
 
 class PatternSet {
 public:
@@ -279,8 +307,9 @@ private:
 
 class Benchmark {
 public:
-    Benchmark(const PatternSet& pat_set, const char* infile):
-        _pat_set(pat_set), _infile(infile) {
+    Benchmark(const PatternSet& pat_set, const char* infile,
+              const Engine& engine):
+        _pat_set(pat_set), _infile(infile), _engine(engine) {
         _mmap = (char*)MAP_FAILED;
         _file_sz = 0;
         _fd = -1;
@@ -299,6 +328,7 @@ public:
 private:
     const PatternSet& _pat_set;
     const char* _infile;
+    const Engine& _engine;
     char* _mmap;
     int _fd;
     size_t _file_sz; // input file size
@@ -339,9 +369,13 @@ Benchmark::Run(int iteration) {
         _file_sz = filestat.st_size;
     }
 
-    ac_t* ac = ac_create(_pat_set.getPatternVector(),
-                         _pat_set.getPatternLenVector(),
-                         _pat_set.getPatternNum());
+    ac_opt_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.flags = _engine.opt_flags;
+
+    ac_t* ac = ac_create_opt(_pat_set.getPatternVector(),
+                             _pat_set.getPatternLenVector(),
+                             _pat_set.getPatternNum(), &opt);
     if (!ac) {
         SomethingWrong = true;
         return false;
@@ -368,9 +402,225 @@ Benchmark::Run(int iteration) {
     return true;
 }
 
-const char* short_opt = "hd:f:i:p:";
+/////////////////////////////////////////////////////////////////////////
+//
+//      Adversarial cases
+//
+/////////////////////////////////////////////////////////////////////////
+//
+// Generated dictionary/input pairs aiming at the worst case of the matcher,
+// in particular the fail-link behavior. Unlike the files under the
+// dictionary and object-file dirs, they don't depend on the test data.
+//
+typedef struct {
+    const char* name;
+    vector<string> patterns;
+    string input;
+} AdvCase;
+
+// Size of the input of each adversarial case
+static const int adv_input_len = 1024 * 1024;
+
+static string
+Random_String(int len, int first_char, int char_num) {
+    string s(len, 0);
+    for (int i = 0; i < len; i++)
+        s[i] = (char)(first_char + rand() % char_num);
+    return s;
+}
+
+static void
+Gen_Adversarial_Cases(vector<AdvCase>& cases) {
+    cases.clear();
+    srand(0x5eed);
+
+    // a^n against {a^k b}: stays deep in the trie without ever matching.
+    {
+        AdvCase c;
+        c.name = "a^n vs {a^k b}";
+        for (int k = 1; k <= 64; k++)
+            c.patterns.push_back(string(k, 'a') + "b");
+        c.input = string(adv_input_len, 'a');
+        cases.push_back(c);
+    }
+
+    // Long shared prefix, and the input fails at the deepest state, walking
+    // along a fail-link chain as long as the prefix.
+    {
+        AdvCase c;
+        c.name = "deep shared prefix";
+        string prefix;
+        for (int i = 0; i < 24; i++)
+            prefix += "ab";
+        for (int i = 0; i < 256; i++)
+            c.patterns.push_back(prefix + (char)('A' + i / 16) +
+                                 (char)('A' + i % 16));
+        string unit = prefix + "x";
+        while ((int)c.input.size() < adv_input_len)
+            c.input += unit;
+        c.input.resize(adv_input_len);
+        cases.push_back(c);
+    }
+
+    // A terminal state at every byte.
+    {
+        AdvCase c;
+        c.name = "hit at every byte";
+        for (int i = 0; i < 26; i++) {
+            c.patterns.push_back(string(1, 'a' + i));
+            c.patterns.push_back(string(1, 'a' + i) + (char)('a' + (i + 1) % 26));
+        }
+        c.input = Random_String(adv_input_len, 'a', 26);
+        cases.push_back(c);
+    }
+
+    // Tiny dictionary, which is small enough for the Sheng table, against
+    // the text full of its partial matches.
+    {
+        AdvCase c;
+        c.name = "tiny dictionary";
+        c.patterns.push_back("abcd");
+        c.patterns.push_back("bcx");
+        c.patterns.push_back("dab");
+        c.input = Random_String(adv_input_len, 'a', 4);
+        cases.push_back(c);
+    }
+
+    // Hex strings, like a list of IOCs, against hex text. The alphabet is
+    // small enough for the stride-2 tables.
+    {
+        AdvCase c;
+        c.name = "hex dictionary";
+        const char* hex = "0123456789abcdef";
+        for (int i = 0; i < 48; i++) {
+            string p;
+            for (int j = 0; j < 8; j++)
+                p += hex[rand() % 16];
+            c.patterns.push_back(p);
+        }
+        for (int i = 0; i < adv_input_len; i++)
+            c.input += hex[rand() % 16];
+        cases.push_back(c);
+    }
+
+    // A large dictionary of words, where the memory footprint matters.
+    {
+        AdvCase c;
+        c.name = "large dictionary";
+        for (int i = 0; i < 60000; i++)
+            c.patterns.push_back(Random_String(6 + rand() % 10, 'a', 26));
+        c.input = Random_String(adv_input_len, 'a', 26);
+        cases.push_back(c);
+    }
+
+    // The root-node with 255 and 256 valid inputs, which are laid-out in a
+    // special way.
+    for (int fanout = 255; fanout <= 256; fanout++) {
+        AdvCase c;
+        c.name = fanout == 255 ? "root fanout 255" : "root fanout 256";
+        for (int i = 256 - fanout; i < 256; i++)
+            c.patterns.push_back(string(2, (char)i));
+        c.input = Random_String(adv_input_len, 0, 256);
+        cases.push_back(c);
+    }
+}
+
+// Scan the entire input with ac_match(), restarting right after each match,
+// like a grep loop does.
+static void
+Scan_Input(ac_t* ac, const string& input) {
+    const char* str = input.data();
+    unsigned int len = input.size();
+    unsigned int ofst = 0;
+    while (ofst < len) {
+        ac_result_t r = ac_match(ac, str + ofst, len - ofst);
+        if (r.match_begin < 0)
+            break;
+        ofst += r.match_end + 1;
+    }
+}
+
+static void
+Run_Adversarial_Suite() {
+    vector<AdvCase> cases;
+    Gen_Adversarial_Cases(cases);
+
+    int round = iteration / 30;
+    if (round < 1)
+        round = 1;
+
+    fprintf(stdout, "Adversarial cases, input size = %d, round = %d "
+            "(ns/byte of first/longest/count)\n", adv_input_len, round);
+
+    // The size of the instance of each case, in bytes per pattern.
+    vector<vector<double> > sizes;
+
+    for (vector<AdvCase>::iterator iter = cases.begin(), iter_e = cases.end();
+         iter != iter_e; ++iter) {
+        const AdvCase& c = *iter;
+        vector<const char*> pat_v;
+        vector<unsigned int> len_v;
+        for (size_t i = 0; i < c.patterns.size(); i++) {
+            pat_v.push_back(c.patterns[i].data());
+            len_v.push_back(c.patterns[i].size());
+        }
+
+        fprintf(stdout, "  %-20s:", c.name);
+        sizes.push_back(vector<double>(engine_num, 0));
+        for (int e = 0; e < engine_num; e++) {
+            ac_opt_t opt;
+            memset(&opt, 0, sizeof(opt));
+            opt.flags = engines[e].opt_flags;
+            ac_t* ac = ac_create_opt(&pat_v[0], &len_v[0], pat_v.size(), &opt);
+            if (!ac) {
+                SomethingWrong = true;
+                fprintf(stdout, " %s fail to create", engines[e].name);
+                continue;
+            }
+
+            Timer t_first, t_longest, t_count;
+            for (int i = 0; i < round; i++) {
+                t_first.Start();
+                Scan_Input(ac, c.input);
+                t_first.Stop();
+
+                // ac_match_longest_l() goes through the entire input anyway.
+                t_longest.Start();
+                ac_match_longest_l(ac, c.input.data(), c.input.size());
+                t_longest.Stop();
+
+                t_count.Start();
+                ac_match_count(ac, c.input.data(), c.input.size(), 0, 0);
+                t_count.Stop();
+            }
+            sizes.back()[e] = (double)ac_serialize(ac, 0, 0) / pat_v.size();
+            ac_free(ac);
+
+            double bytes = (double)c.input.size() * round / 1000.0;
+            fprintf(stdout, "%s %s %.2f/%.2f/%.2f", e ? "," : "",
+                    engines[e].name, t_first.getDuration() / bytes,
+                    t_longest.getDuration() / bytes,
+                    t_count.getDuration() / bytes);
+        }
+        fputs("\n", stdout);
+    }
+
+    fprintf(stdout, "\nSize of the instances (bytes/pattern)\n");
+    for (size_t i = 0; i < cases.size(); i++) {
+        fprintf(stdout, "  %-20s:", cases[i].name);
+        for (int e = 0; e < engine_num; e++) {
+            fprintf(stdout, "%s %s %.1f", e ? "," : "", engines[e].name,
+                    sizes[i][e]);
+        }
+        fputs("\n", stdout);
+    }
+    fputs("\n", stdout);
+}
+
+const char* short_opt = "had:f:i:p:";
 const struct option long_opts[] = {
     {"help",            no_argument,        0, 'h'},
+    {"adversarial",     no_argument,        0, 'a'},
     {"iteration",       required_argument,  0, 'i'},
     {"dictionary-dir",  required_argument,  0, 'd'},
     {"obj-file-dir",    required_argument,  0, 'f'},
@@ -381,6 +631,7 @@ static void
 PrintHelp(const char* prog_name) {
     const char* msg =
 "Usage %s [OPTIONS]\n"
+"  -a, --adversarial     : Only run the generated adversarial cases\n"
 "  -d, --dictionary-dir  : specify the dictionary directory (./dict by default)\n"
 "  -f, --obj-file-dir    : specify the object file directory\n"
 "                          (./testinput by default)\n"
@@ -412,6 +663,10 @@ getOptions(int argc, char** argv) {
             print_help = true;
             break;
 
+        case 'a':
+            adversarial_only = true;
+            break;
+
         case 'i':
             iteration = atol(optarg);
             break;
@@ -464,6 +719,11 @@ main(int argc, char** argv) {
             " by gettimeofday(2) which is imprecise!!!\n\n");
 #endif
 
+    if (adversarial_only) {
+        Run_Adversarial_Suite();
+        return SomethingWrong ? -1 : 0;
+    }
+
     fprintf(stdout, "Test with iteration = %d, piece size = %d, and",
             iteration, piece_size);
     fprintf(stdout, "\n  dictionary dir = %s\n  object file dir = %s\n\n",
@@ -498,22 +758,32 @@ main(int argc, char** argv) {
         }
 
         fprintf(stdout, "Using dictionary %s\n", dict_name);
-        Timer timer;
+        vector<Timer> timers(engine_num);
         for (vector<string>::iterator iter = input_files.begin(),
                 iter_e = input_files.end(); iter != iter_e; ++iter) {
             fprintf(stdout, "  testing %s ... ", iter->c_str());
-            fflush(stdout);
-            Benchmark bm(ps, iter->c_str());
-            bm.Run(iteration);
-            const Timer& t = bm.getTimer();
-            timer += bm.getTimer();
-            fprintf(stdout, "elapsed %.3f\n", t.getDuration() / 1000000.0);
+            for (int i = 0; i < engine_num; i++) {
+                fflush(stdout);
+                Benchmark bm(ps, iter->c_str(), engines[i]);
+                bm.Run(iteration);
+                const Timer& t = bm.getTimer();
+                timers[i] += t;
+                fprintf(stdout, "%s%s %.3f", i ? ", " : "", engines[i].name,
+                        t.getDuration() / 1000000.0);
+            }
+            fputs("\n", stdout);
         }
 
         fprintf(stdout,
                 "\n==========================================================\n"
-                " Total Elapse %.3f\n\n", timer.getDuration() / 1000000.0);
+                " Total Elapse");
+        for (int i = 0; i < engine_num; i++) {
+            fprintf(stdout, "%s %s %.3f", i ? "," : "", engines[i].name,
+                    timers[i].getDuration() / 1000000.0);
+        }
+        fputs("\n\n", stdout);
     }
 
+    Run_Adversarial_Suite();
     return SomethingWrong ? -1 : 0;
 }
@@ -18,16 +18,23 @@ using namespace std;
 namespace {
 class ACBigFileTester : public BigFileTester {
 public:
-    ACBigFileTester(const char* filepath) : BigFileTester(filepath){};
+    ACBigFileTester(const char* filepath, const EngineInfo& engine) :
+        BigFileTester(filepath), _engine(engine) {};
 
 private:
     virtual buf_header_t* PM_Create(const char** strv, uint32* strlenv,
                                     uint32 vect_len) {
-        return (buf_header_t*)ac_create(strv, strlenv, vect_len);
+        ac_opt_t opt;
+        memset(&opt, 0, sizeof(opt));
+        opt.flags = _engine.opt_flags;
+        fprintf(stdout, "Engine: %s\n", _engine.name);
+        return (buf_header_t*)ac_create_opt(strv, strlenv, vect_len, &opt);
     }
 
     virtual void PM_Free(buf_header_t* PM) { ac_free(PM); }
     virtual bool Run_Helper(buf_header_t* PM);
+
+    const EngineInfo& _engine;
 };
 
 class ACTestAggressive: public ACTestBase {
@@ -120,9 +127,11 @@ ACTestAggressive::Run() {
     int fail = 0;
     for (vector<const char*>::iterator i = _files.begin(), e = _files.end();
          i != e; i++) {
-        ACBigFileTester bft(*i);
-        if (!bft.Run())
-            fail ++;
+        for (int engine_idx = 0; engine_idx < engine_num; engine_idx++) {
+            ACBigFileTester bft(*i, engines[engine_idx]);
+            if (!bft.Run())
+                fail ++;
+        }
     }
     return fail == 0;
 }
@@ -0,0 +1,2217 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "ac.h"
+#include "ac_util.hpp"
+#include "test_base.hpp"
+
+using namespace std;
+
+/////////////////////////////////////////////////////////////////////////
+//
+//      Testing the interface functions beyond plain create-and-match.
+//
+/////////////////////////////////////////////////////////////////////////
+//
+namespace {
+typedef bool (*APITestFunc)();
+
+typedef struct {
+    const char* name;
+    APITestFunc func;
+} APITest;
+
+class ACTestAPI : public ACTestBase {
+public:
+    ACTestAPI(const APITest* tests, int test_num, const char* banner) :
+        ACTestBase(banner), _tests(tests), _test_num(test_num) {}
+    virtual bool Run();
+
+private:
+    const APITest* _tests;
+    int _test_num;
+};
+
+// Create an instance with the given options from a NULL-terminated vector
+// of C strings.
+ac_t*
+Create_AC(const char** dict, const ac_opt_t* opt = 0) {
+    vector<unsigned int> len_v;
+    for (int i = 0; dict[i]; i++)
+        len_v.push_back(strlen(dict[i]));
+
+    return ac_create_opt(dict, &len_v[0], len_v.size(), opt);
+}
+
+#define CHECK(c) \
+    if (!(c)) { fprintf(stdout, "  %s:%d check '%s' failed\n", \
+                        __FILE__, __LINE__, #c); return false; }
+
+} // end of anonymous namespace
+
+bool
+ACTestAPI::Run() {
+    int fail = 0;
+    for (int i = 0; i < _test_num; i++) {
+        fprintf(stdout, ">Testing %s : ", _tests[i].name);
+        fflush(stdout);
+        if (_tests[i].func()) {
+            fprintf(stdout, "Pass\n");
+        } else {
+            fprintf(stdout, "Fail\n");
+            fail ++;
+        }
+    }
+
+    fprintf(stdout, "Test count : %d, fail: %d\n", _test_num, fail);
+    fflush(stdout);
+    return fail == 0;
+}
+
+static bool
+Same_Result(const ac_result_t& r1, const ac_result_t& r2) {
+    if (r1.match_begin < 0 || r2.match_begin < 0)
+        return r1.match_begin < 0 && r2.match_begin < 0;
+    return r1.match_begin == r2.match_begin && r1.match_end == r2.match_end &&
+           r1.pattern_idx == r2.pattern_idx;
+}
+
+// The options with the "flags", and nothing else.
+static ac_opt_t
+Make_Opt(unsigned int flags) {
+    ac_opt_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.flags = flags;
+    return opt;
+}
+
+// The flags of the generic engine, which the others are checked against.
+#define GENERIC_FLAGS (AC_OPT_NO_SHENG | AC_OPT_NO_STRIDE2 | AC_OPT_NO_COMPACT)
+
+// Return "num" random patterns of 1 to "max_len" chars, each of which is one
+// of the "alphabet" chars from "first" on.
+static vector<string>
+Random_Dict(int num, int max_len, int first, int alphabet) {
+    vector<string> pats;
+    for (int i = 0; i < num; i++) {
+        string p;
+        for (int j = 0, len = 1 + rand() % max_len; j < len; j++)
+            p += (char)(first + rand() % alphabet);
+        pats.push_back(p);
+    }
+    return pats;
+}
+
+// A copy of the patterns, along with the vectors of the pointers to them and
+// their lengths, which is what ac_create_opt() takes.
+class Pattern_Vect {
+public:
+    explicit Pattern_Vect(const vector<string>& v) : pats(v) {
+        for (size_t i = 0; i < pats.size(); i++) {
+            pat_v.push_back(pats[i].data());
+            len_v.push_back(pats[i].size());
+        }
+    }
+
+    ac_t* Create(const ac_opt_t* opt = 0) {
+        return ac_create_opt(pat_v.empty() ? 0 : &pat_v[0],
+                             len_v.empty() ? 0 : &len_v[0], pat_v.size(), opt);
+    }
+
+    const vector<string> pats;
+    vector<const char*> pat_v;
+    vector<unsigned int> len_v;
+
+private:
+    Pattern_Vect(const Pattern_Vect&);
+    void operator=(const Pattern_Vect&);
+};
+
+// Check that "ac" agrees with "generic", which is built from the same
+// patterns, on "s" for all the match functions, including the scans of
+// ac_match_all() resumed halfway at random limits.
+static bool
+Compare_With_Generic(ac_t* ac, ac_t* generic, const char* s,
+                     unsigned int len) {
+    CHECK(Same_Result(ac_match(ac, s, len), ac_match(generic, s, len)));
+    CHECK(Same_Result(ac_match_longest_l(ac, s, len),
+                      ac_match_longest_l(generic, s, len)));
+    CHECK(ac_match_count(ac, s, len, 0, 0) ==
+          ac_match_count(generic, s, len, 0, 0));
+
+    ac_result_t r1[256], r2[256];
+    ac_limit_t limit;
+    memset(&limit, 0, sizeof(limit));
+    limit.max_matches = 1 + rand() % 7;
+    limit.max_bytes = rand() % 2 ? 0 : 1 + rand() % 50;
+    ac_scan_t scan1, scan2;
+    memset(&scan1, 0, sizeof(scan1));
+    memset(&scan2, 0, sizeof(scan2));
+    do {
+        int num = ac_match_all(ac, s, len, r1, 256, &limit, &scan1);
+        CHECK(num == ac_match_all(generic, s, len, r2, 256, &limit, &scan2));
+        for (int i = 0; i < num; i++)
+            CHECK(Same_Result(r1[i], r2[i]));
+        CHECK(scan1.status == scan2.status &&
+              scan1.resume_ofst == scan2.resume_ofst);
+    } while (scan1.status == AC_SCAN_TRUNCATED);
+    return true;
+}
+
+static bool
+Test_Shadow_Verify() {
+    const char* dict[] = {"he", "she", "his", "her", 0};
+    const char* strs[] = {"he", "she", "ahhe", "shis2", "nothing", "hers"};
+    int str_num = sizeof(strs)/sizeof(strs[0]);
+
+    ac_opt_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.verify_sample = 1;
+    ac_t* ac = Create_AC(dict, &opt);
+    CHECK(ac != 0);
+
+    for (int i = 0; i < str_num; i++)
+        ac_match(ac, strs[i], strlen(strs[i]));
+
+    ac_verify_stat_t stat;
+    CHECK(ac_get_verify_stat(ac, &stat) == 0);
+    CHECK(stat.sampled == (unsigned)str_num && stat.mismatch == 0);
+
+    // Pause the verification.
+    CHECK(ac_set_verify_sample(ac, 0) == 0);
+    for (int i = 0; i < str_num; i++)
+        ac_match2(ac, strs[i], strlen(strs[i]));
+    CHECK(ac_get_verify_stat(ac, &stat) == 0);
+    CHECK(stat.sampled == (unsigned)str_num);
+
+    // One in every two calls.
+    CHECK(ac_set_verify_sample(ac, 2) == 0);
+    for (int i = 0; i < 2 * str_num; i++)
+        ac_match2(ac, strs[0], strlen(strs[0]));
+    CHECK(ac_get_verify_stat(ac, &stat) == 0);
+    CHECK(stat.sampled == (unsigned)str_num * 2 && stat.mismatch == 0);
+    ac_free(ac);
+
+    // Each instance is sampled at its own rate, however the calls to them
+    // interleave.
+    opt.verify_sample = 1000;
+    ac = Create_AC(dict, &opt);
+    opt.verify_sample = 2;
+    ac_t* ac2 = Create_AC(dict, &opt);
+    CHECK(ac && ac2);
+    for (int i = 0; i < 1000; i++) {
+        ac_match2(ac, strs[1], strlen(strs[1]));
+        ac_match2(ac2, strs[1], strlen(strs[1]));
+    }
+    CHECK(ac_get_verify_stat(ac, &stat) == 0 && stat.sampled == 1);
+    CHECK(ac_get_verify_stat(ac2, &stat) == 0 && stat.sampled == 500);
+    ac_free(ac2);
+    ac_free(ac);
+
+    // Verification is not available if it was not asked for at creation.
+    ac = Create_AC(dict);
+    CHECK(ac_set_verify_sample(ac, 1) == -1);
+    CHECK(ac_get_verify_stat(ac, &stat) == -1);
+    ac_free(ac);
+
+    return true;
+}
+
+static bool
+Test_Match_All() {
+    const char* dict[] = {"he", "she", "his", "hers", 0};
+    ac_t* ac = Create_AC(dict);
+    CHECK(ac != 0);
+
+    // "she" and "he" end at the same offset, and the longer one goes first.
+    const char* str = "ushers";
+    ac_result_t expect[] = {{1, 3, 1}, {2, 3, 0}, {2, 5, 3}};
+    int expect_num = sizeof(expect)/sizeof(expect[0]);
+
+    ac_result_t r[8];
+    ac_scan_t scan;
+    memset(&scan, 0, sizeof(scan));
+    CHECK(ac_match_all(ac, str, strlen(str), r, 8, 0, &scan) == expect_num);
+    CHECK(scan.status == AC_SCAN_DONE);
+    for (int i = 0; i < expect_num; i++) {
+        CHECK(r[i].match_begin == expect[i].match_begin &&
+              r[i].match_end == expect[i].match_end &&
+              r[i].pattern_idx == expect[i].pattern_idx);
+    }
+    CHECK(ac_match_count(ac, str, strlen(str), 0, 0) == expect_num);
+    CHECK(ac_match_all(ac, "nothing", 7, r, 8, 0, 0) == 0);
+
+    // Stop after each match, and resume the scan where it was left,
+    // including in the middle of the matches ending at the same offset.
+    ac_limit_t limit;
+    memset(&limit, 0, sizeof(limit));
+    limit.max_matches = 1;
+    memset(&scan, 0, sizeof(scan));
+    for (int i = 0; i < expect_num; i++) {
+        CHECK(ac_match_all(ac, str, strlen(str), r, 8, &limit, &scan) == 1);
+        CHECK(r[0].match_begin == expect[i].match_begin &&
+              r[0].pattern_idx == expect[i].pattern_idx);
+    }
+    // The last match ends at the last byte, nothing is left behind.
+    CHECK(scan.status == AC_SCAN_DONE);
+
+    // A full result vector truncates the scan as well.
+    memset(&scan, 0, sizeof(scan));
+    CHECK(ac_match_all(ac, str, strlen(str), r, 2, 0, &scan) == 2);
+    CHECK(scan.status == AC_SCAN_TRUNCATED && scan.resume_ofst == 4);
+    CHECK(ac_match_all(ac, str, strlen(str), r, 2, 0, &scan) == 1);
+    CHECK(r[0].pattern_idx == 3 && scan.status == AC_SCAN_DONE);
+
+    ac_free(ac);
+    return true;
+}
+
+static bool
+Test_Scan_Limits() {
+    const char* dict[] = {"a", 0};
+    ac_t* ac = Create_AC(dict);
+    CHECK(ac != 0);
+
+    // A hit at every byte.
+    int len = 1024 * 1024;
+    string str(len, 'a');
+
+    ac_limit_t limit;
+    memset(&limit, 0, sizeof(limit));
+    limit.max_bytes = 1000;
+    ac_scan_t scan;
+    memset(&scan, 0, sizeof(scan));
+    CHECK(ac_match_count(ac, str.c_str(), len, &limit, &scan) == 1000);
+    CHECK(scan.status == AC_SCAN_TRUNCATED && scan.resume_ofst == 1000);
+
+    // Resuming with a time budget eventually goes through the whole string.
+    // However soon the budget runs out, each call scans the first 4KB (the
+    // interval the clock is checked at) before giving up, even though it
+    // stops at every byte for the hit.
+    limit.max_bytes = 0;
+    limit.max_usec = 1;
+    int total = 1000, call_num = 0;
+    while (scan.status == AC_SCAN_TRUNCATED) {
+        unsigned int prev = scan.resume_ofst;
+        total += ac_match_count(ac, str.c_str(), len, &limit, &scan);
+        CHECK(scan.resume_ofst >= prev + 4096 ||
+              scan.status == AC_SCAN_DONE);
+        call_num++;
+    }
+    CHECK(total == len && call_num > 1);
+    ac_free(ac);
+
+    // Likewise, for the composite engine.
+    const char* mixed[] = {"a", "aaaaaaaaaaaa", 0};
+    ac_opt_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.flags = AC_OPT_COMPOSITE;
+    ac = Create_AC(mixed, &opt);
+    CHECK(ac != 0);
+    memset(&scan, 0, sizeof(scan));
+    do {
+        unsigned int prev = scan.resume_ofst;
+        ac_match_count(ac, str.c_str(), len, &limit, &scan);
+        CHECK(scan.resume_ofst >= prev + 4096 ||
+              scan.status == AC_SCAN_DONE);
+    } while (scan.status == AC_SCAN_TRUNCATED);
+    ac_free(ac);
+
+    return true;
+}
+
+// Root-node with (almost) all the 256 chars as valid input is laid-out in
+// a special way.
+static bool
+Test_Root_Fanout() {
+    for (int fanout = 255; fanout <= 256; fanout++) {
+        // Pattern "cc" for each char "c" but 'z' (if fanout is 255).
+        vector<string> pats;
+        for (int c = 0; c < 256; c++) {
+            if (fanout == 256 || c != 'z')
+                pats.push_back(string(2, (char)c));
+        }
+        Pattern_Vect dict(pats);
+
+        for (int e = 0; e < engine_num; e++) {
+            ac_opt_t opt = Make_Opt(engines[e].opt_flags);
+            ac_t* ac = dict.Create(&opt);
+            CHECK(ac != 0);
+
+            const char str1[] = "azbyyc";
+            ac_result_t r = ac_match(ac, str1, 6);
+            CHECK(r.match_begin == 3 && r.match_end == 4);
+            r = ac_match_longest_l(ac, str1, 6);
+            CHECK(r.match_begin == 3 && r.match_end == 4);
+            CHECK(ac_match_count(ac, str1, 6, 0, 0) == 1);
+
+            const char str2[] = "\xff\xff\0\0";
+            r = ac_match(ac, str2, 4);
+            CHECK(r.match_begin == 0 && r.match_end == 1);
+            CHECK(ac_match_count(ac, str2, 4, 0, 0) == 2);
+
+            unsigned int expect = (fanout == 256) ? 2 : 0;
+            CHECK(ac_match_count(ac, "zzz", 3, 0, 0) == (int)expect);
+            r = ac_match(ac, "zzz", 3);
+            CHECK(r.match_begin == (fanout == 256 ? 0 : -1));
+            ac_free(ac);
+        }
+    }
+
+    return true;
+}
+
+// Run the given instance against a few strings; it should not crash.
+static void
+Exercise_AC(ac_t* ac) {
+    const char* strs[] = {"ushers", "hishe", "xx", "sheh", "hhhhers"};
+    for (unsigned i = 0; i < sizeof(strs)/sizeof(strs[0]); i++) {
+        unsigned len = strlen(strs[i]);
+        ac_match(ac, strs[i], len);
+        ac_match_longest_l(ac, strs[i], len);
+        ac_match_count(ac, strs[i], len, 0, 0);
+    }
+}
+
+static bool
+Test_Serialize_Load() {
+    const char* dict[] = {"he", "she", "his", "hers", "h", "sh", 0};
+    const char* str = "ushers";
+
+    for (int e = 0; e < engine_num; e++) {
+        ac_opt_t opt = Make_Opt(engines[e].opt_flags);
+        ac_t* ac = Create_AC(dict, &opt);
+        CHECK(ac != 0);
+
+        unsigned int len = ac_serialize(ac, 0, 0);
+        CHECK(len > 0);
+        vector<char> blob(len);
+        CHECK(ac_serialize(ac, &blob[0], len) == len);
+
+        ac_result_t r = ac_match(ac, str, strlen(str));
+        int count = ac_match_count(ac, str, strlen(str), 0, 0);
+        ac_free(ac);
+
+        for (int trusted = 0; trusted < 2; trusted++) {
+            ac = ac_load(&blob[0], len, trusted ? AC_LOAD_TRUSTED : 0);
+            CHECK(ac != 0);
+            ac_result_t r2 = ac_match(ac, str, strlen(str));
+            CHECK(r.match_begin == r2.match_begin &&
+                  r.match_end == r2.match_end &&
+                  r.pattern_idx == r2.pattern_idx);
+            CHECK(ac_match_count(ac, str, strlen(str), 0, 0) == count);
+            ac_free(ac);
+        }
+
+        // Truncated blob is rejected even if it's trusted.
+        CHECK(ac_load(&blob[0], len - 1, 0) == 0);
+        CHECK(ac_load(&blob[0], len - 1, AC_LOAD_TRUSTED) == 0);
+        CHECK(ac_load(&blob[0], 4, 0) == 0);
+
+        // Corrupt the blob one byte at a time. It is either rejected, or
+        // it is still safe to match against.
+        int reject = 0;
+        for (unsigned int i = 0; i < len; i++) {
+            vector<char> bad(blob);
+            for (int v = 1; v < 256; v += 37) {
+                bad[i] = blob[i] ^ (char)v;
+                ac = ac_load(&bad[0], len, 0);
+                if (!ac) {
+                    reject++;
+                    continue;
+                }
+                Exercise_AC(ac);
+                ac_free(ac);
+            }
+        }
+        CHECK(reject > 0);
+    }
+
+    return true;
+}
+
+// Return the names of the files under "dir", or empty vector on error.
+static vector<string>
+List_Dir(const char* dir) {
+    vector<string> files;
+    if (DIR* d = opendir(dir)) {
+        while (struct dirent* e = readdir(d)) {
+            if (e->d_name[0] != '.')
+                files.push_back(string(dir) + "/" + e->d_name);
+        }
+        closedir(d);
+    }
+    return files;
+}
+
+static string
+Serialize_AC(ac_t* ac) {
+    string blob(ac_serialize(ac, 0, 0), 0);
+    ac_serialize(ac, &blob[0], blob.size());
+    return blob;
+}
+
+static bool
+Test_Cache() {
+    const char* dict[] = {"he", "she", "his", "hers", 0};
+    const char* dict2[] = {"he", "she", "his", "her", 0};
+    const char* str = "ushers";
+
+    // Building is deterministic.
+    ac_t* ac = Create_AC(dict);
+    string blob = Serialize_AC(ac);
+    ac_free(ac);
+    ac = Create_AC(dict);
+    CHECK(Serialize_AC(ac) == blob);
+    ac_free(ac);
+
+    char dir[] = "/tmp/ac_cache_test.XXXXXX";
+    CHECK(mkdtemp(dir) != 0);
+
+    ac_opt_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.cache_dir = dir;
+
+    // The 1st one builds the instance and saves it, and the 2nd one gets it
+    // from the cache.
+    for (int i = 0; i < 2; i++) {
+        ac = Create_AC(dict, &opt);
+        CHECK(ac != 0);
+        CHECK(ac_match_count(ac, str, strlen(str), 0, 0) == 3);
+        CHECK(Serialize_AC(ac) == blob);
+        ac_free(ac);
+        CHECK(List_Dir(dir).size() == 1);
+    }
+
+    // Different patterns or options, different entries.
+    ac = Create_AC(dict2, &opt);
+    CHECK(ac_match_count(ac, str, strlen(str), 0, 0) == 3);
+    ac_free(ac);
+    opt.flags = AC_OPT_THREADED;
+    ac = Create_AC(dict, &opt);
+    CHECK(ac_match_count(ac, str, strlen(str), 0, 0) == 3);
+    ac_free(ac);
+    opt.flags = 0;
+
+    vector<string> files = List_Dir(dir);
+    CHECK(files.size() == 3);
+
+    // Corrupted entries are ignored and then overwritten.
+    for (size_t i = 0; i < files.size(); i++)
+        CHECK(truncate(files[i].c_str(), 16) == 0);
+    ac = Create_AC(dict, &opt);
+    CHECK(ac != 0 && Serialize_AC(ac) == blob);
+    ac_free(ac);
+    ac = Create_AC(dict, &opt);
+    CHECK(ac != 0 && Serialize_AC(ac) == blob);
+    ac_free(ac);
+
+    files = List_Dir(dir);
+    for (size_t i = 0; i < files.size(); i++)
+        unlink(files[i].c_str());
+    rmdir(dir);
+
+    // Inaccessible cache is not an error.
+    opt.cache_dir = "/nonexistent/dir";
+    ac = Create_AC(dict, &opt);
+    CHECK(ac != 0 && Serialize_AC(ac) == blob);
+    ac_free(ac);
+
+    return true;
+}
+
+// Replace the content of the file atomically.
+static bool
+Write_File(const string& path, const char* content) {
+    string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (!f)
+        return false;
+    fputs(content, f);
+    fclose(f);
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// Wait for the reloader to finish the "gen"-th build, or "fail"-th failure.
+static bool
+Wait_Reload(ac_reloader_t* r, unsigned gen, unsigned fail) {
+    for (int i = 0; i < 500; i++) {
+        ac_reload_stat_t stat;
+        ac_reloader_get_stat(r, &stat);
+        if (stat.generation >= gen && stat.fail_num >= fail)
+            return true;
+        usleep(10 * 1000);
+    }
+    return false;
+}
+
+typedef struct {
+    ac_reloader_t* r;
+    bool stop;
+    bool ok;
+} Reload_Job;
+
+// Acquire, match and release until told to stop. Either version of the
+// dictionary matches "ushers" once or twice.
+static void*
+Reload_Worker(void* arg) {
+    Reload_Job* job = (Reload_Job*)arg;
+    while (!__atomic_load_n(&job->stop, __ATOMIC_RELAXED)) {
+        ac_t* ac = ac_reloader_acquire(job->r);
+        int count = ac_match_count(ac, "ushers", 6, 0, 0);
+        if (count != 1 && count != 2)
+            job->ok = false;
+        ac_reloader_release(job->r, ac);
+    }
+    return 0;
+}
+
+static bool
+Test_Reload() {
+    const char* str = "ushers";
+    char dir[] = "/tmp/ac_reload_test.XXXXXX";
+    CHECK(mkdtemp(dir) != 0);
+    string path = string(dir) + "/dict.txt";
+
+    // Missing file
+    CHECK(ac_reloader_create(path.c_str(), 0, 0) == 0);
+
+    // Watch the file via inotify, and then via polling.
+    for (int poll = 0; poll < 2; poll++) {
+        ac_reload_opt_t ropt;
+        memset(&ropt, 0, sizeof(ropt));
+        if (poll) {
+            ropt.flags = AC_RELOAD_POLL;
+            ropt.poll_msec = 10;
+        }
+
+        CHECK(Write_File(path, "he\nshe\n"));
+        ac_reloader_t* r = ac_reloader_create(path.c_str(), 0, &ropt);
+        CHECK(r != 0);
+
+        ac_t* ac1 = ac_reloader_acquire(r);
+        CHECK(ac_match_count(ac1, str, strlen(str), 0, 0) == 2);
+
+        CHECK(Write_File(path, "hers\r\n\n"));
+        CHECK(Wait_Reload(r, 2, 0));
+
+        // The new one is published, and the one acquired before is intact.
+        ac_t* ac2 = ac_reloader_acquire(r);
+        CHECK(ac_match_count(ac2, str, strlen(str), 0, 0) == 1);
+        CHECK(ac_match_count(ac1, str, strlen(str), 0, 0) == 2);
+        ac_reloader_release(r, ac1);
+        ac_reloader_release(r, ac2);
+
+        // Bad file is rejected, and the current instance is kept.
+        CHECK(Write_File(path, "\n"));
+        CHECK(Wait_Reload(r, 2, 1));
+
+        ac_reload_stat_t stat;
+        ac_reloader_get_stat(r, &stat);
+        CHECK(stat.generation == 2 && stat.last_error == EINVAL);
+
+        ac1 = ac_reloader_acquire(r);
+        CHECK(ac_match_count(ac1, str, strlen(str), 0, 0) == 1);
+        ac_reloader_release(r, ac1);
+
+        ac_reloader_free(r);
+    }
+
+    // The readers race with the publishing of new versions, and with each
+    // other for releasing the retired ones.
+    CHECK(Write_File(path, "he\nshe\n"));
+    ac_reload_opt_t ropt;
+    memset(&ropt, 0, sizeof(ropt));
+    ropt.flags = AC_RELOAD_POLL;
+    ropt.poll_msec = 1;
+    ac_reloader_t* r = ac_reloader_create(path.c_str(), 0, &ropt);
+    CHECK(r != 0);
+    Reload_Job job = { r, false, true };
+    pthread_t threads[4];
+    for (int t = 0; t < 4; t++)
+        CHECK(pthread_create(&threads[t], 0, Reload_Worker, &job) == 0);
+    for (unsigned gen = 2; gen < 30; gen++) {
+        // Change the size, so that the change is noticed even if the
+        // mtime is not.
+        string content = gen % 2 ? "he\nshe\n" : "hers\n";
+        content += string(gen, '\n');
+        CHECK(Write_File(path, content.c_str()));
+        CHECK(Wait_Reload(r, gen, 0));
+    }
+    __atomic_store_n(&job.stop, true, __ATOMIC_RELAXED);
+    for (int t = 0; t < 4; t++)
+        pthread_join(threads[t], 0);
+    CHECK(job.ok);
+    ac_reloader_free(r);
+
+    unlink(path.c_str());
+    rmdir(dir);
+    return true;
+}
+
+static bool
+Test_Builder() {
+    // Random patterns over a small alphabet, so that they share prefixes,
+    // with some duplicates.
+    srand(1);
+    vector<string> pats = Random_Dict(500, 12, 'a', 4);
+    pats.push_back(pats[0]);
+    pats.push_back(string(1, (char)0xff));
+
+    ac_builder_t* b = ac_builder_create(0, 0);
+    for (size_t i = 0; i < pats.size(); i++)
+        CHECK(ac_builder_add(b, pats[i].data(), pats[i].size()) == AC_OK);
+    CHECK(ac_builder_add(b, "", 0) == AC_ERR_PATTERN);
+    string huge(40000, 'x');
+    CHECK(ac_builder_add(b, huge.data(), huge.size()) == AC_ERR_PATTERN);
+
+    ac_estimate_t est;
+    ac_builder_estimate(b, &est);
+    CHECK(est.pattern_num == pats.size());
+    CHECK(est.peak_mem > est.buf_size);
+
+    // The builder doesn't need the caller's copy, and it yields exactly the
+    // same instance as ac_create() does. The estimated size is exact.
+    int err = AC_ERR_BUDGET;
+    ac_t* ac = ac_builder_finish(b, &err);
+    CHECK(ac != 0 && err == AC_OK);
+    ac_t* ac2 = Pattern_Vect(pats).Create();
+    string blob = Serialize_AC(ac);
+    CHECK(blob == Serialize_AC(ac2));
+    CHECK(blob.size() == est.buf_size);
+    ac_free(ac);
+    ac_free(ac2);
+    ac_builder_free(b);
+
+    // So is the size of the double-array, which depends on how the states
+    // are packed, and that of the succinct graph.
+    unsigned int flags[] = {AC_OPT_DOUBLE_ARRAY, AC_OPT_SUCCINCT};
+    for (int f = 0; f < 2; f++) {
+        ac_opt_t opt = Make_Opt(flags[f]);
+        b = ac_builder_create(&opt, 0);
+        for (size_t i = 0; i < pats.size(); i++)
+            CHECK(ac_builder_add(b, pats[i].data(), pats[i].size()) == AC_OK);
+        ac_estimate_t opt_est;
+        ac_builder_estimate(b, &opt_est);
+        ac = ac_builder_finish(b, 0);
+        CHECK(ac != 0);
+        CHECK(Serialize_AC(ac).size() == opt_est.buf_size);
+        ac_free(ac);
+        ac_builder_free(b);
+    }
+
+    // Just enough budget, and a little bit less.
+    for (int less = 0; less < 2; less++) {
+        b = ac_builder_create(0, est.peak_mem - less);
+        for (size_t i = 0; i < pats.size(); i++)
+            CHECK(ac_builder_add(b, pats[i].data(), pats[i].size()) == AC_OK);
+        ac = ac_builder_finish(b, &err);
+        CHECK(less ? (ac == 0 && err == AC_ERR_BUDGET) : (ac != 0));
+        if (ac)
+            ac_free(ac);
+        ac_builder_free(b);
+    }
+
+    // The patterns alone exceed the budget.
+    b = ac_builder_create(0, 1024);
+    CHECK(ac_builder_add(b, huge.data(), 20000) == AC_ERR_BUDGET);
+    ac_builder_free(b);
+
+    // Nothing is added.
+    b = ac_builder_create(0, 0);
+    ac_builder_estimate(b, &est);
+    CHECK(est.pattern_num == 0 && est.state_num == 1);
+    ac = ac_builder_finish(b, 0);
+    CHECK(ac != 0 && ac_match2(ac, "abc", 3) < 0);
+    CHECK(Serialize_AC(ac).size() == est.buf_size);
+    ac_free(ac);
+    ac_builder_free(b);
+
+    return true;
+}
+
+// Tiny dictionaries are matched with the Sheng table by default, which must
+// agree with the generic engine, including the matches found via fail-links.
+// The Sheng table is picked over the compact format.
+static bool
+Test_Sheng() {
+    ac_opt_t opt = Make_Opt(GENERIC_FLAGS);
+    ac_opt_t sheng_opt = Make_Opt(0);
+
+    // "bc" is found when "abc" fails to go on with 'e'.
+    const char* dict[] = {"abcd", "bc", 0};
+    ac_t* ac = Create_AC(dict, &sheng_opt);
+    ac_t* generic = Create_AC(dict, &opt);
+    CHECK(ac && generic);
+    CHECK(Serialize_AC(ac).size() > Serialize_AC(generic).size());
+    const char* str = "xxxxxxxxxxabcexxxxxxxabcd";
+    ac_result_t r = ac_match(ac, str, strlen(str));
+    CHECK(r.match_begin == 11 && r.match_end == 12 && r.pattern_idx == 1);
+    r = ac_match_longest_l(ac, str, strlen(str));
+    CHECK(r.match_begin == 21 && r.match_end == 24 && r.pattern_idx == 0);
+    ac_opt_t no_compact_opt = Make_Opt(AC_OPT_NO_COMPACT);
+    ac_t* no_compact = Create_AC(dict, &no_compact_opt);
+    CHECK(no_compact != 0);
+    CHECK(Serialize_AC(ac) == Serialize_AC(no_compact));
+    ac_free(no_compact);
+    ac_free(ac);
+    ac_free(generic);
+
+    // The threaded interpreter, if asked for, is used instead.
+    ac_opt_t threaded_opt = Make_Opt(AC_OPT_THREADED);
+    ac = Create_AC(dict, &threaded_opt);
+    threaded_opt.flags |= AC_OPT_NO_SHENG | AC_OPT_NO_STRIDE2;
+    generic = Create_AC(dict, &threaded_opt);
+    CHECK(ac && generic);
+    CHECK(Serialize_AC(ac) == Serialize_AC(generic));
+    ac_free(ac);
+    ac_free(generic);
+
+    srand(2);
+    for (int iter = 0; iter < 300; iter++) {
+        Pattern_Vect dict(Random_Dict(1 + rand() % 5, 4, 'a', 3));
+        ac = dict.Create(&sheng_opt);
+        generic = dict.Create(&opt);
+        CHECK(ac && generic);
+
+        for (int k = 0; k < 20; k++) {
+            // Mostly chars not in the dictionary, with some of those in it.
+            string text;
+            for (int j = 0, len = rand() % 64; j < len; j++)
+                text += (char)((rand() % 8) ? 'a' + rand() % 3 : 'x');
+            CHECK(Compare_With_Generic(ac, generic, text.data(), text.size()));
+        }
+        ac_free(ac);
+        ac_free(generic);
+    }
+
+    return true;
+}
+
+// Dictionaries over small alphabet are matched with the stride-2 tables
+// unless they are in the compact format, which must agree with the generic
+// engine no matter the matches end at odd or even positions.
+static bool
+Test_Stride2() {
+    ac_opt_t opt = Make_Opt(GENERIC_FLAGS);
+    ac_opt_t stride2_opt = Make_Opt(AC_OPT_NO_COMPACT);
+
+    srand(3);
+    for (int iter = 0; iter < 200; iter++) {
+        int alphabet = 2 + rand() % 15;
+        Pattern_Vect dict(Random_Dict(4 + rand() % 40, 8, 'a', alphabet));
+        ac_t* ac = dict.Create(&stride2_opt);
+        ac_t* generic = dict.Create(&opt);
+        CHECK(ac && generic);
+
+        for (int k = 0; k < 20; k++) {
+            string text;
+            for (int j = 0, len = rand() % 100; j < len; j++)
+                text += (char)((rand() % 8) ? 'a' + rand() % alphabet : 'x');
+            CHECK(Compare_With_Generic(ac, generic, text.data(), text.size()));
+        }
+        ac_free(ac);
+        ac_free(generic);
+    }
+
+    // Matches ending at odd and even positions, and at the last byte.
+    const char* dict[] = {"ab", "bab", "abba", 0};
+    ac_t* ac = Create_AC(dict, &stride2_opt);
+    CHECK(ac != 0);
+    ac_result_t r = ac_match(ac, "xab", 3);
+    CHECK(r.match_begin == 1 && r.match_end == 2 && r.pattern_idx == 0);
+    r = ac_match(ac, "xxab", 4);
+    CHECK(r.match_begin == 2 && r.match_end == 3 && r.pattern_idx == 0);
+    r = ac_match_longest_l(ac, "xxabbab", 7);
+    CHECK(r.match_begin == 2 && r.match_end == 5 && r.pattern_idx == 2);
+    ac_free(ac);
+
+    // The tables of dictionary over large alphabet don't fit.
+    vector<string> pats;
+    for (int i = 0; i < 200; i++)
+        pats.push_back(string(1, (char)i) + (char)(i + 1) + (char)(i + 2));
+    Pattern_Vect wide(pats);
+    ac = wide.Create();
+    ac_t* generic = wide.Create(&opt);
+    CHECK(ac && generic);
+    CHECK(Serialize_AC(ac) == Serialize_AC(generic));
+    ac_free(ac);
+    ac_free(generic);
+
+    // Nor are those over 40 chars used unless asked for, though they fit.
+    Pattern_Vect medium(Random_Dict(20, 8, 'A', 40));
+    ac = medium.Create(&stride2_opt);
+    generic = medium.Create(&opt);
+    CHECK(ac && generic);
+    CHECK(Serialize_AC(ac) == Serialize_AC(generic));
+    ac_free(ac);
+
+    stride2_opt.flags |= AC_OPT_STRIDE2;
+    ac = medium.Create(&stride2_opt);
+    CHECK(ac != 0);
+    CHECK(Serialize_AC(ac).size() > Serialize_AC(generic).size());
+    for (int k = 0; k < 20; k++) {
+        string text;
+        for (int j = 0, len = rand() % 100; j < len; j++)
+            text += (char)('A' + rand() % 41);
+        CHECK(Compare_With_Generic(ac, generic, text.data(), text.size()));
+    }
+    ac_free(ac);
+    ac_free(generic);
+
+    return true;
+}
+
+// The succinct graph must agree with the regular one for all the match
+// functions, on dictionaries large enough to span many samples of the
+// select and rank directories.
+static bool
+Test_Succinct() {
+    ac_opt_t opt = Make_Opt(AC_OPT_SUCCINCT);
+
+    srand(4);
+    for (int iter = 0; iter < 30; iter++) {
+        int alphabet = 2 + rand() % 20;
+        Pattern_Vect dict(Random_Dict(1 + rand() % 2000, 12, 'a', alphabet));
+        ac_t* ac = dict.Create(&opt);
+        ac_t* generic = dict.Create();
+        CHECK(ac && generic);
+        CHECK(Serialize_AC(ac).size() < Serialize_AC(generic).size());
+
+        for (int k = 0; k < 20; k++) {
+            string text;
+            for (int j = 0, len = rand() % 200; j < len; j++)
+                text += (char)((rand() % 8) ? 'a' + rand() % alphabet : 'z');
+            CHECK(Compare_With_Generic(ac, generic, text.data(), text.size()));
+        }
+        ac_free(ac);
+        ac_free(generic);
+    }
+
+    return true;
+}
+
+// Tiny dictionaries the Sheng table doesn't apply to are in the compact
+// format, which must agree with the regular one for all the match functions,
+// including the scans resumed halfway, and take a fraction of its memory.
+static bool
+Test_Compact() {
+    ac_opt_t opt = Make_Opt(GENERIC_FLAGS);
+    ac_opt_t compact_opt = Make_Opt(AC_OPT_NO_SHENG);
+
+    srand(5);
+    for (int iter = 0; iter < 300; iter++) {
+        int alphabet = 2 + rand() % 30;
+        Pattern_Vect dict(Random_Dict(1 + rand() % 5, 16, 0xf0, alphabet));
+
+        ac_builder_t* b = ac_builder_create(&compact_opt, 0);
+        for (size_t i = 0; i < dict.pats.size(); i++)
+            ac_builder_add(b, dict.pats[i].data(), dict.pats[i].size());
+        ac_estimate_t est;
+        ac_builder_estimate(b, &est);
+        ac_builder_free(b);
+
+        ac_t* ac = dict.Create(&compact_opt);
+        ac_t* generic = dict.Create(&opt);
+        CHECK(ac && generic);
+        string blob = Serialize_AC(ac);
+        CHECK(blob.size() == est.buf_size);
+        CHECK(blob.size() < Serialize_AC(generic).size());
+
+        for (int k = 0; k < 20; k++) {
+            string text;
+            for (int j = 0, len = rand() % 200; j < len; j++)
+                text += (char)((rand() % 8) ? 0xf0 + rand() % alphabet : 'z');
+            CHECK(Compare_With_Generic(ac, generic, text.data(), text.size()));
+        }
+        ac_free(ac);
+        ac_free(generic);
+    }
+
+    return true;
+}
+
+// Check that each tenant of the "pool" behaves the same as the standalone
+// instance of its dictionary.
+static bool
+Check_Pool(ac_pool_t* pool, const vector<ac_t*>& acs, const string& text) {
+    const char* s = text.data();
+    unsigned int len = text.size();
+    for (size_t t = 0; t < acs.size(); t++) {
+        ac_t* ac = ac_pool_get(pool, t);
+        CHECK(ac != 0);
+        CHECK(Compare_With_Generic(ac, acs[t], s, len));
+
+        // Freeing a tenant is a no-op.
+        ac_free(ac);
+        CHECK(ac_match_count(ac, s, len, 0, 0) ==
+              ac_match_count(acs[t], s, len, 0, 0));
+    }
+    CHECK(ac_pool_get(pool, acs.size()) == 0);
+    return true;
+}
+
+static bool
+Test_Pool() {
+    const int tenant_num = 500;
+    vector<Pattern_Vect*> pats(tenant_num);
+    vector<ac_dict_t> dicts(tenant_num);
+    vector<ac_t*> acs(tenant_num);
+
+    // Tenants of all sizes, including the empty ones.
+    srand(7);
+    unsigned int pattern_num = 0;
+    for (int t = 0; t < tenant_num; t++) {
+        int n = (t % 50 == 0) ? 0 : 1 + rand() % ((t % 10 == 0) ? 200 : 5);
+        pats[t] = new Pattern_Vect(Random_Dict(n, 8, 'a', 6));
+        dicts[t].pattern_v = n ? &pats[t]->pat_v[0] : 0;
+        dicts[t].pattern_len_v = n ? &pats[t]->len_v[0] : 0;
+        dicts[t].pattern_num = n;
+        pattern_num += n;
+        acs[t] = pats[t]->Create();
+        CHECK(acs[t] != 0);
+    }
+
+    string text;
+    for (int j = 0; j < 300; j++)
+        text += (char)('a' + rand() % 7);
+
+    ac_pool_t* pool = ac_pool_create(&dicts[0], tenant_num, 0);
+    CHECK(pool != 0);
+    CHECK(Check_Pool(pool, acs, text));
+
+    ac_pool_stat_t stat;
+    ac_pool_get_stat(pool, &stat);
+    CHECK(stat.tenant_num == (unsigned)tenant_num);
+    CHECK(stat.pattern_num == pattern_num);
+    CHECK(stat.size == ac_pool_serialize(pool, 0, 0));
+
+    string blob(stat.size, 0);
+    CHECK(ac_pool_serialize(pool, &blob[0], blob.size()) == stat.size);
+
+    char dir[] = "/tmp/ac_pool_test.XXXXXX";
+    CHECK(mkdtemp(dir) != 0);
+    string path = string(dir) + "/pool";
+    CHECK(ac_pool_save(pool, path.c_str()) == 0);
+    ac_pool_free(pool);
+
+    for (int trusted = 0; trusted < 2; trusted++) {
+        unsigned int flags = trusted ? AC_LOAD_TRUSTED : 0;
+        pool = ac_pool_load(blob.data(), blob.size(), flags);
+        CHECK(pool != 0);
+        CHECK(Check_Pool(pool, acs, text));
+        ac_pool_free(pool);
+
+        pool = ac_pool_map(path.c_str(), flags);
+        CHECK(pool != 0);
+        CHECK(Check_Pool(pool, acs, text));
+        ac_pool_free(pool);
+    }
+    unlink(path.c_str());
+    rmdir(dir);
+    CHECK(ac_pool_map(path.c_str(), 0) == 0);
+
+    // Neither a truncated pool nor an instance is a pool.
+    CHECK(ac_pool_load(blob.data(), blob.size() - 8, 0) == 0);
+    string inst = Serialize_AC(acs[1]);
+    CHECK(ac_pool_load(inst.data(), inst.size(), 0) == 0);
+
+    // The tenant serialized is a standalone instance, which is freed on its
+    // own.
+    pool = ac_pool_load(blob.data(), blob.size(), 0);
+    CHECK(pool != 0);
+    CHECK(Serialize_AC(ac_pool_get(pool, 1)) == inst);
+    ac_t* ac = ac_load(inst.data(), inst.size(), 0);
+    CHECK(ac != 0);
+    ac_free(ac);
+    ac_pool_free(pool);
+
+    // Corrupted pool is either rejected, or safe to match against.
+    int reject = 0;
+    for (int i = 0; i < 2000; i++) {
+        string bad(blob);
+        bad[rand() % bad.size()] ^= (char)(1 + rand() % 255);
+        pool = ac_pool_load(bad.data(), bad.size(), 0);
+        if (!pool) {
+            reject++;
+            continue;
+        }
+        for (int t = 0; t < tenant_num; t += 7)
+            Exercise_AC(ac_pool_get(pool, t));
+        ac_pool_free(pool);
+    }
+    CHECK(reject > 0);
+
+    // An empty pool is fine.
+    pool = ac_pool_create(0, 0, 0);
+    CHECK(pool != 0);
+    CHECK(ac_pool_get(pool, 0) == 0);
+    ac_pool_free(pool);
+
+    for (int t = 0; t < tenant_num; t++) {
+        ac_free(acs[t]);
+        delete pats[t];
+    }
+    return true;
+}
+
+static bool
+Test_Warm() {
+    const char* dict[] = {"he", "she", "his", "hers", "0123", "3210", 0};
+    const char* str = "ushers";
+    const unsigned int all = AC_WARM_PREFAULT | AC_WARM_LOCK | AC_WARM_TOUCH;
+
+    char dir[] = "/tmp/ac_warm_test.XXXXXX";
+    CHECK(mkdtemp(dir) != 0);
+
+    for (int e = 0; e < engine_num; e++) {
+        ac_opt_t opt = Make_Opt(engines[e].opt_flags);
+        opt.cache_dir = dir;
+
+        // Built, and then mapped from the cache.
+        for (int mapped = 0; mapped < 2; mapped++) {
+            ac_t* ac = Create_AC(dict, &opt);
+            CHECK(ac != 0);
+            string blob = Serialize_AC(ac);
+
+            // The lazy graph has nothing to prefault or lock.
+            unsigned long long fault_bytes = blob.size();
+            if (opt.flags & AC_OPT_LAZY)
+                fault_bytes = 0;
+
+            ac_warm_stat_t stat;
+            CHECK(ac_warm(ac, AC_WARM_PREFAULT | AC_WARM_TOUCH, 0, &stat) == 0);
+            CHECK(stat.fault_bytes == fault_bytes && stat.touch_bytes > 0);
+
+            // Deeper, more to touch.
+            ac_warm_opt_t wopt;
+            memset(&wopt, 0, sizeof(wopt));
+            wopt.max_depth = 1;
+            CHECK(ac_warm(ac, AC_WARM_TOUCH, &wopt, &stat) == 0);
+            unsigned long long shallow = stat.touch_bytes;
+            wopt.max_depth = 100;
+            CHECK(ac_warm(ac, AC_WARM_TOUCH, &wopt, &stat) == 0);
+            CHECK(stat.fault_bytes == 0 && stat.touch_bytes >= shallow);
+
+            // Profiled, rather than by depth.
+            memset(&wopt, 0, sizeof(wopt));
+            wopt.sample = str;
+            wopt.sample_len = strlen(str);
+            CHECK(ac_warm(ac, 0, &wopt, &stat) == 0);
+            CHECK(stat.fault_bytes == 0 && stat.touch_bytes == 0);
+
+            // Locking may be beyond RLIMIT_MEMLOCK, which is not fatal.
+            int ret = ac_warm(ac, all, 0, &stat);
+            CHECK(ret == 0 || errno == ENOMEM || errno == EPERM);
+            CHECK(stat.fault_bytes == fault_bytes);
+
+            // The warm-up is transparent to the user.
+            CHECK(ac_match_count(ac, str, strlen(str), 0, 0) == 3);
+            CHECK(Serialize_AC(ac) == blob);
+            ac_free(ac);
+        }
+    }
+
+    vector<string> files = List_Dir(dir);
+    for (size_t i = 0; i < files.size(); i++)
+        unlink(files[i].c_str());
+    rmdir(dir);
+
+    // A tenant is warmed up in place.
+    vector<unsigned int> len_v;
+    for (int i = 0; dict[i]; i++)
+        len_v.push_back(strlen(dict[i]));
+    ac_dict_t d = { dict, &len_v[0], (unsigned int)len_v.size() };
+    ac_dict_t dicts[] = { d, d };
+    ac_pool_t* pool = ac_pool_create(dicts, 2, 0);
+    CHECK(pool != 0);
+    string blob(ac_pool_serialize(pool, 0, 0), 0);
+    ac_pool_serialize(pool, &blob[0], blob.size());
+
+    ac_warm(ac_pool_get(pool, 1), all, 0, 0);
+    CHECK(ac_match_count(ac_pool_get(pool, 1), str, strlen(str), 0, 0) == 3);
+    string blob2(blob.size(), 0);
+    ac_pool_serialize(pool, &blob2[0], blob2.size());
+    CHECK(blob2 == blob);
+    ac_pool_free(pool);
+
+    return true;
+}
+
+typedef struct {
+    ac_t* ac;
+    const string* text;
+    int count;
+} Lazy_Job;
+
+static void*
+Lazy_Worker(void* arg) {
+    Lazy_Job* job = (Lazy_Job*)arg;
+    job->count = ac_match_count(job->ac, job->text->data(),
+                                job->text->size(), 0, 0);
+    return 0;
+}
+
+static bool
+Test_Lazy() {
+    ac_opt_t lazy_opt = Make_Opt(AC_OPT_LAZY);
+    ac_opt_t eager_opt = Make_Opt(GENERIC_FLAGS);
+
+    srand(11);
+    for (int iter = 0; iter < 100; iter++) {
+        // Small alphabet for long fail-link chains, along with duplicated
+        // and empty patterns.
+        vector<string> pats;
+        int alphabet = 2 + rand() % 4;
+        for (int i = 0, n = 1 + rand() % (iter % 10 ? 50 : 3000); i < n; i++) {
+            string p;
+            int len = rand() % 12 + (rand() % 50 != 0);
+            for (int j = 0; j < len; j++)
+                p += (char)('a' + rand() % alphabet);
+            pats.push_back(p);
+        }
+        Pattern_Vect dict(pats);
+
+        string text;
+        for (int j = 0; j < 20000; j++)
+            text += (char)('a' + rand() % (alphabet + 1));
+
+        ac_t* ac = dict.Create(&lazy_opt);
+        ac_t* eager = dict.Create(&eager_opt);
+        CHECK(ac && eager);
+
+        // Racing to materialize the fresh instance.
+        int count = ac_match_count(eager, text.data(), text.size(), 0, 0);
+        Lazy_Job jobs[4];
+        pthread_t threads[4];
+        for (int t = 0; t < 4; t++) {
+            jobs[t].ac = ac;
+            jobs[t].text = &text;
+            CHECK(pthread_create(&threads[t], 0, Lazy_Worker, &jobs[t]) == 0);
+        }
+        for (int t = 0; t < 4; t++) {
+            pthread_join(threads[t], 0);
+            CHECK(jobs[t].count == count);
+        }
+
+        for (int k = 0; k < 20; k++) {
+            const char* s = text.data() + rand() % 1000;
+            unsigned int len = rand() % 200;
+            CHECK(Compare_With_Generic(ac, eager, s, len));
+        }
+
+        // The serialized instance is the regular one.
+        ac_t* regular = dict.Create();
+        CHECK(Serialize_AC(ac) == Serialize_AC(regular));
+        ac_free(regular);
+        ac_free(eager);
+        ac_free(ac);
+    }
+
+    return true;
+}
+
+// The composite instance splits the patterns by length, and it must agree
+// with the regular one for all the match functions, including the matches
+// the regular one finds via fail-links (or misses, as it stops following
+// them), and the scans resumed halfway. Dictionaries without patterns of
+// both classes fall back to the regular graph.
+static bool
+Test_Composite() {
+    ac_opt_t opt = Make_Opt(AC_OPT_COMPOSITE);
+    ac_opt_t generic_opt = Make_Opt(GENERIC_FLAGS);
+
+    srand(12);
+    for (int iter = 0; iter < 200; iter++) {
+        // Small alphabet for long fail-link chains, along with duplicated
+        // and empty patterns. Some long patterns begin with every byte,
+        // such that root has full fanout.
+        vector<string> pats;
+        int alphabet = 2 + rand() % 6;
+        int short_num = iter % 10 == 1 ? 0 : rand() % 30;
+        int long_num = iter % 10 == 2 ? 0 : 1 + rand() % 200;
+        for (int i = 0; i < short_num + long_num; i++) {
+            string p;
+            int len = i < short_num ? 1 + rand() % 3 : 4 + rand() % 10;
+            for (int j = 0; j < len; j++)
+                p += (char)('a' + rand() % alphabet);
+            pats.push_back(p);
+        }
+        if (!pats.empty())
+            pats.push_back(pats[rand() % pats.size()]);
+        pats.push_back("");
+        if (iter % 10 == 3) {
+            for (int c = 0; c < 256; c++)
+                pats.push_back(string(1, (char)c) + "abc");
+        }
+        random_shuffle(pats.begin(), pats.end());
+
+        ac_builder_t* b = ac_builder_create(&opt, 0);
+        for (size_t i = 0; i < pats.size(); i++) {
+            if (!pats[i].empty())
+                ac_builder_add(b, pats[i].data(), pats[i].size());
+        }
+        ac_estimate_t est;
+        ac_builder_estimate(b, &est);
+        ac_builder_free(b);
+
+        Pattern_Vect dict(pats);
+        ac_t* ac = dict.Create(&opt);
+        ac_t* generic = dict.Create(&generic_opt);
+        CHECK(ac && generic);
+        string blob = Serialize_AC(ac);
+        if (short_num && long_num) {
+            // The empty pattern shifts the indices, but not the size.
+            CHECK(blob.size() == est.buf_size);
+        } else {
+            ac_t* regular = dict.Create();
+            CHECK(blob == Serialize_AC(regular));
+            ac_free(regular);
+        }
+
+        ac_t* loaded = ac_load(blob.data(), blob.size(), 0);
+        CHECK(loaded != 0 && Serialize_AC(loaded) == blob);
+        ac_free(loaded);
+
+        for (int k = 0; k < 20; k++) {
+            string text;
+            for (int j = 0, len = rand() % 300; j < len; j++)
+                text += (char)((rand() % 16) ? 'a' + rand() % alphabet : 'z');
+            CHECK(Compare_With_Generic(ac, generic, text.data(), text.size()));
+        }
+        ac_free(ac);
+        ac_free(generic);
+    }
+
+    // The corrupted instances are rejected, or at least are safe to match
+    // against.
+    const char* pats[] = {"a", "bc", "cab", "abcd", "bcabc", "ccccc"};
+    unsigned int lens[] = {1, 2, 3, 4, 5, 5};
+    ac_t* ac = ac_create_opt(pats, lens, 6, &opt);
+    CHECK(ac != 0);
+    string blob = Serialize_AC(ac);
+    ac_free(ac);
+    for (int i = 0; i < 2000; i++) {
+        string bad = blob;
+        bad[rand() % bad.size()] ^= 1 << (rand() % 8);
+        if (ac_t* ac = ac_load(bad.data(), bad.size(), 0)) {
+            ac_result_t r[256];
+            ac_match(ac, "abcabcdccccca", 13);
+            ac_match_longest_l(ac, "abcabcdccccca", 13);
+            CHECK(ac_match_all(ac, "abcabcdccccca", 13, r, 256, 0, 0) >= 0);
+            for (int j = 0, n = ac_match_all(ac, "abcabcdccccca", 13, r,
+                                              256, 0, 0); j < n; j++) {
+                CHECK(r[j].match_begin >= 0 && r[j].match_end < 13);
+            }
+            ac_free(ac);
+        }
+    }
+
+    return true;
+}
+
+// The NUL-terminated string is matched as if it were strlen()-ed first. The
+// strings end right before an inaccessible page, such that reading past the
+// NUL would crash.
+static bool
+Test_Cstr() {
+    long page_sz = sysconf(_SC_PAGESIZE);
+    char* pages = (char*)mmap(0, 2 * page_sz, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(pages != MAP_FAILED);
+    CHECK(mprotect(pages + page_sz, page_sz, PROT_NONE) == 0);
+
+    srand(13);
+    for (int iter = 0; iter < 40; iter++) {
+        // Some patterns have NUL, and some dictionaries have full fanout.
+        vector<string> pats;
+        for (int i = 0, num = 1 + rand() % 30; i < num; i++) {
+            string p;
+            for (int j = 0, len = 1 + rand() % 6; j < len; j++)
+                p += (rand() % 20) ? (char)('a' + rand() % 3) : '\0';
+            pats.push_back(p);
+        }
+        if (iter % 8 == 1) {
+            for (int c = 0; c < 256; c++)
+                pats.push_back(string(1, (char)c) + "b");
+        }
+        Pattern_Vect dict(pats);
+
+        for (int e = 0; e < engine_num; e++) {
+            ac_opt_t opt = Make_Opt(engines[e].opt_flags);
+            opt.verify_sample = 1;
+            ac_t* ac = dict.Create(&opt);
+            CHECK(ac != 0);
+
+            for (int k = 0; k < 50; k++) {
+                unsigned int len = rand() % 40;
+                char* s = pages + page_sz - len - 1;
+                for (unsigned int j = 0; j < len; j++)
+                    s[j] = (rand() % 8) ? 'a' + rand() % 3 : 'x';
+                s[len] = '\0';
+
+                CHECK(Same_Result(ac_match_cstr(ac, s), ac_match(ac, s, len)));
+                CHECK(Same_Result(ac_match_longest_cstr(ac, s),
+                                  ac_match_longest_l(ac, s, len)));
+
+                // Nothing past the NUL counts.
+                if (len) {
+                    unsigned int cut = rand() % len;
+                    s[cut] = '\0';
+                    CHECK(Same_Result(ac_match_cstr(ac, s),
+                                      ac_match(ac, s, cut)));
+                }
+            }
+
+            ac_verify_stat_t stat;
+            CHECK(ac_get_verify_stat(ac, &stat) == 0);
+            CHECK(stat.sampled != 0 && stat.mismatch == 0);
+            ac_free(ac);
+        }
+    }
+
+    munmap(pages, 2 * page_sz);
+    return true;
+}
+
+// The string fed in segments yields the same matches as the whole string,
+// including the ones across the segments.
+static bool
+Test_Stream() {
+    srand(14);
+    for (int iter = 0; iter < 30; iter++) {
+        // Both short and long patterns, such that the composite engine
+        // applies.
+        vector<string> pats;
+        for (int i = 0, num = 2 + rand() % 40; i < num; i++) {
+            string p;
+            for (int j = 0, len = 1 + rand() % (i % 2 ? 3 : 10); j < len; j++)
+                p += (char)('a' + rand() % 3);
+            pats.push_back(p);
+        }
+        Pattern_Vect dict(pats);
+
+        string text;
+        for (int j = 0, len = rand() % 400; j < len; j++)
+            text += (char)((rand() % 16) ? 'a' + rand() % 3 : 'z');
+        const char* s = text.data();
+        unsigned int len = text.size();
+
+        // The scratch space is shared by all the instances.
+        ac_t* ac = dict.Create();
+        ac_scratch_t* scratch = ac_scratch_create(ac);
+        CHECK(scratch != 0);
+        ac_free(ac);
+
+        for (int e = 0; e < engine_num; e++) {
+            ac_opt_t opt = Make_Opt(engines[e].opt_flags);
+            ac = dict.Create(&opt);
+            CHECK(ac != 0);
+
+            vector<ac_result_t> expect(len * 16 + 1);
+            int expect_num = ac_match_all(ac, s, len, &expect[0],
+                                          expect.size(), 0, 0);
+            CHECK(expect_num >= 0);
+
+            // The composite engine needs more than the others.
+            ac_stream_reset(scratch);
+            if (ac_stream_match_count(ac, scratch, s, len, 0, 0) < 0)
+                ac_scratch_fit(scratch, ac);
+
+            ac_result_t r[8];
+            ac_scan_t scan;
+
+            for (int round = 0; round < 2; round++) {
+                ac_stream_reset(scratch);
+                vector<ac_result_t> got;
+                int count = 0;
+                for (unsigned int ofst = 0; ofst < len;) {
+                    unsigned int seg_len = rand() % 4 ? rand() % 5 :
+                                                        rand() % 100;
+                    if (seg_len > len - ofst)
+                        seg_len = len - ofst;
+
+                    ac_limit_t limit;
+                    memset(&limit, 0, sizeof(limit));
+                    limit.max_matches = 1 + rand() % 7;
+                    limit.max_bytes = rand() % 2 ? 0 : 1 + rand() % 5;
+                    memset(&scan, 0, sizeof(scan));
+                    do {
+                        int num;
+                        if (round == 0) {
+                            num = ac_stream_match_all(ac, scratch, s + ofst,
+                                                      seg_len, r, 8, &limit,
+                                                      &scan);
+                            got.insert(got.end(), r, r + num);
+                        } else {
+                            num = ac_stream_match_count(ac, scratch, s + ofst,
+                                                        seg_len, &limit,
+                                                        &scan);
+                        }
+                        CHECK(num >= 0);
+                        count += num;
+                    } while (scan.status == AC_SCAN_TRUNCATED);
+                    ofst += seg_len;
+                }
+
+                CHECK(count == expect_num);
+                if (round == 0) {
+                    for (int i = 0; i < expect_num; i++)
+                        CHECK(Same_Result(got[i], expect[i]));
+                }
+            }
+            ac_free(ac);
+        }
+        ac_scratch_free(scratch);
+    }
+
+    return true;
+}
+
+// The pattern table gives back the patterns as they were given, whichever
+// engine the instance uses, and it survives the serialization.
+static bool
+Test_Pattern_Table() {
+    srand(15);
+    for (int iter = 0; iter < 30; iter++) {
+        // Duplicated and empty patterns are kept as they are.
+        vector<string> pats;
+        for (int i = 0, num = 1 + rand() % 40; i < num; i++) {
+            string p;
+            for (int j = 0, len = 1 + rand() % (i % 2 ? 3 : 10); j < len; j++)
+                p += (char)(rand() % 2 ? 'a' + rand() % 3 : rand() % 256);
+            pats.push_back(p);
+        }
+        pats.push_back(pats[rand() % pats.size()]);
+        pats.push_back("");
+        random_shuffle(pats.begin(), pats.end());
+        Pattern_Vect dict(pats);
+
+        for (int e = 0; e < engine_num; e++) {
+            ac_opt_t opt = Make_Opt(engines[e].opt_flags);
+            ac_t* plain = dict.Create(&opt);
+            opt.flags |= AC_OPT_PATTERN_TABLE;
+            ac_t* ac = dict.Create(&opt);
+            CHECK(ac && plain);
+
+            unsigned int len = 0;
+            CHECK(ac_get_pattern(plain, 0, &len) == 0);
+            CHECK(ac_get_pattern(ac, pats.size(), &len) == 0);
+
+            string blob = Serialize_AC(ac);
+            ac_t* loaded = ac_load(blob.data(), blob.size(), 0);
+            CHECK(loaded != 0);
+            for (size_t i = 0; i < pats.size(); i++) {
+                const char* p = ac_get_pattern(ac, i, &len);
+                CHECK(p && string(p, len) == pats[i]);
+                p = ac_get_pattern(loaded, i, &len);
+                CHECK(p && string(p, len) == pats[i]);
+            }
+
+            // The table doesn't change the matching.
+            string text;
+            for (int j = 0, n = rand() % 300; j < n; j++)
+                text += (char)('a' + rand() % 3);
+            const char* s = text.data();
+            unsigned int n = text.size();
+            CHECK(Same_Result(ac_match(ac, s, n), ac_match(plain, s, n)));
+            CHECK(Same_Result(ac_match(loaded, s, n), ac_match(plain, s, n)));
+            CHECK(ac_match_count(loaded, s, n, 0, 0) ==
+                  ac_match_count(plain, s, n, 0, 0));
+
+            ac_free(loaded);
+            ac_free(plain);
+            ac_free(ac);
+        }
+    }
+
+    // The estimate of the builder takes the table into account.
+    ac_opt_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.flags = AC_OPT_PATTERN_TABLE;
+    const char* dict[] = {"he", "she", "his", "hers", "she", 0};
+    ac_builder_t* b = ac_builder_create(&opt, 0);
+    for (int i = 0; dict[i]; i++)
+        CHECK(ac_builder_add(b, dict[i], strlen(dict[i])) == AC_OK);
+    ac_estimate_t est;
+    ac_builder_estimate(b, &est);
+    ac_t* ac = ac_builder_finish(b, 0);
+    ac_builder_free(b);
+    CHECK(ac != 0);
+    string blob = Serialize_AC(ac);
+    CHECK(blob.size() == est.buf_size);
+    ac_free(ac);
+
+    // The corrupted instances are rejected, or give back the patterns
+    // within the blob.
+    for (int i = 0; i < 2000; i++) {
+        string bad = blob;
+        bad[blob.size() - 1 - rand() % 64] ^= 1 << (rand() % 8);
+        if (ac_t* ac = ac_load(bad.data(), bad.size(), 0)) {
+            ac_match(ac, "ushers", 6);
+            for (int j = 0; j < 5; j++) {
+                unsigned int len;
+                const char* p = ac_get_pattern(ac, j, &len);
+                const char* base = (const char*)(void*)ac;
+                CHECK(p >= base && p + len <= base + bad.size());
+            }
+            ac_free(ac);
+        }
+    }
+
+    return true;
+}
+
+typedef struct {
+    ac_t* ac;
+    const vector<string>* texts;
+    int round;
+} Telemetry_Job;
+
+static void*
+Telemetry_Worker(void* arg) {
+    Telemetry_Job* job = (Telemetry_Job*)arg;
+    ac_result_t r[64];
+    for (int k = 0; k < job->round; k++) {
+        for (size_t i = 0; i < job->texts->size(); i++) {
+            const string& text = (*job->texts)[i];
+            ac_scan_t scan;
+            memset(&scan, 0, sizeof(scan));
+            do {
+                ac_match_all(job->ac, text.data(), text.size(), r, 64, 0,
+                             &scan);
+            } while (scan.status == AC_SCAN_TRUNCATED);
+            ac_match(job->ac, text.data(), text.size());
+        }
+    }
+    return 0;
+}
+
+// The hits counted by the threads matching concurrently add up to those of
+// the matches reported, and the counters can be reset along the way.
+static bool
+Test_Telemetry() {
+    srand(16);
+    const int thread_num = 20;
+    const int round = 5;
+    for (int iter = 0; iter < 5; iter++) {
+        vector<string> pats;
+        for (int i = 0, num = 1 + rand() % 60; i < num; i++) {
+            string p;
+            for (int j = 0, len = 1 + rand() % (i % 2 ? 3 : 8); j < len; j++)
+                p += (char)('a' + rand() % 4);
+            pats.push_back(p);
+        }
+        Pattern_Vect dict(pats);
+        unsigned int pat_num = pats.size();
+
+        vector<string> texts(10);
+        for (size_t i = 0; i < texts.size(); i++) {
+            for (int j = 0, len = rand() % 500; j < len; j++)
+                texts[i] += (char)('a' + rand() % 5);
+        }
+
+        for (int e = 0; e < engine_num; e++) {
+            ac_opt_t opt = Make_Opt(engines[e].opt_flags);
+            ac_t* ac = dict.Create(&opt);
+            CHECK(ac != 0);
+
+            // The hits of one pass over the texts.
+            vector<unsigned long long> expect(pat_num, 0);
+            for (size_t i = 0; i < texts.size(); i++) {
+                const char* s = texts[i].data();
+                unsigned int len = texts[i].size();
+                vector<ac_result_t> r(len * 16 + 1);
+                int num = ac_match_all(ac, s, len, &r[0], r.size(), 0, 0);
+                for (int k = 0; k < num; k++)
+                    expect[r[k].pattern_idx]++;
+                ac_result_t first = ac_match(ac, s, len);
+                if (first.match_begin >= 0)
+                    expect[first.pattern_idx]++;
+            }
+
+            vector<unsigned long long> hits(pat_num + 1, 0);
+            CHECK(ac_telemetry_snapshot(ac, &hits[0], hits.size(), 0) == -1);
+            ac_telemetry_enable(ac);
+            ac_telemetry_enable(ac);
+            CHECK(ac_telemetry_snapshot(ac, &hits[0], hits.size(), 0) ==
+                  (int)pat_num);
+            for (unsigned int i = 0; i < pat_num; i++)
+                CHECK(hits[i] == 0);
+
+            // Take the snapshots while the threads are matching. The hits
+            // are counted once across all the snapshots.
+            vector<pthread_t> threads(thread_num);
+            Telemetry_Job job = { ac, &texts, round };
+            for (int t = 0; t < thread_num; t++)
+                pthread_create(&threads[t], 0, Telemetry_Worker, &job);
+            vector<unsigned long long> total(pat_num, 0);
+            for (int k = 0; k < 20; k++) {
+                CHECK(ac_telemetry_snapshot(ac, &hits[0], pat_num, 1) ==
+                      (int)pat_num);
+                for (unsigned int i = 0; i < pat_num; i++)
+                    total[i] += hits[i];
+            }
+            for (int t = 0; t < thread_num; t++)
+                pthread_join(threads[t], 0);
+
+            // Too small a vector is left alone, and so are the counters.
+            hits[0] = 12345;
+            CHECK(ac_telemetry_snapshot(ac, &hits[0], pat_num - 1, 1) ==
+                  (int)pat_num);
+            CHECK(hits[0] == 12345);
+            CHECK(ac_telemetry_snapshot(ac, &hits[0], pat_num, 1) ==
+                  (int)pat_num);
+            for (unsigned int i = 0; i < pat_num; i++) {
+                total[i] += hits[i];
+                CHECK(total[i] == expect[i] * thread_num * round);
+            }
+            CHECK(ac_telemetry_snapshot(ac, &hits[0], pat_num, 0) ==
+                  (int)pat_num);
+            for (unsigned int i = 0; i < pat_num; i++)
+                CHECK(hits[i] == 0);
+
+            // The counters are not part of the serialized instance.
+            string blob = Serialize_AC(ac);
+            ac_t* loaded = ac_load(blob.data(), blob.size(), 0);
+            CHECK(loaded != 0);
+            CHECK(ac_telemetry_snapshot(loaded, &hits[0], pat_num, 0) == -1);
+            ac_free(loaded);
+            ac_free(ac);
+        }
+    }
+
+    // The tenants of a pool have their own counters.
+    const char* pats[] = {"he", "she", "his", "hers"};
+    unsigned int lens[] = {2, 3, 3, 4};
+    ac_dict_t dicts[2] = { {pats, lens, 4}, {pats + 2, lens + 2, 2} };
+    ac_pool_t* pool = ac_pool_create(dicts, 2, 0);
+    CHECK(pool != 0);
+    ac_t* tenant = ac_pool_get(pool, 1);
+    ac_telemetry_enable(tenant);
+    ac_result_t r[8];
+    CHECK(ac_match_all(tenant, "ushers his", 10, r, 8, 0, 0) == 2);
+    CHECK(ac_match_all(ac_pool_get(pool, 0), "ushers", 6, r, 8, 0, 0) == 3);
+    unsigned long long hits[2];
+    CHECK(ac_telemetry_snapshot(ac_pool_get(pool, 0), hits, 2, 0) == -1);
+    CHECK(ac_telemetry_snapshot(tenant, hits, 2, 0) == 2);
+    CHECK(hits[0] == 1 && hits[1] == 1);
+    ac_pool_free(pool);
+
+    return true;
+}
+
+// The q-gram prefilter skips the offsets no pattern begins at, and it must
+// be invisible to all the match functions, including the scans resumed
+// halfway. The texts are mostly bytes beginning some pattern, with pieces
+// of the patterns planted in them. Dictionaries with some pattern shorter
+// than 8 bytes fall back to the automatic pick.
+static bool
+Test_QGram() {
+    ac_opt_t opt = Make_Opt(0);
+    ac_opt_t generic_opt = Make_Opt(GENERIC_FLAGS);
+
+    srand(17);
+    for (int iter = 0; iter < 200; iter++) {
+        opt.flags = AC_OPT_QGRAM_FILTER | (iter % 2 ? AC_OPT_THREADED : 0);
+        bool too_short = iter % 10 == 1;
+
+        vector<string> pats;
+        int alphabet = 2 + rand() % 20;
+        int pat_num = 1 + rand() % (iter % 10 == 2 ? 3000 : 100);
+        for (int i = 0; i < pat_num; i++) {
+            string p;
+            int len = 8 + (rand() % 4 ? rand() % 3 : rand() % 20);
+            for (int j = 0; j < len; j++)
+                p += (char)('a' + rand() % alphabet);
+            pats.push_back(p);
+        }
+        pats.push_back(pats[rand() % pats.size()]);
+        pats.push_back("");
+        if (too_short)
+            pats.push_back(string(1 + rand() % 7, 'a'));
+        random_shuffle(pats.begin(), pats.end());
+
+        ac_builder_t* b = ac_builder_create(&opt, 0);
+        for (size_t i = 0; i < pats.size(); i++) {
+            if (!pats[i].empty())
+                ac_builder_add(b, pats[i].data(), pats[i].size());
+        }
+        ac_estimate_t est;
+        ac_builder_estimate(b, &est);
+        ac_builder_free(b);
+
+        Pattern_Vect dict(pats);
+        ac_t* ac = dict.Create(&opt);
+        ac_t* generic = dict.Create(&generic_opt);
+        CHECK(ac && generic);
+        string blob = Serialize_AC(ac);
+        CHECK(blob.size() == est.buf_size);
+        if (too_short) {
+            ac_opt_t auto_opt = Make_Opt(opt.flags & AC_OPT_THREADED);
+            ac_t* regular = dict.Create(&auto_opt);
+            CHECK(blob == Serialize_AC(regular));
+            ac_free(regular);
+        }
+
+        ac_t* loaded = ac_load(blob.data(), blob.size(), 0);
+        CHECK(loaded != 0 && Serialize_AC(loaded) == blob);
+        ac_free(loaded);
+
+        for (int k = 0; k < 20; k++) {
+            string text;
+            for (int len = rand() % 400; (int)text.size() < len; ) {
+                if (rand() % 8) {
+                    text += (char)((rand() % 16) ? 'a' + rand() % alphabet
+                                                 : 'z');
+                } else {
+                    const string& p = pats[rand() % pats.size()];
+                    text += p.substr(0, rand() % (p.size() + 1));
+                }
+            }
+
+            CHECK(Compare_With_Generic(ac, generic, text.data(), text.size()));
+            CHECK(Same_Result(ac_match_cstr(ac, text.c_str()),
+                              ac_match_cstr(generic, text.c_str())));
+        }
+        ac_free(ac);
+        ac_free(generic);
+    }
+
+    // The corrupted instances are rejected, or at least are safe to match
+    // against.
+    const char* pats[] = {"abcdabcd", "bcabcabcab", "ccccaaaabbbb"};
+    unsigned int lens[] = {8, 10, 12};
+    opt.flags = AC_OPT_QGRAM_FILTER;
+    ac_t* ac = ac_create_opt(pats, lens, 3, &opt);
+    CHECK(ac != 0);
+    string blob = Serialize_AC(ac);
+    ac_free(ac);
+    const char* text = "xabcdabcdccccaaaabbbbcabcabcabx";
+    unsigned int text_len = strlen(text);
+    for (int i = 0; i < 2000; i++) {
+        string bad = blob;
+        bad[rand() % bad.size()] ^= 1 << (rand() % 8);
+        if (ac_t* ac = ac_load(bad.data(), bad.size(), 0)) {
+            ac_result_t r[256];
+            ac_match(ac, text, text_len);
+            ac_match_longest_l(ac, text, text_len);
+            int n = ac_match_all(ac, text, text_len, r, 256, 0, 0);
+            CHECK(n >= 0);
+            for (int j = 0; j < n; j++) {
+                CHECK(r[j].match_begin >= 0 &&
+                      r[j].match_end < (int)text_len);
+            }
+            ac_free(ac);
+        }
+    }
+
+    return true;
+}
+
+// The reference normalization, which applies the transforms one at a time,
+// each over the whole output of the previous one. Each byte goes along with
+// the offset of the last raw byte it's made of.
+typedef vector<pair<unsigned char, unsigned int> > Norm_Str;
+
+static int
+Ref_Entity(const Norm_Str& s, size_t i, size_t n) {
+    string name;
+    for (size_t k = i + 1; k + 1 < i + n; k++)
+        name += s[k].first;
+    if (n < 3 || s[i + n - 1].first != ';')
+        return -1;
+
+    const char* names[] = {"lt", "gt", "amp", "quot", "apos", "nbsp"};
+    const char bytes[] = {'<', '>', '&', '"', '\'', (char)0xa0};
+    for (int k = 0; k < 6; k++) {
+        if (name == names[k])
+            return (unsigned char)bytes[k];
+    }
+
+    bool hex = name.size() > 1 && name[0] == '#' &&
+               (name[1] == 'x' || name[1] == 'X');
+    const char* digits = hex ? "0123456789abcdefABCDEF" : "0123456789";
+    string num = name.substr(hex ? 2 : 1);
+    if (name[0] != '#' || num.empty() ||
+        num.find_first_not_of(digits) != string::npos) {
+        return -1;
+    }
+    unsigned long v = strtoul(num.c_str(), 0, hex ? 16 : 10);
+    return v < 256 ? (int)v : -1;
+}
+
+static Norm_Str
+Ref_Normalize(const string& raw, unsigned int norm) {
+    Norm_Str s, t;
+    for (size_t i = 0; i < raw.size(); i++) {
+        unsigned char c = raw[i];
+        unsigned int end = i;
+        if (norm & AC_NORM_URL_DECODE) {
+            if (c == '+') {
+                c = ' ';
+            } else if (c == '%' && i + 2 < raw.size() &&
+                       isxdigit(raw[i + 1]) && isxdigit(raw[i + 2])) {
+                c = strtoul(raw.substr(i + 1, 2).c_str(), 0, 16);
+                end = i += 2;
+            }
+        }
+        s.push_back(make_pair(c, end));
+    }
+
+    if (norm & AC_NORM_HTML_DECODE) {
+        t.clear();
+        for (size_t i = 0; i < s.size(); ) {
+            if (s[i].first == '&') {
+                // The same look-ahead as the library's, up to 10 bytes.
+                size_t n = 1;
+                while (n < 10 && i + n < s.size() &&
+                       (n == 1 || isalnum(s[i + n - 1].first) ||
+                        s[i + n - 1].first == '#')) {
+                    n++;
+                }
+                int c = Ref_Entity(s, i, n);
+                if (c >= 0) {
+                    t.push_back(make_pair(c, s[i + n - 1].second));
+                    i += n;
+                    continue;
+                }
+            }
+            t.push_back(s[i++]);
+        }
+        s.swap(t);
+    }
+
+    if (norm & AC_NORM_CASE_FOLD) {
+        for (size_t i = 0; i < s.size(); i++) {
+            if (s[i].first < 128)
+                s[i].first = tolower(s[i].first);
+        }
+    }
+
+    if (norm & AC_NORM_WS_COLLAPSE) {
+        t.clear();
+        bool in_run = false;
+        for (size_t i = 0; i < s.size(); i++) {
+            bool space = s[i].first < 128 && isspace(s[i].first);
+            if (space && in_run)
+                t.back().second = s[i].second;
+            else
+                t.push_back(make_pair(space ? ' ' : s[i].first, s[i].second));
+            in_run = space;
+        }
+        s.swap(t);
+    }
+    return s;
+}
+
+// The normalizing scan must find what the plain scan finds in the string
+// normalized beforehand, with the offsets mapped back to the raw string,
+// whatever the chunks and the limits are. The raw strings are full of the
+// escapes, broken ones included, which nest and straddle the chunks.
+static bool
+Test_Norm() {
+    static const char* tokens[] = {
+        "a", "b", "c", "A", "B", "C", " ", "\t", "\r\n", "+", "<", "&",
+        "%41", "%62", "%2", "%zz", "%20", "%26", "%26lt%3B", "%25",
+        "&lt;", "&LT;", "&amp;lt;", "&#65;", "&#x42;", "&#X63;", "&#x;",
+        "&#300;", "&&lt;", "&nbsp;", "&lt", "&#0000060;", "&#00000060;",
+    };
+    int token_num = sizeof(tokens) / sizeof(tokens[0]);
+
+    srand(18);
+    for (int iter = 0; iter < 300; iter++) {
+        unsigned int norm = iter % 16;
+        vector<string> pats;
+        for (int i = 0, num = 1 + rand() % 20; i < num; i++) {
+            string p;
+            for (int j = 0, len = 1 + rand() % 8; j < len; j++)
+                p += "abcAB< &"[rand() % 8];
+            pats.push_back(p);
+        }
+        if (iter % 10 == 1)
+            pats.push_back(string(5000, 'a'));
+        Pattern_Vect dict(pats);
+
+        string raw;
+        for (int len = rand() % (iter % 5 ? 300 : 20000);
+             (int)raw.size() < len; ) {
+            raw += iter % 10 == 1 && rand() % 2 ? "%61" :
+                   tokens[rand() % token_num];
+        }
+        Norm_Str norm_str = Ref_Normalize(raw, norm);
+        string text;
+        for (size_t i = 0; i < norm_str.size(); i++)
+            text += (char)norm_str[i].first;
+
+        ac_opt_t opt = Make_Opt(engines[iter % engine_num].opt_flags);
+        ac_t* ac = dict.Create(&opt);
+        ac_scratch_t* scratch = ac_scratch_create(ac);
+        CHECK(ac && scratch);
+
+        // Not fit for the normalization yet.
+        CHECK(ac_norm_match_count(ac, scratch, norm, raw.data(), raw.size(),
+                                  0, 0) == -1);
+        ac_scratch_fit_norm(scratch);
+
+        vector<ac_result_t> expect(text.size() * 16 + 1);
+        int expect_num = ac_match_all(ac, text.data(), text.size(),
+                                      &expect[0], expect.size(), 0, 0);
+        for (int i = 0; i < expect_num; i++) {
+            ac_result_t& r = expect[i];
+            r.match_begin = r.match_begin ?
+                            norm_str[r.match_begin - 1].second + 1 : 0;
+            r.match_end = norm_str[r.match_end].second;
+        }
+
+        CHECK(ac_norm_match_count(ac, scratch, norm, raw.data(), raw.size(),
+                                  0, 0) == expect_num);
+
+        // In one go, and then in pieces.
+        for (int round = 0; round < 2; round++) {
+            ac_limit_t limit;
+            memset(&limit, 0, sizeof(limit));
+            if (round) {
+                limit.max_matches = 1 + rand() % 7;
+                limit.max_bytes = rand() % 2 ? 0 : 1 + rand() % 5000;
+            }
+            vector<ac_result_t> got;
+            ac_result_t r[64];
+            ac_scan_t scan;
+            memset(&scan, 0, sizeof(scan));
+            unsigned int last_ofst = 0;
+            do {
+                int num = ac_norm_match_all(ac, scratch, norm, raw.data(),
+                                            raw.size(), r, round ? 64 : 1,
+                                            &limit, &scan);
+                CHECK(num >= 0);
+                got.insert(got.end(), r, r + num);
+                CHECK(scan.resume_ofst >= last_ofst &&
+                      scan.resume_ofst <= raw.size());
+                last_ofst = scan.resume_ofst;
+            } while (scan.status == AC_SCAN_TRUNCATED);
+            CHECK(last_ofst == raw.size());
+
+            CHECK((int)got.size() == expect_num);
+            for (int i = 0; i < expect_num; i++)
+                CHECK(Same_Result(got[i], expect[i]));
+        }
+
+        ac_scratch_free(scratch);
+        ac_free(ac);
+    }
+
+    // The offsets are those of the raw string.
+    const char* dict[] = {"<script>", "select from", 0};
+    ac_t* ac = Create_AC(dict);
+    ac_scratch_t* scratch = ac_scratch_create(ac);
+    ac_scratch_fit_norm(scratch);
+    const char* raw = "x=%3CScRiPt%3E&y=SELECT%20%09 +FROM&z=&lt;script&gt;";
+    ac_result_t r[4];
+    int num = ac_norm_match_all(ac, scratch, AC_NORM_URL_DECODE |
+                                AC_NORM_HTML_DECODE | AC_NORM_CASE_FOLD |
+                                AC_NORM_WS_COLLAPSE, raw, strlen(raw), r, 4,
+                                0, 0);
+    CHECK(num == 3);
+    CHECK(r[0].match_begin == 2 && r[0].match_end == 13 &&
+          r[0].pattern_idx == 0);
+    CHECK(r[1].match_begin == 17 && r[1].match_end == 34 &&
+          r[1].pattern_idx == 1);
+    CHECK(r[2].match_begin == 38 && r[2].match_end == 51 &&
+          r[2].pattern_idx == 0);
+
+    // Each call makes progress, however small the time budget is.
+    string long_raw;
+    for (int i = 0; i < 2000; i++)
+        long_raw += "%3cscript%3E ";
+    ac_limit_t limit;
+    memset(&limit, 0, sizeof(limit));
+    limit.max_usec = 1;
+    ac_scan_t scan;
+    memset(&scan, 0, sizeof(scan));
+    int total = 0;
+    do {
+        unsigned int last_ofst = scan.resume_ofst;
+        num = ac_norm_match_all(ac, scratch, AC_NORM_URL_DECODE,
+                                long_raw.data(), long_raw.size(), r, 4,
+                                &limit, &scan);
+        CHECK(num >= 0 && scan.resume_ofst > last_ofst);
+        total += num;
+    } while (scan.status == AC_SCAN_TRUNCATED);
+    CHECK(total == 2000);
+    ac_scratch_free(scratch);
+    ac_free(ac);
+
+    return true;
+}
+
+// Return the line the byte at "ofst" is in, and the beginning of it.
+static unsigned int
+Ref_Line(const string& text, unsigned int ofst, unsigned int* line_begin) {
+    unsigned int line_num = 1;
+    *line_begin = 0;
+    for (unsigned int i = 0; i < ofst; i++) {
+        if (text[i] == '\n') {
+            line_num++;
+            *line_begin = i + 1;
+        }
+    }
+    return line_num;
+}
+
+// The lines reported by the line-oriented scan must be those of the matches
+// ac_match_all() finds, and in the AC_LINE_FIRST_ONLY mode, the matches
+// must be those found by matching afresh from the line after the previous
+// match. The long runs between the matches take the vectorized newline
+// counter through its overflow-free rounds.
+static bool
+Test_Lines() {
+    srand(19);
+    for (int iter = 0; iter < 300; iter++) {
+        vector<string> pats;
+        for (int i = 0, num = 1 + rand() % 10; i < num; i++) {
+            string p;
+            for (int j = 0, len = 1 + rand() % (i % 2 ? 3 : 10); j < len; j++)
+                p += "abc\n"[rand() % (iter % 3 ? 3 : 4)];
+            pats.push_back(p);
+        }
+        Pattern_Vect dict(pats);
+
+        // Sparse matches, among newlines dense or sparse.
+        string text;
+        int nl_odds = 1 + rand() % 40;
+        int match_odds = iter % 4 ? 1 + rand() % 4 : 2000;
+        for (int j = 0, len = rand() % (iter % 5 ? 400 : 30000); j < len;
+             j++) {
+            if (rand() % nl_odds == 0)
+                text += '\n';
+            else
+                text += rand() % match_odds ? 'z' : "abc"[rand() % 3];
+        }
+        const char* s = text.data();
+        unsigned int len = text.size();
+
+        ac_opt_t opt = Make_Opt(engines[iter % engine_num].opt_flags);
+        ac_t* ac = dict.Create(&opt);
+        CHECK(ac != 0);
+
+        for (int first_only = 0; first_only < 2; first_only++) {
+            vector<ac_result_t> expect;
+            if (!first_only) {
+                expect.resize(len * 16 + 1);
+                expect.resize(ac_match_all(ac, s, len, &expect[0],
+                                           expect.size(), 0, 0));
+            } else {
+                for (unsigned int base = 0; base < len; ) {
+                    ac_result_t r;
+                    if (ac_match_all(ac, s + base, len - base, &r, 1, 0,
+                                     0) != 1) {
+                        break;
+                    }
+                    r.match_begin += base;
+                    r.match_end += base;
+                    expect.push_back(r);
+                    const char* nl = (const char*)memchr(s + r.match_end,
+                                                         '\n',
+                                                         len - r.match_end);
+                    base = nl ? nl - s + 1 : len;
+                }
+            }
+
+            // In one go, in pieces, and then under a time budget, with
+            // which each call makes progress still.
+            for (int round = 0; round < 3; round++) {
+                ac_limit_t limit;
+                memset(&limit, 0, sizeof(limit));
+                if (round == 1) {
+                    limit.max_matches = 1 + rand() % 7;
+                    limit.max_bytes = rand() % 2 ? 0 : 1 + rand() % 3000;
+                } else if (round == 2) {
+                    limit.max_usec = 1;
+                }
+                vector<ac_line_result_t> got;
+                vector<ac_line_result_t> r(round ? 64 : len * 16 + 1);
+                ac_line_scan_t scan;
+                memset(&scan, 0, sizeof(scan));
+                unsigned int flags = first_only ? AC_LINE_FIRST_ONLY : 0;
+                do {
+                    unsigned int last_ofst = scan.scan.resume_ofst;
+                    int num = ac_line_match_all(ac, s, len, flags, &r[0],
+                                                r.size(), &limit, &scan);
+                    CHECK(num > 0 || scan.scan.resume_ofst > last_ofst ||
+                          scan.scan.status == AC_SCAN_DONE);
+                    got.insert(got.end(), r.begin(), r.begin() + num);
+                } while (scan.scan.status == AC_SCAN_TRUNCATED);
+                CHECK(scan.scan.resume_ofst == len);
+
+                CHECK(got.size() == expect.size());
+                for (size_t i = 0; i < got.size(); i++) {
+                    CHECK(Same_Result(got[i].match, expect[i]));
+                    unsigned int line_begin;
+                    CHECK(got[i].line_num ==
+                          Ref_Line(text, expect[i].match_end, &line_begin));
+                    CHECK(got[i].line_begin == line_begin);
+                }
+            }
+        }
+        ac_free(ac);
+    }
+
+    // More newlines in a row than a lane of the counter holds.
+    const char* dict[] = {"abc", 0};
+    ac_t* ac = Create_AC(dict);
+    string text = string(10000, '\n') + "xabc\n" + string(300, 'x') + "abc";
+    ac_line_result_t r[2];
+    CHECK(ac_line_match_all(ac, text.data(), text.size(), 0, r, 2, 0, 0) == 2);
+    CHECK(r[0].line_num == 10001 && r[0].line_begin == 10000);
+    CHECK(r[1].line_num == 10002 && r[1].line_begin == 10005);
+    ac_free(ac);
+
+    return true;
+}
+
+static const APITest api_tests[] = {
+    { "shadow verification", Test_Shadow_Verify },
+    { "all matches", Test_Match_All },
+    { "scan limits", Test_Scan_Limits },
+    { "root fanout", Test_Root_Fanout },
+    { "serialize and load", Test_Serialize_Load },
+    { "on-disk cache", Test_Cache },
+    { "hot reload", Test_Reload },
+    { "builder", Test_Builder },
+    { "sheng", Test_Sheng },
+    { "stride2", Test_Stride2 },
+    { "succinct", Test_Succinct },
+    { "compact", Test_Compact },
+    { "pool", Test_Pool },
+    { "warm-up", Test_Warm },
+    { "lazy", Test_Lazy },
+    { "composite", Test_Composite },
+    { "NUL-terminated string", Test_Cstr },
+    { "stream", Test_Stream },
+    { "pattern table", Test_Pattern_Table },
+    { "telemetry", Test_Telemetry },
+    { "q-gram prefilter", Test_QGram },
+    { "normalization", Test_Norm },
+    { "lines", Test_Lines },
+};
+
+bool
+Run_AC_API_Test() {
+    ACTestAPI t(api_tests, sizeof(api_tests)/sizeof(api_tests[0]),
+                "AC API test");
+    t.PrintBanner();
+    return t.Run();
+}
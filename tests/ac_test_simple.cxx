@@ -71,6 +71,8 @@ public:
     virtual bool Run();
 
 private:
+    void Run_Engine(const EngineInfo& engine, vector<TestingCase>& tests,
+                    int& total, int& fail);
     void PrintSummary(int total, int fail)  {
         fprintf(stdout, "Test count : %d, fail: %d\n", total, fail);
         fflush(stdout);
@@ -78,24 +80,21 @@ private:
 };
 }
 
-bool
-ACTestSimple::Run() {
-    int total = 0;
-    int fail = 0;
-
-    vector<TestingCase> *tests = Tests::Get_Tests();
-    if (!tests) {
-        PrintSummary(0, 0);
-        return true;
-    }
+void
+ACTestSimple::Run_Engine(const EngineInfo& engine, vector<TestingCase>& tests,
+                         int& total, int& fail) {
+    ac_opt_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.flags = engine.opt_flags;
 
-    for (vector<TestingCase>::iterator i = tests->begin(), e = tests->end();
+    for (vector<TestingCase>::iterator i = tests.begin(), e = tests.end();
             i != e; i++) {
         TestingCase& t = *i;
         int dict_len = t.dict_len;
         unsigned int* strlen_v = new unsigned int[dict_len];
 
-        fprintf(stdout, ">Testing %s\nDictionary:[ ", t.name);
+        fprintf(stdout, ">Testing %s (engine: %s)\nDictionary:[ ",
+                t.name, engine.name);
         for (int i = 0, need_break=0; i < dict_len; i++) {
             const char* s = t.dict[i];
             fprintf(stdout, "%s, ", s);
@@ -108,7 +107,7 @@ ACTestSimple::Run() {
         fputs("]\n", stdout);
 
         /* Create the dictionary */
-        ac_t* ac = ac_create(t.dict, strlen_v, dict_len);
+        ac_t* ac = ac_create_opt(t.dict, strlen_v, dict_len, &opt);
         delete[] strlen_v;
 
         for (int ii = 0, ee = t.strpair_num; ii < ee; ii++, total++) {
@@ -170,6 +169,21 @@ ACTestSimple::Run() {
         fputs("\n", stdout);
         ac_free(ac);
     }
+}
+
+bool
+ACTestSimple::Run() {
+    int total = 0;
+    int fail = 0;
+
+    vector<TestingCase> *tests = Tests::Get_Tests();
+    if (!tests) {
+        PrintSummary(0, 0);
+        return true;
+    }
+
+    for (int i = 0; i < engine_num; i++)
+        Run_Engine(engines[i], *tests, total, fail);
 
     PrintSummary(total, fail);
     return fail == 0;
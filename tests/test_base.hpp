@@ -54,7 +54,17 @@ protected:
     int _key_max_len;
 };
 
+// The match engines every testing case is run against.
+typedef struct {
+    const char* name;
+    unsigned int opt_flags; // The ac_opt_t::flags passed to ac_create_opt()
+} EngineInfo;
+
+extern const EngineInfo engines[];
+extern const int engine_num;
+
 extern bool Run_AC_Simple_Test();
+extern bool Run_AC_API_Test();
 extern bool Run_AC_Aggressive_Test(const vector<const char*>& files);
 
 #endif
@@ -14,6 +14,19 @@
 
 using namespace std;
 
+const EngineInfo engines[] = {
+    { "loop", AC_OPT_NO_SHENG | AC_OPT_NO_STRIDE2 | AC_OPT_NO_COMPACT },
+    { "threaded", AC_OPT_THREADED },
+    { "sheng", AC_OPT_NO_STRIDE2 | AC_OPT_NO_COMPACT },
+    { "stride2", AC_OPT_STRIDE2 | AC_OPT_NO_SHENG | AC_OPT_NO_COMPACT },
+    { "double-array", AC_OPT_DOUBLE_ARRAY },
+    { "succinct", AC_OPT_SUCCINCT },
+    { "compact", AC_OPT_NO_SHENG | AC_OPT_NO_STRIDE2 },
+    { "lazy", AC_OPT_LAZY },
+    { "composite", AC_OPT_COMPOSITE },
+    { "qgram", AC_OPT_QGRAM_FILTER },
+};
+const int engine_num = sizeof(engines)/sizeof(engines[0]);
 
 /////////////////////////////////////////////////////////////////////////
 //
@@ -24,6 +37,7 @@ using namespace std;
 int
 main (int argc, char** argv) {
     bool succ = Run_AC_Simple_Test();
+    succ = Run_AC_API_Test() && succ;
 
     vector<const char*> files;
     for (int i = 1; i < argc; i++) { files.push_back(argv[i]); }